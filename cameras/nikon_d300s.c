@@ -1,5 +1,6 @@
 #include <nefko.h>
 #include <nefko_camera.h>
+#include <nefko_priv_tags.h>
 
 static
 NEF_STATUS d300s_initialize(struct nefko_camera_state **this)
@@ -29,8 +30,19 @@ NEF_STATUS d300s_get_image_attribs(struct nefko_camera_state *this,
     return NEF_OK;
 }
 
+static const struct nefko_camera_params d300s_params = {
+    .white_level = 15520,
+    .bits_per_sample = 14,
+    .active_width = 4288,
+    .active_height = 2848,
+    .cfa_pattern = { 0, 1, 1, 2 },
+    .settings_crypt_off = NEF_IMAGE_SETTINGS_0205_OFF,
+    .settings_wb_off = NEF_IMAGE_SETTINGS_OFF,
+};
+
 struct nefko_camera d300s_camera_methods = {
     .name = "NIKON D300S",
+    .params = &d300s_params,
     .initialize = d300s_initialize,
     .destroy = d300s_destroy,
     .read_model_data = d300s_read_model_data,
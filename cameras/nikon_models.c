@@ -0,0 +1,35 @@
+#include <nefko.h>
+#include <nefko_camera.h>
+
+/* Models known only by their constants, with no model data to parse.
+ * All of them write NEF decode tables with the predictors at offset 2,
+ * black-subtract in the camera, and have an RGGB colour filter. White
+ * levels are where raw samples clip, scaled to 14 bits: 3880 at 12 bits
+ * for the 12-bit bodies.
+ */
+
+#define NIKON_CAMERA(ident, model, bits, white, width, height) \
+    static const struct nefko_camera_params ident##_params = { \
+        .white_level = (white), \
+        .bits_per_sample = (bits), \
+        .active_width = (width), \
+        .active_height = (height), \
+        .cfa_pattern = { 0, 1, 1, 2 }, \
+    }; \
+    const struct nefko_camera ident##_camera = { \
+        .name = (model), \
+        .params = &ident##_params, \
+    };
+
+/* DX, 12.3MP */
+NIKON_CAMERA(nikon_d300, "NIKON D300", 14, 15520, 4288, 2848)
+NIKON_CAMERA(nikon_d90, "NIKON D90", 12, 15520, 4288, 2848)
+NIKON_CAMERA(nikon_d5000, "NIKON D5000", 12, 15520, 4288, 2848)
+
+/* DX, 16.2MP */
+NIKON_CAMERA(nikon_d7000, "NIKON D7000", 14, 15892, 4928, 3264)
+
+/* FX, 12.1MP */
+NIKON_CAMERA(nikon_d700, "NIKON D700", 14, 15892, 4256, 2832)
+NIKON_CAMERA(nikon_d3, "NIKON D3", 14, 15892, 4256, 2832)
+NIKON_CAMERA(nikon_d3s, "NIKON D3S", 14, 15892, 4256, 2832)
@@ -3,6 +3,8 @@
 
 /* Public Declarations for libnefko - a NEF image reader */
 
+#include <stddef.h>
+
 
 /* Opaque structure used for storing state of an NEF image */
 struct nef;
@@ -20,6 +22,169 @@ typedef struct nef_image nef_image_t;
 #define NEF_PIXEL_8         0x0 /* 8 bit samples */
 #define NEF_PIXEL_16        0x1 /* 16 bit samples */
 
+/* Decode modes for full-resolution (CFA mosaic) images */
+#define NEF_DECODE_FULL     0x0 /* One sample per CFA site */
+#define NEF_DECODE_HALF_RGB 0x1 /* One RGB pixel per 2x2 CFA quad */
+#define NEF_DECODE_HALF_AVG 0x2 /* One sample per 2x2 CFA quad, averaged */
+
+/* Conversion applied to each CFA sample as it leaves the decoder:
+ *   out = clamp((in - black[n]) * gain[n], 0, max value of pixel_format)
+ * where n is the sample's position in the 2x2 CFA pattern, in row-major
+ * order.
+ */
+struct nef_output_conv {
+    int pixel_format;       /* NEF_PIXEL_8 or NEF_PIXEL_16 */
+    float black[4];         /* Black level, per CFA position */
+    float gain[4];          /* Gain applied after black subtraction */
+};
+
+/* Orientations for nef_image_set_orientation. 1 to 8 are as in the TIFF
+ * Orientation tag: 1 is as stored, 3 is rotated 180 degrees, and 6 and 8
+ * are rotated 90 degrees clockwise and counter-clockwise; 2, 4, 5 and 7
+ * are these mirrored.
+ */
+#define NEF_ORIENT_AUTO     0x0 /* As given by the Orientation tag */
+#define NEF_ORIENT_STORED   0x1 /* As stored, the default */
+
+/* Layouts of image data in an output buffer */
+#define NEF_LAYOUT_INTERLEAVED  0x0 /* Chunky pixels, one row after another */
+#define NEF_LAYOUT_CFA_PLANES   0x1 /* One plane per 2x2 CFA position */
+
+/* Describes where, and how, nef_image_get_raw_desc writes an image. All
+ * strides and offsets are in bytes, and must be multiples of the sample
+ * size. For NEF_LAYOUT_CFA_PLANES, plane n holds the samples at position
+ * n of the 2x2 CFA pattern (in row-major order), and is (width + 1) / 2
+ * by (height + 1) / 2 samples.
+ */
+struct nef_output_desc {
+    void *buf;              /* Start of the destination buffer */
+    size_t size;            /* Bytes available at buf */
+    size_t offset;          /* Offset of the first sample within buf */
+    size_t row_stride;      /* Bytes between rows; 0 for densely packed */
+    size_t plane_stride;    /* Bytes between planes; 0 for densely packed */
+    int layout;             /* NEF_LAYOUT_* */
+    int pixel_format;       /* NEF_PIXEL_8 or NEF_PIXEL_16 */
+};
+
+/* Statistics of the samples at one position of the 2x2 CFA pattern */
+struct nef_channel_stats {
+    unsigned long long count;   /* Samples counted */
+    unsigned long long sum;     /* Sum of the samples, for the mean */
+    unsigned long long clipped; /* Samples at or above the clip level */
+    unsigned min;
+    unsigned max;
+};
+
+/* Statistics of the raw samples of an image, as they leave the decoder,
+ * before any output conversion or half-size binning. Channels and
+ * histograms are by position in the 2x2 CFA pattern, in row-major order.
+ */
+struct nef_image_stats {
+    unsigned bins;          /* Histogram bins per channel: a power of two,
+                               up to 65536; samples are binned by their
+                               top bits */
+    unsigned clip;          /* Clip level; 0 for the camera's white level */
+    unsigned *hist;         /* 4 * bins counts, one histogram after the
+                               other, or NULL for none */
+    struct nef_channel_stats chan[4];
+};
+
+/* Hashes for nef_image_fingerprint */
+#define NEF_HASH_XXH64      0x0 /* xxHash64; 8 byte fingerprints */
+#define NEF_HASH_SHA256     0x1 /* SHA-256; 32 byte fingerprints */
+
+/* Room for a fingerprint made with any hash */
+#define NEF_FINGERPRINT_MAX 32
+
+/* Flags for nef_image_alloc_buffer */
+#define NEF_BUF_PREFAULT    0x1 /* Touch every page of the buffer up front */
+#define NEF_BUF_POOLED      0x2 /* Recycle buffers through a process-wide pool */
+
+/* Flags for nef_open_ex */
+#define NEF_OPEN_ARENA      0x1 /* Allocate the handle's metadata from one arena */
+#define NEF_OPEN_MMAP       0x2 /* Map the file, for zero-copy reads */
+
+/* Page cache hints for nef_set_io_hints */
+#define NEF_HINT_WILLNEED   0x1 /* Start reading image data before decoding it */
+#define NEF_HINT_SEQUENTIAL 0x2 /* Expect image data to be read in order */
+#define NEF_HINT_DONTNEED   0x4 /* Drop image data from the page cache once decoded */
+#define NEF_HINT_DEFAULT    (NEF_HINT_WILLNEED | NEF_HINT_SEQUENTIAL)
+
+/* Memory allocation hooks. alloc and realloc follow malloc and realloc;
+ * ctx is passed through to each call.
+ */
+struct nef_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+
+/* Stages of decoding timed by the instrumentation counters */
+#define NEF_STAGE_OPEN      0x0 /* nef_open, end to end */
+#define NEF_STAGE_IFD_PARSE 0x1 /* Reading and parsing IFDs */
+#define NEF_STAGE_TAG_FETCH 0x2 /* Fetching tag contents */
+#define NEF_STAGE_IO        0x3 /* Reading image data */
+#define NEF_STAGE_DECRYPT   0x4 /* Deobfuscating MakerNote blocks */
+#define NEF_STAGE_ENTROPY   0x5 /* Entropy decoding raw image data */
+#define NEF_STAGE_CONVERT   0x6 /* Output conversion and formatting */
+#define NEF_STAGE_HINT      0x7 /* Page cache hints for image data */
+#define NEF_STAGE_CALIB     0x8 /* Sensor calibration of decoded rows */
+#define NEF_STAGE_COUNT     0x9
+
+struct nef_stage_stats {
+    unsigned long long calls;   /* Times the stage ran */
+    unsigned long long ticks;   /* Time spent in the stage, in timer ticks */
+    unsigned long long bytes;   /* Bytes produced or consumed by the stage */
+};
+
+struct nef_stats {
+    struct nef_stage_stats stage[NEF_STAGE_COUNT];
+    double ticks_per_sec;       /* Timer rate; 0 if not yet calibrated */
+};
+
+/* Flat-field gains are fixed point, with NEF_CALIB_FLAT_ONE as 1.0 */
+#define NEF_CALIB_FLAT_SHIFT    12
+#define NEF_CALIB_FLAT_ONE      (1 << NEF_CALIB_FLAT_SHIFT)
+
+/* Sensor calibration for one camera body, for nef_calib_write. Each
+ * sample of the raw image is corrected as
+ *   out = clamp((in - dark) * flat >> NEF_CALIB_FLAT_SHIFT, 0, 65535)
+ * and defective pixels are then replaced by the mean of their nearest
+ * good neighbours of the same colour, two samples away.
+ */
+struct nef_calib_desc {
+    unsigned serial;                /* Camera serial number */
+    unsigned width;                 /* Raw image dimensions */
+    unsigned height;
+    const unsigned short *dark;     /* Dark frame, or NULL */
+    const unsigned short *flat;     /* Flat-field gains, or NULL */
+    const unsigned *defects;        /* Defects as y * width + x, ascending */
+    unsigned nr_defects;
+};
+
+/* Counters of the decoded-frame cache */
+struct nef_cache_stats {
+    unsigned long long hits;        /* Decodes served from the cache */
+    unsigned long long misses;      /* Decodes that had to run */
+    unsigned long long evictions;   /* Frames dropped to stay in budget */
+    size_t entries;                 /* Frames held */
+    size_t bytes;                   /* Bytes held */
+    size_t budget;                  /* Most bytes the cache may hold */
+};
+
+/* Log levels */
+#define NEF_LOG_ERROR       0x0
+#define NEF_LOG_WARN        0x1
+#define NEF_LOG_INFO        0x2
+#define NEF_LOG_DEBUG       0x3
+
+/* Receives a log message from libnefko. func and line locate the message
+ * in the library source.
+ */
+typedef void (*nef_log_func_t)(void *ctx, int level, const char *func,
+                               int line, const char *msg);
+
 /* Error handling defines and types */
 typedef int NEF_STATUS;
 
@@ -40,12 +205,94 @@ typedef int NEF_STATUS;
 #define NEF_DATATYPE_UNKNOWN        0 /* unknown, probably not an image IFD */
 #define NEF_DATATYPE_UINT           1 /* Unsigned integer */
 
+/* A tile of one level of an image pyramid. Level 0 has one RGB pixel per
+ * 2x2 CFA quad, as NEF_DECODE_HALF_RGB does; each level after it is half
+ * the size of the one before. Pixels are three unconverted 16-bit samples.
+ */
+struct nef_pyramid_tile {
+    unsigned level;
+    unsigned x;                     /* Column of the tile in its level */
+    unsigned y;                     /* Row of the tile in its level */
+    unsigned width;                 /* Pixels across; less at the edges */
+    unsigned height;                /* Pixels down; less at the edges */
+    const unsigned short *pixels;   /* The top-left pixel of the tile */
+    size_t stride;                  /* Samples between rows of pixels */
+};
+
+/* Receives each tile of a pyramid; pixels are only valid during the call.
+ * Returning anything but NEF_OK stops the decode with that status.
+ */
+typedef NEF_STATUS (*nef_pyramid_func_t)(void *ctx,
+                                         const struct nef_pyramid_tile *tile);
+
 /* Open an NEF image */
 NEF_STATUS nef_open(const char *file, nef_t **fp);
 
+/* Open an NEF image, with flags (NEF_OPEN_*) and an allocator to use for
+ * every allocation made on behalf of the handle. If alloc is NULL, the
+ * global allocator is used.
+ */
+NEF_STATUS nef_open_ex(const char *file, unsigned flags,
+                       const struct nef_allocator *alloc, nef_t **fp);
+
+/* Open n NEF images in parallel, with flags (NEF_OPEN_*), on nthreads
+ * threads (0 for one per CPU), including the calling thread. handles[i]
+ * and statuses[i] receive the handle and status for paths[i]; a file that
+ * fails to open gets a NULL handle, and does not stop the others. Returns
+ * NEF_OK if every file was opened.
+ */
+NEF_STATUS nef_open_many(const char * const *paths, size_t n, unsigned flags,
+                         nef_t **handles, NEF_STATUS *statuses,
+                         unsigned nthreads);
+
+/* Open a sidecar written by nef_image_write_decoded. The file is mapped,
+ * not decoded; the handle has a single full-resolution image, read with
+ * the same functions as the raw image of an NEF.
+ */
+NEF_STATUS nef_open_decoded(const char *file, nef_t **fp);
+
+/* Set the allocator used by libnefko when no handle-specific allocator is
+ * given. Passing NULL restores the C library allocator. This must be
+ * called before any other libnefko function.
+ */
+NEF_STATUS nef_set_allocator(const struct nef_allocator *alloc);
+
 /* Close an NEF image */
 NEF_STATUS nef_close(nef_t *fp);
 
+/* Set the page cache hints given to the kernel for the image data of a
+ * handle (NEF_HINT_*, or 0 for none). Hints cover the strips of an image
+ * as it is decoded with nef_image_get_raw, and the JPEG stream of a preview
+ * of a mapped file. NEF_HINT_SEQUENTIAL only applies to mapped files.
+ * NEF_HINT_DONTNEED keeps one-pass batch jobs from filling the page cache.
+ * Handles start out with NEF_HINT_DEFAULT; hints issued are counted under
+ * NEF_STAGE_HINT.
+ */
+NEF_STATUS nef_set_io_hints(nef_t *fp, unsigned hints);
+
+/* Get the instrumentation counters of a handle, or the totals across all
+ * handles if fp is NULL. If libnefko was built without NEF_STATS, the
+ * counters are always zero.
+ */
+NEF_STATUS nef_stats_get(nef_t *fp, struct nef_stats *stats);
+
+/* Reset the counters of a handle, or the totals if fp is NULL */
+NEF_STATUS nef_stats_reset(nef_t *fp);
+
+/* Send log messages of level and below to func. Passing a NULL func
+ * disables logging, which is the default. Messages above the level the
+ * library was built with (NEF_LOG_DEBUG with _DEBUG, NEF_LOG_WARN
+ * otherwise) are never generated.
+ */
+NEF_STATUS nef_set_log_callback(nef_log_func_t func, void *ctx, int level);
+
+/* Get the name of the set of SIMD kernels in use: "scalar", "sse4.2",
+ * "avx2" or "avx512". The best set the CPU supports is picked when the
+ * library is loaded; setting NEFKO_CPU in the environment to one of these
+ * names forces that set instead, if the CPU supports it.
+ */
+const char *nef_cpu_kernels(void);
+
 /*******************************************************************/
 /* Functions for manipulating NEF image descriptors                */
 /*******************************************************************/
@@ -56,7 +303,72 @@ NEF_STATUS nef_image_get_count(nef_t *fp, int *count);
 /* Get a particular image, by count */
 NEF_STATUS nef_image_get_handle(nef_t *fp, int id, nef_image_t **hdl);
 
-/* Get the attributes of a particular image */
+/* Set how nef_image_get_raw will decode a particular image. The half-size
+ * modes collapse each 2x2 CFA quad as rows leave the decoder, so the output
+ * is a quarter of the size of a full decode. Defaults to NEF_DECODE_FULL.
+ */
+NEF_STATUS nef_image_set_decode_mode(nef_t *fp, nef_image_t *hdl, int mode);
+
+/* Set the orientation nef_image_get_raw writes an image in, as a TIFF
+ * Orientation value or NEF_ORIENT_AUTO. Rows are rotated into place in
+ * blocks as they leave the decoder, so there is no separate pass over the
+ * frame. Only interleaved output can be rotated.
+ */
+NEF_STATUS nef_image_set_orientation(nef_t *fp, nef_image_t *hdl,
+                                     int orientation);
+
+/* Get the CFA colour (0 = R, 1 = G, 2 = B) at each position of the 2x2
+ * repeat pattern of full-resolution output, in row-major order, in the
+ * orientation set for the image.
+ */
+NEF_STATUS nef_image_get_cfa_pattern(nef_t *fp, nef_image_t *hdl,
+                                     unsigned char *pattern);
+
+/* Pass as the black level to nef_image_init_output_conv to use the
+ * camera's black level (0 if the camera is not known).
+ */
+#define NEF_BLACK_CAMERA        (~0u)
+
+/* Fill in an output conversion for an image that subtracts black, applies
+ * the white balance from the MakerNote if wb is non-zero, and scales white
+ * to the full range of pixel_format. If white is 0, the camera's saturation
+ * level is used, or if that is not known, the largest value the image's
+ * sample depth can hold.
+ */
+NEF_STATUS nef_image_init_output_conv(nef_t *fp, nef_image_t *hdl,
+                                      int pixel_format, unsigned black,
+                                      unsigned white, int wb,
+                                      struct nef_output_conv *conv);
+
+/* Set the output conversion nef_image_get_raw applies to an image. Passing
+ * NULL restores the default, which is to emit the decoded 16-bit samples
+ * unmodified.
+ */
+NEF_STATUS nef_image_set_output_conv(nef_t *fp, nef_image_t *hdl,
+                                     const struct nef_output_conv *conv);
+
+/* Get the active area of an image: the part of the sensor that carries
+ * picture data, in full-resolution raw coordinates. This is the whole
+ * image unless the camera is known to have masked or unused borders.
+ */
+NEF_STATUS nef_image_get_active_area(nef_t *fp, nef_image_t *hdl,
+                                     unsigned *left, unsigned *top,
+                                     unsigned *width, unsigned *height);
+
+/* Get the embedded JPEG stream of a preview image. The stream is located
+ * through the JPEGInterchangeFormat tags, or the strips of a JPEG
+ * compressed image. If the file was opened with NEF_OPEN_MMAP, data points
+ * straight into the mapped file; otherwise the stream is read once, and
+ * kept with the image. Either way, data stays valid until nef_close.
+ * Returns NEF_NOT_FOUND for images that carry no JPEG stream.
+ */
+NEF_STATUS nef_image_get_preview(nef_t *fp, nef_image_t *hdl,
+                                 const void **data, size_t *bytes);
+
+/* Get the attributes of a particular image. The dimensions reported are
+ * those of the output of nef_image_get_raw in the current decode mode and
+ * orientation.
+ */
 NEF_STATUS nef_image_get_attribs(nef_t *fp, nef_image_t *hdl,
                                  int *width, int *height, int *chans,
                                  int *image_type, int *data_type);
@@ -65,18 +377,49 @@ NEF_STATUS nef_image_get_attribs(nef_t *fp, nef_image_t *hdl,
 /* Functions for manipulating NEF image metadata                   */
 /*******************************************************************/
 
+/* Tag IDs name a tag of the EXIF IFD or, failing that, of the root IFD.
+ * Wrap an ID in NEF_TAG_MAKERNOTE to name a tag of the Nikon MakerNote.
+ */
+#define NEF_TAG_MAKERNOTE(id)   ((id) | 0x10000)
+
 /* Get the contents of an EXIF tag. Note that calls to this function
  * where data = NULL will just result in the type and tag_count being
- * populated with no extra data being read from the file.
+ * populated with no extra data being read from the file. Obfuscated
+ * MakerNote fields are returned deobfuscated.
  */
 NEF_STATUS nef_exif_get_tag(nef_t *fp, int tag_id,
                             int *tag_type, int *tag_count, void *data);
 
-/* Get the device model.
+/* The outcome of looking up one tag with nef_exif_get_tags */
+struct nef_tag_result {
+    NEF_STATUS status;      /* NEF_NOT_FOUND if the tag is missing, or
+                               NEF_NO_MEMORY if its value did not fit */
+    int type;               /* TIFF type of the items */
+    int count;              /* Number of items */
+    size_t bytes;           /* Size of the value */
+    void *data;             /* The value, in the arena */
+};
+
+/* Get n tags at once, as nef_exif_get_tag would. Values are packed into
+ * the caller's arena of arena_len bytes, at offsets aligned to 8 bytes; a
+ * value that does not fit is skipped, but its type, count and size are
+ * still reported. Returns NEF_OK unless the arguments are bad; the outcome for
+ * each tag is in its result.
+ */
+NEF_STATUS nef_exif_get_tags(nef_t *fp, const int *ids, int n,
+                             struct nef_tag_result *out, void *arena,
+                             size_t arena_len);
+
+/* Get the device model. On entry, count holds the capacity of model; on
+ * return, the length of the model name, including its terminator. If
+ * model is NULL, only count is populated.
  */
 NEF_STATUS nef_meta_get_model(nef_t *fp, int *count, char *model);
 
-/* Get the white balance coefficient array, of floats.
+/* Get the white balance coefficient array, of floats. On entry, count
+ * holds the capacity of coeffs; on return, the number of coefficients
+ * available. The coefficients are the red, green and blue multipliers,
+ * normalized to green. If coeffs is NULL, only count is populated.
  */
 NEF_STATUS nef_meta_white_balance(nef_t *fp, int *count, float *coeffs);
 
@@ -86,11 +429,202 @@ NEF_STATUS nef_meta_white_balance(nef_t *fp, int *count, float *coeffs);
 
 /* Get the image data contents of a given image represented by an
  * nef_image_t handle. Populates image with a width * height * chans
- * array, chunky pixels (if relevant), with each pixel occupying
- * data_type bytes.
+ * array, chunky pixels (if relevant), with each sample occupying
+ * 16 bits, or 8 bits if an NEF_PIXEL_8 output conversion is set.
+ * width, height and chans are as reported by nef_image_get_attribs.
  */
 NEF_STATUS nef_image_get_raw(nef_t *fp, nef_image_t *hdl, unsigned bufsize,
                              void *image_buf);
 
+/* Allocate a buffer sized for the output of nef_image_get_raw for an image
+ * in the given pixel format, in its current decode mode. Buffers are
+ * 64-byte aligned; large ones are backed by huge pages where available.
+ * With NEF_BUF_POOLED, a free pooled buffer of sufficient size is reused
+ * if there is one, and the buffer returns to the pool once freed.
+ */
+NEF_STATUS nef_image_alloc_buffer(nef_t *fp, nef_image_t *hdl, int format,
+                                  unsigned flags, void **buf, size_t *size);
+
+/* Free a buffer allocated with nef_image_alloc_buffer */
+NEF_STATUS nef_image_free_buffer(void *buf);
+
+/* Release every buffer held in the buffer pool */
+NEF_STATUS nef_buffer_pool_drain(void);
+
+/* Set the budget of the process-wide cache of decoded frames. Once it is
+ * non-zero, interleaved output from nef_image_get_raw and
+ * nef_image_get_raw_desc is cached, keyed by the identity of the file, the
+ * image and how it is decoded and converted, and later decodes of the same
+ * frame, from any handle, are copied from the cache. The least recently
+ * used frames are evicted to stay within budget. A budget of 0, the
+ * default, disables the cache and empties it.
+ */
+NEF_STATUS nef_cache_set_budget(size_t bytes);
+
+/* Drop every frame held in the decoded-frame cache */
+NEF_STATUS nef_cache_flush(void);
+
+/* Get the counters of the decoded-frame cache */
+NEF_STATUS nef_cache_get_stats(struct nef_cache_stats *stats);
+
+/* Write the calibration for a camera body to a file, to be found by
+ * nef_calib_set_dir. The dark frame and flat field, where given, are
+ * width * height samples.
+ */
+NEF_STATUS nef_calib_write(const char *file, const struct nef_calib_desc *desc);
+
+/* Set the directory calibration files are looked up in, as
+ * <serial>.nefcal. Files are mapped the first time a camera's calibration
+ * is used, and stay mapped for later images from the same camera.
+ */
+NEF_STATUS nef_calib_set_dir(const char *dir);
+
+/* Unmap every calibration file no image is using */
+NEF_STATUS nef_calib_flush(void);
+
+/* Get the size of the tiles an image is best read in */
+NEF_STATUS nef_image_get_tile_size(nef_t *fp, nef_image_t *hdl,
+                                   unsigned *width, unsigned *height);
+
+/* Read a w x h rectangle of unconverted 16-bit samples, from (x, y) in the
+ * full-resolution image, into a densely packed buffer. Only images whose
+ * reader supports random access, such as uncompressed images and those
+ * opened with nef_open_decoded, can be read this way.
+ */
+NEF_STATUS nef_image_read_tile(nef_t *fp, nef_image_t *hdl, unsigned x,
+                               unsigned y, unsigned w, unsigned h, void *buf);
+
+/* Decode a full-resolution image and write its samples to a sidecar file,
+ * along with its dimensions, CFA pattern, sample depth, black and white
+ * levels and white balance. Samples are stored in tiles of tile_rows rows
+ * (rounded up to even; 0 for a single tile), each starting on a page
+ * boundary. If calibration is enabled for the image, the samples are
+ * written calibrated, since a sidecar cannot be calibrated once written.
+ */
+NEF_STATUS nef_image_write_decoded(nef_t *fp, nef_image_t *hdl,
+                                   const char *file, unsigned tile_rows);
+
+/* Decode a full-resolution CFA image into a pyramid of tile_size square
+ * tiles (tile_size must be even), from level 0 down to the first level
+ * that fits in one tile. Each row of tiles of a level is handed to func
+ * as soon as it is complete, so only one row of tiles per level is ever
+ * held, rather than the whole frame.
+ */
+NEF_STATUS nef_image_get_pyramid(nef_t *fp, nef_image_t *hdl,
+                                 unsigned tile_size, nef_pyramid_func_t func,
+                                 void *ctx);
+
+/* Fingerprint the raw data of an image, without decoding it, for finding
+ * duplicates. Only the strip payload, the camera serial number and the
+ * shutter count are hashed, so files with the same raw data match even
+ * once their metadata has been edited. out receives 8 bytes for
+ * NEF_HASH_XXH64 or 32 bytes for NEF_HASH_SHA256. Strips are hashed in
+ * place if the file was opened with NEF_OPEN_MMAP, and in parallel; the
+ * fingerprint is the same either way.
+ */
+NEF_STATUS nef_image_fingerprint(nef_t *fp, nef_image_t *hdl, int algo,
+                                 unsigned char *out);
+
+/* Correct a full-resolution CFA image with the calibration of the camera
+ * that took it, found by its serial number, each time it is decoded, or
+ * stop correcting it if enable is 0. The dark frame, flat field and
+ * defects are applied together to each band of rows as it leaves the
+ * decoder, ahead of output conversion and statistics. Returns
+ * NEF_NOT_FOUND if there is no calibration for the camera.
+ */
+NEF_STATUS nef_image_set_calibration(nef_t *fp, nef_image_t *hdl,
+                                     int enable);
+
+/* Gather statistics of the raw samples of a full-resolution CFA image each
+ * time it is decoded by nef_image_get_raw or nef_image_get_raw_desc. bins
+ * and clip are read, and chan and hist overwritten, by every successful
+ * decode; stats must stay valid until gathering is stopped by passing
+ * NULL. While statistics are gathered, frames are not read from the
+ * decoded-frame cache.
+ */
+NEF_STATUS nef_image_set_stats(nef_t *fp, nef_image_t *hdl,
+                               struct nef_image_stats *stats);
+
+/* Add the statistics in from to those in into, such as those gathered by
+ * decodes running on separate threads. Both must have the same number of
+ * bins; histograms are added only if both have one.
+ */
+NEF_STATUS nef_image_stats_merge(struct nef_image_stats *into,
+                                 const struct nef_image_stats *from);
+
+/* Get the image data contents of a given image, written as described by
+ * desc. Planar layouts are only available for full-resolution CFA output.
+ * If an output conversion is set, its pixel format must match the one in
+ * desc; without one, NEF_PIXEL_8 output keeps the top 8 bits of each
+ * sample.
+ */
+NEF_STATUS nef_image_get_raw_desc(nef_t *fp, nef_image_t *hdl,
+                                  const struct nef_output_desc *desc);
+
+/*******************************************************************/
+/* Functions for decoding NEFs as they arrive                      */
+/*******************************************************************/
+
+/* State of an NEF being decoded as it arrives */
+struct nef_stream;
+typedef struct nef_stream nef_stream_t;
+
+/* Called from nef_stream_feed as the parts of a file arrive. Any of the
+ * callbacks may be NULL; if one returns anything but NEF_OK, the stream
+ * fails with that status. ctx is passed through to each call.
+ */
+struct nef_stream_callbacks {
+    /* A tag of the root or EXIF IFD, or of the MakerNote with its ID
+     * wrapped in NEF_TAG_MAKERNOTE, as soon as its value has arrived. data
+     * holds count items of the given TIFF type, in host byte order, and is
+     * only valid during the call. MakerNote values are passed as stored,
+     * obfuscated or not.
+     */
+    NEF_STATUS (*tag)(void *ctx, int tag_id, int type, int count,
+                      const void *data);
+
+    /* All the metadata has arrived. The raw image is width x height
+     * samples of bits bits, under the given 2x2 CFA pattern (0 = R,
+     * 1 = G, 2 = B, in row-major order).
+     */
+    NEF_STATUS (*image)(void *ctx, unsigned width, unsigned height,
+                        unsigned bits, const unsigned char *cfa_pattern);
+
+    /* nr_rows rows of the raw image have been decoded, starting at row,
+     * each of width 16-bit samples. Bands of rows start on an even row;
+     * rows is only valid during the call.
+     */
+    NEF_STATUS (*rows)(void *ctx, unsigned row, unsigned nr_rows,
+                       const unsigned short *rows, unsigned width);
+
+    void *ctx;
+};
+
+/* Start decoding an NEF that is passed in a piece at a time, in order,
+ * with nef_stream_feed, for files that cannot be read at random (from a
+ * pipe or a socket, say). alloc is as for nef_open_ex.
+ */
+NEF_STATUS nef_stream_open(const struct nef_stream_callbacks *cb,
+                           const struct nef_allocator *alloc,
+                           nef_stream_t **stream);
+
+/* Pass the next len bytes of the file. IFDs are parsed, and the raw image
+ * decoded, as far as the bytes passed so far allow, and the callbacks are
+ * made along the way. Only bytes that are still needed are kept: until
+ * the metadata is complete, that is everything; after it, only raw image
+ * data not yet decoded. Once a call fails, later calls return the same
+ * status.
+ */
+NEF_STATUS nef_stream_feed(nef_stream_t *stream, const void *bytes,
+                           size_t len);
+
+/* Say the whole file has been passed. Returns NEF_OK if the raw image was
+ * decoded in full, or NEF_RANGE_ERROR if the file ended early.
+ */
+NEF_STATUS nef_stream_finish(nef_stream_t *stream);
+
+/* Free a stream, finished or not */
+NEF_STATUS nef_stream_close(nef_stream_t *stream);
+
 #endif /* __INCLUDE_NEFKO_H__ */
 
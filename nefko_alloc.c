@@ -0,0 +1,256 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Memory allocation for libnefko. Every allocation the library makes goes
+ * through nef_alloc/nef_free, which use the allocator of the handle the
+ * memory belongs to, or the global allocator if there is no handle yet.
+ *
+ * Handles opened with NEF_OPEN_ARENA carve their metadata out of a chain
+ * of chunks with a bump pointer. Freeing arena memory only reclaims it if
+ * it was the most recent allocation (tag data is usually fetched, used
+ * and released straight away); everything else is released at once by
+ * nef_close. Large allocations, such as strip data, bypass the arena.
+ */
+
+/* Size of the first chunk of an arena; later chunks double in size */
+#define NEF_ARENA_CHUNK_SIZE    (16 * 1024)
+
+/* Allocations larger than this do not come from the arena */
+#define NEF_ARENA_MAX_ALLOC     (64 * 1024)
+
+#define NEF_ARENA_ALIGN         16
+#define NEF_ARENA_ROUND(x) \
+    (((x) + NEF_ARENA_ALIGN - 1) & ~((size_t)NEF_ARENA_ALIGN - 1))
+
+struct nef_arena_chunk {
+    struct nef_arena_chunk *next;
+    size_t size;            /* Bytes available in data */
+    size_t used;            /* Bytes handed out */
+    size_t last;            /* Offset of the most recent allocation */
+    uint8_t data[] __attribute__((aligned(NEF_ARENA_ALIGN)));
+};
+
+static void *nef_libc_alloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static void *nef_libc_realloc(void *ctx, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void nef_libc_free(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+static struct nef_allocator nef_global_allocator = {
+    .alloc = nef_libc_alloc,
+    .realloc = nef_libc_realloc,
+    .free = nef_libc_free,
+    .ctx = NULL
+};
+
+NEF_STATUS nef_set_allocator(const struct nef_allocator *alloc)
+{
+    if (alloc == NULL) {
+        nef_global_allocator.alloc = nef_libc_alloc;
+        nef_global_allocator.realloc = nef_libc_realloc;
+        nef_global_allocator.free = nef_libc_free;
+        nef_global_allocator.ctx = NULL;
+        return NEF_OK;
+    }
+
+    NEF_CHECK_ARG(alloc->alloc);
+    NEF_CHECK_ARG(alloc->realloc);
+    NEF_CHECK_ARG(alloc->free);
+
+    nef_global_allocator = *alloc;
+
+    return NEF_OK;
+}
+
+static inline struct nef_allocator *nef_allocator_of(nef_t *nef)
+{
+    return nef != NULL ? &nef->allocator : &nef_global_allocator;
+}
+
+static struct nef_arena_chunk *nef_arena_new_chunk(struct nef_allocator *a,
+                                                   size_t size)
+{
+    struct nef_arena_chunk *chunk = NULL;
+
+    chunk = (struct nef_arena_chunk *)a->alloc(a->ctx,
+        sizeof(struct nef_arena_chunk) + size);
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->last = 0;
+
+    return chunk;
+}
+
+static void *nef_arena_alloc(nef_t *nef, size_t size)
+{
+    struct nef_arena_chunk *chunk = nef->arena;
+    size_t need = NEF_ARENA_ROUND(size);
+
+    if (chunk->size - chunk->used < need) {
+        size_t new_size = chunk->size * 2;
+
+        if (new_size < need) {
+            new_size = need;
+        }
+
+        if ((chunk = nef_arena_new_chunk(&nef->allocator, new_size)) == NULL) {
+            return NULL;
+        }
+
+        chunk->next = nef->arena;
+        nef->arena = chunk;
+    }
+
+    chunk->last = chunk->used;
+    chunk->used += need;
+
+    return chunk->data + chunk->last;
+}
+
+static int nef_arena_owns(nef_t *nef, void *ptr)
+{
+    struct nef_arena_chunk *chunk = NULL;
+
+    for (chunk = nef->arena; chunk != NULL; chunk = chunk->next) {
+        if ((uint8_t *)ptr >= chunk->data &&
+            (uint8_t *)ptr < chunk->data + chunk->size)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void *nef_alloc_raw(nef_t *nef, size_t size)
+{
+    struct nef_allocator *a = nef_allocator_of(nef);
+
+    if (nef != NULL && nef->arena != NULL && size <= NEF_ARENA_MAX_ALLOC) {
+        return nef_arena_alloc(nef, size);
+    }
+
+    return a->alloc(a->ctx, size);
+}
+
+void *nef_alloc(nef_t *nef, size_t size)
+{
+    void *ptr = nef_alloc_raw(nef, size);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+void *nef_realloc(nef_t *nef, void *ptr, size_t size)
+{
+    struct nef_allocator *a = nef_allocator_of(nef);
+
+    /* Arena memory is never resized; callers that grow buffers must not
+     * get them from an arena.
+     */
+    if (nef != NULL && nef->arena != NULL && ptr != NULL &&
+        nef_arena_owns(nef, ptr))
+    {
+        NEF_TRACE("Attempted to resize arena memory\n");
+        return NULL;
+    }
+
+    return a->realloc(a->ctx, ptr, size);
+}
+
+void nef_free(nef_t *nef, void *ptr)
+{
+    struct nef_allocator *a = nef_allocator_of(nef);
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (nef != NULL && nef->arena != NULL && nef_arena_owns(nef, ptr)) {
+        struct nef_arena_chunk *chunk = nef->arena;
+
+        /* Roll back the most recent allocation only */
+        if ((uint8_t *)ptr == chunk->data + chunk->last &&
+            chunk->last != chunk->used)
+        {
+            chunk->used = chunk->last;
+        }
+
+        return;
+    }
+
+    a->free(a->ctx, ptr);
+}
+
+NEF_STATUS nef_handle_alloc(unsigned flags, const struct nef_allocator *alloc,
+                            nef_t **nef)
+{
+    struct nef_allocator a = alloc != NULL ? *alloc : nef_global_allocator;
+    struct nef_arena_chunk *chunk = NULL;
+    nef_t *nef_fp = NULL;
+
+    if (flags & NEF_OPEN_ARENA) {
+        if ((chunk = nef_arena_new_chunk(&a, NEF_ARENA_CHUNK_SIZE)) == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        /* The handle itself is the first thing in the arena */
+        nef_fp = (nef_t *)chunk->data;
+        chunk->used = NEF_ARENA_ROUND(sizeof(nef_t));
+        chunk->last = chunk->used;
+    } else if ((nef_fp = (nef_t *)a.alloc(a.ctx, sizeof(nef_t))) == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    memset(nef_fp, 0, sizeof(nef_t));
+
+    nef_fp->allocator = a;
+    nef_fp->arena = chunk;
+    nef_fp->flags = flags;
+    nef_fp->fd = -1;
+    nef_fp->hints = NEF_HINT_DEFAULT;
+
+    *nef = nef_fp;
+
+    return NEF_OK;
+}
+
+void nef_handle_free(nef_t *nef)
+{
+    struct nef_allocator a = nef->allocator;
+    struct nef_arena_chunk *chunk = nef->arena;
+
+    if (chunk == NULL) {
+        memset(nef, 0, sizeof(nef_t));
+        a.free(a.ctx, nef);
+        return;
+    }
+
+    /* The handle lives in the arena, so it goes with it */
+    while (chunk != NULL) {
+        struct nef_arena_chunk *next = chunk->next;
+        a.free(a.ctx, chunk);
+        chunk = next;
+    }
+}
@@ -0,0 +1,163 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Opening many files at once. Parsing an NEF is a chain of small reads,
+ * each depending on the last (the header, the root IFD, the SubIFDs, the
+ * EXIF IFD, the MakerNote), so one open spends most of its time waiting.
+ * Workers open files in parallel, and ahead of them the head of each
+ * upcoming file is hinted to the kernel, so its reads are already queued
+ * by the time a worker gets to it.
+ */
+
+/* Bytes at the start of a file that hold its IFDs and MakerNote */
+#define NEF_OPEN_MANY_HEAD      (256 * 1024)
+
+/* Files hinted ahead of the next one to be opened */
+#define NEF_OPEN_MANY_AHEAD     32
+
+/* Default number of workers if the CPU count cannot be found */
+#define NEF_WORKER_THREADS      4
+
+void nef_run_workers(void *(*worker)(void *), void *arg, unsigned nthreads,
+                     size_t n)
+{
+    pthread_t *threads = NULL;
+    unsigned i, started = 0;
+
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nthreads = cpus > 0 ? (unsigned)cpus : NEF_WORKER_THREADS;
+    }
+
+    if (nthreads > n) {
+        nthreads = n;
+    }
+
+    if (nthreads > 1) {
+        threads = (pthread_t *)nef_alloc(NULL, sizeof(pthread_t) * nthreads);
+    }
+
+    /* Workers beyond the first are only an optimization */
+    for (i = 1; threads != NULL && i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, worker, arg) != 0) {
+            NEF_WARN("Could only start %u of %u workers\n", started + 1,
+                nthreads);
+            break;
+        }
+        started++;
+    }
+
+    worker(arg);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (threads) nef_free(NULL, threads);
+}
+
+struct nef_open_many {
+    const char * const *paths;
+    size_t n;
+    unsigned flags;
+    nef_t **handles;
+    NEF_STATUS *statuses;
+
+    /* Index of the next file to open, and of the next to hint */
+    size_t next;
+    size_t next_hint;
+};
+
+/* Ask the kernel to start reading the head of a file */
+static void nef_open_many_hint(const char *path)
+{
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, NEF_OPEN_MANY_HEAD, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void *nef_open_many_worker(void *arg)
+{
+    struct nef_open_many *batch = (struct nef_open_many *)arg;
+    size_t i, hint;
+
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+           batch->n)
+    {
+        /* Keep the hints a window ahead of the opens */
+        while ((hint = __atomic_load_n(&batch->next_hint, __ATOMIC_RELAXED)) <
+               batch->n && hint < i + NEF_OPEN_MANY_AHEAD)
+        {
+            if (__atomic_compare_exchange_n(&batch->next_hint, &hint, hint + 1,
+                                            0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                nef_open_many_hint(batch->paths[hint]);
+            }
+        }
+
+        if (batch->paths[i] == NULL) {
+            batch->statuses[i] = NEF_BAD_ARGUMENT;
+            continue;
+        }
+
+        batch->statuses[i] = nef_open_ex(batch->paths[i], batch->flags, NULL,
+                                         &batch->handles[i]);
+    }
+
+    return NULL;
+}
+
+NEF_STATUS nef_open_many(const char * const *paths, size_t n, unsigned flags,
+                         nef_t **handles, NEF_STATUS *statuses,
+                         unsigned nthreads)
+{
+    struct nef_open_many batch;
+    size_t j;
+
+    NEF_CHECK_ARG(paths);
+    NEF_CHECK_ARG(handles);
+    NEF_CHECK_ARG(statuses);
+
+    for (j = 0; j < n; j++) {
+        handles[j] = NULL;
+        statuses[j] = NEF_FAILURE;
+    }
+
+    if (n == 0) {
+        return NEF_OK;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.paths = paths;
+    batch.n = n;
+    batch.flags = flags;
+    batch.handles = handles;
+    batch.statuses = statuses;
+
+    /* Seal the registries once, before the workers race to */
+    nef_registry_seal();
+
+    nef_run_workers(nef_open_many_worker, &batch, nthreads, n);
+
+    for (j = 0; j < n; j++) {
+        if (statuses[j] != NEF_OK) {
+            return NEF_FAILURE;
+        }
+    }
+
+    return NEF_OK;
+}
@@ -0,0 +1,250 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Output buffer allocator. Small buffers come from posix_memalign; large
+ * ones are mapped directly, aligned to a huge page boundary and, where the
+ * kernel supports it, backed by transparent huge pages. Every buffer is
+ * preceded by a header describing how to release it.
+ */
+
+#define NEF_BUF_ALIGN           64
+#define NEF_BUF_HUGE_PAGE       (2ul * 1024 * 1024)
+#define NEF_BUF_MAGIC           0x4e454642ul    /* 'NEFB' */
+
+/* Maximum number of free buffers kept in the pool */
+#define NEF_BUF_POOL_MAX        8
+
+struct nef_buf_hdr {
+    uint32_t magic;
+    uint32_t flags;
+    size_t size;            /* Usable bytes following the header */
+    void *base;             /* Start of the underlying allocation */
+    size_t base_len;        /* Length of the mapping, or 0 if malloc'd */
+    struct nef_buf_hdr *next;
+};
+
+/* The header occupies one alignment unit, so the data stays aligned */
+#define NEF_BUF_HDR_SIZE        NEF_BUF_ALIGN
+
+#define NEF_BUF_DATA(hdr)       ((uint8_t *)(hdr) + NEF_BUF_HDR_SIZE)
+#define NEF_BUF_HDR(data) \
+    ((struct nef_buf_hdr *)((uint8_t *)(data) - NEF_BUF_HDR_SIZE))
+
+static pthread_mutex_t nef_buf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nef_buf_hdr *nef_buf_pool = NULL;
+static unsigned nef_buf_pool_count = 0;
+
+static struct nef_buf_hdr *nef_buf_map(size_t size)
+{
+    size_t len = size + NEF_BUF_HDR_SIZE + NEF_BUF_HUGE_PAGE;
+    uint8_t *base = NULL, *start = NULL;
+    struct nef_buf_hdr *hdr = NULL;
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* Place the data on a huge page boundary; the header sits just below
+     * it, in the slack at the start of the mapping.
+     */
+    start = (uint8_t *)(((uintptr_t)base + NEF_BUF_HDR_SIZE +
+        NEF_BUF_HUGE_PAGE - 1) & ~(NEF_BUF_HUGE_PAGE - 1));
+
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+
+    hdr = NEF_BUF_HDR(start);
+    hdr->base = base;
+    hdr->base_len = len;
+
+    return hdr;
+}
+
+static struct nef_buf_hdr *nef_buf_alloc(size_t size)
+{
+    struct nef_buf_hdr *hdr = NULL;
+    void *base = NULL;
+
+    if (size >= NEF_BUF_HUGE_PAGE) {
+        hdr = nef_buf_map(size);
+    } else if (posix_memalign(&base, NEF_BUF_ALIGN,
+                              size + NEF_BUF_HDR_SIZE) == 0)
+    {
+        hdr = (struct nef_buf_hdr *)base;
+        hdr->base = base;
+        hdr->base_len = 0;
+    }
+
+    if (hdr == NULL) {
+        return NULL;
+    }
+
+    hdr->magic = NEF_BUF_MAGIC;
+    hdr->size = size;
+    hdr->next = NULL;
+
+    return hdr;
+}
+
+static void nef_buf_release(struct nef_buf_hdr *hdr)
+{
+    hdr->magic = 0;
+
+    if (hdr->base_len != 0) {
+        munmap(hdr->base, hdr->base_len);
+    } else {
+        free(hdr->base);
+    }
+}
+
+/* Take the smallest pooled buffer that can hold size bytes, if any */
+static struct nef_buf_hdr *nef_buf_pool_get(size_t size)
+{
+    struct nef_buf_hdr **prev = NULL, **best = NULL, *hdr = NULL;
+
+    pthread_mutex_lock(&nef_buf_pool_lock);
+
+    for (prev = &nef_buf_pool; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->size >= size &&
+            (best == NULL || (*prev)->size < (*best)->size))
+        {
+            best = prev;
+        }
+    }
+
+    if (best != NULL) {
+        hdr = *best;
+        *best = hdr->next;
+        hdr->next = NULL;
+        nef_buf_pool_count--;
+    }
+
+    pthread_mutex_unlock(&nef_buf_pool_lock);
+
+    return hdr;
+}
+
+static int nef_buf_pool_put(struct nef_buf_hdr *hdr)
+{
+    int pooled = 0;
+
+    pthread_mutex_lock(&nef_buf_pool_lock);
+
+    if (nef_buf_pool_count < NEF_BUF_POOL_MAX) {
+        hdr->next = nef_buf_pool;
+        nef_buf_pool = hdr;
+        nef_buf_pool_count++;
+        pooled = 1;
+    }
+
+    pthread_mutex_unlock(&nef_buf_pool_lock);
+
+    return pooled;
+}
+
+NEF_STATUS nef_image_alloc_buffer(nef_t *fp, nef_image_t *hdl, int format,
+                                  unsigned flags, void **buf, size_t *size)
+{
+    struct nef_buf_hdr *hdr = NULL;
+    unsigned width, height, chans;
+    size_t bytes;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(buf);
+    NEF_CHECK_ARG(size);
+
+    *buf = NULL;
+    *size = 0;
+
+    if (format != NEF_PIXEL_8 && format != NEF_PIXEL_16) {
+        return NEF_RANGE_ERROR;
+    }
+
+    nef_image_get_output_dims(hdl, &width, &height, &chans);
+
+    bytes = (size_t)width * height * chans * (format == NEF_PIXEL_8 ? 1 : 2);
+
+    if (bytes == 0) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (flags & NEF_BUF_POOLED) {
+        hdr = nef_buf_pool_get(bytes);
+    }
+
+    if (hdr == NULL) {
+        if ((hdr = nef_buf_alloc(bytes)) == NULL) {
+            NEF_ERROR("Failed to allocate %zu byte buffer\n", bytes);
+            return NEF_NO_MEMORY;
+        }
+
+        if (flags & NEF_BUF_PREFAULT) {
+            long page = sysconf(_SC_PAGESIZE);
+            size_t off;
+
+            for (off = 0; off < bytes; off += page) {
+                NEF_BUF_DATA(hdr)[off] = 0;
+            }
+        }
+    }
+
+    hdr->flags = flags;
+
+    *buf = NEF_BUF_DATA(hdr);
+    *size = bytes;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_free_buffer(void *buf)
+{
+    struct nef_buf_hdr *hdr = NULL;
+
+    NEF_CHECK_ARG(buf);
+
+    hdr = NEF_BUF_HDR(buf);
+
+    if (hdr->magic != NEF_BUF_MAGIC) {
+        NEF_TRACE("Buffer %p was not allocated by nef_image_alloc_buffer\n",
+            buf);
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if ((hdr->flags & NEF_BUF_POOLED) && nef_buf_pool_put(hdr)) {
+        return NEF_OK;
+    }
+
+    nef_buf_release(hdr);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_buffer_pool_drain(void)
+{
+    struct nef_buf_hdr *hdr = NULL;
+
+    pthread_mutex_lock(&nef_buf_pool_lock);
+    hdr = nef_buf_pool;
+    nef_buf_pool = NULL;
+    nef_buf_pool_count = 0;
+    pthread_mutex_unlock(&nef_buf_pool_lock);
+
+    while (hdr != NULL) {
+        struct nef_buf_hdr *next = hdr->next;
+        nef_buf_release(hdr);
+        hdr = next;
+    }
+
+    return NEF_OK;
+}
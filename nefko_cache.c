@@ -0,0 +1,330 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Process-wide cache of decoded frames. A frame is keyed by the identity
+ * of its file (device, inode, size and modification time, so a rewritten
+ * file misses), the index of the image, and everything that shapes the
+ * output: decode mode, orientation, calibration, pixel format and output
+ * conversion.
+ *
+ * Frames live in a hash table, and on a list from most to least recently
+ * used. The lock only covers lookups and list updates; frames are copied
+ * in and out without it, pinned by a reference count, so readers never
+ * wait on each other's copies. A frame evicted while pinned is freed by
+ * its last reader.
+ */
+
+#define NEF_CACHE_BUCKETS       256
+
+struct nef_cache_key {
+    struct nef_file_id file;
+    unsigned image;
+    unsigned decode_mode;
+    unsigned orientation;
+    uint64_t calib;
+    int pixel_format;
+    unsigned has_conv;
+    struct nef_output_conv conv;
+};
+
+struct nef_cache_entry {
+    struct nef_cache_key key;
+    unsigned bucket;
+    struct nef_cache_entry *chain;      /* Next in the hash bucket */
+    struct nef_cache_entry *prev;       /* LRU list, most recent first */
+    struct nef_cache_entry *next;
+    unsigned refs;
+    int evicted;
+    size_t bytes;
+    uint8_t data[];
+};
+
+static pthread_mutex_t nef_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nef_cache_entry *nef_cache_buckets[NEF_CACHE_BUCKETS];
+static struct nef_cache_entry *nef_cache_head = NULL;
+static struct nef_cache_entry *nef_cache_tail = NULL;
+static struct nef_cache_stats nef_cache_stats;
+
+/* Read without the lock, to skip the cache cheaply when it is off */
+static size_t nef_cache_budget = 0;
+
+void nef_cache_identify(nef_t *nef, const char *file)
+{
+    struct stat st;
+
+    memset(&nef->file_id, 0, sizeof(nef->file_id));
+
+    if (stat(file, &st) != 0) {
+        return;
+    }
+
+    nef->file_id.dev = st.st_dev;
+    nef->file_id.ino = st.st_ino;
+    nef->file_id.size = st.st_size;
+    nef->file_id.mtime_sec = st.st_mtim.tv_sec;
+    nef->file_id.mtime_nsec = st.st_mtim.tv_nsec;
+    nef->file_id.valid = 1;
+}
+
+/* Build the key for an image. Returns 0 if the image cannot be cached. */
+static int nef_cache_make_key(nef_t *nef, nef_image_t *img, int pixel_format,
+                              struct nef_cache_key *key)
+{
+    if (!nef->file_id.valid) {
+        return 0;
+    }
+
+    /* Keys are compared bytewise, padding included */
+    memset(key, 0, sizeof(*key));
+
+    key->file = nef->file_id;
+    key->image = img - nef->images;
+    key->decode_mode = img->decode_mode;
+    key->orientation = img->orientation > 1 ? img->orientation : 1;
+    key->calib = img->calib != NULL ? img->calib->id : 0;
+    key->pixel_format = pixel_format;
+    key->has_conv = img->has_conv;
+    if (img->has_conv) {
+        key->conv = img->conv;
+    }
+
+    return 1;
+}
+
+/* FNV-1a over the key */
+static unsigned nef_cache_hash(const struct nef_cache_key *key)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++) {
+        hash ^= p[i];
+        hash *= 0x01000193;
+    }
+
+    return hash % NEF_CACHE_BUCKETS;
+}
+
+/* The following functions must be called with the lock held */
+
+static void nef_cache_lru_unlink(struct nef_cache_entry *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else nef_cache_head = entry->next;
+
+    if (entry->next) entry->next->prev = entry->prev;
+    else nef_cache_tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+static void nef_cache_lru_push(struct nef_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = nef_cache_head;
+
+    if (nef_cache_head) nef_cache_head->prev = entry;
+    else nef_cache_tail = entry;
+
+    nef_cache_head = entry;
+}
+
+static struct nef_cache_entry *nef_cache_find(const struct nef_cache_key *key,
+                                              unsigned bucket)
+{
+    struct nef_cache_entry *entry;
+
+    for (entry = nef_cache_buckets[bucket]; entry; entry = entry->chain) {
+        if (!memcmp(&entry->key, key, sizeof(*key))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Take an entry out of the cache; it is freed once no reader holds it */
+static void nef_cache_evict(struct nef_cache_entry *entry)
+{
+    struct nef_cache_entry **link = &nef_cache_buckets[entry->bucket];
+
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    nef_cache_lru_unlink(entry);
+
+    nef_cache_stats.entries--;
+    nef_cache_stats.bytes -= entry->bytes;
+    entry->evicted = 1;
+
+    if (entry->refs == 0) {
+        free(entry);
+    }
+}
+
+/* Evict least recently used entries until bytes more would fit */
+static void nef_cache_make_room(size_t bytes)
+{
+    while (nef_cache_tail != NULL &&
+           nef_cache_stats.bytes + bytes > nef_cache_stats.budget)
+    {
+        nef_cache_evict(nef_cache_tail);
+        nef_cache_stats.evictions++;
+    }
+}
+
+static void nef_cache_put(struct nef_cache_entry *entry)
+{
+    pthread_mutex_lock(&nef_cache_lock);
+
+    if (--entry->refs == 0 && entry->evicted) {
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&nef_cache_lock);
+}
+
+NEF_STATUS nef_cache_read(nef_t *nef, nef_image_t *img, int pixel_format,
+                          uint8_t *dst, size_t row_stride, size_t line_bytes,
+                          unsigned rows)
+{
+    struct nef_cache_key key;
+    struct nef_cache_entry *entry;
+    unsigned bucket, i;
+
+    if (__atomic_load_n(&nef_cache_budget, __ATOMIC_RELAXED) == 0 ||
+        !nef_cache_make_key(nef, img, pixel_format, &key))
+    {
+        return NEF_NOT_FOUND;
+    }
+
+    bucket = nef_cache_hash(&key);
+
+    pthread_mutex_lock(&nef_cache_lock);
+
+    entry = nef_cache_find(&key, bucket);
+
+    if (entry == NULL || entry->bytes != line_bytes * rows) {
+        nef_cache_stats.misses++;
+        pthread_mutex_unlock(&nef_cache_lock);
+        return NEF_NOT_FOUND;
+    }
+
+    entry->refs++;
+    nef_cache_lru_unlink(entry);
+    nef_cache_lru_push(entry);
+    nef_cache_stats.hits++;
+
+    pthread_mutex_unlock(&nef_cache_lock);
+
+    if (row_stride == line_bytes) {
+        memcpy(dst, entry->data, entry->bytes);
+    } else {
+        for (i = 0; i < rows; i++) {
+            memcpy(dst + i * row_stride, entry->data + i * line_bytes,
+                line_bytes);
+        }
+    }
+
+    nef_cache_put(entry);
+
+    return NEF_OK;
+}
+
+void nef_cache_insert(nef_t *nef, nef_image_t *img, int pixel_format,
+                      const uint8_t *src, size_t row_stride,
+                      size_t line_bytes, unsigned rows)
+{
+    struct nef_cache_key key;
+    struct nef_cache_entry *entry;
+    size_t bytes = line_bytes * rows;
+    unsigned i;
+
+    if (bytes > __atomic_load_n(&nef_cache_budget, __ATOMIC_RELAXED) ||
+        !nef_cache_make_key(nef, img, pixel_format, &key))
+    {
+        return;
+    }
+
+    /* Fill the entry before taking the lock */
+    entry = (struct nef_cache_entry *)malloc(sizeof(*entry) + bytes);
+    if (entry == NULL) {
+        return;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->bucket = nef_cache_hash(&key);
+    entry->bytes = bytes;
+
+    for (i = 0; i < rows; i++) {
+        memcpy(entry->data + i * line_bytes, src + i * row_stride, line_bytes);
+    }
+
+    pthread_mutex_lock(&nef_cache_lock);
+
+    /* Another reader may have decoded the same frame meanwhile */
+    if (bytes > nef_cache_stats.budget ||
+        nef_cache_find(&key, entry->bucket) != NULL)
+    {
+        pthread_mutex_unlock(&nef_cache_lock);
+        free(entry);
+        return;
+    }
+
+    nef_cache_make_room(bytes);
+
+    entry->chain = nef_cache_buckets[entry->bucket];
+    nef_cache_buckets[entry->bucket] = entry;
+    nef_cache_lru_push(entry);
+
+    nef_cache_stats.entries++;
+    nef_cache_stats.bytes += bytes;
+
+    pthread_mutex_unlock(&nef_cache_lock);
+}
+
+NEF_STATUS nef_cache_set_budget(size_t bytes)
+{
+    pthread_mutex_lock(&nef_cache_lock);
+
+    nef_cache_stats.budget = bytes;
+    __atomic_store_n(&nef_cache_budget, bytes, __ATOMIC_RELAXED);
+    nef_cache_make_room(0);
+
+    pthread_mutex_unlock(&nef_cache_lock);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_cache_flush(void)
+{
+    pthread_mutex_lock(&nef_cache_lock);
+
+    while (nef_cache_tail != NULL) {
+        nef_cache_evict(nef_cache_tail);
+    }
+
+    pthread_mutex_unlock(&nef_cache_lock);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_cache_get_stats(struct nef_cache_stats *stats)
+{
+    NEF_CHECK_ARG(stats);
+
+    pthread_mutex_lock(&nef_cache_lock);
+    *stats = nef_cache_stats;
+    pthread_mutex_unlock(&nef_cache_lock);
+
+    return NEF_OK;
+}
@@ -0,0 +1,638 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Sensor calibration: dark frame subtraction, flat-field correction and
+ * defective pixel interpolation, applied to each band of rows in one pass
+ * as it leaves the decoder.
+ *
+ * Calibration files hold what is needed for one camera body. The file is
+ * a page-sized header followed by the dark frame, the flat field and the
+ * list of defects, in host byte order, each starting on a page boundary,
+ * so the file is used in place once mapped. Files are found by camera
+ * serial number, and stay mapped, shared by every image from the camera,
+ * until flushed.
+ *
+ * Defects are interpolated from the samples two rows or columns away,
+ * which are the nearest of the same colour. Rows are held back until the
+ * two rows below them have arrived, so the sink keeps a window of rows
+ * sliding down the image: the two rows above the rows it holds back, then
+ * those rows.
+ */
+
+#define NEF_CALIB_MAGIC         "NEFC"
+#define NEF_CALIB_VERSION       1
+#define NEF_CALIB_BYTE_ORDER    0x0102
+#define NEF_CALIB_PAGE          4096
+
+#define NEF_CALIB_ROUND(x)  (((x) + NEF_CALIB_PAGE - 1) & ~(uint64_t)(NEF_CALIB_PAGE - 1))
+
+struct nef_calib_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;        /* NEF_CALIB_BYTE_ORDER, as written */
+    uint32_t serial;
+    uint32_t width;
+    uint32_t height;
+    uint32_t nr_defects;
+
+    /* Offsets of each part from the start of the file, 0 if absent */
+    uint64_t dark_off;
+    uint64_t flat_off;
+    uint64_t defects_off;
+};
+
+static pthread_mutex_t nef_calib_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nef_calib *nef_calib_list = NULL;
+static char *nef_calib_dir = NULL;
+static uint64_t nef_calib_next_id = 1;
+
+/* Check that defects are in ascending order, and inside the image */
+static int nef_calib_defects_ok(const uint32_t *defects, unsigned nr_defects,
+                                uint64_t samples)
+{
+    unsigned i;
+
+    for (i = 0; i < nr_defects; i++) {
+        if (defects[i] >= samples || (i > 0 && defects[i] <= defects[i - 1])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Write a part of a calibration file, padded to a whole number of pages */
+static NEF_STATUS nef_calib_write_part(FILE *out, const void *data,
+                                       size_t bytes)
+{
+    static const uint8_t zero[NEF_CALIB_PAGE];
+    size_t pad = NEF_CALIB_ROUND(bytes) - bytes;
+
+    if (fwrite(data, 1, bytes, out) != bytes ||
+        fwrite(zero, 1, pad, out) != pad)
+    {
+        return NEF_FAILURE;
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_calib_write(const char *file, const struct nef_calib_desc *desc)
+{
+    struct nef_calib_header *hdr = NULL;
+    uint64_t samples, frame_bytes, off;
+    FILE *out = NULL;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(file);
+    NEF_CHECK_ARG(desc);
+
+    samples = (uint64_t)desc->width * desc->height;
+
+    if (desc->serial == 0 || samples == 0 || samples > UINT32_MAX ||
+        (desc->nr_defects != 0 && desc->defects == NULL))
+    {
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (!nef_calib_defects_ok(desc->defects, desc->nr_defects, samples)) {
+        NEF_TRACE("Defects must be ascending, and inside the image\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    if ((hdr = (struct nef_calib_header *)nef_alloc(NULL, NEF_CALIB_PAGE))
+            == NULL)
+    {
+        return NEF_NO_MEMORY;
+    }
+
+    frame_bytes = samples * sizeof(uint16_t);
+
+    memset(hdr, 0, NEF_CALIB_PAGE);
+    memcpy(hdr->magic, NEF_CALIB_MAGIC, 4);
+    hdr->version = NEF_CALIB_VERSION;
+    hdr->byte_order = NEF_CALIB_BYTE_ORDER;
+    hdr->serial = desc->serial;
+    hdr->width = desc->width;
+    hdr->height = desc->height;
+    hdr->nr_defects = desc->nr_defects;
+
+    off = NEF_CALIB_PAGE;
+    if (desc->dark != NULL) {
+        hdr->dark_off = off;
+        off += NEF_CALIB_ROUND(frame_bytes);
+    }
+    if (desc->flat != NULL) {
+        hdr->flat_off = off;
+        off += NEF_CALIB_ROUND(frame_bytes);
+    }
+    if (desc->nr_defects != 0) {
+        hdr->defects_off = off;
+    }
+
+    if ((out = fopen(file, "wb")) == NULL) {
+        NEF_ERROR("Could not create '%s'\n", file);
+        ret = NEF_NOT_FOUND;
+        goto done;
+    }
+
+    if (fwrite(hdr, NEF_CALIB_PAGE, 1, out) != 1 ||
+        (desc->dark != NULL &&
+         nef_calib_write_part(out, desc->dark, frame_bytes) != NEF_OK) ||
+        (desc->flat != NULL &&
+         nef_calib_write_part(out, desc->flat, frame_bytes) != NEF_OK) ||
+        (desc->nr_defects != 0 &&
+         nef_calib_write_part(out, desc->defects,
+                              desc->nr_defects * sizeof(uint32_t)) != NEF_OK))
+    {
+        NEF_ERROR("Failed to write '%s'\n", file);
+        ret = NEF_FAILURE;
+    }
+
+    if (fclose(out) != 0) {
+        ret = NEF_FAILURE;
+    }
+
+done:
+    nef_free(NULL, hdr);
+
+    return ret;
+}
+
+/* Check that a part of a mapped file lies inside it, on a page boundary */
+static int nef_calib_part_ok(uint64_t off, uint64_t bytes, size_t map_bytes)
+{
+    return off % NEF_CALIB_PAGE == 0 && off >= NEF_CALIB_PAGE &&
+        off <= map_bytes && bytes <= map_bytes - off;
+}
+
+/* Check that a mapped file is calibration for serial this build can use */
+static NEF_STATUS nef_calib_check(const uint8_t *map, size_t bytes,
+                                  unsigned serial)
+{
+    const struct nef_calib_header *hdr = (const struct nef_calib_header *)map;
+    uint64_t samples, frame_bytes;
+
+    if (bytes < NEF_CALIB_PAGE || memcmp(hdr->magic, NEF_CALIB_MAGIC, 4)) {
+        return NEF_NOT_NEF;
+    }
+
+    if (hdr->version != NEF_CALIB_VERSION ||
+        hdr->byte_order != NEF_CALIB_BYTE_ORDER)
+    {
+        NEF_TRACE("Unsupported calibration version %u (byte order %04x)\n",
+            hdr->version, hdr->byte_order);
+        return NEF_NOT_NEF;
+    }
+
+    if (hdr->serial != serial) {
+        NEF_TRACE("Calibration is for camera %u, not %u\n", hdr->serial,
+            serial);
+        return NEF_NOT_FOUND;
+    }
+
+    samples = (uint64_t)hdr->width * hdr->height;
+    frame_bytes = samples * sizeof(uint16_t);
+
+    if (samples == 0 || samples > UINT32_MAX ||
+        (hdr->dark_off != 0 &&
+         !nef_calib_part_ok(hdr->dark_off, frame_bytes, bytes)) ||
+        (hdr->flat_off != 0 &&
+         !nef_calib_part_ok(hdr->flat_off, frame_bytes, bytes)) ||
+        (hdr->nr_defects != 0 &&
+         !nef_calib_part_ok(hdr->defects_off,
+                            (uint64_t)hdr->nr_defects * sizeof(uint32_t),
+                            bytes)))
+    {
+        NEF_TRACE("Calibration is truncated\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    if (hdr->nr_defects != 0 &&
+        !nef_calib_defects_ok((const uint32_t *)(map + hdr->defects_off),
+                              hdr->nr_defects, samples))
+    {
+        NEF_TRACE("Calibration has a bad defect list\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    return NEF_OK;
+}
+
+/* Map the calibration file for a camera. Call with the lock held. */
+static NEF_STATUS nef_calib_load(unsigned serial, struct nef_calib **out)
+{
+    const struct nef_calib_header *hdr = NULL;
+    struct nef_calib *calib = NULL;
+    const uint8_t *map = NULL;
+    char path[4096];
+    struct stat st;
+    NEF_STATUS ret;
+    int fd;
+
+    if (nef_calib_dir == NULL) {
+        return NEF_NOT_FOUND;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%u.nefcal", nef_calib_dir, serial)
+            >= (int)sizeof(path))
+    {
+        return NEF_RANGE_ERROR;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        NEF_TRACE("No calibration for camera %u\n", serial);
+        return NEF_NOT_FOUND;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NEF_NOT_NEF;
+    }
+
+    map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+                                0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        NEF_ERROR("Failed to map '%s'\n", path);
+        return NEF_FAILURE;
+    }
+
+    if ((ret = nef_calib_check(map, st.st_size, serial)) != NEF_OK) {
+        goto fail;
+    }
+
+    if ((calib = (struct nef_calib *)nef_alloc(NULL, sizeof(*calib))) == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto fail;
+    }
+
+    hdr = (const struct nef_calib_header *)map;
+
+    memset(calib, 0, sizeof(*calib));
+    calib->serial = serial;
+    calib->width = hdr->width;
+    calib->height = hdr->height;
+    calib->dark = hdr->dark_off ?
+        (const uint16_t *)(map + hdr->dark_off) : NULL;
+    calib->flat = hdr->flat_off ?
+        (const uint16_t *)(map + hdr->flat_off) : NULL;
+    calib->defects = hdr->nr_defects ?
+        (const uint32_t *)(map + hdr->defects_off) : NULL;
+    calib->nr_defects = hdr->nr_defects;
+    calib->id = nef_calib_next_id++;
+    calib->map = (void *)map;
+    calib->map_bytes = st.st_size;
+
+    NEF_TRACE("Mapped calibration for camera %u: %ux%u, %u defects\n",
+        serial, calib->width, calib->height, calib->nr_defects);
+
+    *out = calib;
+
+    return NEF_OK;
+
+fail:
+    munmap((void *)map, st.st_size);
+
+    return ret;
+}
+
+static void nef_calib_destroy(struct nef_calib *calib)
+{
+    munmap(calib->map, calib->map_bytes);
+    nef_free(NULL, calib);
+}
+
+/* Drop every calibration from the list. Call with the lock held. */
+static void nef_calib_evict_all(void)
+{
+    struct nef_calib *calib, *next;
+
+    for (calib = nef_calib_list; calib != NULL; calib = next) {
+        next = calib->next;
+        calib->next = NULL;
+
+        /* Calibration in use is freed by its last user */
+        if (calib->refs == 0) {
+            nef_calib_destroy(calib);
+        } else {
+            calib->evicted = 1;
+        }
+    }
+
+    nef_calib_list = NULL;
+}
+
+NEF_STATUS nef_calib_set_dir(const char *dir)
+{
+    char *copy = NULL;
+
+    if (dir != NULL) {
+        size_t len = strlen(dir) + 1;
+
+        if ((copy = (char *)nef_alloc(NULL, len)) == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        memcpy(copy, dir, len);
+    }
+
+    pthread_mutex_lock(&nef_calib_lock);
+
+    /* Calibration from the old directory no longer applies */
+    nef_calib_evict_all();
+
+    if (nef_calib_dir != NULL) {
+        nef_free(NULL, nef_calib_dir);
+    }
+    nef_calib_dir = copy;
+
+    pthread_mutex_unlock(&nef_calib_lock);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_calib_flush(void)
+{
+    pthread_mutex_lock(&nef_calib_lock);
+    nef_calib_evict_all();
+    pthread_mutex_unlock(&nef_calib_lock);
+
+    return NEF_OK;
+}
+
+void nef_calib_release(nef_image_t *img)
+{
+    struct nef_calib *calib = img->calib;
+
+    if (calib == NULL) {
+        return;
+    }
+
+    img->calib = NULL;
+
+    pthread_mutex_lock(&nef_calib_lock);
+
+    if (--calib->refs == 0 && calib->evicted) {
+        nef_calib_destroy(calib);
+    }
+
+    pthread_mutex_unlock(&nef_calib_lock);
+}
+
+NEF_STATUS nef_image_set_calibration(nef_t *fp, nef_image_t *hdl,
+                                     int enable)
+{
+    struct nef_calib *calib = NULL;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    nef_calib_release(hdl);
+
+    if (!enable) {
+        return NEF_OK;
+    }
+
+    if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1) {
+        NEF_TRACE("Calibration needs a CFA image\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (fp->serial == 0) {
+        NEF_TRACE("The camera serial number is not known\n");
+        return NEF_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&nef_calib_lock);
+
+    for (calib = nef_calib_list; calib != NULL; calib = calib->next) {
+        if (calib->serial == fp->serial) {
+            break;
+        }
+    }
+
+    if (calib == NULL) {
+        if ((ret = nef_calib_load(fp->serial, &calib)) != NEF_OK) {
+            goto done;
+        }
+
+        calib->next = nef_calib_list;
+        nef_calib_list = calib;
+    }
+
+    if (calib->width != hdl->width || calib->height != hdl->height) {
+        NEF_TRACE("Calibration is %ux%u, the image %ux%u\n", calib->width,
+            calib->height, hdl->width, hdl->height);
+        ret = NEF_RANGE_ERROR;
+        goto done;
+    }
+
+    calib->refs++;
+    hdl->calib = calib;
+
+done:
+    pthread_mutex_unlock(&nef_calib_lock);
+
+    return ret;
+}
+
+/* The sink correcting rows on their way to the next one */
+struct nef_calib_sink {
+    nef_t *fp;
+    struct nef_row_sink *next;
+    const struct nef_calib *calib;
+
+    /* Corrected rows, from image row base on, filled rows of them */
+    uint16_t *window;
+    unsigned window_rows;
+    unsigned base;
+    unsigned filled;
+
+    /* The first row not yet passed on */
+    unsigned done;
+
+    /* The next defect to interpolate */
+    unsigned defect;
+};
+
+/* Check if a sample is defective */
+static int nef_calib_is_defect(const struct nef_calib *calib, uint32_t idx)
+{
+    unsigned lo = 0, hi = calib->nr_defects;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (calib->defects[mid] < idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < calib->nr_defects && calib->defects[lo] == idx;
+}
+
+/* Interpolate the defects in the rows of the window up to end */
+static void nef_calib_fix_defects(struct nef_calib_sink *s, unsigned end)
+{
+    const struct nef_calib *calib = s->calib;
+    unsigned w = calib->width, h = calib->height;
+    uint32_t limit = end * w;
+
+    while (s->defect < calib->nr_defects && calib->defects[s->defect] < limit) {
+        uint32_t idx = calib->defects[s->defect++];
+        unsigned x = idx % w, y = idx / w, sum = 0, n = 0;
+        uint16_t *p = s->window + (size_t)(y - s->base) * w + x;
+
+        if (x >= 2 && !nef_calib_is_defect(calib, idx - 2)) {
+            sum += p[-2];
+            n++;
+        }
+
+        if (x + 2 < w && !nef_calib_is_defect(calib, idx + 2)) {
+            sum += p[2];
+            n++;
+        }
+
+        if (y >= 2 && !nef_calib_is_defect(calib, idx - 2 * w)) {
+            sum += p[-2 * (ptrdiff_t)w];
+            n++;
+        }
+
+        if (y + 2 < h && !nef_calib_is_defect(calib, idx + 2 * w)) {
+            sum += p[2 * w];
+            n++;
+        }
+
+        if (n != 0) {
+            *p = (sum + n / 2) / n;
+        }
+    }
+}
+
+static NEF_STATUS nef_calib_put_rows(struct nef_row_sink *sink,
+                                     unsigned row, unsigned nr_rows,
+                                     const uint16_t *rows,
+                                     unsigned width, unsigned stride)
+{
+    struct nef_calib_sink *s = (struct nef_calib_sink *)sink->state;
+    const struct nef_calib *calib = s->calib;
+    unsigned end = row + nr_rows, ready, keep, i;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_STATS_START(start);
+
+    if (row != s->base + s->filled || width != calib->width ||
+        end > calib->height)
+    {
+        NEF_ERROR("Rows out of order for calibration\n");
+        return NEF_FAILURE;
+    }
+
+    if (s->filled + nr_rows > s->window_rows) {
+        uint16_t *window = (uint16_t *)nef_realloc(s->fp, s->window,
+            (size_t)(s->filled + nr_rows) * width * sizeof(uint16_t));
+
+        if (window == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        s->window = window;
+        s->window_rows = s->filled + nr_rows;
+    }
+
+    for (i = 0; i < nr_rows; i++) {
+        size_t off = (size_t)(row + i) * width;
+
+        nef_calib_row(rows + (size_t)i * stride,
+            s->window + (size_t)(s->filled + i) * width, width,
+            calib->dark ? calib->dark + off : NULL,
+            calib->flat ? calib->flat + off : NULL);
+    }
+
+    s->filled += nr_rows;
+
+    /* Rows can go on once the rows two below them are in */
+    if (end == calib->height) {
+        ready = end;
+    } else {
+        ready = end >= 2 ? end - 2 : 0;
+    }
+
+    if (ready <= s->done) {
+        NEF_STATS_STOP(s->fp, NEF_STAGE_CALIB, start,
+                       (size_t)nr_rows * width * sizeof(uint16_t));
+        return NEF_OK;
+    }
+
+    nef_calib_fix_defects(s, ready);
+
+    NEF_STATS_STOP(s->fp, NEF_STAGE_CALIB, start,
+                   (size_t)nr_rows * width * sizeof(uint16_t));
+
+    if ((ret = s->next->put_rows(s->next, s->done, ready - s->done,
+                                 s->window + (size_t)(s->done - s->base) * width,
+                                 width, width)) != NEF_OK)
+    {
+        return ret;
+    }
+
+    s->done = ready;
+
+    /* Slide the window down, keeping the two rows above the next to go */
+    keep = ready >= 2 ? ready - 2 : 0;
+    if (keep > s->base) {
+        unsigned drop = keep - s->base;
+
+        memmove(s->window, s->window + (size_t)drop * width,
+            (size_t)(s->filled - drop) * width * sizeof(uint16_t));
+        s->base = keep;
+        s->filled -= drop;
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_calib_decode(nef_t *fp, nef_image_t *hdl,
+                            struct nef_row_sink *sink)
+{
+    struct nef_calib_sink s;
+    struct nef_row_sink wrap;
+    NEF_STATUS ret;
+
+    if (hdl->calib == NULL) {
+        return hdl->reader->decode_rows(hdl, sink);
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.fp = fp;
+    s.next = sink;
+    s.calib = hdl->calib;
+
+    wrap.put_rows = nef_calib_put_rows;
+    wrap.get_rows = NULL;
+    wrap.state = &s;
+
+    ret = hdl->reader->decode_rows(hdl, &wrap);
+
+    if (ret == NEF_OK && s.done != hdl->height) {
+        NEF_ERROR("Decoder stopped at row %u of %u\n", s.done, hdl->height);
+        ret = NEF_FAILURE;
+    }
+
+    nef_free(fp, s.window);
+
+    return ret;
+}
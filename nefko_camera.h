@@ -2,6 +2,10 @@
 #define __INCLUDE_NEFKO_CAMERA_H__
 
 #include <nefko.h>
+#include <ghetto.h>
+
+#include <stddef.h>
+#include <stdint.h>
 
 /* Forward Declarations */
 struct nefko_camera;
@@ -16,7 +20,25 @@ typedef struct nefko_camera_state {
     void *data;                         /* A private data structure used by the given
                                            camera plugin
                                          */
-};
+} nefko_camera_state_t;
+
+/* Per-model constants. Decoding specializes from these once the camera is
+ * known, rather than probing for them in every file. A zero field means
+ * "not known for this model"; the library then falls back to the file or
+ * to a generic default.
+ */
+typedef struct nefko_camera_params {
+    unsigned black_level;               /* Black level of the raw samples */
+    unsigned white_level;               /* Saturation level at 14 bits */
+    unsigned bits_per_sample;           /* Deepest raw sample depth */
+    unsigned active_width;              /* Size of the active area of the */
+    unsigned active_height;             /* sensor, centred in the raw image */
+    uint8_t cfa_pattern[4];             /* CFA colours, if the file omits them */
+    unsigned settings_crypt_off;        /* Start of the obfuscated part of the
+                                           image settings block */
+    unsigned settings_wb_off;           /* Offset of the white balance in the
+                                           image settings block */
+} nefko_camera_params_t;
 
 /* Structure used to define the actual camera information (name,
  * sensor information, etc.)
@@ -24,6 +46,9 @@ typedef struct nefko_camera_state {
 typedef struct nefko_camera {
     const char *name;
 
+    /* Per-model constants, or NULL if there are none */
+    const struct nefko_camera_params *params;
+
     /* Construct and initialize a new Camera State object */
     NEF_STATUS (*initialize)(struct nefko_camera_state **this);
 
@@ -42,5 +67,10 @@ typedef struct nefko_camera {
                                     float *aperture);               /* f-stops */
 } nefko_camera_t;
 
+/* Register a camera, matched against the Model tag of files as they are
+ * opened. Cameras must be registered before the first NEF is opened.
+ */
+NEF_STATUS nefko_register_camera(const struct nefko_camera *camera);
+
 #endif /* __INCLUDE_NEFKO_CAMERA_H__ */
 
@@ -0,0 +1,419 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/* Pre-decoded sidecar files. A sidecar holds the decoded samples of one
+ * full-resolution image, along with what is needed to process them, so a
+ * later open maps the file instead of entropy decoding the NEF again.
+ *
+ * The file is a page-sized header followed by the samples, 16 bits each,
+ * in host byte order. Rows are grouped in tiles of tile_rows rows; every
+ * tile starts on a page boundary, so reading a band of rows faults in
+ * only its own pages.
+ */
+
+#define NEF_DECODED_MAGIC       "NEFD"
+#define NEF_DECODED_VERSION     1
+#define NEF_DECODED_BYTE_ORDER  0x0102
+#define NEF_DECODED_PAGE        4096
+
+struct nef_decoded_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;        /* NEF_DECODED_BYTE_ORDER, as written */
+    uint32_t data_off;          /* Offset of the first tile */
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits_per_sample;
+    uint32_t tile_rows;         /* Rows per tile, even */
+    uint32_t tile_bytes;        /* Bytes from one tile to the next */
+    uint8_t cfa_pattern[4];
+    uint32_t black_level;
+    uint32_t white_level;       /* At 14 bits, 0 if not known */
+    float wb[3];                /* Red, green and blue multipliers */
+    char model[64];
+};
+
+#define NEF_DECODED_ROUND(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/* Get the start of a row of samples in a mapped sidecar */
+static const uint16_t *nef_decoded_row(const struct nef_decoded_header *hdr,
+                                       unsigned row)
+{
+    const uint8_t *base = (const uint8_t *)hdr + hdr->data_off;
+
+    return (const uint16_t *)(base + (size_t)(row / hdr->tile_rows) *
+        hdr->tile_bytes + (size_t)(row % hdr->tile_rows) * hdr->width *
+        sizeof(uint16_t));
+}
+
+/* Sink placing decoded rows where they go in the sidecar */
+static NEF_STATUS nef_decoded_put_rows(struct nef_row_sink *sink,
+                                       unsigned row, unsigned nr_rows,
+                                       const uint16_t *rows,
+                                       unsigned width, unsigned stride)
+{
+    struct nef_decoded_header *hdr = (struct nef_decoded_header *)sink->state;
+    unsigned i;
+
+    for (i = 0; i < nr_rows; i++) {
+        memcpy((uint16_t *)nef_decoded_row(hdr, row + i), rows + i * stride,
+            width * sizeof(uint16_t));
+    }
+
+    return NEF_OK;
+}
+
+/* Get the model name of the camera, for the header */
+static void nef_decoded_get_model(nef_t *fp, char *model, size_t len)
+{
+    char *tag = NULL;
+    int type, count;
+
+    if (fp->camera != NULL) {
+        strncpy(model, fp->camera->name, len - 1);
+        return;
+    }
+
+    if (fp->image_count > 0 &&
+        nef_get_tag_alloc(fp, fp->images[0].ifd, TIFF_TAG_MODEL,
+                          (void **)&tag, &type, &count) == NEF_OK)
+    {
+        if (type == TIFF_TYPE_ASCII && count > 0) {
+            strncpy(model, tag, (size_t)count < len ? (size_t)count : len - 1);
+        }
+        nef_free(fp, tag);
+    }
+}
+
+NEF_STATUS nef_image_write_decoded(nef_t *fp, nef_image_t *hdl,
+                                   const char *file, unsigned tile_rows)
+{
+    struct nef_decoded_header *hdr = NULL;
+    struct nef_row_sink sink;
+    size_t bytes, nr_tiles, i;
+    float wb[3] = { 1.0f, 1.0f, 1.0f };
+    int count = 3;
+    FILE *out = NULL;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(file);
+
+    if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1) {
+        NEF_TRACE("Only full-resolution CFA images can be written\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (tile_rows == 0 || tile_rows > hdl->height) {
+        tile_rows = hdl->height;
+    }
+
+    /* Keep whole CFA quads in each tile */
+    tile_rows = NEF_DECODED_ROUND(tile_rows, 2);
+    nr_tiles = (hdl->height + tile_rows - 1) / tile_rows;
+
+    NEFKO_CHECK(nef_image_get_reader(fp, hdl), NEF_FAILURE);
+
+    bytes = NEF_DECODED_PAGE + nr_tiles *
+        NEF_DECODED_ROUND((size_t)tile_rows * hdl->width * sizeof(uint16_t),
+                          NEF_DECODED_PAGE);
+
+    /* The frame is multi-MB; only the header and tile padding need zeroing,
+     * the decoder writes every pixel.
+     */
+    if ((hdr = (struct nef_decoded_header *)nef_alloc_raw(fp, bytes)) == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    memset(hdr, 0, NEF_DECODED_PAGE);
+    memcpy(hdr->magic, NEF_DECODED_MAGIC, 4);
+    hdr->version = NEF_DECODED_VERSION;
+    hdr->byte_order = NEF_DECODED_BYTE_ORDER;
+    hdr->data_off = NEF_DECODED_PAGE;
+    hdr->width = hdl->width;
+    hdr->height = hdl->height;
+    hdr->bits_per_sample = hdl->bits_per_sample;
+    hdr->tile_rows = tile_rows;
+    hdr->tile_bytes = NEF_DECODED_ROUND((size_t)tile_rows * hdl->width *
+                                        sizeof(uint16_t), NEF_DECODED_PAGE);
+    memcpy(hdr->cfa_pattern, hdl->cfa_pattern, 4);
+
+    for (i = 0; i < nr_tiles; i++) {
+        size_t rows = hdl->height - i * tile_rows;
+        size_t used = (rows < tile_rows ? rows : tile_rows) * hdl->width *
+            sizeof(uint16_t);
+
+        memset((uint8_t *)hdr + NEF_DECODED_PAGE + i * hdr->tile_bytes + used,
+               0, hdr->tile_bytes - used);
+    }
+
+    hdr->black_level = fp->params.black_level;
+    hdr->white_level = fp->params.white_level;
+
+    if (nef_meta_white_balance(fp, &count, wb) != NEF_OK) {
+        NEF_WARN("No white balance; writing unity multipliers\n");
+    }
+    memcpy(hdr->wb, wb, sizeof(hdr->wb));
+
+    nef_decoded_get_model(fp, hdr->model, sizeof(hdr->model));
+
+    sink.put_rows = nef_decoded_put_rows;
+    sink.get_rows = NULL;
+    sink.state = hdr;
+
+    if ((ret = nef_calib_decode(fp, hdl, &sink)) != NEF_OK) {
+        goto done;
+    }
+
+    if ((out = fopen(file, "wb")) == NULL) {
+        NEF_ERROR("Could not create '%s'\n", file);
+        ret = NEF_NOT_FOUND;
+        goto done;
+    }
+
+    if (fwrite(hdr, bytes, 1, out) != 1) {
+        NEF_ERROR("Failed to write %zu bytes to '%s'\n", bytes, file);
+        ret = NEF_FAILURE;
+    }
+
+    if (fclose(out) != 0) {
+        ret = NEF_FAILURE;
+    }
+
+done:
+    nef_free(fp, hdr);
+
+    return ret;
+}
+
+/* The reader for the image in a sidecar: rows come straight from the map */
+
+static NEF_STATUS nef_decoded_can_open(struct nef_image *image)
+{
+    NEF_CHECK_ARG(image);
+
+    return image->nef_file->decoded != NULL ? NEF_OK : NEF_FAILURE;
+}
+
+static NEF_STATUS nef_decoded_init_state(struct nef_image *image,
+                                         tiff_ifd_t *makernote)
+{
+    NEF_CHECK_ARG(image);
+
+    image->reader_state = (void *)image->nef_file->decoded;
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_decoded_read_image_tile(struct nef_image *image,
+                                              unsigned x_off, unsigned y_off,
+                                              unsigned w, unsigned h,
+                                              void *buf)
+{
+    const struct nef_decoded_header *hdr = NULL;
+    uint16_t *dst = (uint16_t *)buf;
+    unsigned row;
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(buf);
+
+    hdr = (const struct nef_decoded_header *)image->reader_state;
+
+    if (x_off + w > hdr->width || y_off + h > hdr->height) {
+        return NEF_RANGE_ERROR;
+    }
+
+    for (row = 0; row < h; row++) {
+        memcpy(dst + (size_t)row * w, nef_decoded_row(hdr, y_off + row) + x_off,
+            w * sizeof(uint16_t));
+    }
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_decoded_image_tile_size(struct nef_image *image,
+                                              unsigned *w, unsigned *h)
+{
+    const struct nef_decoded_header *hdr = NULL;
+
+    NEF_CHECK_ARG(image);
+
+    hdr = (const struct nef_decoded_header *)image->reader_state;
+
+    *w = hdr->width;
+    *h = hdr->tile_rows;
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_decoded_decode_rows(struct nef_image *image,
+                                          struct nef_row_sink *sink)
+{
+    const struct nef_decoded_header *hdr = NULL;
+    unsigned row, nr_rows;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(sink);
+
+    hdr = (const struct nef_decoded_header *)image->reader_state;
+
+    for (row = 0; row < hdr->height; row += hdr->tile_rows) {
+        NEF_STATS_START(start);
+
+        nr_rows = hdr->height - row;
+        if (nr_rows > hdr->tile_rows) {
+            nr_rows = hdr->tile_rows;
+        }
+
+        if ((ret = sink->put_rows(sink, row, nr_rows, nef_decoded_row(hdr, row),
+                                  hdr->width, hdr->width)) != NEF_OK)
+        {
+            return ret;
+        }
+
+        NEF_STATS_STOP(image->nef_file, NEF_STAGE_CONVERT, start,
+                       (size_t)nr_rows * hdr->width * sizeof(uint16_t));
+    }
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_decoded_clean_up(struct nef_image *image)
+{
+    NEF_CHECK_ARG(image);
+
+    image->reader_state = NULL;
+
+    return NEF_OK;
+}
+
+static struct nef_image_reader nef_decoded_reader = {
+    .format_name = "libnefko decoded sidecar",
+    .can_open = nef_decoded_can_open,
+    .init_state = nef_decoded_init_state,
+    .read_image_tile = nef_decoded_read_image_tile,
+    .image_tile_size = nef_decoded_image_tile_size,
+    .decode_rows = nef_decoded_decode_rows,
+    .clean_state = nef_decoded_clean_up
+};
+
+/* Check that a mapped file is a sidecar this build can read */
+static NEF_STATUS nef_decoded_check(const uint8_t *map, size_t bytes)
+{
+    const struct nef_decoded_header *hdr =
+        (const struct nef_decoded_header *)map;
+    size_t nr_tiles;
+
+    if (bytes < NEF_DECODED_PAGE || memcmp(hdr->magic, NEF_DECODED_MAGIC, 4)) {
+        return NEF_NOT_NEF;
+    }
+
+    if (hdr->version != NEF_DECODED_VERSION ||
+        hdr->byte_order != NEF_DECODED_BYTE_ORDER)
+    {
+        NEF_TRACE("Unsupported sidecar version %u (byte order %04x)\n",
+            hdr->version, hdr->byte_order);
+        return NEF_NOT_NEF;
+    }
+
+    if (hdr->width == 0 || hdr->height == 0 || hdr->tile_rows == 0 ||
+        (hdr->tile_rows & 1) || hdr->data_off % NEF_DECODED_PAGE ||
+        hdr->tile_bytes < (size_t)hdr->tile_rows * hdr->width * 2)
+    {
+        return NEF_RANGE_ERROR;
+    }
+
+    nr_tiles = (hdr->height + hdr->tile_rows - 1) / hdr->tile_rows;
+
+    if (hdr->data_off + nr_tiles * hdr->tile_bytes > bytes) {
+        NEF_TRACE("Sidecar is truncated\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_open_decoded(const char *file, nef_t **fp)
+{
+    const struct nef_decoded_header *hdr = NULL;
+    nef_image_t *img = NULL;
+    nef_t *nef = NULL;
+    char model[sizeof(hdr->model) + 1];
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(file);
+    NEF_CHECK_ARG(fp);
+
+    *fp = NULL;
+
+    nef_registry_seal();
+
+    NEFKO_CHECK(nef_handle_alloc(0, NULL, &nef), NEF_NO_MEMORY);
+
+    if ((ret = nef_map_file(nef, file)) != NEF_OK) {
+        NEF_TRACE("Could not map '%s'\n", file);
+        goto fail;
+    }
+
+    if ((ret = nef_decoded_check(nef->map, nef->map_bytes)) != NEF_OK) {
+        goto fail;
+    }
+
+    hdr = (const struct nef_decoded_header *)nef->map;
+    nef->decoded = hdr;
+
+    /* The camera's constants, with the levels the sidecar was written with */
+    memcpy(model, hdr->model, sizeof(hdr->model));
+    model[sizeof(hdr->model)] = '\0';
+    nef_camera_get_params(nef_registry_find_camera(model), &nef->params);
+    nef->params.black_level = hdr->black_level;
+    nef->params.white_level = hdr->white_level;
+
+    if ((img = (nef_image_t *)nef_alloc(nef, sizeof(nef_image_t))) == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto fail;
+    }
+
+    memset(img, 0, sizeof(*img));
+    img->nef_file = nef;
+    img->type = NEF_IMAGE_FULL;
+    img->width = hdr->width;
+    img->height = hdr->height;
+    img->chans = 1;
+    img->data_type = NEF_DATATYPE_UINT;
+    img->compression = TIFF_COMPRESSION_NONE;
+    img->photo_interp = TIFF_PHOTOMETRIC_CFA;
+    img->bits_per_sample = hdr->bits_per_sample;
+    memcpy(img->cfa_pattern, hdr->cfa_pattern, 4);
+    img->reader = &nef_decoded_reader;
+
+    nef->images = img;
+    nef->image_count = 1;
+
+    *fp = nef;
+
+    return NEF_OK;
+
+fail:
+    nef_unmap_file(nef);
+    nef_handle_free(nef);
+
+    return ret;
+}
+
+NEF_STATUS nef_decoded_white_balance(nef_t *fp, float *coeffs)
+{
+    memcpy(coeffs, fp->decoded->wb, sizeof(fp->decoded->wb));
+
+    return NEF_OK;
+}
+
+const char *nef_decoded_model(nef_t *fp)
+{
+    return fp->decoded->model;
+}
@@ -83,25 +83,41 @@ static uint8_t nef_iv_table[] = {
 NEF_STATUS nef_decrypt_buffer(nef_t *fp,
                               void *buffer, size_t bytes)
 {
-    size_t i = 0;
-    uint8_t *buf = (uint8_t *)buffer;
-    uint8_t cntr;
+    NEF_STATS_START(start);
 
     NEF_CHECK_ARG(buffer);
     NEF_CHECK_ARG(fp);
 
     if (bytes == 0) return NEF_RANGE_ERROR;
 
-    cntr = fp->iv;
+    nef_kernels->decrypt((uint8_t *)buffer, bytes, fp->key, fp->iv);
 
-    for (i = 0; i < bytes; i++) {
-        cntr += fp->key * (i + 0x60);
-        buf[i] ^= cntr;
-    }
+    NEF_STATS_STOP(fp, NEF_STAGE_DECRYPT, start, bytes);
 
     return NEF_OK;
 }
 
+/* Obfuscation is an XOR with a keystream, so it is its own inverse */
+NEF_STATUS nef_encrypt_buffer(nef_t *fp,
+                              void *buffer, size_t bytes)
+{
+    return nef_decrypt_buffer(fp, buffer, bytes);
+}
+
+void nef_derive_obfuscation_params(unsigned serial, unsigned shutter_count,
+                                   uint8_t *key, uint8_t *iv)
+{
+    unsigned iv_off;
+
+    iv_off = BYTE(shutter_count, 0) ^
+             BYTE(shutter_count, 1) ^
+             BYTE(shutter_count, 3) ^
+             BYTE(shutter_count, 2);
+
+    *iv = nef_iv_table[iv_off];
+    *key = nef_key[serial & 0xff];
+}
+
 NEF_STATUS nef_get_obfuscation_params(nef_t *nef)
 {
     unsigned shutter_dep = 0;
@@ -109,8 +125,6 @@ NEF_STATUS nef_get_obfuscation_params(nef_t *nef)
     int ser_type, ser_count;
     unsigned serial_num = 0;
 
-    unsigned iv_off;
-
     NEF_CHECK_ARG(nef);
 
     /* Grab the shutter count tag */
@@ -125,7 +139,7 @@ NEF_STATUS nef_get_obfuscation_params(nef_t *nef)
 
     if (ser_type != TIFF_TYPE_ASCII || ser_count <= 0) {
         NEF_TRACE("Failed to get serial number.\n");
-        free(serial);
+        nef_free(nef, serial);
         return NEF_NOT_FOUND;
     }
 
@@ -133,15 +147,11 @@ NEF_STATUS nef_get_obfuscation_params(nef_t *nef)
 
     NEF_TRACE("Camera serial number: %u\n", serial_num);
 
-    free(serial);
+    nef->serial = serial_num;
 
-    iv_off = BYTE(shutter_dep, 0) ^
-             BYTE(shutter_dep, 1) ^
-             BYTE(shutter_dep, 3) ^
-             BYTE(shutter_dep, 2);
+    nef_free(nef, serial);
 
-    nef->iv = nef_iv_table[iv_off];
-    nef->key = nef_key[serial_num & 0xff];
+    nef_derive_obfuscation_params(serial_num, shutter_dep, &nef->key, &nef->iv);
 
     NEF_TRACE("iv = %02x, key = %02x\n", (unsigned)nef->iv,
         (unsigned)nef->key);
@@ -1,15 +1,21 @@
 #include <nefko.h>
 #include <ghetto.h>
 #include <nefko_priv.h>
+#include <nefko_camera.h>
 
 #include <string.h>
 #include <stdint.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /* Extendable test for whether or not this is an NEF file. Eventually,
  * this should also cover identifying whether or not this is a sub-
  * variant of NEF that is supported by libnefko.
  */
-static NEF_STATUS nef_identify(tiff_t *fp, tiff_ifd_t *parent)
+static NEF_STATUS nef_identify(nef_t *nef, tiff_t *fp, tiff_ifd_t *parent)
 {
     tiff_tag_t *maker = NULL;
     char *maker_tag = NULL;
@@ -27,7 +33,7 @@ static NEF_STATUS nef_identify(tiff_t *fp, tiff_ifd_t *parent)
         return NEF_NOT_NEF;
     }
 
-    maker_tag = (char *)calloc(1, maker_count + 1);
+    maker_tag = (char *)nef_alloc(nef, maker_count + 1);
     if (maker_tag == NULL) {
         return NEF_NO_MEMORY;
     }
@@ -46,12 +52,12 @@ static NEF_STATUS nef_identify(tiff_t *fp, tiff_ifd_t *parent)
         goto fail;
     }
 
-    free(maker_tag);
+    nef_free(nef, maker_tag);
 
     return NEF_OK;
 
 fail:
-    if (maker_tag) free(maker_tag);
+    if (maker_tag) nef_free(nef, maker_tag);
 
     return ret;
 }
@@ -60,6 +66,8 @@ NEF_STATUS nef_get_tag_low(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
                            void *dest)
 {
     tiff_tag_t *taginfo = NULL;
+    NEF_STATS_START(start);
+
     GHETTO_CHECK(tiff_get_tag(nef->tiff_fp, ifd, tag_id, &taginfo));
 
     if (taginfo == NULL) {
@@ -68,6 +76,8 @@ NEF_STATUS nef_get_tag_low(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
 
     GHETTO_CHECK(tiff_get_tag_data(nef->tiff_fp, ifd, taginfo, dest));
 
+    NEF_STATS_STOP(nef, NEF_STAGE_TAG_FETCH, start, 0);
+
     return NEF_OK;
 }
 
@@ -79,6 +89,7 @@ NEF_STATUS nef_get_tag_alloc(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
     void *dest_ptr = NULL;
     size_t tysz;
     NEF_STATUS stat;
+    NEF_STATS_START(start);
 
     NEF_CHECK_ARG(dest);
     NEF_CHECK_ARG(item_type);
@@ -101,7 +112,7 @@ NEF_STATUS nef_get_tag_alloc(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
         return NEF_RANGE_ERROR;
     }
 
-    dest_ptr = calloc(tysz, count);
+    dest_ptr = nef_alloc(nef, tysz * count);
 
     if (dest_ptr == NULL) {
         return NEF_NO_MEMORY;
@@ -110,7 +121,7 @@ NEF_STATUS nef_get_tag_alloc(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
     if ((stat = tiff_get_tag_data(nef->tiff_fp, ifd, taginfo, dest_ptr)) != NEF_OK)
     {
         NEF_TRACE("Failed to get tag data.\n");
-        free(dest_ptr);
+        nef_free(nef, dest_ptr);
         return stat;
     }
 
@@ -118,6 +129,8 @@ NEF_STATUS nef_get_tag_alloc(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
     *item_type = type;
     *item_count = count;
 
+    NEF_STATS_STOP(nef, NEF_STAGE_TAG_FETCH, start, tysz * count);
+
     return NEF_OK;
 }
 
@@ -127,8 +140,7 @@ NEF_STATUS nef_get_tag(nef_t *nef, nef_image_t *img, unsigned tag_id,
     return nef_get_tag_low(nef, img->ifd, tag_id, dest);
 }
 
-#ifdef _DEBUG
-static char *nef_data_types[] = {
+static const char *nef_data_types[] = {
         "unknown",
         "uint",
         "int",
@@ -137,11 +149,42 @@ static char *nef_data_types[] = {
         "complex int",
         "complex float"
     };
-#endif
+
+/* Read the 2x2 CFA pattern of an image. NEF raw IFDs describe it with the
+ * TIFF/EP CFARepeatPatternDim and CFAPattern tags; if these are missing or
+ * describe something other than a 2x2 pattern, use the camera's pattern
+ * (RGGB if the camera is not known).
+ */
+static void nef_populate_cfa_pattern(nef_t *nef, nef_image_t *img)
+{
+    uint8_t *pattern = NULL;
+    int type, count;
+
+    memcpy(img->cfa_pattern, nef->params.cfa_pattern, 4);
+
+    if (nef_get_tag_alloc(nef, img->ifd, TIFF_TAG_CFAPATTERN,
+                          (void **)&pattern, &type, &count) != NEF_OK)
+    {
+        return;
+    }
+
+    if (count == 4 && pattern[0] <= 2 && pattern[1] <= 2 &&
+        pattern[2] <= 2 && pattern[3] <= 2)
+    {
+        memcpy(img->cfa_pattern, pattern, 4);
+    } else {
+        NEF_WARN("Unsupported CFA pattern (%d entries), using the "
+            "camera's\n", count);
+    }
+
+    nef_free(nef, pattern);
+}
 
 static NEF_STATUS nef_populate_image_info(nef_t *nef, nef_image_t *img)
 {
     unsigned int type = 0;
+    void *bps = NULL;
+    int bps_type, bps_count;
 
     NEFKO_CHECK(nef_get_tag(nef, img, TIFF_TAG_IMAGELENGTH, &(img->height)),
         NEF_NOT_FOUND);
@@ -163,7 +206,7 @@ static NEF_STATUS nef_populate_image_info(nef_t *nef, nef_image_t *img)
     } else if (type == 0) {
         img->type = NEF_IMAGE_FULL;
     } else {
-        NEF_TRACE("Unknown NewSubfileType: %08x\n", type);
+        NEF_WARN("Unknown NewSubfileType: %08x\n", type);
     }
 
     if (nef_get_tag(nef, img, TIFF_TAG_PHOTOMETRICINTERP, &(img->photo_interp)) !=
@@ -173,6 +216,29 @@ static NEF_STATUS nef_populate_image_info(nef_t *nef, nef_image_t *img)
         img->photo_interp = 0;
     }
 
+    if (nef_get_tag_alloc(nef, img->ifd, TIFF_TAG_BITSPERSAMPLE,
+                          (void **)&bps, &bps_type, &bps_count) == NEF_OK)
+    {
+        /* All channels of NEF images have the same sample depth */
+        if (bps_type == TIFF_TYPE_SHORT) {
+            img->bits_per_sample = *(uint16_t *)bps;
+        } else {
+            img->bits_per_sample = *(uint32_t *)bps;
+        }
+        nef_free(nef, bps);
+    } else if (img->compression == TIFF_COMPRESSION_NIKON &&
+               nef->params.bits_per_sample != 0)
+    {
+        NEF_TRACE("Assuming the camera's %u bits per sample\n",
+            nef->params.bits_per_sample);
+        img->bits_per_sample = nef->params.bits_per_sample;
+    } else {
+        NEF_TRACE("Assuming 8 bits per sample\n");
+        img->bits_per_sample = 8;
+    }
+
+    nef_populate_cfa_pattern(nef, img);
+
     NEF_TRACE("Image: %d x %d, %d channels (data type: '%s') (%s) Comp: 0x%08x PhInterp: %08x\n",
         img->width, img->height, img->chans, nef_data_types[img->data_type],
         img->type == NEF_IMAGE_REDUCED ? "thumbnail" : "full-resolution",
@@ -180,9 +246,55 @@ static NEF_STATUS nef_populate_image_info(nef_t *nef, nef_image_t *img)
 
     img->nef_file = nef;
 
+    /* Probe the readers once; decodes dispatch straight to this one */
+    img->reader = nef_registry_find_reader(img);
+
     return NEF_OK;
 }
 
+/* Look the camera up by its Model tag, set up its state and take the
+ * constants for the model. Called before the images are read, so they can
+ * be described using the camera's constants.
+ */
+static void nef_find_camera(nef_t *nef, tiff_ifd_t *root)
+{
+    const struct nefko_camera *camera;
+    char *model = NULL;
+    int type, count;
+
+    nef_camera_get_params(NULL, &nef->params);
+
+    if (nef_get_tag_alloc(nef, root, TIFF_TAG_MODEL, (void **)&model,
+                          &type, &count) != NEF_OK)
+    {
+        NEF_TRACE("No Model tag\n");
+        return;
+    }
+
+    if (type != TIFF_TYPE_ASCII || count <= 0) {
+        nef_free(nef, model);
+        return;
+    }
+
+    model[count - 1] = '\0';
+
+    camera = nef_registry_find_camera(model);
+
+    if (camera == NULL) {
+        NEF_TRACE("Unknown camera '%s'\n", model);
+    } else if (camera->initialize != NULL &&
+               camera->initialize(&nef->camera_state) != NEF_OK)
+    {
+        NEF_WARN("Failed to initialize camera '%s'\n", camera->name);
+        camera = NULL;
+    }
+
+    nef->camera = camera;
+    nef_camera_get_params(camera, &nef->params);
+
+    nef_free(nef, model);
+}
+
 static NEF_STATUS nef_find_images(nef_t *nef, tiff_t *fp, tiff_ifd_t *root)
 {
     tiff_tag_t *subifds = NULL;
@@ -205,7 +317,11 @@ static NEF_STATUS nef_find_images(nef_t *nef, tiff_t *fp, tiff_ifd_t *root)
         return NEF_NOT_NEF;
     }
 
-    subifd_offs = (uint32_t *)calloc(1, tiff_get_type_size(type) * count);
+    subifd_offs = (uint32_t *)nef_alloc(nef, tiff_get_type_size(type) * count);
+
+    if (subifd_offs == NULL) {
+        return NEF_NO_MEMORY;
+    }
 
     if (tiff_get_tag_data(fp, root, subifds, subifd_offs) != TIFF_OK) {
         goto fail_free_offs;
@@ -214,9 +330,9 @@ static NEF_STATUS nef_find_images(nef_t *nef, tiff_t *fp, tiff_ifd_t *root)
     /* Allocate an array for storing each image, including the image stored
      * in the root IFD.
      */
-    nef->images = (nef_image_t *)calloc(1, sizeof(nef_image_t) * (count + 1));
+    nef->images = (nef_image_t *)nef_alloc(nef, sizeof(nef_image_t) * (count + 1));
     if (nef->images == NULL) {
-        NEF_TRACE("Failed to allocate %zd bytes for image data\n",
+        NEF_ERROR("Failed to allocate %zd bytes for image data\n",
             sizeof(nef_image_t) * (count + 1));
         ret = NEF_NO_MEMORY;
         goto fail_free_offs;
@@ -234,9 +350,13 @@ static NEF_STATUS nef_find_images(nef_t *nef, tiff_t *fp, tiff_ifd_t *root)
     /* Populate the remaining images with the contents of the SubIFDs */
     for (i = 1; i < count + 1; i++) {
         tiff_ifd_t *sub_ifd = NULL;
+        NEF_STATS_START(start);
+
         if (tiff_read_ifd(fp, subifd_offs[i - 1], &sub_ifd) != TIFF_OK) {
             goto fail_free_images;
         }
+
+        NEF_STATS_STOP(nef, NEF_STAGE_IFD_PARSE, start, 0);
         nef->images[i].ifd = sub_ifd;
 
         if (nef_populate_image_info(nef, &nef->images[i]) != NEF_OK) {
@@ -249,6 +369,8 @@ static NEF_STATUS nef_find_images(nef_t *nef, tiff_t *fp, tiff_ifd_t *root)
 
     nef->image_count = count + 1;
 
+    nef_free(nef, subifd_offs);
+
     return NEF_OK;
 
 fail_free_images:
@@ -257,18 +379,28 @@ fail_free_images:
             tiff_free_ifd(fp, nef->images[i].ifd);
         }
     }
-    if (nef->images) free(nef->images);
+    if (nef->images) nef_free(nef, nef->images);
     nef->images = NULL;
 
 fail_free_offs:
-    if (subifd_offs) free(subifd_offs);
+    if (subifd_offs) nef_free(nef, subifd_offs);
 
     return NEF_NOT_NEF;
 }
 
 static NEF_STATUS nef_destroy_image(nef_t *nef, nef_image_t *img)
 {
-    if (tiff_free_ifd(nef->tiff_fp, img->ifd) != TIFF_OK) {
+    nef_calib_release(img);
+
+    if (img->reader != NULL && img->reader_state != NULL) {
+        img->reader->clean_state(img);
+    }
+
+    if (img->preview != NULL) {
+        nef_free(nef, img->preview);
+    }
+
+    if (img->ifd != NULL && tiff_free_ifd(nef->tiff_fp, img->ifd) != TIFF_OK) {
         return NEF_FAILURE;
     }
 
@@ -277,7 +409,134 @@ static NEF_STATUS nef_destroy_image(nef_t *nef, nef_image_t *img)
     return NEF_OK;
 }
 
-NEF_STATUS nef_open(const char *file, nef_t **fp)
+int nef_file_fd(nef_t *nef)
+{
+    struct stat st;
+
+    if (nef->fd >= 0 || nef->path == NULL) {
+        return nef->fd;
+    }
+
+    nef->fd = open(nef->path, O_RDONLY | O_CLOEXEC);
+
+    /* The path may have been replaced since the handle was opened; hints
+     * for another file would only evict or fetch the wrong pages */
+    if (nef->fd >= 0 &&
+        (!nef->file_id.valid || fstat(nef->fd, &st) != 0 ||
+         st.st_dev != nef->file_id.dev || st.st_ino != nef->file_id.ino))
+    {
+        NEF_TRACE("'%s' is no longer the file that was opened\n", nef->path);
+        close(nef->fd);
+        nef->fd = -1;
+    }
+
+    /* Do not try again for every hint */
+    if (nef->fd < 0) {
+        nef_free(nef, nef->path);
+        nef->path = NULL;
+    }
+
+    return nef->fd;
+}
+
+/* Map the whole file read-only, for NEF_OPEN_MMAP */
+NEF_STATUS nef_map_file(nef_t *nef, const char *file)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        return NEF_NOT_FOUND;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NEF_FAILURE;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NEF_NO_MEMORY;
+    }
+
+    nef->map = (const uint8_t *)map;
+    nef->map_bytes = st.st_size;
+
+    return NEF_OK;
+}
+
+void nef_unmap_file(nef_t *nef)
+{
+    if (nef->map != NULL) {
+        munmap((void *)nef->map, nef->map_bytes);
+        nef->map = NULL;
+        nef->map_bytes = 0;
+    }
+}
+
+/* Hints go through the mapping where there is one, since a mapping keeps
+ * its own readahead state and holds its pages until told otherwise, so a
+ * mapped file never needs a descriptor. Otherwise, prefetching and
+ * dropping pages go through a descriptor opened the first time either is
+ * asked for.
+ */
+void nef_hint_range(nef_t *nef, uint64_t off, uint64_t len, unsigned advice)
+{
+    NEF_STATS_START(start);
+
+    if (len == 0) {
+        return;
+    }
+
+    if (nef->map != NULL && off < nef->map_bytes) {
+        uintptr_t mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        uint8_t *first = (uint8_t *)((uintptr_t)(nef->map + off) & ~mask);
+        size_t span;
+
+        if (len > nef->map_bytes - off) {
+            len = nef->map_bytes - off;
+        }
+
+        span = nef->map + off + len - first;
+
+        switch (advice) {
+        case NEF_HINT_WILLNEED:
+            madvise(first, span, MADV_WILLNEED);
+            break;
+        case NEF_HINT_SEQUENTIAL:
+            madvise(first, span, MADV_SEQUENTIAL);
+            break;
+        case NEF_HINT_DONTNEED:
+            madvise(first, span, MADV_DONTNEED);
+            break;
+        }
+    } else if (advice == NEF_HINT_WILLNEED && nef_file_fd(nef) >= 0) {
+        posix_fadvise(nef->fd, off, len, POSIX_FADV_WILLNEED);
+    } else if (advice == NEF_HINT_DONTNEED && nef_file_fd(nef) >= 0) {
+        posix_fadvise(nef->fd, off, len, POSIX_FADV_DONTNEED);
+    }
+
+    NEF_STATS_STOP(nef, NEF_STAGE_HINT, start, len);
+}
+
+NEF_STATUS nef_set_io_hints(nef_t *fp, unsigned hints)
+{
+    NEF_CHECK_ARG(fp);
+
+    if (hints & ~(NEF_HINT_WILLNEED | NEF_HINT_SEQUENTIAL | NEF_HINT_DONTNEED)) {
+        return NEF_BAD_ARGUMENT;
+    }
+
+    fp->hints = hints;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_open_ex(const char *file, unsigned flags,
+                       const struct nef_allocator *alloc, nef_t **fp)
 {
     tiff_t *tiff_fp = NULL;
     tiff_ifd_t *root_ifd = NULL;
@@ -290,6 +549,8 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
     uint8_t *maker_buf = NULL;
 
     nef_t *nef_fp = NULL;
+    NEF_STATS_START(open_start);
+    NEF_STATS_START(ifd_start);
 
     NEF_CHECK_ARG(file);
     NEF_CHECK_ARG(fp);
@@ -300,6 +561,8 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
 
     *fp = NULL;
 
+    nef_registry_seal();
+
     /* Open the NEF file */
     if ( (ret = tiff_open(&tiff_fp, file, "r")) != TIFF_OK ) {
         NEF_TRACE("Failed to open file '%s'\n", file);
@@ -310,31 +573,49 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
         }
     }
 
+    if ( (nret = nef_handle_alloc(flags, alloc, &nef_fp)) != NEF_OK ) {
+        goto fail_close_file;
+    }
+
+    nef_fp->tiff_fp = tiff_fp;
+
+    nef_cache_identify(nef_fp, file);
+
+    /* libghetto keeps its descriptor to itself, so hints open one of their
+     * own, should they need it */
+    if ((nef_fp->path = (char *)nef_alloc(nef_fp, strlen(file) + 1)) == NULL) {
+        nret = NEF_NO_MEMORY;
+        goto fail_free_fptr;
+    }
+    strcpy(nef_fp->path, file);
+
+    if ((flags & NEF_OPEN_MMAP) && nef_map_file(nef_fp, file) != NEF_OK) {
+        NEF_WARN("Could not map '%s'; it will be read instead\n", file);
+    }
+
     if ( (ret = tiff_get_base_ifd_offset(tiff_fp, &root_ifd_off)) != TIFF_OK ) {
         nret = NEF_NOT_NEF;
-        goto fail_close_file;
+        goto fail_free_fptr;
     }
 
+    NEF_STATS_RESTART(ifd_start);
+
     if ( (ret = tiff_read_ifd(tiff_fp, root_ifd_off, &root_ifd)) != TIFF_OK ) {
         nret = NEF_NOT_NEF;
-        goto fail_close_file;
+        goto fail_free_fptr;
     }
 
-    if (nef_identify(tiff_fp, root_ifd) != NEF_OK) {
+    NEF_STATS_STOP(nef_fp, NEF_STAGE_IFD_PARSE, ifd_start, 0);
+
+    if (nef_identify(nef_fp, tiff_fp, root_ifd) != NEF_OK) {
         nret = NEF_NOT_NEF;
         NEF_TRACE("This is not an NEF file...\n");
-        goto fail_close_file;
+        goto fail_free_fptr;
     }
 
-    /* This is likely a NEF file. Open the IFDs and store them. */
-    nef_fp = (nef_t *)calloc(1, sizeof(nef_t));
+    nef_find_camera(nef_fp, root_ifd);
 
-    if (nef_fp == NULL) {
-        nret = NEF_NO_MEMORY;
-        goto fail_close_file;
-    }
-
-    nef_fp->tiff_fp = tiff_fp;
+    /* This is likely a NEF file. Open the IFDs and store them. */
 
     if (nef_find_images(nef_fp, tiff_fp, root_ifd) != NEF_OK) {
         nret = NEF_NOT_NEF;
@@ -357,12 +638,16 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
         goto fail_free_fptr;
     }
 
+    NEF_STATS_RESTART(ifd_start);
+
     if (tiff_read_ifd(nef_fp->tiff_fp, exif_off, &nef_fp->exif) != TIFF_OK) {
         NEF_TRACE("Could not read the EXIF IFD.\n");
         nret = NEF_NOT_NEF;
         goto fail_free_fptr;
     }
 
+    NEF_STATS_STOP(nef_fp, NEF_STAGE_IFD_PARSE, ifd_start, 0);
+
     /* Load the MakerNote IFD */
     if (tiff_get_tag(nef_fp->tiff_fp, nef_fp->exif, TIFF_TAG_EXIF_MAKERNOTE,
                      &makernote_off_tag) != TIFF_OK)
@@ -393,10 +678,10 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
         goto fail_free_exif;
     }
 
-    maker_buf = (uint8_t *)calloc(maker_type_size, maker_count);
+    maker_buf = (uint8_t *)nef_alloc(nef_fp, maker_type_size * maker_count);
 
     if (maker_buf == NULL) {
-        NEF_TRACE("Failed to allocate memory. Aborting.\n");
+        NEF_ERROR("Failed to allocate memory. Aborting.\n");
         nret = NEF_NO_MEMORY;
         goto fail_free_exif;
     }
@@ -406,29 +691,34 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
     {
         NEF_TRACE("Failed to get tag data.\n");
         nret = NEF_NOT_NEF;
-        free(maker_buf);
+        nef_free(nef_fp, maker_buf);
         goto fail_free_exif;
     }
 
     if (strncmp("Nikon", (char *)maker_buf, 5)) {
         NEF_TRACE("This is not a Nikon MakerNote... aborting.\n");
         nret = NEF_NOT_NEF;
-        free(maker_buf);
+        nef_free(nef_fp, maker_buf);
         goto fail_free_exif;
     }
 
     /* Create an IFD for the makernote */
+    NEF_STATS_RESTART(ifd_start);
+
     if (tiff_make_ifd(nef_fp->tiff_fp, maker_buf + NEF_MAKERNOTE_OFF,
             maker_type_size * maker_count, makernote_off + NEF_MAKERNOTE_OFF - 8,
             &nef_fp->makernote) != TIFF_OK)
     {
-        NEF_TRACE("Failed to create NEF MakerNote structure. Aborting.\n");
+        NEF_ERROR("Failed to create NEF MakerNote structure. Aborting.\n");
         nret = NEF_NOT_NEF;
-        free(maker_buf);
+        nef_free(nef_fp, maker_buf);
         goto fail_free_exif;
     }
 
-    free(maker_buf);
+    NEF_STATS_STOP(nef_fp, NEF_STAGE_IFD_PARSE, ifd_start,
+                   maker_type_size * maker_count);
+
+    nef_free(nef_fp, maker_buf);
 
     if (nef_get_obfuscation_params(nef_fp) != NEF_OK) {
         NEF_TRACE("Failed to get crypto params\n");
@@ -436,6 +726,8 @@ NEF_STATUS nef_open(const char *file, nef_t **fp)
         goto fail_free_makernote;
     }
 
+    NEF_STATS_STOP(nef_fp, NEF_STAGE_OPEN, open_start, 0);
+
     *fp = nef_fp;
 
     return NEF_OK;
@@ -447,7 +739,15 @@ fail_free_exif:
     if (nef_fp->exif) tiff_free_ifd(tiff_fp, nef_fp->exif);
 
 fail_free_fptr:
-    if (nef_fp) free(nef_fp);
+    if (nef_fp && nef_fp->camera && nef_fp->camera->destroy) {
+        nef_fp->camera->destroy(&nef_fp->camera_state);
+    }
+    if (nef_fp) {
+        if (nef_fp->fd >= 0) close(nef_fp->fd);
+        nef_free(nef_fp, nef_fp->path);
+        nef_unmap_file(nef_fp);
+        nef_handle_free(nef_fp);
+    }
 
 fail_close_file:
     if (root_ifd) tiff_free_ifd(tiff_fp, root_ifd);
@@ -461,20 +761,31 @@ NEF_STATUS nef_close(nef_t *fp)
 
     NEF_CHECK_ARG(fp);
 
+    if (fp->camera != NULL && fp->camera->destroy != NULL) {
+        fp->camera->destroy(&fp->camera_state);
+    }
+
     if (fp->image_count > 0 && fp->images != NULL) {
         for (i = 0; i < fp->image_count; i++) {
             nef_destroy_image(fp, &fp->images[i]);
         }
-        free(fp->images);
+        nef_free(fp, fp->images);
     }
 
     if (fp->exif) tiff_free_ifd(fp->tiff_fp, fp->exif);
     if (fp->makernote) tiff_free_ifd(fp->tiff_fp, fp->makernote);
 
-    tiff_close(fp->tiff_fp);
+    if (fp->tiff_fp) tiff_close(fp->tiff_fp);
+    if (fp->fd >= 0) close(fp->fd);
+    nef_free(fp, fp->path);
 
-    memset(fp, 0, sizeof(nef_t));
-    free(fp);
+    nef_unmap_file(fp);
+    nef_handle_free(fp);
     return NEF_OK;
 }
 
+NEF_STATUS nef_open(const char *file, nef_t **fp)
+{
+    return nef_open_ex(file, 0, NULL, fp);
+}
+
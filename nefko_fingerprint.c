@@ -0,0 +1,532 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_priv_tags.h>
+
+#include <string.h>
+
+/* Fingerprints of the raw data of an image, for finding duplicates. Only
+ * the strip payload is hashed, along with the camera serial number and
+ * shutter count, so that a file matches itself after an editor rewrites
+ * its metadata. The payload is cut into fixed-size chunks, hashed on as
+ * many threads as there are CPUs, and the fingerprint is the hash of the
+ * chunk hashes followed by the identity fields. Chunking is over the
+ * payload as a whole, so a fingerprint does not depend on how the file
+ * was read.
+ */
+
+/* Bytes of payload in each independently hashed chunk */
+#define NEF_FINGERPRINT_CHUNK   (1024 * 1024)
+
+/* Bytes in the hash of each chunk */
+#define NEF_XXH64_BYTES         8
+#define NEF_SHA256_BYTES        32
+
+/*******************************************************************/
+/* xxHash64                                                        */
+/*******************************************************************/
+
+#define NEF_XXH_P1  0x9e3779b185ebca87ull
+#define NEF_XXH_P2  0xc2b2ae3d27d4eb4full
+#define NEF_XXH_P3  0x165667b19e3779f9ull
+#define NEF_XXH_P4  0x85ebca77c2b2ae63ull
+#define NEF_XXH_P5  0x27d4eb2f165667c5ull
+
+static inline uint64_t nef_rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t nef_read_le64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return NEF_HOST_BIG_ENDIAN ? __builtin_bswap64(v) : v;
+}
+
+static inline uint32_t nef_read_le32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return NEF_HOST_BIG_ENDIAN ? __builtin_bswap32(v) : v;
+}
+
+static inline uint64_t nef_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * NEF_XXH_P2;
+    acc = nef_rotl64(acc, 31);
+
+    return acc * NEF_XXH_P1;
+}
+
+static inline uint64_t nef_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= nef_xxh64_round(0, val);
+
+    return acc * NEF_XXH_P1 + NEF_XXH_P4;
+}
+
+/* The four lanes of the main loop are independent, so they run in
+ * parallel in the pipeline, or in vector registers where there are
+ * 64-bit multiplies.
+ */
+static uint64_t nef_xxh64(const uint8_t *p, size_t len, uint64_t seed)
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + NEF_XXH_P1 + NEF_XXH_P2;
+        uint64_t v2 = seed + NEF_XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - NEF_XXH_P1;
+
+        do {
+            v1 = nef_xxh64_round(v1, nef_read_le64(p));
+            v2 = nef_xxh64_round(v2, nef_read_le64(p + 8));
+            v3 = nef_xxh64_round(v3, nef_read_le64(p + 16));
+            v4 = nef_xxh64_round(v4, nef_read_le64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = nef_rotl64(v1, 1) + nef_rotl64(v2, 7) + nef_rotl64(v3, 12) +
+            nef_rotl64(v4, 18);
+        h = nef_xxh64_merge(h, v1);
+        h = nef_xxh64_merge(h, v2);
+        h = nef_xxh64_merge(h, v3);
+        h = nef_xxh64_merge(h, v4);
+    } else {
+        h = seed + NEF_XXH_P5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= nef_xxh64_round(0, nef_read_le64(p));
+        h = nef_rotl64(h, 27) * NEF_XXH_P1 + NEF_XXH_P4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)nef_read_le32(p) * NEF_XXH_P1;
+        h = nef_rotl64(h, 23) * NEF_XXH_P2 + NEF_XXH_P3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= *p * NEF_XXH_P5;
+        h = nef_rotl64(h, 11) * NEF_XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= NEF_XXH_P2;
+    h ^= h >> 29;
+    h *= NEF_XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* Store an xxHash64 in its canonical, big-endian, form */
+static void nef_xxh64_digest(const uint8_t *p, size_t len, uint8_t *out)
+{
+    uint64_t h = nef_xxh64(p, len, 0);
+    int i;
+
+    for (i = 0; i < NEF_XXH64_BYTES; i++) {
+        out[i] = h >> (56 - 8 * i);
+    }
+}
+
+/*******************************************************************/
+/* SHA-256                                                         */
+/*******************************************************************/
+
+struct nef_sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t fill;
+    uint64_t total;
+};
+
+static const uint32_t nef_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t nef_rotr32(uint32_t x, unsigned r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static void nef_sha256_init(struct nef_sha256 *ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->fill = 0;
+    ctx->total = 0;
+}
+
+static void nef_sha256_block(uint32_t *state, const uint8_t *p)
+{
+    uint32_t w[64], s[8], t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = nef_rotr32(w[i - 15], 7) ^ nef_rotr32(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = nef_rotr32(w[i - 2], 17) ^ nef_rotr32(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, state, sizeof(s));
+
+    for (i = 0; i < 64; i++) {
+        t1 = s[7] + (nef_rotr32(s[4], 6) ^ nef_rotr32(s[4], 11) ^
+             nef_rotr32(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+             nef_sha256_k[i] + w[i];
+        t2 = (nef_rotr32(s[0], 2) ^ nef_rotr32(s[0], 13) ^
+             nef_rotr32(s[0], 22)) +
+             ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+        s[7] = s[6];
+        s[6] = s[5];
+        s[5] = s[4];
+        s[4] = s[3] + t1;
+        s[3] = s[2];
+        s[2] = s[1];
+        s[1] = s[0];
+        s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++) {
+        state[i] += s[i];
+    }
+}
+
+static void nef_sha256_update(struct nef_sha256 *ctx, const uint8_t *p,
+                              size_t len)
+{
+    ctx->total += len;
+
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        len -= take;
+
+        if (ctx->fill < 64) {
+            return;
+        }
+
+        nef_sha256_block(ctx->state, ctx->block);
+        ctx->fill = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64) {
+        nef_sha256_block(ctx->state, p);
+    }
+
+    memcpy(ctx->block, p, len);
+    ctx->fill = len;
+}
+
+static void nef_sha256_final(struct nef_sha256 *ctx, uint8_t *out)
+{
+    uint64_t bits = ctx->total * 8;
+    uint8_t pad[72];
+    size_t pad_len = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+
+    for (i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+
+    nef_sha256_update(ctx, pad, pad_len + 8);
+
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+static void nef_sha256_digest(const uint8_t *p, size_t len, uint8_t *out)
+{
+    struct nef_sha256 ctx;
+
+    nef_sha256_init(&ctx);
+    nef_sha256_update(&ctx, p, len);
+    nef_sha256_final(&ctx, out);
+}
+
+/*******************************************************************/
+/* Fingerprinting                                                  */
+/*******************************************************************/
+
+struct nef_fingerprint {
+    const uint8_t *payload;
+    size_t bytes;
+    size_t nr_chunks;
+
+    int algo;
+    size_t digest_bytes;
+
+    /* The hash of each chunk, one after the other */
+    uint8_t *digests;
+
+    /* Index of the next chunk to hash */
+    size_t next;
+};
+
+static void nef_fingerprint_digest(int algo, const uint8_t *p, size_t len,
+                                   uint8_t *out)
+{
+    if (algo == NEF_HASH_SHA256) {
+        nef_sha256_digest(p, len, out);
+    } else {
+        nef_xxh64_digest(p, len, out);
+    }
+}
+
+static void *nef_fingerprint_worker(void *arg)
+{
+    struct nef_fingerprint *fpr = (struct nef_fingerprint *)arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&fpr->next, 1, __ATOMIC_RELAXED)) <
+           fpr->nr_chunks)
+    {
+        size_t off = i * NEF_FINGERPRINT_CHUNK;
+        size_t len = fpr->bytes - off < NEF_FINGERPRINT_CHUNK ?
+            fpr->bytes - off : NEF_FINGERPRINT_CHUNK;
+
+        nef_fingerprint_digest(fpr->algo, fpr->payload + off, len,
+            fpr->digests + i * fpr->digest_bytes);
+    }
+
+    return NULL;
+}
+
+/* Get the size of the value of a MakerNote tag, 0 if it is missing */
+static size_t nef_fingerprint_tag_bytes(nef_t *fp, unsigned tag_id)
+{
+    int type = 0, count = 0;
+
+    if (nef_exif_get_tag(fp, NEF_TAG_MAKERNOTE(tag_id), &type, &count, NULL)
+            == NEF_OK && count > 0)
+    {
+        return tiff_get_type_size(type) * count;
+    }
+
+    return 0;
+}
+
+/* Append a MakerNote tag to the identity fields: its type, its count, and
+ * its value, with the count 0 if the tag is missing. buf has room for the
+ * tag, as sized by nef_fingerprint_tag_bytes.
+ */
+static NEF_STATUS nef_fingerprint_tag(nef_t *fp, unsigned tag_id,
+                                      uint8_t *buf, size_t *len)
+{
+    int type = 0, count = 0;
+    size_t bytes = nef_fingerprint_tag_bytes(fp, tag_id);
+    uint8_t *dst = buf + *len;
+
+    if (nef_exif_get_tag(fp, NEF_TAG_MAKERNOTE(tag_id), &type, &count, NULL)
+            != NEF_OK)
+    {
+        type = 0;
+    }
+
+    dst[0] = type;
+    dst[1] = type >> 8;
+    dst[2] = dst[3] = 0;
+    dst[4] = bytes ? count : 0;
+    dst[5] = bytes ? count >> 8 : 0;
+    dst[6] = bytes ? count >> 16 : 0;
+    dst[7] = bytes ? count >> 24 : 0;
+
+    if (bytes != 0 &&
+        nef_exif_get_tag(fp, NEF_TAG_MAKERNOTE(tag_id), &type, &count,
+                         dst + 8) != NEF_OK)
+    {
+        return NEF_FAILURE;
+    }
+
+    /* Keep the fingerprint the same on hosts of either byte order */
+    if (NEF_HOST_BIG_ENDIAN && bytes != 0) {
+        size_t size = bytes / count, j, k;
+
+        for (j = 0; j < bytes; j += size) {
+            for (k = 0; k < size / 2; k++) {
+                uint8_t t = dst[8 + j + k];
+
+                dst[8 + j + k] = dst[8 + j + size - 1 - k];
+                dst[8 + j + size - 1 - k] = t;
+            }
+        }
+    }
+
+    *len += 8 + bytes;
+
+    return NEF_OK;
+}
+
+/* Get the strips of an image straight from the mapped file, if there is one
+ * and the strips are back to back, as they are in files from a camera */
+static int nef_fingerprint_mapped(nef_t *fp, nef_image_t *hdl,
+                                  const uint8_t **payload, size_t *bytes)
+{
+    uint32_t *offsets = NULL, *counts = NULL;
+    int type_off, type_cnt, count_off, count_cnt, i;
+    size_t end = 0;
+    int ret = 0;
+
+    if (fp->map == NULL ||
+        nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPOFFSETS,
+                          (void **)&offsets, &type_off, &count_off) != NEF_OK ||
+        nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPBYTECOUNTS,
+                          (void **)&counts, &type_cnt, &count_cnt) != NEF_OK ||
+        type_off != TIFF_TYPE_LONG || type_cnt != TIFF_TYPE_LONG ||
+        count_off != count_cnt || count_off == 0)
+    {
+        goto done;
+    }
+
+    end = offsets[0];
+
+    for (i = 0; i < count_off; i++) {
+        if (offsets[i] != end) {
+            goto done;
+        }
+        end += counts[i];
+    }
+
+    if (end > fp->map_bytes) {
+        goto done;
+    }
+
+    *payload = fp->map + offsets[0];
+    *bytes = end - offsets[0];
+    ret = 1;
+
+done:
+    nef_free(fp, offsets);
+    nef_free(fp, counts);
+
+    return ret;
+}
+
+NEF_STATUS nef_image_fingerprint(nef_t *fp, nef_image_t *hdl, int algo,
+                                 unsigned char *out)
+{
+    struct nef_fingerprint fpr;
+    uint8_t *copy = NULL, *ident = NULL;
+    size_t ident_len = 8, i;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(out);
+
+    if (algo != NEF_HASH_XXH64 && algo != NEF_HASH_SHA256) {
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (hdl->ifd == NULL) {
+        NEF_TRACE("Image has no strips to fingerprint\n");
+        return NEF_NOT_FOUND;
+    }
+
+    memset(&fpr, 0, sizeof(fpr));
+    fpr.algo = algo;
+    fpr.digest_bytes = algo == NEF_HASH_SHA256 ?
+        NEF_SHA256_BYTES : NEF_XXH64_BYTES;
+
+    if (!nef_fingerprint_mapped(fp, hdl, &fpr.payload, &fpr.bytes)) {
+        if ((ret = nef_image_read_strips(fp, hdl, &copy, &fpr.bytes))
+                != NEF_OK)
+        {
+            return ret;
+        }
+        fpr.payload = copy;
+    }
+
+    fpr.nr_chunks = (fpr.bytes + NEF_FINGERPRINT_CHUNK - 1) /
+        NEF_FINGERPRINT_CHUNK;
+
+    /* The chunk hashes, then the payload size and the identity fields,
+     * sized up front, as arena memory cannot be grown */
+    if ((ident = (uint8_t *)nef_alloc(fp, ident_len + 16 +
+            nef_fingerprint_tag_bytes(fp, TIFF_TAG_MAKERNOTE_SERIAL) +
+            nef_fingerprint_tag_bytes(fp, TIFF_TAG_MAKERNOTE_SHUTTER))) == NULL)
+    {
+        ret = NEF_NO_MEMORY;
+        goto done;
+    }
+
+    for (i = 0; i < 8; i++) {
+        ident[i] = (uint64_t)fpr.bytes >> (8 * i);
+    }
+
+    if ((ret = nef_fingerprint_tag(fp, TIFF_TAG_MAKERNOTE_SERIAL, ident,
+                                   &ident_len)) != NEF_OK ||
+        (ret = nef_fingerprint_tag(fp, TIFF_TAG_MAKERNOTE_SHUTTER, ident,
+                                   &ident_len)) != NEF_OK)
+    {
+        goto done;
+    }
+
+    fpr.digests = (uint8_t *)nef_alloc(fp,
+        fpr.nr_chunks * fpr.digest_bytes + ident_len);
+    if (fpr.digests == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto done;
+    }
+
+    /* Hash every chunk of the payload, on as many threads as are useful */
+    if (fpr.nr_chunks > 0) {
+        nef_run_workers(nef_fingerprint_worker, &fpr, 0, fpr.nr_chunks);
+    }
+
+    memcpy(fpr.digests + fpr.nr_chunks * fpr.digest_bytes, ident, ident_len);
+
+    nef_fingerprint_digest(algo, fpr.digests,
+        fpr.nr_chunks * fpr.digest_bytes + ident_len, out);
+
+done:
+    nef_free(fp, fpr.digests);
+    nef_free(fp, ident);
+    nef_free(fp, copy);
+
+    return ret;
+}
@@ -0,0 +1,264 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <string.h>
+
+/* Statistics of the raw samples of an image, gathered in the sink chain
+ * as rows leave the decoder, so that auto-exposure and QC do not need a
+ * second pass over the mosaic. Each decode counts into partials of its
+ * own, and only copies them out once it has succeeded; decodes running on
+ * separate threads, each into its own nef_image_stats, are combined with
+ * nef_image_stats_merge.
+ */
+
+/* Most histogram bins per channel: one per 16-bit sample value */
+#define NEF_HISTOGRAM_MAX_BINS  65536
+
+struct nef_histogram_chan {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t clipped;
+    unsigned min;
+    unsigned max;
+};
+
+struct nef_histogram {
+    /* The sink the rows go on to */
+    struct nef_row_sink *next;
+
+    /* Samples are binned by shifting them down, to at most last */
+    unsigned shift;
+    unsigned last;
+    unsigned bins;
+    unsigned clip;
+
+    uint32_t *hist;
+    struct nef_histogram_chan chan[4];
+};
+
+/* Count a row of samples, alternating between the CFA positions pos and
+ * pos + 1 */
+static void nef_histogram_row(struct nef_histogram *h, const uint16_t *src,
+                              unsigned width, unsigned pos)
+{
+    struct nef_histogram_chan *even = &h->chan[pos], *odd = &h->chan[pos + 1];
+    uint32_t *hist_even = h->hist + pos * h->bins;
+    uint32_t *hist_odd = hist_even + h->bins;
+    unsigned min_even = even->min, max_even = even->max;
+    unsigned min_odd = odd->min, max_odd = odd->max;
+    unsigned clip = h->clip, shift = h->shift, last = h->last;
+    uint64_t sum_even = 0, sum_odd = 0;
+    unsigned clip_even = 0, clip_odd = 0, x;
+
+    for (x = 0; x + 1 < width; x += 2) {
+        unsigned a = src[x], b = src[x + 1];
+        unsigned bin_a = a >> shift, bin_b = b >> shift;
+
+        sum_even += a;
+        sum_odd += b;
+        min_even = a < min_even ? a : min_even;
+        max_even = a > max_even ? a : max_even;
+        min_odd = b < min_odd ? b : min_odd;
+        max_odd = b > max_odd ? b : max_odd;
+        clip_even += a >= clip;
+        clip_odd += b >= clip;
+        hist_even[bin_a > last ? last : bin_a]++;
+        hist_odd[bin_b > last ? last : bin_b]++;
+    }
+
+    if (x < width) {
+        unsigned a = src[x], bin_a = a >> shift;
+
+        sum_even += a;
+        min_even = a < min_even ? a : min_even;
+        max_even = a > max_even ? a : max_even;
+        clip_even += a >= clip;
+        hist_even[bin_a > last ? last : bin_a]++;
+    }
+
+    even->count += (width + 1) / 2;
+    even->sum += sum_even;
+    even->clipped += clip_even;
+    even->min = min_even;
+    even->max = max_even;
+
+    odd->count += width / 2;
+    odd->sum += sum_odd;
+    odd->clipped += clip_odd;
+    odd->min = min_odd;
+    odd->max = max_odd;
+}
+
+static NEF_STATUS nef_histogram_put_rows(struct nef_row_sink *sink,
+                                         unsigned row, unsigned nr_rows,
+                                         const uint16_t *rows,
+                                         unsigned width, unsigned stride)
+{
+    struct nef_histogram *h = (struct nef_histogram *)sink->state;
+    unsigned i;
+
+    for (i = 0; i < nr_rows; i++) {
+        nef_histogram_row(h, rows + i * stride, width, ((row + i) & 1) * 2);
+    }
+
+    return h->next->put_rows(h->next, row, nr_rows, rows, width, stride);
+}
+
+static uint16_t *nef_histogram_get_rows(struct nef_row_sink *sink,
+                                        unsigned row, unsigned nr_rows,
+                                        unsigned *stride)
+{
+    struct nef_histogram *h = (struct nef_histogram *)sink->state;
+
+    return h->next->get_rows(h->next, row, nr_rows, stride);
+}
+
+/* Get the log2 of a power of two */
+static unsigned nef_histogram_log2(unsigned n)
+{
+    unsigned log = 0;
+
+    while (n > 1) {
+        n >>= 1;
+        log++;
+    }
+
+    return log;
+}
+
+NEF_STATUS nef_image_set_stats(nef_t *fp, nef_image_t *hdl,
+                               struct nef_image_stats *stats)
+{
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    if (stats == NULL) {
+        hdl->stats = NULL;
+        return NEF_OK;
+    }
+
+    if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1) {
+        NEF_TRACE("Statistics need a CFA image\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (stats->bins == 0 || stats->bins > NEF_HISTOGRAM_MAX_BINS ||
+        (stats->bins & (stats->bins - 1)))
+    {
+        NEF_TRACE("Bins must be a power of two, up to %u: %u\n",
+            NEF_HISTOGRAM_MAX_BINS, stats->bins);
+        return NEF_RANGE_ERROR;
+    }
+
+    hdl->stats = stats;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_stats_merge(struct nef_image_stats *into,
+                                 const struct nef_image_stats *from)
+{
+    unsigned c, i;
+
+    NEF_CHECK_ARG(into);
+    NEF_CHECK_ARG(from);
+
+    if (into->bins != from->bins) {
+        return NEF_RANGE_ERROR;
+    }
+
+    for (c = 0; c < 4; c++) {
+        struct nef_channel_stats *dst = &into->chan[c];
+        const struct nef_channel_stats *src = &from->chan[c];
+
+        if (src->count == 0) {
+            continue;
+        }
+
+        if (dst->count == 0 || src->min < dst->min) {
+            dst->min = src->min;
+        }
+
+        if (dst->count == 0 || src->max > dst->max) {
+            dst->max = src->max;
+        }
+
+        dst->count += src->count;
+        dst->sum += src->sum;
+        dst->clipped += src->clipped;
+    }
+
+    if (into->hist != NULL && from->hist != NULL) {
+        for (i = 0; i < 4 * into->bins; i++) {
+            into->hist[i] += from->hist[i];
+        }
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_histogram_decode(nef_t *fp, nef_image_t *hdl,
+                                struct nef_row_sink *sink)
+{
+    struct nef_image_stats *stats = hdl->stats;
+    struct nef_histogram h;
+    struct nef_row_sink wrap;
+    unsigned bits = hdl->bits_per_sample, log_bins, c, i;
+    NEF_STATUS ret;
+
+    memset(&h, 0, sizeof(h));
+
+    log_bins = nef_histogram_log2(stats->bins);
+    h.next = sink;
+    h.bins = stats->bins;
+    h.last = stats->bins - 1;
+    h.shift = bits > log_bins ? bits - log_bins : 0;
+    h.clip = stats->clip;
+
+    /* The camera's saturation level is given for 14-bit samples */
+    if (h.clip == 0 && fp->params.white_level != 0 && bits <= 14) {
+        h.clip = fp->params.white_level >> (14 - bits);
+    }
+
+    if (h.clip == 0) {
+        h.clip = (1u << bits) - 1;
+    }
+
+    for (c = 0; c < 4; c++) {
+        h.chan[c].min = ~0u;
+    }
+
+    h.hist = (uint32_t *)nef_alloc(fp, 4 * h.bins * sizeof(uint32_t));
+    if (h.hist == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    memset(h.hist, 0, 4 * h.bins * sizeof(uint32_t));
+
+    wrap.put_rows = nef_histogram_put_rows;
+    wrap.get_rows = sink->get_rows != NULL ? nef_histogram_get_rows : NULL;
+    wrap.state = &h;
+
+    if ((ret = nef_calib_decode(fp, hdl, &wrap)) != NEF_OK) {
+        goto done;
+    }
+
+    for (c = 0; c < 4; c++) {
+        stats->chan[c].count = h.chan[c].count;
+        stats->chan[c].sum = h.chan[c].sum;
+        stats->chan[c].clipped = h.chan[c].clipped;
+        stats->chan[c].min = h.chan[c].count ? h.chan[c].min : 0;
+        stats->chan[c].max = h.chan[c].max;
+    }
+
+    if (stats->hist != NULL) {
+        for (i = 0; i < 4 * h.bins; i++) {
+            stats->hist[i] = h.hist[i];
+        }
+    }
+
+done:
+    nef_free(fp, h.hist);
+
+    return ret;
+}
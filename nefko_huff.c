@@ -4,6 +4,45 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Number of rows decoded before they are handed to the row sink */
+#define NEF_NPC_BAND_ROWS       16
+
+/* Huffman table specifications, as used by the various NPC flavours. The
+ * first 16 bytes are the count of codes of each length, from 1 to 16 bits,
+ * followed by the symbols for each code, in canonical order. Each symbol
+ * holds the length of the difference that follows in its low nibble, and
+ * the count of low-order bits that are dropped from it in the high nibble.
+ */
+static const uint8_t nef_npc_trees[6][32] = {
+    /* 12-bit lossy */
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0,
+      5, 4, 3, 6, 2, 7, 1, 0, 8, 9, 11, 10, 12 },
+    /* 12-bit lossy, after the split row */
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0,
+      0x39, 0x5a, 0x38, 0x27, 0x16, 5, 4, 3, 2, 1, 0, 11, 12, 12 },
+    /* 12-bit lossless */
+    { 0, 1, 4, 2, 3, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      5, 4, 6, 3, 7, 2, 8, 1, 9, 0, 10, 11, 12 },
+    /* 14-bit lossy */
+    { 0, 1, 4, 3, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0,
+      5, 6, 4, 7, 8, 3, 9, 2, 1, 0, 10, 11, 12, 13, 14 },
+    /* 14-bit lossy, after the split row */
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0,
+      8, 0x5c, 0x4b, 0x3a, 0x29, 7, 6, 5, 4, 3, 2, 1, 0, 13, 14 },
+    /* 14-bit lossless */
+    { 0, 1, 4, 2, 2, 3, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0,
+      7, 6, 8, 5, 9, 4, 10, 3, 11, 12, 2, 0, 1, 13, 14 }
+};
+
+const uint8_t *nef_npc_tree_spec(unsigned tree)
+{
+    if (tree >= sizeof(nef_npc_trees) / sizeof(nef_npc_trees[0])) {
+        return NULL;
+    }
+
+    return nef_npc_trees[tree];
+}
+
 /* A little helper bit iterator to assist with traversing buffers o'
  * bits
  */
@@ -17,19 +56,27 @@ struct biterator {
 };
 
 struct nef_npc_huff {
-    int predictor[4];
-    int edge_pred[2];
+    /* Initial vertical predictors, indexed [row & 1][col & 1] */
+    int predictor[2][2];
+
+    /* Row at which the lossy-after-split tree takes over, or 0 */
+    unsigned split_row;
+
+    /* Linearization curve, mapping predicted values to samples */
+    uint16_t *curve;
+
     struct nef_huff_leaf *root;
+    struct nef_huff_leaf *split_root;
 };
 
-struct nef_huff_leaf *nef_new_huff_node()
+struct nef_huff_leaf *nef_new_huff_node(nef_t *nef)
 {
     struct nef_huff_leaf *branch = NULL;
 
-    branch = (struct nef_huff_leaf*)malloc(sizeof(struct nef_huff_leaf));
+    branch = (struct nef_huff_leaf*)nef_alloc(nef, sizeof(struct nef_huff_leaf));
 
-    if (branch != NULL) {
-        memset(branch, 0, sizeof(struct nef_huff_leaf));
+    if (branch == NULL) {
+        return NULL;
     }
 
     branch->leaf = 0xfffffffful;
@@ -37,13 +84,24 @@ struct nef_huff_leaf *nef_new_huff_node()
     return branch;
 }
 
+void nef_free_huff_tree(nef_t *nef, struct nef_huff_leaf *root)
+{
+    if (root == NULL) return;
+
+    nef_free_huff_tree(nef, root->branch[0]);
+    nef_free_huff_tree(nef, root->branch[1]);
+
+    nef_free(nef, root);
+}
 
-NEF_STATUS nef_huff_append_node(struct nef_huff_leaf *root,
+/* Append the symbol entrynum to the tree, reached by the size low-order
+ * bits of code, most significant bit first.
+ */
+NEF_STATUS nef_huff_append_node(nef_t *nef, struct nef_huff_leaf *root,
                                 unsigned size,
-                                unsigned value,
+                                unsigned code,
                                 unsigned entrynum)
 {
-    unsigned code = value >> (8 - size);
     int i;
 
     struct nef_huff_leaf *branch = root;
@@ -54,7 +112,11 @@ NEF_STATUS nef_huff_append_node(struct nef_huff_leaf *root,
         int dir = (code >> (size - i - 1)) & 1;
 
         if (branch->branch[dir] == NULL) {
-            branch->branch[dir] = nef_new_huff_node();
+            branch->branch[dir] = nef_new_huff_node(nef);
+
+            if (branch->branch[dir] == NULL) {
+                return NEF_NO_MEMORY;
+            }
         }
 
         branch = branch->branch[dir];
@@ -65,23 +127,43 @@ NEF_STATUS nef_huff_append_node(struct nef_huff_leaf *root,
     return NEF_OK;
 }
 
-
-static struct biterator *nef_npc_new_biterator(uint8_t *buffer,
-                                              size_t byte_size)
+/* Build a Huffman tree from one of the nef_npc_trees specifications */
+static NEF_STATUS nef_npc_build_tree(nef_t *nef, const uint8_t *spec,
+                                     struct nef_huff_leaf **root)
 {
-    struct biterator *bit = NULL;
+    unsigned len, i, code = 0, entry = 0;
+    NEF_STATUS ret;
+
+    *root = nef_new_huff_node(nef);
 
-    bit = (struct biterator *)malloc(sizeof(struct biterator));
+    if (*root == NULL) {
+        return NEF_NO_MEMORY;
+    }
 
-    if (bit == NULL) return NULL;
+    for (len = 1; len <= 16; len++) {
+        for (i = 0; i < spec[len - 1]; i++) {
+            if ((ret = nef_huff_append_node(nef, *root, len, code++,
+                    spec[16 + entry++])) != NEF_OK)
+            {
+                nef_free_huff_tree(nef, *root);
+                *root = NULL;
+                return ret;
+            }
+        }
+        code <<= 1;
+    }
 
+    return NEF_OK;
+}
+
+static void nef_npc_biterator_init(struct biterator *bit, uint8_t *buffer,
+                                   size_t byte_size)
+{
     bit->cached = *buffer;
     bit->buf_ptr = buffer;
     bit->buf_off = 0;
     bit->bit_off = 0;
     bit->buf_max = byte_size;
-
-    return bit;
 }
 
 static inline int nef_npc_biterator_advance(struct biterator *bit)
@@ -99,65 +181,137 @@ static inline int nef_npc_biterator_advance(struct biterator *bit)
     return (bit->cached >> (8 - bit->bit_off++ - 1)) & 0x1;
 }
 
+/* Read count bits, most significant bit first */
+static inline int nef_npc_biterator_get_bits(struct biterator *bit,
+                                             unsigned count)
+{
+    int out = 0, i;
+
+    for (i = 0; i < count; i++) {
+        int bit_val = nef_npc_biterator_advance(bit);
 
-int nef_npc_huff_get_value(struct nef_huff_leaf *root,
-                           struct biterator *bit)
+        if (bit_val == -1) {
+            return -1;
+        }
+
+        out = (out << 1) | bit_val;
+    }
+
+    return out;
+}
+
+/* Decode the next difference from the bitstream */
+static inline NEF_STATUS nef_npc_huff_get_value(struct nef_huff_leaf *root,
+                                                struct biterator *bit,
+                                                int *diff)
 {
     struct nef_huff_leaf *node = root;
+    unsigned len, shl;
     int val;
 
     while (node->branch[0] != NULL || node->branch[1] != NULL) {
         int bit_val = nef_npc_biterator_advance(bit);
         if (bit_val == -1) {
-            printf ("failed to get bit\n");
-            return -33939;
+            return NEF_RANGE_ERROR;
         }
 
         node = node->branch[bit_val];
 
         if (node == NULL) {
-            NEF_TRACE("Busted - got an unexpected bit");
-            return -33939;
+            NEF_ERROR("Busted - got an unexpected bit\n");
+            return NEF_FAILURE;
         }
     }
 
-    val = node->leaf;
+    len = node->leaf & 0xf;
+    shl = node->leaf >> 4;
 
-    if (val != 0) {
-        uint8_t first = nef_npc_biterator_advance(bit);
-        int i;
-        int out = 0;
+    if (len == 0) {
+        *diff = 0;
+        return NEF_OK;
+    }
+
+    if ((val = nef_npc_biterator_get_bits(bit, len - shl)) == -1) {
+        return NEF_RANGE_ERROR;
+    }
 
-        out = first;
+    val = (((val << 1) + 1) << shl) >> 1;
 
-        for (i = 1; i < val; i++)
-            out = (out << 1) | nef_npc_biterator_advance(bit);
+    if ((val & (1 << (len - 1))) == 0) {
+        val -= (1 << len) - !shl;
+    }
 
-        if (!first) {
-            out -= (1 << val) - 1;
+    *diff = val;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_npc_read_bits(uint8_t *data, size_t bytes, unsigned bits,
+                             unsigned *out, unsigned count)
+{
+    struct biterator bit;
+    unsigned i;
+
+    NEF_CHECK_ARG(data);
+    NEF_CHECK_ARG(out);
+
+    if (bytes == 0 || bits == 0 || bits > 16) {
+        return NEF_RANGE_ERROR;
+    }
+
+    nef_npc_biterator_init(&bit, data, bytes);
+
+    for (i = 0; i < count; i++) {
+        int val = nef_npc_biterator_get_bits(&bit, bits);
+
+        if (val == -1) {
+            return NEF_RANGE_ERROR;
         }
 
-        val = out;
+        out[i] = val;
     }
 
-    return val;
+    return NEF_OK;
 }
 
-static NEF_STATUS nef_npc_can_open(struct nef_image *image)
+NEF_STATUS nef_npc_decode_diffs(nef_t *nef, unsigned tree, uint8_t *data,
+                                size_t bytes, int *diffs, unsigned count)
 {
-    uint32_t comp_type = 0;
+    struct nef_huff_leaf *root = NULL;
+    struct biterator bit;
+    NEF_STATUS ret = NEF_OK;
+    unsigned i;
 
-    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(data);
+    NEF_CHECK_ARG(diffs);
 
-    /* Get the compression type */
-    if (nef_get_tag_alloc(image->nef_file, image->ifd, TIFF_TAG_COMPRESSION,
-                          (void *)&comp_type, NULL, NULL) != NEF_OK)
+    if (tree >= sizeof(nef_npc_trees) / sizeof(nef_npc_trees[0]) ||
+        bytes == 0)
     {
-        NEF_TRACE("Failed to get compression tag.\n");
-        return NEF_NOT_FOUND;
+        return NEF_RANGE_ERROR;
     }
 
-    if (comp_type != TIFF_COMPRESSION_NIKON) {
+    NEFKO_CHECK(nef_npc_build_tree(nef, nef_npc_trees[tree], &root),
+        NEF_NO_MEMORY);
+
+    nef_npc_biterator_init(&bit, data, bytes);
+
+    for (i = 0; i < count; i++) {
+        if ((ret = nef_npc_huff_get_value(root, &bit, &diffs[i])) != NEF_OK) {
+            break;
+        }
+    }
+
+    nef_free_huff_tree(nef, root);
+
+    return ret;
+}
+
+static NEF_STATUS nef_npc_can_open(struct nef_image *image)
+{
+    NEF_CHECK_ARG(image);
+
+    if (image->compression != TIFF_COMPRESSION_NIKON) {
         NEF_TRACE("Compression type is not NIKON.\n");
         return NEF_FAILURE;
     }
@@ -165,26 +319,343 @@ static NEF_STATUS nef_npc_can_open(struct nef_image *image)
     return NEF_OK;
 }
 
-static NEF_STATUS nef_npc_init_state(struct nef_image *image, tiff_ifd_t *makernote)
+#define NEF_NPC_GET16(b, off) \
+    (((unsigned)(b)[(off)] << 8) | (b)[(off) + 1])
+
+/* Parse the NEF decode table (MakerNote tag 150), which carries the
+ * initial predictors, the linearization curve and, for lossy images, the
+ * row where the Huffman tree changes. Like the rest of the MakerNote, its
+ * contents are big-endian.
+ */
+static NEF_STATUS nef_npc_parse_table(nef_t *nef, const uint8_t *table,
+                                      size_t count, unsigned bits,
+                                      struct nef_npc_huff **out)
 {
+    struct nef_npc_huff *state = NULL;
+    unsigned ver0, ver1, off = 2, csize, step = 0, max, tree, i;
+    NEF_STATUS ret = NEF_OK;
+
+    if (count < 2) {
+        return NEF_RANGE_ERROR;
+    }
+
+    ver0 = table[0];
+    ver1 = table[1];
+
+    if (ver0 == 0x49 || ver1 == 0x58) {
+        off += 2110;
+    }
+
+    if (off + 10 > count) {
+        NEF_TRACE("NEF decode table is too short (%zu bytes)\n", count);
+        return NEF_RANGE_ERROR;
+    }
+
+    state = (struct nef_npc_huff *)nef_alloc(nef, sizeof(struct nef_npc_huff));
+    if (state == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    state->curve = (uint16_t *)nef_alloc(nef, NEF_NPC_CURVE_SIZE * sizeof(uint16_t));
+    if (state->curve == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto fail;
+    }
+
+    for (i = 0; i < NEF_NPC_CURVE_SIZE; i++) {
+        state->curve[i] = i;
+    }
+
+    for (i = 0; i < 4; i++) {
+        state->predictor[i >> 1][i & 1] =
+            (int16_t)NEF_NPC_GET16(table, off + i * 2);
+    }
+    off += 8;
+
+    csize = NEF_NPC_GET16(table, off);
+    off += 2;
+
+    max = (1 << bits) & 0x7fff;
+
+    if (csize > 1) {
+        step = max / (csize - 1);
+    }
+
+    if (ver0 == NEF_NPC_VER_LOSSY && ver1 == NEF_NPC_VER_LOSSY_SUB && step > 0) {
+        /* Lossy: the curve is sampled every step entries */
+        if (off + csize * 2 > count || NEF_NPC_SPLIT_OFF + 2 > count) {
+            ret = NEF_RANGE_ERROR;
+            goto fail;
+        }
+
+        for (i = 0; i < csize; i++) {
+            state->curve[i * step] = NEF_NPC_GET16(table, off + i * 2);
+        }
+
+        for (i = 0; i < max; i++) {
+            unsigned frac = i % step;
+            state->curve[i] = (state->curve[i - frac] * (step - frac) +
+                               state->curve[i - frac + step] * frac) / step;
+        }
+
+        state->split_row = NEF_NPC_GET16(table, NEF_NPC_SPLIT_OFF);
+    } else if (ver0 != NEF_NPC_VER_LOSSLESS && csize <= NEF_NPC_CURVE_SIZE) {
+        if (off + csize * 2 > count) {
+            ret = NEF_RANGE_ERROR;
+            goto fail;
+        }
+
+        for (i = 0; i < csize; i++) {
+            state->curve[i] = NEF_NPC_GET16(table, off + i * 2);
+        }
+    }
+
+    tree = ver0 == NEF_NPC_VER_LOSSLESS ? NEF_NPC_TREE_12_LOSSLESS :
+        NEF_NPC_TREE_12_LOSSY;
+    if (bits == 14) {
+        tree += NEF_NPC_TREE_14_OFF;
+    }
+
+    NEF_TRACE("NEF decode table v%02x.%02x: tree %u, curve %u, split at %u\n",
+        ver0, ver1, tree, csize, state->split_row);
+
+    if ((ret = nef_npc_build_tree(nef, nef_npc_trees[tree], &state->root))
+            != NEF_OK)
+    {
+        goto fail;
+    }
+
+    if (state->split_row != 0 &&
+        (ret = nef_npc_build_tree(nef, nef_npc_trees[tree + 1],
+                                  &state->split_root))
+            != NEF_OK)
+    {
+        goto fail;
+    }
+
+    *out = state;
+
     return NEF_OK;
+
+fail:
+    nef_free_huff_tree(nef, state->root);
+    if (state->curve) nef_free(nef, state->curve);
+    nef_free(nef, state);
+
+    return ret;
 }
 
+static void nef_npc_free_state(nef_t *nef, struct nef_npc_huff *state)
+{
+    nef_free_huff_tree(nef, state->root);
+    nef_free_huff_tree(nef, state->split_root);
+    nef_free(nef, state->curve);
+    nef_free(nef, state);
+}
+
+static NEF_STATUS nef_npc_init_state(struct nef_image *image, tiff_ifd_t *makernote)
+{
+    nef_t *nef = NULL;
+    uint8_t *table = NULL;
+    int type, count;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(makernote);
+
+    nef = image->nef_file;
+
+    if (image->bits_per_sample != 12 && image->bits_per_sample != 14) {
+        NEF_TRACE("Unsupported sample depth: %u\n", image->bits_per_sample);
+        return NEF_RANGE_ERROR;
+    }
+
+    if (nef_get_tag_alloc(nef, makernote,
+                          TIFF_TAG_MAKERNOTE_NEF_DECODE,
+                          (void **)&table, &type, &count) != NEF_OK)
+    {
+        NEF_TRACE("Failed to get NEF decode table.\n");
+        return NEF_NOT_FOUND;
+    }
+
+    ret = nef_npc_parse_table(nef, table, count, image->bits_per_sample,
+                              (struct nef_npc_huff **)&image->reader_state);
+
+    nef_free(nef, table);
+
+    return ret;
+}
+
+/* NPC streams can only be decoded from the start, so the whole image is a
+ * single tile and there is no random access.
+ */
 static NEF_STATUS nef_npc_read_image_tile(struct nef_image *image,
                                     unsigned x_off, unsigned y_off,
                                     unsigned w, unsigned h, void *buf)
 {
-    return NEF_OK;
+    NEF_TRACE("NPC images can only be decoded whole\n");
+    return NEF_FAILURE;
 }
 
 static NEF_STATUS nef_npc_get_image_tile_size(struct nef_image *image,
                                               unsigned *w, unsigned *h)
 {
+    NEF_CHECK_ARG(image);
+
+    *w = image->width;
+    *h = image->height;
+
+    return NEF_OK;
+}
+
+/* Entropy decode one row. Each sample is predicted from the previous
+ * sample of the same colour in its row; the first two samples of each row
+ * are predicted from the first two samples of the previous row of the same
+ * parity, kept in vpred.
+ */
+static inline NEF_STATUS nef_npc_decode_row(struct nef_npc_huff *state,
+                                            struct biterator *bit,
+                                            int vpred[2][2], unsigned row,
+                                            unsigned width, uint16_t *out)
+{
+    struct nef_huff_leaf *root = state->root;
+    int hpred[2], diff;
+    unsigned col;
+    NEF_STATUS ret;
+
+    if (state->split_row != 0 && row >= state->split_row) {
+        root = state->split_root;
+    }
+
+    for (col = 0; col < width; col++) {
+        int sample;
+
+        if ((ret = nef_npc_huff_get_value(root, bit, &diff)) != NEF_OK) {
+            NEF_ERROR("Failed to decode row %u, col %u\n", row, col);
+            return ret;
+        }
+
+        if (col < 2) {
+            hpred[col] = vpred[row & 1][col] += diff;
+        } else {
+            hpred[col & 1] += diff;
+        }
+
+        sample = hpred[col & 1];
+        if (sample < 0) sample = 0;
+        if (sample > 0x3fff) sample = 0x3fff;
+
+        out[col] = state->curve[sample];
+    }
+
     return NEF_OK;
 }
 
+/* Entropy decode the image a band of rows at a time */
+static NEF_STATUS nef_npc_decode_rows(struct nef_image *image,
+                                      struct nef_row_sink *sink)
+{
+    struct nef_npc_huff *state = NULL;
+    nef_t *nef = NULL;
+    struct biterator bit;
+    uint8_t *data = NULL;
+    uint16_t *band = NULL, *dest = NULL;
+    size_t bytes = 0;
+    int vpred[2][2];
+    unsigned row, band_row = 0, stride = 0;
+    NEF_STATUS ret = NEF_OK;
+    NEF_STATS_START(band_start);
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(sink);
+    NEF_CHECK_ARG(image->reader_state);
+
+    state = (struct nef_npc_huff *)image->reader_state;
+    nef = image->nef_file;
+
+    NEFKO_CHECK(nef_image_read_strips(nef, image, &data, &bytes),
+        NEF_RANGE_ERROR);
+
+    if (bytes == 0) {
+        nef_free(nef, data);
+        return NEF_RANGE_ERROR;
+    }
+
+    band = (uint16_t *)nef_alloc_raw(nef, sizeof(uint16_t) * image->width *
+                                     NEF_NPC_BAND_ROWS);
+    if (band == NULL) {
+        nef_free(nef, data);
+        return NEF_NO_MEMORY;
+    }
+
+    nef_npc_biterator_init(&bit, data, bytes);
+    memcpy(vpred, state->predictor, sizeof(vpred));
+
+    for (row = 0; row < image->height; row++) {
+        if (band_row == 0) {
+            unsigned nr_rows = image->height - row;
+
+            if (nr_rows > NEF_NPC_BAND_ROWS) {
+                nr_rows = NEF_NPC_BAND_ROWS;
+            }
+
+            dest = NULL;
+            if (sink->get_rows != NULL) {
+                dest = sink->get_rows(sink, row, nr_rows, &stride);
+            }
+
+            if (dest == NULL) {
+                dest = band;
+                stride = image->width;
+            }
+
+            NEF_STATS_RESTART(band_start);
+        }
+
+        if ((ret = nef_npc_decode_row(state, &bit, vpred, row, image->width,
+                                      dest + band_row * stride)) != NEF_OK)
+        {
+            goto exit;
+        }
+
+        if (++band_row == NEF_NPC_BAND_ROWS || row + 1 == image->height) {
+            NEF_STATS_STOP(nef, NEF_STAGE_ENTROPY, band_start,
+                           band_row * image->width * sizeof(uint16_t));
+            NEF_STATS_RESTART(band_start);
+
+            if ((ret = sink->put_rows(sink, row + 1 - band_row, band_row, dest,
+                                      image->width, stride)) != NEF_OK)
+            {
+                goto exit;
+            }
+
+            NEF_STATS_STOP(nef, NEF_STAGE_CONVERT, band_start,
+                           band_row * image->width * sizeof(uint16_t));
+            band_row = 0;
+        }
+    }
+
+exit:
+    nef_free(nef, band);
+    nef_free(nef, data);
+
+    return ret;
+}
+
 static NEF_STATUS nef_npc_clean_up(struct nef_image *image)
 {
+    struct nef_npc_huff *state = NULL;
+
+    NEF_CHECK_ARG(image);
+
+    state = (struct nef_npc_huff *)image->reader_state;
+
+    if (state != NULL) {
+        nef_npc_free_state(image->nef_file, state);
+    }
+
+    image->reader_state = NULL;
+
     return NEF_OK;
 }
 
@@ -195,5 +666,129 @@ struct nef_image_reader nef_huff = {
     .init_state = nef_npc_init_state,
     .read_image_tile = nef_npc_read_image_tile,
     .image_tile_size = nef_npc_get_image_tile_size,
+    .decode_rows = nef_npc_decode_rows,
     .clean_state = nef_npc_clean_up
 };
+
+/* Bytes of bitstream a row of width samples can take at most: no code is
+ * longer than 16 bits, nor any difference longer than 16 bits */
+#define NEF_NPC_ROW_MAX_BYTES(width)    ((size_t)(width) * 4 + 1)
+
+struct nef_npc_stream {
+    struct nef_npc_huff *state;
+    int vpred[2][2];
+
+    /* Next row to decode, and the bits of the first byte of the next data
+     * passed in that were already used */
+    unsigned row;
+    unsigned bit_off;
+
+    unsigned width;
+    unsigned height;
+};
+
+NEF_STATUS nef_npc_stream_new(nef_t *nef, const uint8_t *table, size_t bytes,
+                              unsigned bits, unsigned width, unsigned height,
+                              struct nef_npc_stream **npc)
+{
+    struct nef_npc_stream *dec = NULL;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(table);
+    NEF_CHECK_ARG(npc);
+
+    *npc = NULL;
+
+    if (bits != 12 && bits != 14) {
+        NEF_TRACE("Unsupported sample depth: %u\n", bits);
+        return NEF_RANGE_ERROR;
+    }
+
+    dec = (struct nef_npc_stream *)nef_alloc(nef, sizeof(*dec));
+    if (dec == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    if ((ret = nef_npc_parse_table(nef, table, bytes, bits, &dec->state))
+            != NEF_OK)
+    {
+        nef_free(nef, dec);
+        return ret;
+    }
+
+    memcpy(dec->vpred, dec->state->predictor, sizeof(dec->vpred));
+    dec->width = width;
+    dec->height = height;
+
+    *npc = dec;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_npc_stream_rows(struct nef_npc_stream *npc, const uint8_t *data,
+                               size_t bytes, int final, uint16_t *out,
+                               unsigned stride, unsigned nr_rows,
+                               unsigned *decoded, size_t *consumed)
+{
+    struct biterator bit;
+    unsigned done = 0;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(npc);
+    NEF_CHECK_ARG(out);
+    NEF_CHECK_ARG(decoded);
+    NEF_CHECK_ARG(consumed);
+
+    *decoded = 0;
+    *consumed = 0;
+
+    if (bytes == 0) {
+        return final && npc->row < npc->height ? NEF_RANGE_ERROR : NEF_OK;
+    }
+
+    nef_npc_biterator_init(&bit, (uint8_t *)data, bytes);
+    bit.bit_off = npc->bit_off;
+
+    while (done < nr_rows && npc->row < npc->height) {
+        /* Unless this is all there is, only decode rows that must be
+         * complete, so no row is left half decoded */
+        if (!final &&
+            bytes - bit.buf_off < NEF_NPC_ROW_MAX_BYTES(npc->width) + 1)
+        {
+            break;
+        }
+
+        if ((ret = nef_npc_decode_row(npc->state, &bit, npc->vpred, npc->row,
+                                      npc->width, out + done * stride))
+                != NEF_OK)
+        {
+            break;
+        }
+
+        npc->row++;
+        done++;
+    }
+
+    /* Hand back the bytes that were used up */
+    if (bit.bit_off == 8) {
+        *consumed = bit.buf_off + 1;
+        npc->bit_off = 0;
+    } else {
+        *consumed = bit.buf_off;
+        npc->bit_off = bit.bit_off;
+    }
+
+    *decoded = done;
+
+    return ret;
+}
+
+void nef_npc_stream_free(nef_t *nef, struct nef_npc_stream *npc)
+{
+    if (npc == NULL) {
+        return;
+    }
+
+    nef_npc_free_state(nef, npc->state);
+    nef_free(nef, npc);
+}
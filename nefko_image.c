@@ -5,6 +5,8 @@
 #include <ghetto.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 NEF_STATUS nef_image_get_count(nef_t *fp, int *count)
 {
@@ -33,23 +35,506 @@ NEF_STATUS nef_image_get_handle(nef_t *fp, int id, nef_image_t **hdl)
     return NEF_OK;
 }
 
+NEF_STATUS nef_image_set_decode_mode(nef_t *fp, nef_image_t *hdl, int mode)
+{
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    switch (mode) {
+    case NEF_DECODE_FULL:
+        break;
+    case NEF_DECODE_HALF_RGB:
+    case NEF_DECODE_HALF_AVG:
+        if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1) {
+            NEF_TRACE("Half-size decoding needs a CFA image\n");
+            return NEF_BAD_ARGUMENT;
+        }
+        break;
+    default:
+        NEF_TRACE("Unknown decode mode: %d\n", mode);
+        return NEF_RANGE_ERROR;
+    }
+
+    hdl->decode_mode = mode;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_init_output_conv(nef_t *fp, nef_image_t *hdl,
+                                      int pixel_format, unsigned black,
+                                      unsigned white, int wb,
+                                      struct nef_output_conv *conv)
+{
+    float coeffs[3] = { 1.0f, 1.0f, 1.0f };
+    float full;
+    int count = 3, i;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(conv);
+
+    if (pixel_format != NEF_PIXEL_8 && pixel_format != NEF_PIXEL_16) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (black == NEF_BLACK_CAMERA) {
+        black = fp->params.black_level;
+    }
+
+    /* The camera's saturation level is given for 14-bit samples */
+    if (white == 0 && fp->params.white_level != 0 &&
+        hdl->bits_per_sample <= 14)
+    {
+        white = fp->params.white_level >> (14 - hdl->bits_per_sample);
+    }
+
+    if (white == 0) {
+        white = (1u << hdl->bits_per_sample) - 1;
+    }
+
+    if (white <= black) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (wb) {
+        NEFKO_CHECK(nef_meta_white_balance(fp, &count, coeffs), NEF_NOT_FOUND);
+    }
+
+    full = pixel_format == NEF_PIXEL_8 ? 255.0f : 65535.0f;
+
+    conv->pixel_format = pixel_format;
+
+    for (i = 0; i < 4; i++) {
+        conv->black[i] = black;
+        conv->gain[i] = full / (float)(white - black) *
+            coeffs[hdl->cfa_pattern[i]];
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_get_active_area(nef_t *fp, nef_image_t *hdl,
+                                     unsigned *left, unsigned *top,
+                                     unsigned *width, unsigned *height)
+{
+    unsigned w, h, x = 0, y = 0;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    w = hdl->width;
+    h = hdl->height;
+
+    /* Centre the camera's active area, keeping whole CFA quads */
+    if (hdl->type == NEF_IMAGE_FULL && fp->params.active_width != 0 &&
+        fp->params.active_height != 0 &&
+        fp->params.active_width <= hdl->width &&
+        fp->params.active_height <= hdl->height)
+    {
+        w = fp->params.active_width;
+        h = fp->params.active_height;
+        x = ((hdl->width - w) >> 1) & ~1u;
+        y = ((hdl->height - h) >> 1) & ~1u;
+    }
+
+    if (left) *left = x;
+    if (top) *top = y;
+    if (width) *width = w;
+    if (height) *height = h;
+
+    return NEF_OK;
+}
+
+/* Get entry i of a SHORT or LONG array tag */
+static uint32_t nef_image_tag_entry(const void *data, int type, int i)
+{
+    if (type == TIFF_TYPE_SHORT) {
+        return ((const uint16_t *)data)[i];
+    }
+
+    return ((const uint32_t *)data)[i];
+}
+
+/* Find the byte range of the JPEG stream of an image. Preview IFDs point
+ * at it with JPEGInterchangeFormat; otherwise, it is the strips of a JPEG
+ * compressed image, which must be contiguous.
+ */
+static NEF_STATUS nef_image_find_jpeg(nef_t *fp, nef_image_t *hdl,
+                                      uint32_t *off, uint32_t *len)
+{
+    void *offsets = NULL, *counts = NULL;
+    int type_off, type_cnt, count_off, count_cnt, i;
+    NEF_STATUS ret = NEF_OK;
+
+    *off = 0;
+    *len = 0;
+
+    if (nef_get_tag(fp, hdl, TIFF_TAG_JPEGIFOFFSET, off) == NEF_OK &&
+        nef_get_tag(fp, hdl, TIFF_TAG_JPEGIFBYTECOUNT, len) == NEF_OK &&
+        *len != 0)
+    {
+        return NEF_OK;
+    }
+
+    if (hdl->compression != TIFF_COMPRESSION_OJPEG &&
+        hdl->compression != TIFF_COMPRESSION_JPEG)
+    {
+        return NEF_NOT_FOUND;
+    }
+
+    if (nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPOFFSETS, &offsets,
+                          &type_off, &count_off) != NEF_OK ||
+        nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPBYTECOUNTS, &counts,
+                          &type_cnt, &count_cnt) != NEF_OK)
+    {
+        ret = NEF_NOT_FOUND;
+        goto done;
+    }
+
+    if (count_off != count_cnt || count_off == 0) {
+        ret = NEF_RANGE_ERROR;
+        goto done;
+    }
+
+    *off = nef_image_tag_entry(offsets, type_off, 0);
+
+    for (i = 0; i < count_off; i++) {
+        if (nef_image_tag_entry(offsets, type_off, i) != *off + *len) {
+            NEF_TRACE("JPEG strips are not contiguous\n");
+            ret = NEF_RANGE_ERROR;
+            goto done;
+        }
+        *len += nef_image_tag_entry(counts, type_cnt, i);
+    }
+
+done:
+    nef_free(fp, offsets);
+    nef_free(fp, counts);
+
+    return ret;
+}
+
+/* Give each of a set of hints for one range, sequential first so that the
+ * readahead it sets up covers the range */
+static void nef_image_hint_range(nef_t *fp, uint32_t off, uint32_t len,
+                                 unsigned hints)
+{
+    if (hints & NEF_HINT_SEQUENTIAL) {
+        nef_hint_range(fp, off, len, NEF_HINT_SEQUENTIAL);
+    }
+
+    if (hints & NEF_HINT_WILLNEED) {
+        nef_hint_range(fp, off, len, NEF_HINT_WILLNEED);
+    }
+
+    if (hints & NEF_HINT_DONTNEED) {
+        nef_hint_range(fp, off, len, NEF_HINT_DONTNEED);
+    }
+}
+
+void nef_image_hint(nef_t *fp, nef_image_t *hdl, int when)
+{
+    void *offsets = NULL, *counts = NULL;
+    int type_off, type_cnt, count_off, count_cnt, i;
+    uint32_t off = 0, len = 0;
+    unsigned hints;
+
+    if (when == NEF_HINT_AFTER) {
+        hints = fp->hints & NEF_HINT_DONTNEED;
+    } else {
+        hints = fp->hints & ~NEF_HINT_DONTNEED;
+    }
+
+    /* Only madvise takes sequential hints; anything else needs a file */
+    if (fp->map == NULL) {
+        hints &= ~NEF_HINT_SEQUENTIAL;
+    }
+
+    if (hints == 0 || hdl->ifd == NULL ||
+        (fp->map == NULL && fp->fd < 0 && fp->path == NULL))
+    {
+        return;
+    }
+
+    if (nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPOFFSETS, &offsets,
+                          &type_off, &count_off) != NEF_OK ||
+        nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPBYTECOUNTS, &counts,
+                          &type_cnt, &count_cnt) != NEF_OK ||
+        count_off != count_cnt)
+    {
+        goto done;
+    }
+
+    /* Strips are usually back to back; hint each run of them at once */
+    for (i = 0; i < count_off; i++) {
+        uint32_t strip_off = nef_image_tag_entry(offsets, type_off, i);
+        uint32_t strip_len = nef_image_tag_entry(counts, type_cnt, i);
+
+        if (len != 0 && strip_off == off + len) {
+            len += strip_len;
+            continue;
+        }
+
+        nef_image_hint_range(fp, off, len, hints);
+        off = strip_off;
+        len = strip_len;
+    }
+
+    nef_image_hint_range(fp, off, len, hints);
+
+done:
+    nef_free(fp, offsets);
+    nef_free(fp, counts);
+}
+
+NEF_STATUS nef_image_get_preview(nef_t *fp, nef_image_t *hdl,
+                                 const void **data, size_t *bytes)
+{
+    const uint8_t *jpeg = NULL;
+    uint32_t off, len;
+    size_t count_read = 0;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(data);
+    NEF_CHECK_ARG(bytes);
+
+    *data = NULL;
+    *bytes = 0;
+
+    if (hdl->preview != NULL) {
+        *data = hdl->preview;
+        *bytes = hdl->preview_bytes;
+        return NEF_OK;
+    }
+
+    NEFKO_CHECK(nef_image_find_jpeg(fp, hdl, &off, &len), NEF_NOT_FOUND);
+
+    if (fp->map != NULL) {
+        if ((size_t)off + len > fp->map_bytes) {
+            NEF_ERROR("JPEG stream runs past the end of the file\n");
+            return NEF_RANGE_ERROR;
+        }
+
+        nef_image_hint_range(fp, off, len, fp->hints & ~NEF_HINT_DONTNEED);
+        jpeg = fp->map + off;
+    } else {
+        uint8_t *buf;
+        NEF_STATS_START(start);
+
+        if ((buf = (uint8_t *)nef_alloc_raw(fp, len)) == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        if (tiff_read(fp->tiff_fp, off, len, 1, buf, &count_read) != TIFF_OK) {
+            NEF_ERROR("Failed to read the %u byte JPEG stream\n", len);
+            nef_free(fp, buf);
+            return NEF_FAILURE;
+        }
+
+        /* The buffer is not zeroed, and is kept for later calls */
+        if (count_read != len) {
+            NEF_ERROR("Read %zu of the %u byte JPEG stream\n", count_read,
+                len);
+            nef_free(fp, buf);
+            return NEF_RANGE_ERROR;
+        }
+
+        NEF_STATS_STOP(fp, NEF_STAGE_IO, start, len);
+
+        /* The stream is kept with the image, so the file is done with */
+        nef_image_hint_range(fp, off, len, fp->hints & NEF_HINT_DONTNEED);
+
+        hdl->preview = buf;
+        hdl->preview_bytes = len;
+        jpeg = buf;
+    }
+
+    if (len < 2 || jpeg[0] != 0xff || jpeg[1] != 0xd8) {
+        NEF_WARN("JPEG stream does not start with an SOI marker\n");
+    }
+
+    *data = jpeg;
+    *bytes = len;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_set_output_conv(nef_t *fp, nef_image_t *hdl,
+                                     const struct nef_output_conv *conv)
+{
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    if (conv == NULL) {
+        hdl->has_conv = 0;
+        return NEF_OK;
+    }
+
+    if (conv->pixel_format != NEF_PIXEL_8 &&
+        conv->pixel_format != NEF_PIXEL_16)
+    {
+        NEF_TRACE("Unknown pixel format: %d\n", conv->pixel_format);
+        return NEF_RANGE_ERROR;
+    }
+
+    if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1) {
+        NEF_TRACE("Output conversion needs a CFA image\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    hdl->conv = *conv;
+    hdl->has_conv = 1;
+
+    return NEF_OK;
+}
+
+void nef_image_get_stored_dims(nef_image_t *hdl, unsigned *width,
+                               unsigned *height, unsigned *chans)
+{
+    switch (hdl->decode_mode) {
+    case NEF_DECODE_HALF_RGB:
+        *width = hdl->width / 2;
+        *height = hdl->height / 2;
+        *chans = 3;
+        break;
+    case NEF_DECODE_HALF_AVG:
+        *width = hdl->width / 2;
+        *height = hdl->height / 2;
+        *chans = 1;
+        break;
+    default:
+        *width = hdl->width;
+        *height = hdl->height;
+        *chans = hdl->chans;
+        break;
+    }
+}
+
+void nef_image_get_output_dims(nef_image_t *hdl, unsigned *width,
+                               unsigned *height, unsigned *chans)
+{
+    nef_image_get_stored_dims(hdl, width, height, chans);
+
+    /* Orientations 5 to 8 swap rows for columns */
+    if (hdl->orientation >= 5) {
+        unsigned t = *width;
+
+        *width = *height;
+        *height = t;
+    }
+}
+
+NEF_STATUS nef_image_set_orientation(nef_t *fp, nef_image_t *hdl,
+                                     int orientation)
+{
+    uint16_t tag = 0;
+    int type, count;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+
+    if (orientation == NEF_ORIENT_AUTO) {
+        orientation = NEF_ORIENT_STORED;
+
+        if (fp->decoded == NULL &&
+            nef_exif_get_tag(fp, TIFF_TAG_ORIENTATION, &type, &count, NULL)
+                == NEF_OK && type == TIFF_TYPE_SHORT && count == 1 &&
+            nef_exif_get_tag(fp, TIFF_TAG_ORIENTATION, &type, &count, &tag)
+                == NEF_OK && tag >= 1 && tag <= 8)
+        {
+            orientation = tag;
+        }
+    } else if (orientation < 1 || orientation > 8) {
+        NEF_TRACE("Unknown orientation: %d\n", orientation);
+        return NEF_RANGE_ERROR;
+    }
+
+    hdl->orientation = orientation;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_get_cfa_pattern(nef_t *fp, nef_image_t *hdl,
+                                     unsigned char *pattern)
+{
+    unsigned w, h, dx, dy;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(pattern);
+
+    w = hdl->width;
+    h = hdl->height;
+
+    /* Find where each displayed position of the pattern was stored */
+    for (dy = 0; dy < 2; dy++) {
+        for (dx = 0; dx < 2; dx++) {
+            unsigned sx, sy;
+
+            switch (hdl->orientation) {
+            case 2:
+                sx = w - 1 - dx;
+                sy = dy;
+                break;
+            case 3:
+                sx = w - 1 - dx;
+                sy = h - 1 - dy;
+                break;
+            case 4:
+                sx = dx;
+                sy = h - 1 - dy;
+                break;
+            case 5:
+                sx = dy;
+                sy = dx;
+                break;
+            case 6:
+                sx = dy;
+                sy = h - 1 - dx;
+                break;
+            case 7:
+                sx = w - 1 - dy;
+                sy = h - 1 - dx;
+                break;
+            case 8:
+                sx = w - 1 - dy;
+                sy = dx;
+                break;
+            default:
+                sx = dx;
+                sy = dy;
+                break;
+            }
+
+            pattern[dy * 2 + dx] = hdl->cfa_pattern[(sy & 1) * 2 + (sx & 1)];
+        }
+    }
+
+    return NEF_OK;
+}
+
 NEF_STATUS nef_image_get_attribs(nef_t *fp, nef_image_t *hdl,
                                  int *width, int *height, int *chans,
                                  int *image_type, int *data_type)
 {
+    unsigned out_width, out_height, out_chans;
+
     NEF_CHECK_ARG(fp);
     NEF_CHECK_ARG(hdl);
 
+    nef_image_get_output_dims(hdl, &out_width, &out_height, &out_chans);
+
     if (width) {
-        *width = hdl->width;
+        *width = out_width;
     }
 
     if (height) {
-        *height = hdl->height;
+        *height = out_height;
     }
 
     if (chans) {
-        *chans = hdl->chans;
+        *chans = out_chans;
     }
 
     if (image_type) {
@@ -63,12 +548,13 @@ NEF_STATUS nef_image_get_attribs(nef_t *fp, nef_image_t *hdl,
     return NEF_OK;
 }
 
-/* Decompress a TIFF_COMPRESSION_NIKON type compressed image */
-static NEF_STATUS nef_image_get_nikon_raw(nef_t *fp, nef_image_t *hdl,
-                                          unsigned bufsize, void *image_buf)
+NEF_STATUS nef_image_read_strips(nef_t *fp, nef_image_t *hdl,
+                                 uint8_t **data, size_t *bytes)
 {
     unsigned *stripoffsets = NULL, *stripbytecounts = NULL;
     int type, count, count_off, count_cnts, i;
+    uint8_t *buf = NULL;
+    size_t total = 0, pos = 0;
     NEF_STATUS ret = NEF_OK;
 
 #if _DUMP_IMAGE_DATA
@@ -76,6 +562,12 @@ static NEF_STATUS nef_image_get_nikon_raw(nef_t *fp, nef_image_t *hdl,
     FILE *ffp = NULL;
 #endif
 
+    NEF_CHECK_ARG(data);
+    NEF_CHECK_ARG(bytes);
+
+    *data = NULL;
+    *bytes = 0;
+
     if (nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPBYTECOUNTS,
                           (void**)&stripbytecounts, &type, &count_off) != NEF_OK)
     {
@@ -83,14 +575,14 @@ static NEF_STATUS nef_image_get_nikon_raw(nef_t *fp, nef_image_t *hdl,
         return NEF_NOT_FOUND;
     }
 
-    NEF_TRACE("Got %d strips (type = %d)!\n", count, type);
+    NEF_TRACE("Got %d strips (type = %d)!\n", count_off, type);
     count = count_off;
 
     if (nef_get_tag_alloc(fp, hdl->ifd, TIFF_TAG_STRIPOFFSETS,
                           (void**)&stripoffsets, &type, &count_cnts) != NEF_OK)
     {
         NEF_TRACE("Failed to get StripOffsets tag!\n");
-        free(stripbytecounts);
+        nef_free(fp, stripbytecounts);
         return NEF_NOT_FOUND;
     }
 
@@ -100,6 +592,17 @@ static NEF_STATUS nef_image_get_nikon_raw(nef_t *fp, nef_image_t *hdl,
         goto exit;
     }
 
+    for (i = 0; i < count; i++) {
+        total += stripbytecounts[i];
+    }
+
+    buf = (uint8_t *)nef_alloc_raw(fp, total);
+
+    if (buf == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto exit;
+    }
+
 #if _DUMP_IMAGE_DATA
     /* Load the data and dump it to a temporary file... */
     asprintf(&fname, "%dX%d.dat", hdl->width, hdl->height);
@@ -108,58 +611,44 @@ static NEF_STATUS nef_image_get_nikon_raw(nef_t *fp, nef_image_t *hdl,
 #endif
 
     for (i = 0; i < count; i++) {
-        uint8_t *buf = (uint8_t *)malloc(stripbytecounts[i]);
         size_t count_read = 0;
-
-        if (buf == NULL) {
-            ret = NEF_NO_MEMORY;
-            goto exit;
-        }
+        NEF_STATS_START(start);
 
         NEF_TRACE("Reading strip %d (offset = %08x count = %u)\n",
             i, stripoffsets[i], stripbytecounts[i]);
 
         if (tiff_read(fp->tiff_fp, stripoffsets[i], stripbytecounts[i], 1,
-                      buf, &count_read) != TIFF_OK)
+                      buf + pos, &count_read) != TIFF_OK)
         {
-            NEF_TRACE("Failed to read %u bytes.\n",
+            NEF_ERROR("Failed to read %u bytes.\n",
                 stripbytecounts[i]);
             ret = NEF_RANGE_ERROR;
-            free(buf);
+            nef_free(fp, buf);
             goto exit;
         }
 
+        NEF_STATS_STOP(fp, NEF_STAGE_IO, start, count_read);
+
         NEF_TRACE("Read %zd bytes\n", count_read);
 
 #if _DUMP_IMAGE_DATA
-        fwrite(buf, stripbytecounts[i], 1, ffp);
+        fwrite(buf + pos, stripbytecounts[i], 1, ffp);
 #endif
 
-        free(buf);
+        pos += stripbytecounts[i];
     }
 
 #if _DUMP_IMAGE_DATA
     fclose(ffp);
 #endif
 
+    *data = buf;
+    *bytes = total;
+
 exit:
-    free(stripbytecounts);
-    free(stripoffsets);
+    nef_free(fp, stripoffsets);
+    nef_free(fp, stripbytecounts);
 
     return ret;
 }
 
-NEF_STATUS nef_image_get_raw(nef_t *fp, nef_image_t *hdl, unsigned bufsize,
-                             void *image_buf)
-{
-    NEF_CHECK_ARG(fp);
-    NEF_CHECK_ARG(hdl);
-    NEF_CHECK_ARG(image_buf);
-
-    NEF_TRACE("Loading unformatted image data...\n");
-
-    nef_image_get_nikon_raw(fp, hdl, bufsize, image_buf);
-
-    return NEF_OK;
-}
-
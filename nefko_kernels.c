@@ -0,0 +1,340 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Data-parallel kernels. Each kernel is written once, as a generic body
+ * that the compiler can vectorize, and instantiated for several
+ * instruction sets. The best instantiation the CPU supports is picked
+ * once, when the library is loaded; the NEFKO_CPU environment variable
+ * can force a lesser one ("scalar", "sse4.2", "avx2" or "avx512").
+ *
+ * The bodies are kept free of data-dependent branches (clamping is done
+ * on integers, where it maps onto min/max instructions), and the output
+ * conversion handles one pair of CFA samples per iteration.
+ */
+
+#define NEF_CONV_CLAMP(v, max) \
+    ((v) < 0 ? 0 : ((v) > (max) ? (max) : (v)))
+
+#define NEF_KERNEL_BODY static inline __attribute__((always_inline))
+
+NEF_KERNEL_BODY void nef_conv_row_16_body(const uint16_t *src, uint16_t *dst,
+                                          unsigned width, const float *black,
+                                          const float *gain)
+{
+    const float b0 = black[0], b1 = black[1];
+    const float g0 = gain[0], g1 = gain[1];
+    unsigned x;
+
+    for (x = 0; x + 1 < width; x += 2) {
+        int v0 = (int)(((float)src[x] - b0) * g0 + 0.5f);
+        int v1 = (int)(((float)src[x + 1] - b1) * g1 + 0.5f);
+
+        dst[x] = NEF_CONV_CLAMP(v0, 65535);
+        dst[x + 1] = NEF_CONV_CLAMP(v1, 65535);
+    }
+
+    if (x < width) {
+        int v0 = (int)(((float)src[x] - b0) * g0 + 0.5f);
+        dst[x] = NEF_CONV_CLAMP(v0, 65535);
+    }
+}
+
+NEF_KERNEL_BODY void nef_conv_row_8_body(const uint16_t *src, uint8_t *dst,
+                                         unsigned width, const float *black,
+                                         const float *gain)
+{
+    const float b0 = black[0], b1 = black[1];
+    const float g0 = gain[0], g1 = gain[1];
+    unsigned x;
+
+    for (x = 0; x + 1 < width; x += 2) {
+        int v0 = (int)(((float)src[x] - b0) * g0 + 0.5f);
+        int v1 = (int)(((float)src[x + 1] - b1) * g1 + 0.5f);
+
+        dst[x] = NEF_CONV_CLAMP(v0, 255);
+        dst[x + 1] = NEF_CONV_CLAMP(v1, 255);
+    }
+
+    if (x < width) {
+        int v0 = (int)(((float)src[x] - b0) * g0 + 0.5f);
+        dst[x] = NEF_CONV_CLAMP(v0, 255);
+    }
+}
+
+/* The deobfuscation keystream (see nefko_decrypt.c) is a running sum, but
+ * byte i of it has the closed form
+ *     iv + key * ((i + 1) * 0x60 + i * (i + 1) / 2)
+ * modulo 256. This only depends on i modulo 512, so the keystream repeats
+ * every NEF_KEYSTREAM_PERIOD bytes: generate one period, without any
+ * dependency between bytes, then XOR it over the buffer.
+ */
+#define NEF_KEYSTREAM_PERIOD    512
+
+NEF_KERNEL_BODY void nef_decrypt_body(uint8_t *buf, size_t bytes, uint8_t key,
+                                      uint8_t iv)
+{
+    uint8_t stream[NEF_KEYSTREAM_PERIOD];
+    size_t off, len = bytes < NEF_KEYSTREAM_PERIOD ? bytes : NEF_KEYSTREAM_PERIOD;
+    uint32_t n;
+
+    for (n = 0; n < len; n++) {
+        stream[n] = iv + key * ((n + 1) * 0x60 + ((n * (n + 1)) >> 1));
+    }
+
+    for (off = 0; off < bytes; off += NEF_KEYSTREAM_PERIOD) {
+        size_t i, chunk = bytes - off < NEF_KEYSTREAM_PERIOD ?
+            bytes - off : NEF_KEYSTREAM_PERIOD;
+
+        for (i = 0; i < chunk; i++) {
+            buf[off + i] ^= stream[i];
+        }
+    }
+}
+
+/* Packed samples are unpacked a group at a time: a group is the smallest
+ * run of samples that fills whole bytes. Every group is independent, so
+ * the loops vectorize.
+ */
+NEF_KERNEL_BODY void nef_unpack_12_body(const uint8_t *src, uint16_t *dst,
+                                        size_t count, int msb_first)
+{
+    size_t i, n = count / 2;
+
+    if (msb_first) {
+        for (i = 0; i < n; i++) {
+            const uint8_t *b = src + 3 * i;
+
+            dst[2 * i] = (b[0] << 4) | (b[1] >> 4);
+            dst[2 * i + 1] = ((b[1] & 0xf) << 8) | b[2];
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            const uint8_t *b = src + 3 * i;
+
+            dst[2 * i] = b[0] | ((b[1] & 0xf) << 8);
+            dst[2 * i + 1] = (b[1] >> 4) | (b[2] << 4);
+        }
+    }
+}
+
+/* Load the 7 bytes of a group of 14-bit samples into the low 56 bits of a
+ * word, first byte most significant (big) or least significant (little).
+ * All but the last group of a buffer may load a byte past their end.
+ */
+NEF_KERNEL_BODY uint64_t nef_unpack_14_load(const uint8_t *b, int big, int last)
+{
+    uint64_t v = 0;
+
+    if (last) {
+        memcpy(&v, b, 7);
+    } else {
+        memcpy(&v, b, 8);
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = big ? v >> 8 : __builtin_bswap64(v) & 0xffffffffffffffull;
+#else
+    v = big ? __builtin_bswap64(v) >> 8 : v & 0xffffffffffffffull;
+#endif
+
+    return v;
+}
+
+NEF_KERNEL_BODY void nef_unpack_14_body(const uint8_t *src, uint16_t *dst,
+                                        size_t count, int msb_first)
+{
+    size_t i, n = count / 4;
+
+    if (n == 0) {
+        return;
+    }
+
+    if (msb_first) {
+        for (i = 0; i < n; i++) {
+            uint64_t v = nef_unpack_14_load(src + 7 * i, 1, i + 1 == n);
+
+            dst[4 * i] = (v >> 42) & 0x3fff;
+            dst[4 * i + 1] = (v >> 28) & 0x3fff;
+            dst[4 * i + 2] = (v >> 14) & 0x3fff;
+            dst[4 * i + 3] = v & 0x3fff;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            uint64_t v = nef_unpack_14_load(src + 7 * i, 0, i + 1 == n);
+
+            dst[4 * i] = v & 0x3fff;
+            dst[4 * i + 1] = (v >> 14) & 0x3fff;
+            dst[4 * i + 2] = (v >> 28) & 0x3fff;
+            dst[4 * i + 3] = (v >> 42) & 0x3fff;
+        }
+    }
+}
+
+NEF_KERNEL_BODY void nef_swap_16_body(const uint16_t *src, uint16_t *dst,
+                                      size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        dst[i] = (uint16_t)((src[i] << 8) | (src[i] >> 8));
+    }
+}
+
+/* Sensor calibration. The loops are split on which corrections there are,
+ * so that each is branch-free. The flat-field product of a 16-bit sample
+ * and a 16-bit gain fits in 32 bits.
+ */
+NEF_KERNEL_BODY void nef_calib_row_body(const uint16_t *src, uint16_t *dst,
+                                        unsigned width, const uint16_t *dark,
+                                        const uint16_t *flat)
+{
+    const uint32_t round = 1u << (NEF_CALIB_FLAT_SHIFT - 1);
+    unsigned x;
+
+    if (dark != NULL && flat != NULL) {
+        for (x = 0; x < width; x++) {
+            uint32_t v = src[x] > dark[x] ? src[x] - dark[x] : 0;
+
+            v = (v * flat[x] + round) >> NEF_CALIB_FLAT_SHIFT;
+            dst[x] = v > 65535 ? 65535 : v;
+        }
+    } else if (dark != NULL) {
+        for (x = 0; x < width; x++) {
+            dst[x] = src[x] > dark[x] ? src[x] - dark[x] : 0;
+        }
+    } else if (flat != NULL) {
+        for (x = 0; x < width; x++) {
+            uint32_t v = ((uint32_t)src[x] * flat[x] + round) >>
+                NEF_CALIB_FLAT_SHIFT;
+
+            dst[x] = v > 65535 ? 65535 : v;
+        }
+    } else {
+        memcpy(dst, src, width * sizeof(uint16_t));
+    }
+}
+
+#define NEF_KERNELS(isa, isa_name, attr) \
+    attr static void nef_conv_row_16_##isa(const uint16_t *src, uint16_t *dst, \
+            unsigned width, const float *black, const float *gain) \
+    { \
+        nef_conv_row_16_body(src, dst, width, black, gain); \
+    } \
+    attr static void nef_conv_row_8_##isa(const uint16_t *src, uint8_t *dst, \
+            unsigned width, const float *black, const float *gain) \
+    { \
+        nef_conv_row_8_body(src, dst, width, black, gain); \
+    } \
+    attr static void nef_decrypt_##isa(uint8_t *buf, size_t bytes, \
+            uint8_t key, uint8_t iv) \
+    { \
+        nef_decrypt_body(buf, bytes, key, iv); \
+    } \
+    attr static void nef_unpack_12_##isa(const uint8_t *src, uint16_t *dst, \
+            size_t count, int msb_first) \
+    { \
+        nef_unpack_12_body(src, dst, count, msb_first); \
+    } \
+    attr static void nef_unpack_14_##isa(const uint8_t *src, uint16_t *dst, \
+            size_t count, int msb_first) \
+    { \
+        nef_unpack_14_body(src, dst, count, msb_first); \
+    } \
+    attr static void nef_swap_16_##isa(const uint16_t *src, uint16_t *dst, \
+            size_t count) \
+    { \
+        nef_swap_16_body(src, dst, count); \
+    } \
+    attr static void nef_calib_row_##isa(const uint16_t *src, uint16_t *dst, \
+            unsigned width, const uint16_t *dark, const uint16_t *flat) \
+    { \
+        nef_calib_row_body(src, dst, width, dark, flat); \
+    } \
+    static const struct nef_kernels nef_kernels_##isa = { \
+        .name = (isa_name), \
+        .conv_row_16 = nef_conv_row_16_##isa, \
+        .conv_row_8 = nef_conv_row_8_##isa, \
+        .decrypt = nef_decrypt_##isa, \
+        .unpack_12 = nef_unpack_12_##isa, \
+        .unpack_14 = nef_unpack_14_##isa, \
+        .swap_16 = nef_swap_16_##isa, \
+        .calib_row = nef_calib_row_##isa, \
+    };
+
+/* The scalar kernels are kept scalar, as a reference and a baseline */
+NEF_KERNELS(scalar, "scalar", __attribute__((optimize("no-tree-vectorize"))))
+
+#if defined(__x86_64__) || defined(__i386__)
+NEF_KERNELS(sse42, "sse4.2", __attribute__((target("sse4.2"))))
+NEF_KERNELS(avx2, "avx2", __attribute__((target("avx2"))))
+NEF_KERNELS(avx512, "avx512",
+            __attribute__((target("avx512f,avx512bw,avx512vl"))))
+#endif
+
+const struct nef_kernels *nef_kernels = &nef_kernels_scalar;
+
+/* Kernel sets, from least to most capable */
+static const struct nef_kernels *nef_kernel_sets[] = {
+    &nef_kernels_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+    &nef_kernels_sse42,
+    &nef_kernels_avx2,
+    &nef_kernels_avx512,
+#endif
+};
+
+#define NEF_NR_KERNEL_SETS \
+    (sizeof(nef_kernel_sets) / sizeof(nef_kernel_sets[0]))
+
+/* Get the index of the most capable kernel set the CPU can run */
+static unsigned nef_kernels_best(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl"))
+    {
+        return 3;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        return 2;
+    }
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+static void __attribute__((constructor)) nef_kernels_select(void)
+{
+    unsigned best = nef_kernels_best(), i;
+    const char *force = getenv("NEFKO_CPU");
+
+    if (force != NULL) {
+        for (i = 0; i < NEF_NR_KERNEL_SETS; i++) {
+            if (!strcmp(force, nef_kernel_sets[i]->name)) {
+                /* Never pick kernels the CPU cannot run */
+                if (i < best) {
+                    best = i;
+                }
+                break;
+            }
+        }
+    }
+
+    nef_kernels = nef_kernel_sets[best];
+}
+
+const char *nef_cpu_kernels(void)
+{
+    return nef_kernels->name;
+}
@@ -0,0 +1,47 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/* Messages longer than this are truncated */
+#define NEF_LOG_MSG_MAX     512
+
+int nef_log_level = -1;
+
+static nef_log_func_t nef_log_func = NULL;
+static void *nef_log_ctx = NULL;
+
+NEF_STATUS nef_set_log_callback(nef_log_func_t func, void *ctx, int level)
+{
+    if (func != NULL && (level < NEF_LOG_ERROR || level > NEF_LOG_DEBUG)) {
+        return NEF_RANGE_ERROR;
+    }
+
+    nef_log_level = -1;
+    nef_log_func = func;
+    nef_log_ctx = ctx;
+
+    if (func != NULL) {
+        nef_log_level = level;
+    }
+
+    return NEF_OK;
+}
+
+void nef_log(int level, const char *func, int line, const char *fmt, ...)
+{
+    char msg[NEF_LOG_MSG_MAX];
+    nef_log_func_t log_func = nef_log_func;
+    va_list ap;
+
+    if (log_func == NULL) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    log_func(nef_log_ctx, level, func, line, msg);
+}
@@ -0,0 +1,287 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_priv_tags.h>
+
+#include <ghetto.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* MakerNote fields that are obfuscated past a version prefix, once the
+ * version is "02xx" or later (earlier versions are stored in the clear).
+ * A zero offset means the camera's settings_crypt_off.
+ */
+static const struct {
+    unsigned tag;
+    unsigned crypt_off;
+} nef_meta_crypted[] = {
+    { TIFF_TAG_MAKERNOTE_SHOT_INFO, 4 },
+    { TIFF_TAG_MAKERNOTE_IMAGE_SETTINGS, 0 },
+    { TIFF_TAG_MAKERNOTE_LENS_DATA, 4 },
+};
+
+/* Find the IFD and the entry of a tag named by a public tag ID */
+static NEF_STATUS nef_meta_find_tag(nef_t *fp, int tag_id, tiff_ifd_t **ifd,
+                                    tiff_tag_t **tag)
+{
+    tiff_ifd_t *ifds[2] = { NULL, NULL };
+    unsigned i;
+
+    *tag = NULL;
+
+    /* Sidecars carry no IFDs */
+    if (fp->tiff_fp == NULL) {
+        return NEF_NOT_FOUND;
+    }
+
+    if (tag_id & NEF_TAG_MAKERNOTE(0)) {
+        ifds[0] = fp->makernote;
+    } else {
+        ifds[0] = fp->exif;
+        ifds[1] = fp->images != NULL ? fp->images[0].ifd : NULL;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (ifds[i] == NULL) {
+            continue;
+        }
+
+        if (tiff_get_tag(fp->tiff_fp, ifds[i], tag_id & 0xffff, tag)
+                == TIFF_OK && *tag != NULL)
+        {
+            *ifd = ifds[i];
+            return NEF_OK;
+        }
+    }
+
+    return NEF_NOT_FOUND;
+}
+
+/* Deobfuscate the value of a tag in place, if it is obfuscated */
+static void nef_meta_decrypt_tag(nef_t *fp, int tag_id, uint8_t *data,
+                                 size_t bytes)
+{
+    unsigned i, off;
+
+    if (!(tag_id & NEF_TAG_MAKERNOTE(0))) {
+        return;
+    }
+
+    for (i = 0; i < sizeof(nef_meta_crypted) / sizeof(nef_meta_crypted[0]);
+         i++)
+    {
+        if (nef_meta_crypted[i].tag != (tag_id & 0xffff)) {
+            continue;
+        }
+
+        off = nef_meta_crypted[i].crypt_off;
+        if (off == 0) {
+            off = fp->params.settings_crypt_off;
+        }
+
+        if (bytes > off && bytes >= 4 && data[0] == '0' && data[1] >= '2') {
+            nef_decrypt_buffer(fp, data + off, bytes - off);
+        }
+
+        return;
+    }
+}
+
+/* Get the type and item count of a tag, and optionally its value */
+static NEF_STATUS nef_meta_get_value(nef_t *fp, int tag_id, int *type,
+                                     int *count, size_t *bytes, void *data,
+                                     size_t capacity)
+{
+    tiff_ifd_t *ifd = NULL;
+    tiff_tag_t *tag = NULL;
+    NEF_STATS_START(start);
+
+    NEFKO_CHECK(nef_meta_find_tag(fp, tag_id, &ifd, &tag), NEF_NOT_FOUND);
+
+    GHETTO_CHECK(tiff_get_tag_info(fp->tiff_fp, tag, NULL, type, count));
+
+    *bytes = tiff_get_type_size(*type) * (size_t)*count;
+
+    if (data == NULL) {
+        return NEF_OK;
+    }
+
+    if (*bytes > capacity) {
+        return NEF_NO_MEMORY;
+    }
+
+    GHETTO_CHECK(tiff_get_tag_data(fp->tiff_fp, ifd, tag, data));
+
+    NEF_STATS_STOP(fp, NEF_STAGE_TAG_FETCH, start, *bytes);
+
+    nef_meta_decrypt_tag(fp, tag_id, (uint8_t *)data, *bytes);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_exif_get_tag(nef_t *fp, int tag_id,
+                            int *tag_type, int *tag_count, void *data)
+{
+    int type, count;
+    size_t bytes;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(fp);
+
+    /* The caller sized data from an earlier call */
+    if ((ret = nef_meta_get_value(fp, tag_id, &type, &count, &bytes, data,
+                                  (size_t)-1)) != NEF_OK)
+    {
+        return ret;
+    }
+
+    if (tag_type) *tag_type = type;
+    if (tag_count) *tag_count = count;
+
+    return NEF_OK;
+}
+
+#define NEF_META_ALIGN(x)   (((x) + 7) & ~(size_t)7)
+
+NEF_STATUS nef_exif_get_tags(nef_t *fp, const int *ids, int n,
+                             struct nef_tag_result *out, void *arena,
+                             size_t arena_len)
+{
+    uint8_t *base = (uint8_t *)arena;
+    size_t used = 0;
+    int i;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(ids);
+    NEF_CHECK_ARG(out);
+
+    for (i = 0; i < n; i++) {
+        struct nef_tag_result *res = &out[i];
+        uint8_t *dst = base != NULL ? base + used : NULL;
+
+        memset(res, 0, sizeof(*res));
+
+        res->status = nef_meta_get_value(fp, ids[i], &res->type, &res->count,
+                                         &res->bytes, dst, arena_len - used);
+
+        if (res->status != NEF_OK) {
+            continue;
+        }
+
+        if (dst == NULL) {
+            /* Without an arena, only the sizes are reported */
+            res->status = NEF_NO_MEMORY;
+            continue;
+        }
+
+        res->data = dst;
+        used += NEF_META_ALIGN(res->bytes);
+
+        if (used > arena_len) {
+            used = arena_len;
+        }
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_meta_get_model(nef_t *fp, int *count, char *model)
+{
+    const char *name = NULL;
+    char *tag = NULL;
+    int type, nr_chars = 0, len;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(count);
+
+    if (fp->decoded != NULL) {
+        name = nef_decoded_model(fp);
+    } else {
+        if (fp->images == NULL ||
+            nef_get_tag_alloc(fp, fp->images[0].ifd, TIFF_TAG_MODEL,
+                              (void **)&tag, &type, &nr_chars) != NEF_OK)
+        {
+            NEF_TRACE("No Model tag\n");
+            return NEF_NOT_FOUND;
+        }
+
+        if (type != TIFF_TYPE_ASCII || nr_chars <= 0) {
+            nef_free(fp, tag);
+            return NEF_RANGE_ERROR;
+        }
+
+        tag[nr_chars - 1] = '\0';
+        name = tag;
+    }
+
+    len = strlen(name) + 1;
+
+    if (model != NULL) {
+        if (*count < len) {
+            if (tag) nef_free(fp, tag);
+            return NEF_RANGE_ERROR;
+        }
+
+        memcpy(model, name, len);
+    }
+
+    *count = len;
+
+    if (tag) nef_free(fp, tag);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_meta_white_balance(nef_t *fp, int *count, float *coeffs)
+{
+    uint32_t *levels = NULL;
+    int type, nr_levels;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(count);
+
+    if (coeffs == NULL) {
+        *count = 3;
+        return NEF_OK;
+    }
+
+    if (*count < 3) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (fp->decoded != NULL) {
+        *count = 3;
+        return nef_decoded_white_balance(fp, coeffs);
+    }
+
+    /* WB_RBLevels is an array of RATIONALs, the red and blue multipliers
+     * relative to green.
+     */
+    if (nef_get_tag_alloc(fp, fp->makernote, TIFF_TAG_MAKERNOTE_WB_LEVELS,
+                          (void **)&levels, &type, &nr_levels) != NEF_OK)
+    {
+        NEF_TRACE("Failed to get WB levels tag.\n");
+        return NEF_NOT_FOUND;
+    }
+
+    if (type != TIFF_TYPE_RATIONAL || nr_levels < 2 ||
+        levels[1] == 0 || levels[3] == 0)
+    {
+        NEF_TRACE("Unexpected WB levels (type %d, count %d)\n", type,
+            nr_levels);
+        nef_free(fp, levels);
+        return NEF_RANGE_ERROR;
+    }
+
+    coeffs[0] = (float)levels[0] / (float)levels[1];
+    coeffs[1] = 1.0f;
+    coeffs[2] = (float)levels[2] / (float)levels[3];
+
+    NEF_TRACE("White balance: R = %f, B = %f\n", coeffs[0], coeffs[2]);
+
+    nef_free(fp, levels);
+
+    *count = 3;
+
+    return NEF_OK;
+}
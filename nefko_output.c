@@ -0,0 +1,669 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_priv_tags.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Row sinks that format decoded CFA samples into the caller's buffer */
+
+struct nef_image_out {
+    nef_image_t *hdl;
+
+    uint8_t *buf;               /* First sample of the image */
+    size_t row_stride;          /* Bytes between rows */
+    size_t plane_stride;        /* Bytes between CFA planes */
+    unsigned sample_bytes;
+    int layout;
+
+    /* The conversion to apply; for 8-bit output this is always set */
+    int has_conv;
+    struct nef_output_conv conv;
+
+    /* A pair of rows of converted samples */
+    uint16_t *scratch;
+};
+
+static inline void nef_output_store(struct nef_image_out *out, uint8_t *row,
+                                    size_t idx, unsigned val)
+{
+    if (out->sample_bytes == 1) {
+        row[idx] = val > 255 ? 255 : val;
+    } else {
+        ((uint16_t *)row)[idx] = val;
+    }
+}
+
+/* Apply the output conversion, if any, to the pair of rows of a CFA quad
+ * starting at top. Returns the rows to bin samples from, and their stride.
+ */
+static const uint16_t *nef_output_conv_quad(struct nef_image_out *out,
+                                            const uint16_t *top,
+                                            unsigned width, unsigned stride,
+                                            unsigned *out_stride)
+{
+    if (!out->has_conv) {
+        *out_stride = stride;
+        return top;
+    }
+
+    nef_conv_row_16(top, out->scratch, width, &out->conv.black[0],
+        &out->conv.gain[0]);
+    nef_conv_row_16(top + stride, out->scratch + width, width,
+        &out->conv.black[2], &out->conv.gain[2]);
+
+    *out_stride = width;
+
+    return out->scratch;
+}
+
+/* Let the decoder write unconverted rows straight into the destination */
+static uint16_t *nef_output_get_rows_direct(struct nef_row_sink *sink,
+                                            unsigned row, unsigned nr_rows,
+                                            unsigned *stride)
+{
+    struct nef_image_out *out = (struct nef_image_out *)sink->state;
+
+    *stride = out->row_stride / sizeof(uint16_t);
+
+    return (uint16_t *)(out->buf + row * out->row_stride);
+}
+
+/* Write rows of CFA samples out, converting them if requested */
+static NEF_STATUS nef_output_put_rows_full(struct nef_row_sink *sink,
+                                           unsigned row, unsigned nr_rows,
+                                           const uint16_t *rows,
+                                           unsigned width, unsigned stride)
+{
+    struct nef_image_out *out = (struct nef_image_out *)sink->state;
+    unsigned i;
+
+    for (i = 0; i < nr_rows; i++) {
+        const uint16_t *src = rows + i * stride;
+        uint8_t *dst = out->buf + (row + i) * out->row_stride;
+        unsigned pos = ((row + i) & 1) * 2;
+
+        if (!out->has_conv) {
+            if ((uint8_t *)src != dst) {
+                memcpy(dst, src, width * sizeof(uint16_t));
+            }
+        } else if (out->sample_bytes == 1) {
+            nef_conv_row_8(src, dst, width,
+                &out->conv.black[pos], &out->conv.gain[pos]);
+        } else {
+            nef_conv_row_16(src, (uint16_t *)dst, width,
+                &out->conv.black[pos], &out->conv.gain[pos]);
+        }
+    }
+
+    return NEF_OK;
+}
+
+/* Split rows of CFA samples into one plane per CFA position */
+static NEF_STATUS nef_output_put_rows_planes(struct nef_row_sink *sink,
+                                             unsigned row, unsigned nr_rows,
+                                             const uint16_t *rows,
+                                             unsigned width, unsigned stride)
+{
+    struct nef_image_out *out = (struct nef_image_out *)sink->state;
+    unsigned i, x;
+
+    for (i = 0; i < nr_rows; i++) {
+        const uint16_t *src = rows + i * stride;
+        unsigned y = row + i, pos = (y & 1) * 2;
+        uint8_t *even = out->buf + pos * out->plane_stride +
+            (y / 2) * out->row_stride;
+        uint8_t *odd = even + out->plane_stride;
+
+        if (out->has_conv) {
+            nef_conv_row_16(src, out->scratch, width,
+                &out->conv.black[pos], &out->conv.gain[pos]);
+            src = out->scratch;
+        }
+
+        if (out->sample_bytes == 2) {
+            uint16_t *even16 = (uint16_t *)even, *odd16 = (uint16_t *)odd;
+
+            for (x = 0; x + 1 < width; x += 2) {
+                even16[x / 2] = src[x];
+                odd16[x / 2] = src[x + 1];
+            }
+
+            if (x < width) {
+                even16[x / 2] = src[x];
+            }
+        } else {
+            for (x = 0; x + 1 < width; x += 2) {
+                even[x / 2] = src[x] > 255 ? 255 : src[x];
+                odd[x / 2] = src[x + 1] > 255 ? 255 : src[x + 1];
+            }
+
+            if (x < width) {
+                even[x / 2] = src[x] > 255 ? 255 : src[x];
+            }
+        }
+    }
+
+    return NEF_OK;
+}
+
+/* Collapse each 2x2 CFA quad into one RGB pixel, averaging the greens */
+static NEF_STATUS nef_output_put_rows_half_rgb(struct nef_row_sink *sink,
+                                               unsigned row, unsigned nr_rows,
+                                               const uint16_t *rows,
+                                               unsigned width, unsigned stride)
+{
+    struct nef_image_out *out = (struct nef_image_out *)sink->state;
+    const uint8_t *cfa = out->hdl->cfa_pattern;
+    unsigned out_width = width / 2, i, x, c;
+
+    for (i = 0; i + 1 < nr_rows; i += 2) {
+        unsigned quad_stride;
+        const uint16_t *top = nef_output_conv_quad(out, rows + i * stride,
+                                                   width, stride,
+                                                   &quad_stride);
+        const uint16_t *bottom = top + quad_stride;
+        uint8_t *dst = out->buf + ((row + i) / 2) * out->row_stride;
+
+        for (x = 0; x < out_width; x++) {
+            unsigned sum[3] = { 0, 0, 0 }, num[3] = { 0, 0, 0 };
+
+            sum[cfa[0]] += top[2 * x];
+            num[cfa[0]]++;
+            sum[cfa[1]] += top[2 * x + 1];
+            num[cfa[1]]++;
+            sum[cfa[2]] += bottom[2 * x];
+            num[cfa[2]]++;
+            sum[cfa[3]] += bottom[2 * x + 1];
+            num[cfa[3]]++;
+
+            for (c = 0; c < 3; c++) {
+                nef_output_store(out, dst, x * 3 + c,
+                    num[c] ? sum[c] / num[c] : 0);
+            }
+        }
+    }
+
+    return NEF_OK;
+}
+
+/* Collapse each 2x2 CFA quad into one sample, the average of the quad */
+static NEF_STATUS nef_output_put_rows_half_avg(struct nef_row_sink *sink,
+                                               unsigned row, unsigned nr_rows,
+                                               const uint16_t *rows,
+                                               unsigned width, unsigned stride)
+{
+    struct nef_image_out *out = (struct nef_image_out *)sink->state;
+    unsigned out_width = width / 2, i, x;
+
+    for (i = 0; i + 1 < nr_rows; i += 2) {
+        unsigned quad_stride;
+        const uint16_t *top = nef_output_conv_quad(out, rows + i * stride,
+                                                   width, stride,
+                                                   &quad_stride);
+        const uint16_t *bottom = top + quad_stride;
+        uint8_t *dst = out->buf + ((row + i) / 2) * out->row_stride;
+
+        for (x = 0; x < out_width; x++) {
+            nef_output_store(out, dst, x,
+                (top[2 * x] + top[2 * x + 1] +
+                 bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+        }
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_get_reader(nef_t *fp, nef_image_t *hdl)
+{
+    if (hdl->reader == NULL) {
+        NEF_TRACE("No reader for compression type %u\n", hdl->compression);
+        return NEF_FAILURE;
+    }
+
+    if (hdl->reader_state == NULL) {
+        NEFKO_CHECK(hdl->reader->init_state(hdl, fp->makernote), NEF_FAILURE);
+    }
+
+    return NEF_OK;
+}
+
+/* Writing an image in an orientation other than as stored. Each band of
+ * rows is formatted into a buffer of its own, then copied into place a
+ * block of columns at a time, so the part of the band and the destination
+ * rows being written both stay in cache as the band is turned.
+ */
+#define NEF_ORIENT_BLOCK    32
+
+struct nef_image_orient {
+    nef_t *fp;
+    unsigned orientation;
+
+    /* The destination, and the sink formatting rows into the band */
+    struct nef_image_out *out;
+    struct nef_image_out band;
+    struct nef_row_sink format;
+    unsigned band_rows;
+
+    /* Output dimensions as stored */
+    unsigned width;
+    unsigned height;
+    unsigned pixel_bytes;
+
+    /* CFA rows per output row */
+    unsigned scale;
+
+    /* Offset in the destination of stored pixel (0, 0), and the steps to
+     * the next pixel along a stored row, and down a stored column */
+    ptrdiff_t origin;
+    ptrdiff_t step_x;
+    ptrdiff_t step_y;
+};
+
+/* Copy rows of the band to where they go in the destination. Turned
+ * orientations walk down each column of a block, as that is along a row
+ * of the destination; the others copy a row of the band at a time.
+ */
+static inline void nef_output_orient_copy(struct nef_image_orient *o,
+                                          unsigned row, unsigned rows,
+                                          const unsigned bytes)
+{
+    uint8_t *dst = o->out->buf;
+    unsigned x0, x, y;
+
+    if (o->orientation < 5) {
+        for (y = 0; y < rows; y++) {
+            const uint8_t *src = o->band.buf + y * o->band.row_stride;
+            ptrdiff_t off = o->origin + (ptrdiff_t)(row + y) * o->step_y;
+
+            for (x = 0; x < o->width; x++) {
+                memcpy(dst + off + x * o->step_x, src + x * bytes, bytes);
+            }
+        }
+
+        return;
+    }
+
+    for (x0 = 0; x0 < o->width; x0 += NEF_ORIENT_BLOCK) {
+        unsigned x_end = o->width - x0 < NEF_ORIENT_BLOCK ?
+            o->width : x0 + NEF_ORIENT_BLOCK;
+
+        for (x = x0; x < x_end; x++) {
+            const uint8_t *src = o->band.buf + x * bytes;
+            ptrdiff_t off = o->origin + x * o->step_x +
+                (ptrdiff_t)row * o->step_y;
+
+            for (y = 0; y < rows; y++) {
+                memcpy(dst + off + y * o->step_y,
+                    src + y * o->band.row_stride, bytes);
+            }
+        }
+    }
+}
+
+static NEF_STATUS nef_output_put_rows_oriented(struct nef_row_sink *sink,
+                                               unsigned row, unsigned nr_rows,
+                                               const uint16_t *rows,
+                                               unsigned width, unsigned stride)
+{
+    struct nef_image_orient *o = (struct nef_image_orient *)sink->state;
+    unsigned out_row = row / o->scale, out_rows = nr_rows / o->scale;
+    NEF_STATUS ret;
+
+    if (out_rows > o->band_rows) {
+        uint8_t *band = (uint8_t *)nef_realloc(o->fp, o->band.buf,
+            out_rows * o->band.row_stride);
+
+        if (band == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        o->band.buf = band;
+        o->band_rows = out_rows;
+    }
+
+    /* Bands start on even rows, so the band sink sees the same CFA phase
+     * starting from row 0 */
+    if ((ret = o->format.put_rows(&o->format, 0, nr_rows, rows, width,
+                                  stride)) != NEF_OK)
+    {
+        return ret;
+    }
+
+    /* Only the constant sizes are worth specializing the copy for */
+    switch (o->pixel_bytes) {
+    case 1:
+        nef_output_orient_copy(o, out_row, out_rows, 1);
+        break;
+    case 2:
+        nef_output_orient_copy(o, out_row, out_rows, 2);
+        break;
+    case 6:
+        nef_output_orient_copy(o, out_row, out_rows, 6);
+        break;
+    default:
+        nef_output_orient_copy(o, out_row, out_rows, o->pixel_bytes);
+        break;
+    }
+
+    return NEF_OK;
+}
+
+/* Put a sink formatting rows for out behind one that turns them into the
+ * orientation of the image */
+static void nef_output_orient_init(nef_t *fp, nef_image_t *hdl,
+                                   struct nef_image_out *out,
+                                   struct nef_row_sink *sink,
+                                   struct nef_image_orient *o)
+{
+    ptrdiff_t p, r, w, h;
+    unsigned chans;
+
+    memset(o, 0, sizeof(*o));
+
+    nef_image_get_stored_dims(hdl, &o->width, &o->height, &chans);
+
+    o->fp = fp;
+    o->orientation = hdl->orientation;
+    o->out = out;
+    o->pixel_bytes = chans * out->sample_bytes;
+    o->scale = hdl->decode_mode == NEF_DECODE_FULL ? 1 : 2;
+
+    o->band = *out;
+    o->band.buf = NULL;
+    o->band.row_stride = (size_t)o->width * o->pixel_bytes;
+
+    o->format = *sink;
+    o->format.state = &o->band;
+    o->format.get_rows = NULL;
+
+    sink->put_rows = nef_output_put_rows_oriented;
+    sink->get_rows = NULL;
+    sink->state = o;
+
+    p = o->pixel_bytes;
+    r = out->row_stride;
+    w = o->width - 1;
+    h = o->height - 1;
+
+    switch (o->orientation) {
+    case 2:
+        o->origin = w * p;
+        o->step_x = -p;
+        o->step_y = r;
+        break;
+    case 3:
+        o->origin = w * p + h * r;
+        o->step_x = -p;
+        o->step_y = -r;
+        break;
+    case 4:
+        o->origin = h * r;
+        o->step_x = p;
+        o->step_y = -r;
+        break;
+    case 5:
+        o->origin = 0;
+        o->step_x = r;
+        o->step_y = p;
+        break;
+    case 6:
+        o->origin = h * p;
+        o->step_x = r;
+        o->step_y = -p;
+        break;
+    case 7:
+        o->origin = h * p + w * r;
+        o->step_x = -r;
+        o->step_y = -p;
+        break;
+    case 8:
+        o->origin = w * r;
+        o->step_x = -r;
+        o->step_y = p;
+        break;
+    default:
+        o->origin = 0;
+        o->step_x = p;
+        o->step_y = r;
+        break;
+    }
+}
+
+/* Check an output descriptor against the image, and fill in the output
+ * state from it.
+ */
+static NEF_STATUS nef_output_setup(nef_image_t *hdl,
+                                   const struct nef_output_desc *desc,
+                                   struct nef_image_out *out)
+{
+    unsigned width, height, chans, rows;
+    size_t line_bytes, last;
+
+    nef_image_get_output_dims(hdl, &width, &height, &chans);
+
+    if (width == 0 || height == 0) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (desc->pixel_format != NEF_PIXEL_8 &&
+        desc->pixel_format != NEF_PIXEL_16)
+    {
+        NEF_TRACE("Unknown pixel format: %d\n", desc->pixel_format);
+        return NEF_RANGE_ERROR;
+    }
+
+    if (hdl->has_conv && hdl->conv.pixel_format != desc->pixel_format) {
+        NEF_TRACE("Pixel format does not match the output conversion\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    memset(out, 0, sizeof(*out));
+
+    out->hdl = hdl;
+    out->layout = desc->layout;
+    out->sample_bytes = desc->pixel_format == NEF_PIXEL_8 ? 1 : 2;
+
+    switch (desc->layout) {
+    case NEF_LAYOUT_INTERLEAVED:
+        rows = height;
+        line_bytes = (size_t)width * chans * out->sample_bytes;
+        break;
+    case NEF_LAYOUT_CFA_PLANES:
+        if (hdl->orientation > 1) {
+            NEF_TRACE("Only interleaved output can be rotated\n");
+            return NEF_BAD_ARGUMENT;
+        }
+        if (hdl->decode_mode != NEF_DECODE_FULL || chans != 1) {
+            NEF_TRACE("CFA planes need a full-resolution CFA image\n");
+            return NEF_BAD_ARGUMENT;
+        }
+        rows = (height + 1) / 2;
+        line_bytes = (size_t)((width + 1) / 2) * out->sample_bytes;
+        break;
+    default:
+        NEF_TRACE("Unknown layout: %d\n", desc->layout);
+        return NEF_RANGE_ERROR;
+    }
+
+    out->row_stride = desc->row_stride ? desc->row_stride : line_bytes;
+    out->plane_stride = desc->plane_stride ? desc->plane_stride :
+        out->row_stride * rows;
+
+    if (out->row_stride < line_bytes ||
+        out->row_stride % out->sample_bytes != 0 ||
+        out->plane_stride % out->sample_bytes != 0 ||
+        desc->offset % out->sample_bytes != 0 ||
+        (uintptr_t)desc->buf % out->sample_bytes != 0)
+    {
+        NEF_TRACE("Bad row stride or misaligned output\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    last = desc->offset + (rows - 1) * out->row_stride + line_bytes;
+    if (desc->layout == NEF_LAYOUT_CFA_PLANES) {
+        last += 3 * out->plane_stride;
+    }
+
+    if (last > desc->size) {
+        NEF_TRACE("Output of %zu bytes is too small, need %zu\n",
+            desc->size, last);
+        return NEF_RANGE_ERROR;
+    }
+
+    out->buf = (uint8_t *)desc->buf + desc->offset;
+
+    if (hdl->has_conv) {
+        out->conv = hdl->conv;
+        out->has_conv = 1;
+    } else if (out->sample_bytes == 1) {
+        /* Scale samples down to 8 bits */
+        int i;
+
+        for (i = 0; i < 4; i++) {
+            out->conv.black[i] = 0.0f;
+            out->conv.gain[i] = hdl->bits_per_sample > 8 ?
+                1.0f / (float)(1 << (hdl->bits_per_sample - 8)) : 1.0f;
+        }
+        out->conv.pixel_format = NEF_PIXEL_8;
+        out->has_conv = 1;
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_get_raw_desc(nef_t *fp, nef_image_t *hdl,
+                                  const struct nef_output_desc *desc)
+{
+    struct nef_image_out out;
+    struct nef_image_orient orient;
+    struct nef_row_sink sink;
+    unsigned width, height, chans;
+    size_t line_bytes = 0;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(desc);
+    NEF_CHECK_ARG(desc->buf);
+
+    NEF_TRACE("Loading unformatted image data...\n");
+
+    if ((ret = nef_output_setup(hdl, desc, &out)) != NEF_OK) {
+        return ret;
+    }
+
+    /* Interleaved frames go through the decoded-frame cache, though only
+     * into it if statistics are wanted, as they come from the decoder */
+    if (out.layout == NEF_LAYOUT_INTERLEAVED) {
+        nef_image_get_output_dims(hdl, &width, &height, &chans);
+        line_bytes = (size_t)width * chans * out.sample_bytes;
+
+        if (hdl->stats == NULL &&
+            nef_cache_read(fp, hdl, desc->pixel_format, out.buf,
+                           out.row_stride, line_bytes, height) == NEF_OK)
+        {
+            return NEF_OK;
+        }
+    }
+
+    if ((ret = nef_image_get_reader(fp, hdl)) != NEF_OK) {
+        return ret;
+    }
+
+    sink.state = &out;
+    sink.get_rows = NULL;
+
+    switch (hdl->decode_mode) {
+    case NEF_DECODE_HALF_RGB:
+        sink.put_rows = nef_output_put_rows_half_rgb;
+        break;
+    case NEF_DECODE_HALF_AVG:
+        sink.put_rows = nef_output_put_rows_half_avg;
+        break;
+    default:
+        if (out.layout == NEF_LAYOUT_CFA_PLANES) {
+            sink.put_rows = nef_output_put_rows_planes;
+        } else {
+            sink.put_rows = nef_output_put_rows_full;
+            if (!out.has_conv) {
+                sink.get_rows = nef_output_get_rows_direct;
+            }
+        }
+        break;
+    }
+
+    if (out.has_conv && sink.put_rows != nef_output_put_rows_full) {
+        out.scratch = (uint16_t *)nef_alloc(fp, 2 * hdl->width * sizeof(uint16_t));
+        if (out.scratch == NULL) {
+            return NEF_NO_MEMORY;
+        }
+    }
+
+    if (hdl->orientation > 1) {
+        nef_output_orient_init(fp, hdl, &out, &sink, &orient);
+    }
+
+    nef_image_hint(fp, hdl, NEF_HINT_BEFORE);
+
+    if (hdl->stats != NULL) {
+        ret = nef_histogram_decode(fp, hdl, &sink);
+    } else {
+        ret = nef_calib_decode(fp, hdl, &sink);
+    }
+
+    nef_image_hint(fp, hdl, NEF_HINT_AFTER);
+
+    if (out.scratch) nef_free(fp, out.scratch);
+    if (hdl->orientation > 1) nef_free(fp, orient.band.buf);
+
+    if (ret == NEF_OK && line_bytes != 0) {
+        nef_cache_insert(fp, hdl, desc->pixel_format, out.buf, out.row_stride,
+                         line_bytes, height);
+    }
+
+    return ret;
+}
+
+NEF_STATUS nef_image_get_tile_size(nef_t *fp, nef_image_t *hdl,
+                                   unsigned *width, unsigned *height)
+{
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(width);
+    NEF_CHECK_ARG(height);
+
+    NEFKO_CHECK(nef_image_get_reader(fp, hdl), NEF_FAILURE);
+
+    return hdl->reader->image_tile_size(hdl, width, height);
+}
+
+NEF_STATUS nef_image_read_tile(nef_t *fp, nef_image_t *hdl, unsigned x,
+                               unsigned y, unsigned w, unsigned h, void *buf)
+{
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(buf);
+
+    NEFKO_CHECK(nef_image_get_reader(fp, hdl), NEF_FAILURE);
+
+    return hdl->reader->read_image_tile(hdl, x, y, w, h, buf);
+}
+
+NEF_STATUS nef_image_get_raw(nef_t *fp, nef_image_t *hdl, unsigned bufsize,
+                             void *image_buf)
+{
+    struct nef_output_desc desc;
+
+    NEF_CHECK_ARG(hdl);
+
+    memset(&desc, 0, sizeof(desc));
+
+    desc.buf = image_buf;
+    desc.size = bufsize;
+    desc.layout = NEF_LAYOUT_INTERLEAVED;
+    desc.pixel_format = hdl->has_conv ? hdl->conv.pixel_format : NEF_PIXEL_16;
+
+    return nef_image_get_raw_desc(fp, hdl, &desc);
+}
@@ -3,23 +3,74 @@
 
 #include <nefko.h>
 #include <nefko_priv_tags.h>
+#include <nefko_camera.h>
 #include <ghetto.h>
 
 #include <stdio.h>
 #include <stdint.h>
 
+struct nef_arena_chunk;
+struct nef_decoded_header;
+
+/* Identity of an opened file, for the decoded-frame cache and to check
+ * that the descriptor for hints is still the same file */
+struct nef_file_id {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int valid;
+};
+
 struct nef {
     tiff_t *tiff_fp;
 
+    /* Allocator for everything belonging to this handle */
+    struct nef_allocator allocator;
+    struct nef_arena_chunk *arena;
+    unsigned flags;
+
+    /* Identity of the file, keying its frames in the cache */
+    struct nef_file_id file_id;
+
+    /* The whole file, if it was opened with NEF_OPEN_MMAP */
+    const uint8_t *map;
+    size_t map_bytes;
+
+    /* The file, opened the first time page cache hints need it (-1 until
+     * then), the path to open it by (NULL once that has failed), and the
+     * hints to give (NEF_HINT_*) */
+    int fd;
+    char *path;
+    unsigned hints;
+
+    /* The header of the sidecar, for handles from nef_open_decoded */
+    const struct nef_decoded_header *decoded;
+
     nef_image_t *images;
 
     tiff_ifd_t *makernote;
     tiff_ifd_t *exif;
 
+    /* The camera that took the image, if it is a known one */
+    const struct nefko_camera *camera;
+    struct nefko_camera_state *camera_state;
+
+    /* Constants for the camera model, with generic values for anything
+     * the model does not specify */
+    struct nefko_camera_params params;
+
+    /* Instrumentation counters for this handle */
+    struct nef_stats stats;
+
     /* Parameters for deobfuscating various MakerNote params. */
     uint8_t key;
     uint8_t iv;
 
+    /* The camera serial number from the MakerNote, 0 if there is none */
+    unsigned serial;
+
     size_t image_count;
 };
 
@@ -36,9 +87,33 @@ struct nef_image {
 
     unsigned compression;
     unsigned photo_interp;
+    unsigned bits_per_sample;
+
+    /* CFA colour (0 = R, 1 = G, 2 = B) at each position of the 2x2
+     * repeat pattern, in row-major order */
+    uint8_t cfa_pattern[4];
 
+    /* How nef_image_get_raw should format the decoded image, and the TIFF
+     * orientation to write it in (0 or 1 for as stored) */
+    unsigned decode_mode;
+    unsigned orientation;
+    unsigned has_conv;
+    struct nef_output_conv conv;
+
+    /* Where to gather statistics of decoded samples, if anywhere */
+    struct nef_image_stats *stats;
+
+    /* The sensor calibration to correct decoded samples with, if any */
+    struct nef_calib *calib;
+
+    /* The reader for the image, picked once at open (NULL if there is
+     * none), and its state, set up by the first decode */
     struct nef_image_reader *reader;
     void *reader_state;
+
+    /* The JPEG stream of a preview, once read from an unmapped file */
+    uint8_t *preview;
+    size_t preview_bytes;
 };
 
 struct nef_huff_leaf {
@@ -46,6 +121,32 @@ struct nef_huff_leaf {
     unsigned leaf;
 };
 
+/* A consumer of decoded CFA samples. Readers hand decoded rows to a sink
+ * in bands, and the sink is responsible for formatting them for output.
+ * Bands always start on an even row and, save for possibly the last band
+ * of an image, contain an even number of rows, so a sink always sees
+ * whole 2x2 CFA quads.
+ */
+struct nef_row_sink {
+    /* Consume nr_rows rows of width samples each, starting at image row
+     * row. Each row of the band is stride samples apart.
+     */
+    NEF_STATUS (*put_rows)(struct nef_row_sink *sink, unsigned row,
+                           unsigned nr_rows, const uint16_t *rows,
+                           unsigned width, unsigned stride);
+
+    /* Optionally, get where the decoder may write the given rows itself,
+     * and their stride in samples. put_rows is still called for the rows,
+     * with rows pointing at the returned buffer. Returning NULL, or leaving
+     * this NULL, has the decoder use a buffer of its own.
+     */
+    uint16_t *(*get_rows)(struct nef_row_sink *sink, unsigned row,
+                          unsigned nr_rows, unsigned *stride);
+
+    /* Private state of the sink */
+    void *state;
+};
+
 struct nef_image_reader {
     /* A human-readable name for the image type */
     const char *format_name;
@@ -66,15 +167,96 @@ struct nef_image_reader {
     NEF_STATUS (*image_tile_size)(struct nef_image *image,
                                   unsigned *w, unsigned *h);
 
+    /* Decode the whole image, handing the rows to the given sink */
+    NEF_STATUS (*decode_rows)(struct nef_image *image,
+                              struct nef_row_sink *sink);
+
     /* Destroy the reader_state in the given nef_image */
     NEF_STATUS (*clean_state)(struct nef_image *image);
 };
 
+/* Most verbose log level compiled in */
+#ifndef NEF_LOG_MAX_LEVEL
 #ifdef _DEBUG
-#define NEF_TRACE(x, ...) \
-    printf("%s:%d - " x, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+#define NEF_LOG_MAX_LEVEL   NEF_LOG_DEBUG
+#else
+#define NEF_LOG_MAX_LEVEL   NEF_LOG_WARN
+#endif
+#endif
+
+/* Level at and below which messages reach the log callback, or -1 */
+extern int nef_log_level;
+
+void nef_log(int level, const char *func, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define NEF_LOG(level, x, ...) \
+    do { \
+        if ((level) <= NEF_LOG_MAX_LEVEL && (level) <= nef_log_level) { \
+            nef_log((level), __FUNCTION__, __LINE__, x, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define NEF_ERROR(x, ...)   NEF_LOG(NEF_LOG_ERROR, x, ##__VA_ARGS__)
+#define NEF_WARN(x, ...)    NEF_LOG(NEF_LOG_WARN, x, ##__VA_ARGS__)
+#define NEF_TRACE(x, ...)   NEF_LOG(NEF_LOG_DEBUG, x, ##__VA_ARGS__)
+
+/* Instrumentation. NEF_STATS_START declares a timer and starts it, and
+ * NEF_STATS_STOP charges the time since to a stage of the given handle
+ * (which may be NULL) and the global totals. All of these compile away
+ * without NEF_STATS.
+ */
+#ifdef NEF_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline uint64_t nef_stats_now(void)
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline uint64_t nef_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+extern struct nef_stats nef_stats_global;
+
+static inline void nef_stats_add(nef_t *nef, unsigned stage, uint64_t ticks,
+                                 uint64_t bytes)
+{
+    struct nef_stage_stats *global = &nef_stats_global.stage[stage];
+
+    __atomic_fetch_add(&global->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global->bytes, bytes, __ATOMIC_RELAXED);
+
+    if (nef != NULL) {
+        struct nef_stage_stats *local = &nef->stats.stage[stage];
+
+        local->calls++;
+        local->ticks += ticks;
+        local->bytes += bytes;
+    }
+}
+
+#define NEF_STATS_START(t) \
+    uint64_t t = nef_stats_now()
+#define NEF_STATS_RESTART(t) \
+    (t) = nef_stats_now()
+#define NEF_STATS_STOP(nef, stage, t, bytes) \
+    nef_stats_add((nef), (stage), nef_stats_now() - (t), (bytes))
 #else
-#define NEF_TRACE(...)
+#define NEF_STATS_START(t)                      do { } while (0)
+#define NEF_STATS_RESTART(t)                    do { } while (0)
+#define NEF_STATS_STOP(nef, stage, t, bytes)    do { } while (0)
 #endif
 
 #define NEF_CHECK_ARG(x) \
@@ -100,6 +282,22 @@ struct nef_image_reader {
 #define BYTE(dw, n) \
     (uint8_t)((((dw) >> (n * 8)) & 0xff))
 
+#define NEF_HOST_BIG_ENDIAN     (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+/* Allocate zeroed memory on behalf of a handle (or globally, if nef is
+ * NULL), and free it again. nef_alloc_raw skips the zeroing, for data
+ * buffers that are always written before they are read.
+ */
+void *nef_alloc(nef_t *nef, size_t size);
+void *nef_alloc_raw(nef_t *nef, size_t size);
+void *nef_realloc(nef_t *nef, void *ptr, size_t size);
+void nef_free(nef_t *nef, void *ptr);
+
+/* Allocate and free the handle structure itself */
+NEF_STATUS nef_handle_alloc(unsigned flags, const struct nef_allocator *alloc,
+                            nef_t **nef);
+void nef_handle_free(nef_t *nef);
+
 /* Retrieve a tag from an IFD */
 NEF_STATUS nef_get_tag(nef_t *nef, nef_image_t *img, unsigned tag_id,
                        void *dest);
@@ -115,5 +313,276 @@ NEF_STATUS nef_get_obfuscation_params(nef_t *nef);
 NEF_STATUS nef_get_tag_alloc(nef_t *nef, tiff_ifd_t *ifd, unsigned tag_id,
                              void **dest, int *item_type, int *item_count);
 
+/* Get the dimensions of the output of nef_image_get_raw for an image, in
+ * the image's current decode mode, as stored and in its orientation.
+ */
+void nef_image_get_stored_dims(nef_image_t *hdl, unsigned *width,
+                               unsigned *height, unsigned *chans);
+void nef_image_get_output_dims(nef_image_t *hdl, unsigned *width,
+                               unsigned *height, unsigned *chans);
+
+/* Read all strips of an image into one newly allocated, contiguous buffer */
+NEF_STATUS nef_image_read_strips(nef_t *nef, nef_image_t *img,
+                                 uint8_t **data, size_t *bytes);
+
+/* Map a whole file read-only into nef->map, and unmap it */
+NEF_STATUS nef_map_file(nef_t *nef, const char *file);
+void nef_unmap_file(nef_t *nef);
+
+/* Sensor calibration for a camera body, mapped from its calibration file
+ * and shared by every image from the camera. Arrays point into the map.
+ */
+struct nef_calib {
+    struct nef_calib *next;
+    unsigned serial;
+    unsigned width;
+    unsigned height;
+
+    const uint16_t *dark;
+    const uint16_t *flat;
+    const uint32_t *defects;
+    unsigned nr_defects;
+
+    /* Distinguishes this mapping from any earlier one of the same file,
+     * for the decoded-frame cache */
+    uint64_t id;
+
+    void *map;
+    size_t map_bytes;
+    unsigned refs;
+    int evicted;
+};
+
+/* Stop using the calibration of an image */
+void nef_calib_release(nef_image_t *img);
+
+/* Decode an image through sink, correcting it with its calibration, if it
+ * has one */
+NEF_STATUS nef_calib_decode(nef_t *fp, nef_image_t *hdl,
+                            struct nef_row_sink *sink);
+
+/* Decode an image through sink, gathering the statistics set for it */
+NEF_STATUS nef_histogram_decode(nef_t *fp, nef_image_t *hdl,
+                                struct nef_row_sink *sink);
+
+/* Give the kernel one piece of advice (a single NEF_HINT_*) about a range
+ * of the file of a handle */
+void nef_hint_range(nef_t *nef, uint64_t off, uint64_t len, unsigned advice);
+
+/* Give the kernel the hints of a handle for the strips of an image, before
+ * (NEF_HINT_BEFORE) or after (NEF_HINT_AFTER) reading them */
+#define NEF_HINT_BEFORE     0
+#define NEF_HINT_AFTER      1
+
+void nef_image_hint(nef_t *fp, nef_image_t *hdl, int when);
+
+/* Set up the state of the reader picked for an image at open, if not done
+ * already */
+NEF_STATUS nef_image_get_reader(nef_t *fp, nef_image_t *hdl);
+
+/* Get the white balance and the model name stored in a sidecar */
+NEF_STATUS nef_decoded_white_balance(nef_t *fp, float *coeffs);
+const char *nef_decoded_model(nef_t *fp);
+
+/* Record the identity of a file as it is opened */
+void nef_cache_identify(nef_t *nef, const char *file);
+
+/* Get a descriptor for the file of a handle, for page cache hints, opening
+ * it the first time; -1 if it cannot be opened, or if the path no longer
+ * names the file that was opened */
+int nef_file_fd(nef_t *nef);
+
+/* Copy a cached frame for an image, decoded as it is currently set up,
+ * into rows of line_bytes each, row_stride apart. Returns NEF_NOT_FOUND if
+ * the frame is not cached.
+ */
+NEF_STATUS nef_cache_read(nef_t *nef, nef_image_t *img, int pixel_format,
+                          uint8_t *dst, size_t row_stride, size_t line_bytes,
+                          unsigned rows);
+
+/* Add a freshly decoded frame to the cache, if it is enabled */
+void nef_cache_insert(nef_t *nef, nef_image_t *img, int pixel_format,
+                      const uint8_t *src, size_t row_stride,
+                      size_t line_bytes, unsigned rows);
+
+/* A set of data-parallel kernels, built for one instruction set */
+struct nef_kernels {
+    const char *name;
+
+    /* Convert a row of CFA samples, where even samples use
+     * black[0]/gain[0] and odd samples use black[1]/gain[1].
+     */
+    void (*conv_row_16)(const uint16_t *src, uint16_t *dst, unsigned width,
+                        const float *black, const float *gain);
+    void (*conv_row_8)(const uint16_t *src, uint8_t *dst, unsigned width,
+                       const float *black, const float *gain);
+
+    /* XOR a buffer with the MakerNote obfuscation keystream */
+    void (*decrypt)(uint8_t *buf, size_t bytes, uint8_t key, uint8_t iv);
+
+    /* Unpack count samples stored back to back at 12 or 14 bits each,
+     * most significant bit first if msb_first is set, least significant
+     * bit first otherwise. count must be a multiple of 2 (12 bits) or 4
+     * (14 bits), so that the samples fill whole bytes.
+     */
+    void (*unpack_12)(const uint8_t *src, uint16_t *dst, size_t count,
+                      int msb_first);
+    void (*unpack_14)(const uint8_t *src, uint16_t *dst, size_t count,
+                      int msb_first);
+
+    /* Byte swap count 16-bit samples */
+    void (*swap_16)(const uint16_t *src, uint16_t *dst, size_t count);
+
+    /* Subtract a row of the dark frame from a row of samples and scale
+     * them by a row of flat-field gains; either may be NULL */
+    void (*calib_row)(const uint16_t *src, uint16_t *dst, unsigned width,
+                      const uint16_t *dark, const uint16_t *flat);
+};
+
+/* The kernels picked for this CPU at load time */
+extern const struct nef_kernels *nef_kernels;
+
+static inline void nef_conv_row_16(const uint16_t *src, uint16_t *dst,
+                                   unsigned width, const float *black,
+                                   const float *gain)
+{
+    nef_kernels->conv_row_16(src, dst, width, black, gain);
+}
+
+static inline void nef_conv_row_8(const uint16_t *src, uint8_t *dst,
+                                  unsigned width, const float *black,
+                                  const float *gain)
+{
+    nef_kernels->conv_row_8(src, dst, width, black, gain);
+}
+
+static inline void nef_unpack_12(const uint8_t *src, uint16_t *dst,
+                                 size_t count, int msb_first)
+{
+    nef_kernels->unpack_12(src, dst, count, msb_first);
+}
+
+static inline void nef_unpack_14(const uint8_t *src, uint16_t *dst,
+                                 size_t count, int msb_first)
+{
+    nef_kernels->unpack_14(src, dst, count, msb_first);
+}
+
+static inline void nef_swap_16(const uint16_t *src, uint16_t *dst,
+                               size_t count)
+{
+    nef_kernels->swap_16(src, dst, count);
+}
+
+static inline void nef_calib_row(const uint16_t *src, uint16_t *dst,
+                                 unsigned width, const uint16_t *dark,
+                                 const uint16_t *flat)
+{
+    nef_kernels->calib_row(src, dst, width, dark, flat);
+}
+
+/* Indices of the NPC Huffman trees. The tree used after the split row of
+ * a lossy image immediately follows the tree used before it, and each
+ * 14-bit tree is NEF_NPC_TREE_14_OFF after its 12-bit counterpart.
+ */
+#define NEF_NPC_TREE_12_LOSSY       0
+#define NEF_NPC_TREE_12_LOSSLESS    2
+#define NEF_NPC_TREE_14_OFF         3
+
+/* NEF decode table (MakerNote tag 150) versions */
+#define NEF_NPC_VER_LOSSY           0x44
+#define NEF_NPC_VER_LOSSY_SUB       0x20
+#define NEF_NPC_VER_LOSSLESS        0x46
+
+/* Offset of the split row within a lossy-after-split NEF decode table */
+#define NEF_NPC_SPLIT_OFF           562
+
+/* Largest sample value that can index the linearization curve, plus one */
+#define NEF_NPC_CURVE_SIZE          0x4001
+
+/* Get the specification of one of the NPC Huffman trees: 16 counts of
+ * codes of each length, followed by the symbols in canonical order.
+ */
+const uint8_t *nef_npc_tree_spec(unsigned tree);
+
+/* Read count fields of bits bits each (MSB first) from an NPC bitstream */
+NEF_STATUS nef_npc_read_bits(uint8_t *data, size_t bytes, unsigned bits,
+                             unsigned *out, unsigned count);
+
+/* Decode count differences from an NPC bitstream, using the given one of
+ * the NPC Huffman trees.
+ */
+NEF_STATUS nef_npc_decode_diffs(nef_t *nef, unsigned tree, uint8_t *data,
+                                size_t bytes, int *diffs, unsigned count);
+
+/* An NPC decode fed its bitstream a piece at a time, for nef_stream */
+struct nef_npc_stream;
+
+/* Start decoding a width x height NPC image of bits bits per sample, as
+ * described by the given NEF decode table (MakerNote tag 150).
+ */
+NEF_STATUS nef_npc_stream_new(nef_t *nef, const uint8_t *table, size_t bytes,
+                              unsigned bits, unsigned width, unsigned height,
+                              struct nef_npc_stream **npc);
+
+/* Decode up to nr_rows rows, stride samples apart, from the bitstream in
+ * data, which carries on from where the last call left off. Unless final
+ * is set, to say data holds the rest of the bitstream, only rows that
+ * data must hold all of are decoded. On return, decoded holds the count of
+ * rows decoded, and consumed the count of bytes of data that were used up;
+ * the next call must pass the bitstream from there on.
+ */
+NEF_STATUS nef_npc_stream_rows(struct nef_npc_stream *npc, const uint8_t *data,
+                               size_t bytes, int final, uint16_t *out,
+                               unsigned stride, unsigned nr_rows,
+                               unsigned *decoded, size_t *consumed);
+
+void nef_npc_stream_free(nef_t *nef, struct nef_npc_stream *npc);
+
+/* Deobfuscate a buffer of MakerNote data */
+NEF_STATUS nef_decrypt_buffer(nef_t *fp, void *buffer, size_t bytes);
+
+/* Obfuscate a buffer of MakerNote data, as a camera would */
+NEF_STATUS nef_encrypt_buffer(nef_t *fp, void *buffer, size_t bytes);
+
+/* Compute the MakerNote obfuscation key and IV for a camera serial number
+ * and shutter count.
+ */
+void nef_derive_obfuscation_params(unsigned serial, unsigned shutter_count,
+                                   uint8_t *key, uint8_t *iv);
+
+/* The NIKON Proprietary Compression image reader */
+extern struct nef_image_reader nef_huff;
+
+/* The reader for uncompressed images, in 16-bit words or packed */
+extern struct nef_image_reader nef_unpacked;
+
+/* Register an image reader, probed after the built-in readers. Readers
+ * must be registered before the first NEF is opened.
+ */
+NEF_STATUS nefko_register_image_type(struct nef_image_reader *img_type);
+
+/* Run worker(arg) on nthreads threads (0 for one per CPU), including the
+ * calling thread, but no more than n, and wait for them all. Workers take
+ * their share of the n items of work themselves.
+ */
+void nef_run_workers(void *(*worker)(void *), void *arg, unsigned nthreads,
+                     size_t n);
+
+/* Seal the reader and camera registries; called on the first open */
+void nef_registry_seal(void);
+
+/* Find the first reader whose can_open accepts an image, or NULL */
+struct nef_image_reader *nef_registry_find_reader(struct nef_image *image);
+
+/* Find the camera with the given model name, or NULL */
+const struct nefko_camera *nef_registry_find_camera(const char *model);
+
+/* Get the constants for a camera, which may be NULL for an unknown one.
+ * Generic values fill in whatever the camera does not specify.
+ */
+void nef_camera_get_params(const struct nefko_camera *camera,
+                           struct nefko_camera_params *params);
+
 #endif /* __INCLUDE_NEFKO_PRIV_H__ */
 
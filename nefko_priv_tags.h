@@ -7,24 +7,43 @@
 #define TIFF_TAG_BITSPERSAMPLE      258
 #define TIFF_TAG_COMPRESSION        259
 #define   TIFF_COMPRESSION_NONE       1
-#define   TIFF_COMPRESSION_NIKON      32803
+#define   TIFF_COMPRESSION_OJPEG      6
+#define   TIFF_COMPRESSION_JPEG       7
+#define   TIFF_COMPRESSION_NIKON      34713
 #define TIFF_TAG_PHOTOMETRICINTERP  262
+#define   TIFF_PHOTOMETRIC_RGB        2
+#define   TIFF_PHOTOMETRIC_YCBCR      6
+#define   TIFF_PHOTOMETRIC_CFA        32803
 #define TIFF_TAG_SAMPLESPERPIXEL    277
 #define TIFF_TAG_SAMPLEFORMAT       339
+#define TIFF_TAG_CFAREPEATPATTERNDIM 33421
+#define TIFF_TAG_CFAPATTERN         33422
 
 #define TIFF_TAG_STRIPOFFSETS       273
+#define TIFF_TAG_ORIENTATION        274
 #define TIFF_TAG_ROWSPERSTRIP       278
 #define TIFF_TAG_STRIPBYTECOUNTS    279
 
 #define TIFF_TAG_MAKER              271
 #define TIFF_TAG_MODEL              272
 #define TIFF_TAG_SUBIFDS            330
+#define TIFF_TAG_JPEGIFOFFSET       513
+#define TIFF_TAG_JPEGIFBYTECOUNT    514
 #define TIFF_TAG_EXIFIFD            34665
 
+#define TIFF_TAG_EXIF_EXPOSURETIME  33434
+#define TIFF_TAG_EXIF_FNUMBER       33437
+#define TIFF_TAG_EXIF_ISO           34855
 #define TIFF_TAG_EXIF_MAKERNOTE     37500
 
+#define TIFF_TAG_MAKERNOTE_VERSION    1
+#define TIFF_TAG_MAKERNOTE_WB_LEVELS  12
 #define TIFF_TAG_MAKERNOTE_SERIAL     29
+#define TIFF_TAG_MAKERNOTE_LENS       132
 #define TIFF_TAG_MAKERNOTE_SHUTTER    167
+#define TIFF_TAG_MAKERNOTE_SHOT_INFO  145
+#define TIFF_TAG_MAKERNOTE_NEF_DECODE 150
+#define TIFF_TAG_MAKERNOTE_LENS_DATA  152
 
 #define TIFF_TAG_MAKERNOTE_IMAGE_SETTINGS  151
 /* Header v.0205 has a special offset */
@@ -0,0 +1,249 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <string.h>
+
+/* A row sink that builds an image pyramid as the decoder runs. The first
+ * level collapses each 2x2 CFA quad into one RGB pixel; every level after
+ * it averages 2x2 blocks of the one before. Each level only holds the one
+ * strip of tiles its rows are arriving in: once a pair of rows of a level
+ * is in, it is averaged into a row of the next level, and once the strip
+ * is full, its tiles are handed out and it is reused. Tiles are an even
+ * number of rows high, so pairs of rows never straddle two strips.
+ */
+
+struct nef_pyramid_level {
+    unsigned width;
+    unsigned height;
+
+    /* The next row of the level to arrive */
+    unsigned row;
+
+    /* Rows held in the strip */
+    unsigned fill;
+
+    /* tile_size rows of width RGB pixels */
+    uint16_t *strip;
+};
+
+struct nef_pyramid {
+    nef_image_t *hdl;
+    unsigned tile_size;
+
+    struct nef_pyramid_level *levels;
+    unsigned nr_levels;
+
+    nef_pyramid_func_t func;
+    void *ctx;
+};
+
+/* Hand out the tiles of the strip of a level */
+static NEF_STATUS nef_pyramid_emit(struct nef_pyramid *p, unsigned level)
+{
+    struct nef_pyramid_level *lvl = &p->levels[level];
+    struct nef_pyramid_tile tile;
+    unsigned x;
+    NEF_STATUS ret;
+
+    tile.level = level;
+    tile.y = (lvl->row - lvl->fill) / p->tile_size;
+    tile.height = lvl->fill;
+    tile.stride = (size_t)lvl->width * 3;
+
+    for (x = 0; x < lvl->width; x += p->tile_size) {
+        tile.x = x / p->tile_size;
+        tile.width = lvl->width - x < p->tile_size ?
+            lvl->width - x : p->tile_size;
+        tile.pixels = lvl->strip + x * 3;
+
+        if ((ret = p->func(p->ctx, &tile)) != NEF_OK) {
+            return ret;
+        }
+    }
+
+    lvl->fill = 0;
+
+    return NEF_OK;
+}
+
+/* Account for a row just written into the strip of a level: average it and
+ * the row before it into the next level if it completes a pair, and hand
+ * out the strip once it is full.
+ */
+static NEF_STATUS nef_pyramid_row_done(struct nef_pyramid *p, unsigned level)
+{
+    struct nef_pyramid_level *lvl = &p->levels[level];
+    NEF_STATUS ret;
+
+    lvl->fill++;
+    lvl->row++;
+
+    if ((lvl->row & 1) == 0 && level + 1 < p->nr_levels &&
+        p->levels[level + 1].row < p->levels[level + 1].height)
+    {
+        struct nef_pyramid_level *next = &p->levels[level + 1];
+        size_t stride = (size_t)lvl->width * 3;
+        const uint16_t *top = lvl->strip + (lvl->fill - 2) * stride;
+        const uint16_t *bottom = top + stride;
+        uint16_t *dst = next->strip + (size_t)next->fill * next->width * 3;
+        unsigned x, c;
+
+        for (x = 0; x < next->width; x++) {
+            for (c = 0; c < 3; c++) {
+                unsigned i = 6 * x + c;
+
+                dst[3 * x + c] = (top[i] + top[i + 3] + bottom[i] +
+                                  bottom[i + 3] + 2) >> 2;
+            }
+        }
+
+        if ((ret = nef_pyramid_row_done(p, level + 1)) != NEF_OK) {
+            return ret;
+        }
+    }
+
+    if (lvl->fill == p->tile_size || lvl->row == lvl->height) {
+        return nef_pyramid_emit(p, level);
+    }
+
+    return NEF_OK;
+}
+
+/* Collapse each pair of CFA rows into a row of the first level, as
+ * NEF_DECODE_HALF_RGB does */
+static NEF_STATUS nef_pyramid_put_rows(struct nef_row_sink *sink,
+                                       unsigned row, unsigned nr_rows,
+                                       const uint16_t *rows,
+                                       unsigned width, unsigned stride)
+{
+    struct nef_pyramid *p = (struct nef_pyramid *)sink->state;
+    struct nef_pyramid_level *lvl = &p->levels[0];
+    const uint8_t *cfa = p->hdl->cfa_pattern;
+    unsigned i, x, c;
+    NEF_STATUS ret;
+
+    for (i = 0; i + 1 < nr_rows && lvl->row < lvl->height; i += 2) {
+        const uint16_t *top = rows + i * stride;
+        const uint16_t *bottom = top + stride;
+        uint16_t *dst = lvl->strip + (size_t)lvl->fill * lvl->width * 3;
+
+        for (x = 0; x < lvl->width; x++) {
+            unsigned sum[3] = { 0, 0, 0 }, num[3] = { 0, 0, 0 };
+
+            sum[cfa[0]] += top[2 * x];
+            num[cfa[0]]++;
+            sum[cfa[1]] += top[2 * x + 1];
+            num[cfa[1]]++;
+            sum[cfa[2]] += bottom[2 * x];
+            num[cfa[2]]++;
+            sum[cfa[3]] += bottom[2 * x + 1];
+            num[cfa[3]]++;
+
+            for (c = 0; c < 3; c++) {
+                dst[3 * x + c] = num[c] ? sum[c] / num[c] : 0;
+            }
+        }
+
+        if ((ret = nef_pyramid_row_done(p, 0)) != NEF_OK) {
+            return ret;
+        }
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_image_get_pyramid(nef_t *fp, nef_image_t *hdl,
+                                 unsigned tile_size, nef_pyramid_func_t func,
+                                 void *ctx)
+{
+    struct nef_pyramid p;
+    struct nef_row_sink sink;
+    unsigned width, height, i;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(fp);
+    NEF_CHECK_ARG(hdl);
+    NEF_CHECK_ARG(func);
+
+    if (hdl->type != NEF_IMAGE_FULL || hdl->chans != 1 ||
+        hdl->width < 2 || hdl->height < 2)
+    {
+        NEF_TRACE("A pyramid needs a CFA image\n");
+        return NEF_BAD_ARGUMENT;
+    }
+
+    if (tile_size < 2 || (tile_size & 1)) {
+        NEF_TRACE("Tiles must be an even number of pixels: %u\n", tile_size);
+        return NEF_RANGE_ERROR;
+    }
+
+    NEFKO_CHECK(nef_image_get_reader(fp, hdl), NEF_FAILURE);
+
+    memset(&p, 0, sizeof(p));
+    p.hdl = hdl;
+    p.tile_size = tile_size;
+    p.func = func;
+    p.ctx = ctx;
+
+    /* Halve until a level fits in one tile */
+    width = hdl->width / 2;
+    height = hdl->height / 2;
+    p.nr_levels = 1;
+
+    while ((width > tile_size || height > tile_size) &&
+           width >= 2 && height >= 2)
+    {
+        width /= 2;
+        height /= 2;
+        p.nr_levels++;
+    }
+
+    p.levels = (struct nef_pyramid_level *)nef_alloc(fp,
+        p.nr_levels * sizeof(struct nef_pyramid_level));
+    if (p.levels == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    memset(p.levels, 0, p.nr_levels * sizeof(struct nef_pyramid_level));
+
+    width = hdl->width / 2;
+    height = hdl->height / 2;
+
+    for (i = 0; i < p.nr_levels; i++) {
+        struct nef_pyramid_level *lvl = &p.levels[i];
+
+        lvl->width = width;
+        lvl->height = height;
+        lvl->strip = (uint16_t *)nef_alloc(fp,
+            (size_t)tile_size * width * 3 * sizeof(uint16_t));
+        if (lvl->strip == NULL) {
+            ret = NEF_NO_MEMORY;
+            goto done;
+        }
+
+        width /= 2;
+        height /= 2;
+    }
+
+    sink.put_rows = nef_pyramid_put_rows;
+    sink.get_rows = NULL;
+    sink.state = &p;
+
+    nef_image_hint(fp, hdl, NEF_HINT_BEFORE);
+
+    if (hdl->stats != NULL) {
+        ret = nef_histogram_decode(fp, hdl, &sink);
+    } else {
+        ret = nef_calib_decode(fp, hdl, &sink);
+    }
+
+    nef_image_hint(fp, hdl, NEF_HINT_AFTER);
+
+done:
+    for (i = 0; i < p.nr_levels; i++) {
+        nef_free(fp, p.levels[i].strip);
+    }
+    nef_free(fp, p.levels);
+
+    return ret;
+}
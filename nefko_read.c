@@ -1,34 +1,240 @@
 #include <nefko.h>
 #include <nefko_priv.h>
+#include <nefko_camera.h>
 
-static struct nef_image_reader **nefko_image_types = NULL;
-static int nefko_image_types_count = 0;
+#include <string.h>
+
+/* Registries of image readers and cameras. The built-in entries are in
+ * static tables; more may be registered before the first NEF is opened,
+ * which seals the registries. From then on they never change, so lookups
+ * need no locking. Registration itself is not thread-safe, and must
+ * happen before any thread opens a file.
+ */
+
+/* Room for entries registered at run time */
+#define NEF_MAX_EXTRA_READERS   8
+#define NEF_MAX_EXTRA_CAMERAS   32
+
+extern struct nefko_camera d300s_camera_methods;
+extern const struct nefko_camera nikon_d300_camera, nikon_d90_camera,
+    nikon_d700_camera, nikon_d3_camera, nikon_d3s_camera,
+    nikon_d7000_camera, nikon_d5000_camera;
+
+/* Built-in image readers, in the order they are probed */
+static struct nef_image_reader * const nef_builtin_readers[] = {
+    &nef_huff,
+    &nef_unpacked,
+};
+
+/* Built-in cameras, in a perfect hash table keyed by model name. Each
+ * camera sits in the slot given by nef_camera_hash; the multiplier was
+ * picked so that no two built-in models share a slot. Adding a camera may
+ * need a new multiplier (debug builds check the table when it is sealed).
+ */
+#define NEF_CAMERA_HASH_BITS    4
+#define NEF_CAMERA_HASH_MULT    9u
+
+static const struct nefko_camera * const
+    nef_builtin_cameras[1 << NEF_CAMERA_HASH_BITS] =
+{
+    [2] = &nikon_d5000_camera,
+    [3] = &nikon_d3s_camera,
+    [4] = &d300s_camera_methods,
+    [5] = &nikon_d700_camera,
+    [7] = &nikon_d3_camera,
+    [8] = &nikon_d7000_camera,
+    [12] = &nikon_d300_camera,
+    [15] = &nikon_d90_camera,
+};
+
+/* Constants for anything a camera does not specify */
+static const struct nefko_camera_params nef_generic_camera_params = {
+    .cfa_pattern = { 0, 1, 1, 2 },
+    .settings_crypt_off = NEF_IMAGE_SETTINGS_0205_OFF,
+    .settings_wb_off = NEF_IMAGE_SETTINGS_OFF,
+};
+
+static struct nef_image_reader *nef_extra_readers[NEF_MAX_EXTRA_READERS];
+static unsigned nef_nr_extra_readers = 0;
+
+static const struct nefko_camera *nef_extra_cameras[NEF_MAX_EXTRA_CAMERAS];
+static unsigned nef_nr_extra_cameras = 0;
+
+static int nef_registry_sealed = 0;
+
+#define NEF_NR_BUILTIN(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Get the length of a Model tag without the spaces it may be padded with */
+static size_t nef_model_len(const char *model)
+{
+    size_t len = strlen(model);
+
+    while (len > 0 && model[len - 1] == ' ') {
+        len--;
+    }
+
+    return len;
+}
+
+/* FNV-1a over the model name, folded to a slot by multiplicative hashing */
+static unsigned nef_camera_hash(const char *model, size_t len)
+{
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)model[i];
+        hash *= 0x01000193;
+    }
+
+    return (uint32_t)(hash * NEF_CAMERA_HASH_MULT) >> (32 - NEF_CAMERA_HASH_BITS);
+}
+
+void nef_registry_seal(void)
+{
+    if (!__atomic_load_n(&nef_registry_sealed, __ATOMIC_ACQUIRE)) {
+#ifdef _DEBUG
+        unsigned i;
+
+        for (i = 0; i < NEF_NR_BUILTIN(nef_builtin_cameras); i++) {
+            const char *name;
+
+            if (nef_builtin_cameras[i] == NULL) {
+                continue;
+            }
+
+            name = nef_builtin_cameras[i]->name;
+            if (nef_camera_hash(name, nef_model_len(name)) != i) {
+                NEF_ERROR("Camera '%s' is in the wrong hash slot (%u)\n",
+                    name, i);
+            }
+        }
+#endif
+        __atomic_store_n(&nef_registry_sealed, 1, __ATOMIC_RELEASE);
+    }
+}
 
 NEF_STATUS nefko_register_image_type(struct nef_image_reader *img_type)
 {
-    NEF_CHECK_ARG(img);
+    NEF_CHECK_ARG(img_type);
+    NEF_CHECK_ARG(img_type->can_open);
+    NEF_CHECK_ARG(img_type->init_state);
+    NEF_CHECK_ARG(img_type->decode_rows);
+    NEF_CHECK_ARG(img_type->clean_state);
+
+    if (__atomic_load_n(&nef_registry_sealed, __ATOMIC_ACQUIRE)) {
+        NEF_ERROR("Image readers must be registered before the first open\n");
+        return NEF_FAILURE;
+    }
+
+    if (nef_nr_extra_readers == NEF_MAX_EXTRA_READERS) {
+        return NEF_NO_MEMORY;
+    }
+
+    nef_extra_readers[nef_nr_extra_readers++] = img_type;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nefko_register_camera(const struct nefko_camera *camera)
+{
+    NEF_CHECK_ARG(camera);
+    NEF_CHECK_ARG(camera->name);
+
+    if (__atomic_load_n(&nef_registry_sealed, __ATOMIC_ACQUIRE)) {
+        NEF_ERROR("Cameras must be registered before the first open\n");
+        return NEF_FAILURE;
+    }
+
+    if (nef_nr_extra_cameras == NEF_MAX_EXTRA_CAMERAS) {
+        return NEF_NO_MEMORY;
+    }
 
-    if (nefko_image_types = NULL) {
-        nefko_image_types =
-            (struct nef_image_reader **)calloc(1, sizeof(struct nef_image_reader *));
+    nef_extra_cameras[nef_nr_extra_cameras++] = camera;
 
-        if (nefko_image_types == NULL) {
-            return NEF_NO_MEMORY;
+    return NEF_OK;
+}
+
+struct nef_image_reader *nef_registry_find_reader(struct nef_image *image)
+{
+    unsigned i;
+
+    for (i = 0; i < NEF_NR_BUILTIN(nef_builtin_readers); i++) {
+        if (nef_builtin_readers[i]->can_open(image) == NEF_OK) {
+            return nef_builtin_readers[i];
         }
+    }
+
+    for (i = 0; i < nef_nr_extra_readers; i++) {
+        if (nef_extra_readers[i]->can_open(image) == NEF_OK) {
+            return nef_extra_readers[i];
+        }
+    }
+
+    return NULL;
+}
 
-        nefko_image_types_count = 1;
-    } else {
-        nefko_image_types =
-            (struct nef_image_reader **)realloc(nefko_image_types,
-                ++nefko_image_types_count * sizeof(struct nef_image_reader *));
+/* Compare a camera name to the first len characters of a Model tag */
+static int nef_registry_model_matches(const char *name, const char *model,
+                                      size_t len)
+{
+    return !strncmp(name, model, len) && name[len] == '\0';
+}
+
+const struct nefko_camera *nef_registry_find_camera(const char *model)
+{
+    const struct nefko_camera *camera;
+    size_t len;
+    unsigned i;
+
+    if (model == NULL) {
+        return NULL;
+    }
+
+    len = nef_model_len(model);
 
-        if (nefko_image_types == NULL) {
-            return NEF_NO_MEMORY;
+    camera = nef_builtin_cameras[nef_camera_hash(model, len)];
+    if (camera != NULL && nef_registry_model_matches(camera->name, model, len)) {
+        return camera;
+    }
+
+    for (i = 0; i < nef_nr_extra_cameras; i++) {
+        if (nef_registry_model_matches(nef_extra_cameras[i]->name, model, len)) {
+            return nef_extra_cameras[i];
         }
     }
 
-    nefko_image_types[nefko_image_types_count - 1] = img_type;
+    return NULL;
+}
 
+void nef_camera_get_params(const struct nefko_camera *camera,
+                           struct nefko_camera_params *params)
+{
+    const struct nefko_camera_params *model;
 
-    return NEF_OK;
+    *params = nef_generic_camera_params;
+
+    if (camera == NULL || (model = camera->params) == NULL) {
+        return;
+    }
+
+#define NEF_CAMERA_PARAM(field) \
+    if (model->field != 0) params->field = model->field
+
+    NEF_CAMERA_PARAM(black_level);
+    NEF_CAMERA_PARAM(white_level);
+    NEF_CAMERA_PARAM(bits_per_sample);
+    NEF_CAMERA_PARAM(active_width);
+    NEF_CAMERA_PARAM(active_height);
+    NEF_CAMERA_PARAM(settings_crypt_off);
+    NEF_CAMERA_PARAM(settings_wb_off);
+
+#undef NEF_CAMERA_PARAM
+
+    /* All zeroes (all red) is not a real pattern */
+    if (model->cfa_pattern[0] | model->cfa_pattern[1] |
+        model->cfa_pattern[2] | model->cfa_pattern[3])
+    {
+        memcpy(params->cfa_pattern, model->cfa_pattern, 4);
+    }
 }
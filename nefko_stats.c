@@ -0,0 +1,97 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <string.h>
+#include <time.h>
+
+/* Instrumentation counters. Each handle keeps its own counters, and every
+ * update is also added, atomically, to the global totals. The timer is
+ * the TSC where there is one; its rate is estimated from how far it has
+ * advanced against the monotonic clock since the library was loaded.
+ */
+
+#ifdef NEF_STATS
+struct nef_stats nef_stats_global;
+
+static uint64_t nef_stats_epoch_ticks;
+static uint64_t nef_stats_epoch_ns;
+
+static uint64_t nef_stats_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void __attribute__((constructor)) nef_stats_epoch(void)
+{
+    nef_stats_epoch_ns = nef_stats_clock_ns();
+    nef_stats_epoch_ticks = nef_stats_now();
+}
+
+static double nef_stats_ticks_per_sec(void)
+{
+    uint64_t ns = nef_stats_clock_ns() - nef_stats_epoch_ns;
+    uint64_t ticks = nef_stats_now() - nef_stats_epoch_ticks;
+
+    /* Too little time has passed for a usable estimate */
+    if (ns < 1000000) {
+        return 0.0;
+    }
+
+    return (double)ticks * 1e9 / (double)ns;
+}
+#endif
+
+NEF_STATUS nef_stats_get(nef_t *fp, struct nef_stats *stats)
+{
+    NEF_CHECK_ARG(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+#ifdef NEF_STATS
+    if (fp != NULL) {
+        *stats = fp->stats;
+    } else {
+        int i;
+
+        for (i = 0; i < NEF_STAGE_COUNT; i++) {
+            struct nef_stage_stats *global = &nef_stats_global.stage[i];
+
+            stats->stage[i].calls =
+                __atomic_load_n(&global->calls, __ATOMIC_RELAXED);
+            stats->stage[i].ticks =
+                __atomic_load_n(&global->ticks, __ATOMIC_RELAXED);
+            stats->stage[i].bytes =
+                __atomic_load_n(&global->bytes, __ATOMIC_RELAXED);
+        }
+    }
+
+    stats->ticks_per_sec = nef_stats_ticks_per_sec();
+#endif
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_stats_reset(nef_t *fp)
+{
+#ifdef NEF_STATS
+    if (fp != NULL) {
+        memset(&fp->stats, 0, sizeof(fp->stats));
+    } else {
+        int i;
+
+        for (i = 0; i < NEF_STAGE_COUNT; i++) {
+            struct nef_stage_stats *global = &nef_stats_global.stage[i];
+
+            __atomic_store_n(&global->calls, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&global->ticks, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&global->bytes, 0, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+
+    return NEF_OK;
+}
@@ -0,0 +1,1050 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Decoding an NEF as it arrives, for files that come over a pipe or a
+ * socket rather than from somewhere they can be read at random.
+ *
+ * libghetto needs a file it can seek in, so a stream walks the TIFF
+ * structure itself. Each IFD and out-of-line tag value it learns of is
+ * recorded as a need: a range of the file it is waiting for. As bytes
+ * arrive, the needs they satisfy are parsed, which may add more. Until no
+ * needs are left everything received is kept, since an IFD may point
+ * anywhere before it. After that, only the strips of the raw image are
+ * kept, and they are decoded a band of rows at a time as they arrive.
+ *
+ * Cameras write the IFDs first and the raw image last, so the metadata is
+ * complete within the first few hundred KiB, and decoding keeps up with
+ * the transfer from then on. A file laid out the other way around is
+ * still decoded, but only once its IFDs have arrived.
+ */
+
+/* Number of rows decoded before they are handed to the rows callback */
+#define NEF_STREAM_BAND_ROWS    16
+
+/* Most bytes held while waiting for the metadata to be complete */
+#define NEF_STREAM_MAX_HELD     (512ul << 20)
+
+/* Most entries in an IFD, and most SubIFDs, that are believable */
+#define NEF_STREAM_MAX_ENTRIES  1024
+#define NEF_STREAM_MAX_SUBIFDS  8
+
+/* States of a stream */
+#define NEF_STREAM_HEADER       0   /* Waiting for the TIFF header */
+#define NEF_STREAM_META         1   /* Parsing IFDs as they arrive */
+#define NEF_STREAM_RAW          2   /* Decoding the raw image as it arrives */
+#define NEF_STREAM_DONE         3   /* The raw image has been decoded */
+#define NEF_STREAM_FAILED       4
+
+/* IFDs a stream parses */
+#define NEF_STREAM_IFD_ROOT         0
+#define NEF_STREAM_IFD_EXIF         1
+#define NEF_STREAM_IFD_MAKERNOTE    2
+#define NEF_STREAM_IFD_SUB          3
+
+/* A range of the file a stream is waiting for: an IFD, or the value of a
+ * tag that did not fit in its entry */
+struct nef_stream_need {
+    int ifd;                /* NEF_STREAM_IFD_* it is, or belongs to */
+    unsigned sub;           /* Index of the SubIFD */
+    int is_ifd;
+    int big_endian;         /* Byte order of the IFD */
+    size_t base;            /* Offsets in the IFD are relative to this */
+    size_t off;             /* File offset of the IFD or value */
+    size_t bytes;           /* Bytes needed; for an IFD, just its entry
+                               count until that is known */
+    unsigned tag;           /* The tag, for a value */
+    unsigned type;
+    unsigned count;
+};
+
+/* What a stream has learned of the image in a SubIFD */
+struct nef_stream_image {
+    uint32_t subfile_type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits;
+    uint32_t compression;
+    uint32_t chans;
+    uint32_t rows_per_strip;
+    uint8_t cfa_pattern[4];
+    int has_cfa_pattern;
+
+    uint32_t *strip_offs;
+    uint32_t *strip_bytes;
+    unsigned nr_strip_offs;
+    unsigned nr_strip_bytes;
+};
+
+struct nef_stream {
+    /* A handle with no file, for its allocator, camera and counters */
+    nef_t *nef;
+
+    struct nef_stream_callbacks cb;
+    int state;
+    NEF_STATUS status;
+
+    /* Count of bytes passed in so far */
+    size_t received;
+
+    /* Byte order of the file, and whether its Maker is Nikon */
+    int big_endian;
+    int is_nikon;
+
+    /* Everything received, while waiting for the metadata */
+    uint8_t *held;
+    size_t held_bytes;
+    size_t held_cap;
+
+    struct nef_stream_need *needs;
+    size_t nr_needs;
+    size_t cap_needs;
+
+    struct nef_stream_image subs[NEF_STREAM_MAX_SUBIFDS];
+    unsigned nr_subs;
+
+    /* The NEF decode table (MakerNote tag 150) */
+    uint8_t *npc_table;
+    size_t npc_table_bytes;
+
+    /* Tag values converted to host byte order */
+    uint8_t *scratch;
+    size_t scratch_cap;
+
+    /* The raw image. Its strips are taken in file order, each only up to
+     * strip_len bytes, and the strip being received is strip. */
+    struct nef_stream_image *raw;
+    uint32_t *strip_len;
+    unsigned strip;
+    size_t raw_left;
+
+    /* Raw image data received but not decoded yet */
+    uint8_t *win;
+    size_t win_bytes;
+    size_t win_cap;
+
+    /* The NPC decoder, or for an uncompressed image, the bits per sample
+     * in the data (16 for a 16-bit container) and the bytes per row */
+    struct nef_npc_stream *npc;
+    unsigned packing;
+    size_t row_bytes;
+
+    /* Rows decoded, and the band they are gathered in */
+    unsigned row;
+    unsigned band_row;
+    uint16_t *band;
+};
+
+/* Sizes of the TIFF types, by type; 0 for types that are not known */
+static const uint8_t nef_stream_type_sizes[] = {
+    0,
+    1,  /* BYTE */
+    1,  /* ASCII */
+    2,  /* SHORT */
+    4,  /* LONG */
+    8,  /* RATIONAL */
+    1,  /* SBYTE */
+    1,  /* UNDEFINED */
+    2,  /* SSHORT */
+    4,  /* SLONG */
+    8,  /* SRATIONAL */
+    4,  /* FLOAT */
+    8,  /* DOUBLE */
+    4,  /* IFD */
+};
+
+#define NEF_STREAM_NR_TYPES \
+    (sizeof(nef_stream_type_sizes) / sizeof(nef_stream_type_sizes[0]))
+
+static inline unsigned nef_stream_type_size(unsigned type)
+{
+    return type < NEF_STREAM_NR_TYPES ? nef_stream_type_sizes[type] : 0;
+}
+
+/* Size of the numbers a value of the type is made of, for byte swapping */
+static inline unsigned nef_stream_type_unit(unsigned type)
+{
+    return type == TIFF_TYPE_RATIONAL || type == 10 /* SRATIONAL */ ? 4 :
+        nef_stream_type_size(type);
+}
+
+static inline uint32_t nef_stream_get16(const uint8_t *p, int big_endian)
+{
+    return big_endian ? ((uint32_t)p[0] << 8) | p[1] :
+        p[0] | ((uint32_t)p[1] << 8);
+}
+
+static inline uint32_t nef_stream_get32(const uint8_t *p, int big_endian)
+{
+    return big_endian ?
+        ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3] :
+        p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+        ((uint32_t)p[3] << 24);
+}
+
+/* Grow a buffer to hold at least need bytes */
+static NEF_STATUS nef_stream_reserve(nef_t *nef, uint8_t **buf, size_t *cap,
+                                     size_t need)
+{
+    size_t new_cap = *cap ? *cap : 4096;
+    uint8_t *p;
+
+    if (need <= *cap) {
+        return NEF_OK;
+    }
+
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+
+    if ((p = (uint8_t *)nef_realloc(nef, *buf, new_cap)) == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    *buf = p;
+    *cap = new_cap;
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_stream_add_need(struct nef_stream *s,
+                                      const struct nef_stream_need *need)
+{
+    if (s->nr_needs == s->cap_needs) {
+        size_t cap = s->cap_needs ? s->cap_needs * 2 : 16;
+        struct nef_stream_need *p;
+
+        p = (struct nef_stream_need *)nef_realloc(s->nef, s->needs,
+            cap * sizeof(struct nef_stream_need));
+        if (p == NULL) {
+            return NEF_NO_MEMORY;
+        }
+
+        s->needs = p;
+        s->cap_needs = cap;
+    }
+
+    s->needs[s->nr_needs++] = *need;
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_stream_add_ifd(struct nef_stream *s, int ifd,
+                                     unsigned sub, int big_endian,
+                                     size_t base, size_t off)
+{
+    struct nef_stream_need need;
+
+    memset(&need, 0, sizeof(need));
+    need.ifd = ifd;
+    need.sub = sub;
+    need.is_ifd = 1;
+    need.big_endian = big_endian;
+    need.base = base;
+    need.off = off;
+    need.bytes = 2;
+
+    return nef_stream_add_need(s, &need);
+}
+
+/* Copy a value to the scratch buffer, in host byte order and aligned */
+static const void *nef_stream_host_value(struct nef_stream *s,
+                                         int big_endian, unsigned type,
+                                         unsigned count, const uint8_t *raw)
+{
+    unsigned unit = nef_stream_type_unit(type);
+    size_t bytes = (size_t)nef_stream_type_size(type) * count, i;
+
+    if (nef_stream_reserve(s->nef, &s->scratch, &s->scratch_cap, bytes)
+            != NEF_OK)
+    {
+        return NULL;
+    }
+
+    if (unit == 1 || big_endian == NEF_HOST_BIG_ENDIAN) {
+        memcpy(s->scratch, raw, bytes);
+        return s->scratch;
+    }
+
+    for (i = 0; i < bytes; i += unit) {
+        unsigned j;
+
+        for (j = 0; j < unit; j++) {
+            s->scratch[i + j] = raw[i + unit - 1 - j];
+        }
+    }
+
+    return s->scratch;
+}
+
+/* Get item i of a value in host byte order as an integer */
+static uint32_t nef_stream_item(unsigned type, const void *value, unsigned i)
+{
+    switch (type) {
+    case TIFF_TYPE_BYTE:
+    case TIFF_TYPE_UNDEFINED:
+        return ((const uint8_t *)value)[i];
+    case TIFF_TYPE_SHORT:
+        return ((const uint16_t *)value)[i];
+    case TIFF_TYPE_LONG:
+    case 13:    /* IFD */
+        return ((const uint32_t *)value)[i];
+    default:
+        return 0;
+    }
+}
+
+static NEF_STATUS nef_stream_item_array(struct nef_stream *s, unsigned type,
+                                        unsigned count, const void *value,
+                                        uint32_t **items)
+{
+    unsigned i;
+
+    if (*items != NULL) {
+        nef_free(s->nef, *items);
+    }
+
+    if ((*items = (uint32_t *)nef_alloc(s->nef, count * sizeof(uint32_t)))
+            == NULL)
+    {
+        return NEF_NO_MEMORY;
+    }
+
+    for (i = 0; i < count; i++) {
+        (*items)[i] = nef_stream_item(type, value, i);
+    }
+
+    return NEF_OK;
+}
+
+/* Note a tag of a SubIFD that describes its image */
+static NEF_STATUS nef_stream_sub_tag(struct nef_stream *s,
+                                     struct nef_stream_image *img,
+                                     unsigned tag, unsigned type,
+                                     unsigned count, const void *value)
+{
+    uint32_t v = nef_stream_item(type, value, 0);
+
+    switch (tag) {
+    case TIFF_TAG_NEWSUBFILETYPE:
+        img->subfile_type = v;
+        break;
+    case TIFF_TAG_IMAGEWIDTH:
+        img->width = v;
+        break;
+    case TIFF_TAG_IMAGELENGTH:
+        img->height = v;
+        break;
+    case TIFF_TAG_BITSPERSAMPLE:
+        img->bits = v;
+        break;
+    case TIFF_TAG_COMPRESSION:
+        img->compression = v;
+        break;
+    case TIFF_TAG_SAMPLESPERPIXEL:
+        img->chans = v;
+        break;
+    case TIFF_TAG_ROWSPERSTRIP:
+        img->rows_per_strip = v;
+        break;
+    case TIFF_TAG_CFAPATTERN:
+        if (count == 4) {
+            memcpy(img->cfa_pattern, value, 4);
+            img->has_cfa_pattern = 1;
+        }
+        break;
+    case TIFF_TAG_STRIPOFFSETS:
+        img->nr_strip_offs = count;
+        return nef_stream_item_array(s, type, count, value, &img->strip_offs);
+    case TIFF_TAG_STRIPBYTECOUNTS:
+        img->nr_strip_bytes = count;
+        return nef_stream_item_array(s, type, count, value, &img->strip_bytes);
+    }
+
+    return NEF_OK;
+}
+
+/* Handle a tag whose value has arrived. raw is the value as stored, at
+ * file offset off. */
+static NEF_STATUS nef_stream_tag(struct nef_stream *s,
+                                 const struct nef_stream_need *ifd,
+                                 unsigned tag, unsigned type, unsigned count,
+                                 const uint8_t *raw, size_t off)
+{
+    const void *value;
+    int tag_id = tag;
+    unsigned i;
+    NEF_STATUS ret;
+
+    if ((value = nef_stream_host_value(s, ifd->big_endian, type, count, raw))
+            == NULL)
+    {
+        return NEF_NO_MEMORY;
+    }
+
+    switch (ifd->ifd) {
+    case NEF_STREAM_IFD_SUB:
+        return nef_stream_sub_tag(s, &s->subs[ifd->sub], tag, type, count,
+                                  value);
+
+    case NEF_STREAM_IFD_ROOT:
+        if (tag == TIFF_TAG_MAKER) {
+            s->is_nikon = count >= 17 &&
+                !strncmp((const char *)raw, "NIKON CORPORATION", 17);
+        } else if (tag == TIFF_TAG_MODEL && type == TIFF_TYPE_ASCII &&
+                   count > 0)
+        {
+            char model[64];
+            size_t len = count < sizeof(model) ? count : sizeof(model) - 1;
+
+            memcpy(model, raw, len);
+            model[len] = '\0';
+
+            nef_camera_get_params(nef_registry_find_camera(model),
+                                  &s->nef->params);
+        } else if (tag == TIFF_TAG_SUBIFDS) {
+            for (i = 0; i < count && s->nr_subs < NEF_STREAM_MAX_SUBIFDS;
+                 i++)
+            {
+                if ((ret = nef_stream_add_ifd(s, NEF_STREAM_IFD_SUB,
+                        s->nr_subs++, s->big_endian, 0,
+                        nef_stream_item(type, value, i))) != NEF_OK)
+                {
+                    return ret;
+                }
+            }
+        } else if (tag == TIFF_TAG_EXIFIFD) {
+            if ((ret = nef_stream_add_ifd(s, NEF_STREAM_IFD_EXIF, 0,
+                    s->big_endian, 0, nef_stream_item(type, value, 0)))
+                    != NEF_OK)
+            {
+                return ret;
+            }
+        }
+        break;
+
+    case NEF_STREAM_IFD_EXIF:
+        /* The MakerNote is a signature, then an embedded TIFF header that
+         * its offsets are relative to */
+        if (tag == TIFF_TAG_EXIF_MAKERNOTE && count >= NEF_MAKERNOTE_OFF &&
+            !strncmp((const char *)raw, "Nikon", 5))
+        {
+            const uint8_t *header = raw + NEF_MAKERNOTE_OFF - 8;
+            int big_endian = header[0] == 'M';
+
+            if ((ret = nef_stream_add_ifd(s, NEF_STREAM_IFD_MAKERNOTE, 0,
+                    big_endian, off + NEF_MAKERNOTE_OFF - 8,
+                    off + NEF_MAKERNOTE_OFF - 8 +
+                    nef_stream_get32(header + 4, big_endian))) != NEF_OK)
+            {
+                return ret;
+            }
+        }
+        break;
+
+    case NEF_STREAM_IFD_MAKERNOTE:
+        tag_id = NEF_TAG_MAKERNOTE(tag);
+
+        if (tag == TIFF_TAG_MAKERNOTE_NEF_DECODE && s->npc_table == NULL) {
+            if ((s->npc_table = (uint8_t *)nef_alloc(s->nef, count)) == NULL) {
+                return NEF_NO_MEMORY;
+            }
+            memcpy(s->npc_table, raw, count);
+            s->npc_table_bytes = count;
+        }
+        break;
+    }
+
+    if (s->cb.tag != NULL) {
+        return s->cb.tag(s->cb.ctx, tag_id, type, count, value);
+    }
+
+    return NEF_OK;
+}
+
+/* Parse an IFD, once its entry count has arrived and then once all of its
+ * entries have. Values that are not inline become needs. */
+static NEF_STATUS nef_stream_parse_ifd(struct nef_stream *s,
+                                       struct nef_stream_need *need)
+{
+    const uint8_t *ifd = s->held + need->off;
+    unsigned nr_entries = nef_stream_get16(ifd, need->big_endian), i;
+    NEF_STATUS ret = NEF_OK;
+    NEF_STATS_START(start);
+
+    if (need->bytes == 2) {
+        if (nr_entries == 0 || nr_entries > NEF_STREAM_MAX_ENTRIES) {
+            NEF_TRACE("IFD at %zu has %u entries\n", need->off, nr_entries);
+            return NEF_NOT_NEF;
+        }
+
+        need->bytes = 2 + nr_entries * 12;
+
+        return nef_stream_add_need(s, need);
+    }
+
+    for (i = 0; i < nr_entries && ret == NEF_OK; i++) {
+        const uint8_t *ent = ifd + 2 + i * 12;
+        unsigned tag = nef_stream_get16(ent, need->big_endian);
+        unsigned type = nef_stream_get16(ent + 2, need->big_endian);
+        uint32_t count = nef_stream_get32(ent + 4, need->big_endian);
+        size_t size = nef_stream_type_size(type), bytes;
+
+        /* Entries of unknown types are skipped, as TIFF says */
+        if (size == 0 || count == 0 || count > 0x7fffffff / size) {
+            continue;
+        }
+
+        bytes = size * count;
+
+        if (bytes <= 4) {
+            ret = nef_stream_tag(s, need, tag, type, count, ent + 8,
+                                 need->off + 2 + i * 12 + 8);
+        } else {
+            struct nef_stream_need value = *need;
+
+            value.is_ifd = 0;
+            value.off = need->base + nef_stream_get32(ent + 8,
+                                                      need->big_endian);
+            value.bytes = bytes;
+            value.tag = tag;
+            value.type = type;
+            value.count = count;
+
+            ret = nef_stream_add_need(s, &value);
+        }
+    }
+
+    NEF_STATS_STOP(s->nef, NEF_STAGE_IFD_PARSE, start, need->bytes);
+
+    return ret;
+}
+
+/* Take bytes at file offset off that belong to the strips of the raw
+ * image into the window */
+static NEF_STATUS nef_stream_take(struct nef_stream *s, size_t off,
+                                  const uint8_t *data, size_t len)
+{
+    struct nef_stream_image *raw = s->raw;
+    NEF_STATUS ret;
+
+    while (len > 0 && s->strip < raw->nr_strip_offs) {
+        size_t start = raw->strip_offs[s->strip];
+        size_t end = start + s->strip_len[s->strip], n;
+
+        if (off >= end) {
+            s->strip++;
+            continue;
+        }
+
+        if (off + len <= start) {
+            break;
+        }
+
+        if (off < start) {
+            data += start - off;
+            len -= start - off;
+            off = start;
+        }
+
+        n = end - off < len ? end - off : len;
+
+        if ((ret = nef_stream_reserve(s->nef, &s->win, &s->win_cap,
+                                      s->win_bytes + n)) != NEF_OK)
+        {
+            return ret;
+        }
+
+        memcpy(s->win + s->win_bytes, data, n);
+        s->win_bytes += n;
+        s->raw_left -= n;
+
+        data += n;
+        off += n;
+        len -= n;
+    }
+
+    return NEF_OK;
+}
+
+/* Convert uncompressed rows of the window into the band */
+static unsigned nef_stream_unpack_rows(struct nef_stream *s,
+                                       const uint8_t *data, size_t bytes,
+                                       uint16_t *out, unsigned nr_rows)
+{
+    unsigned width = s->raw->width, i;
+
+    if (bytes / s->row_bytes < nr_rows) {
+        nr_rows = bytes / s->row_bytes;
+    }
+
+    for (i = 0; i < nr_rows; i++, data += s->row_bytes, out += width) {
+        switch (s->packing) {
+        case 12:
+            nef_unpack_12(data, out, width, s->big_endian);
+            break;
+        case 14:
+            nef_unpack_14(data, out, width, s->big_endian);
+            break;
+        default: {
+            unsigned x;
+
+            for (x = 0; x < width; x++) {
+                out[x] = nef_stream_get16(data + 2 * x, s->big_endian);
+            }
+            break;
+        }
+        }
+    }
+
+    return nr_rows;
+}
+
+/* Decode as many rows as the window allows, handing them on a band at a
+ * time, and drop the bytes that were used up */
+static NEF_STATUS nef_stream_decode(struct nef_stream *s)
+{
+    unsigned width = s->raw->width, height = s->raw->height;
+    size_t pos = 0;
+    NEF_STATUS ret = NEF_OK;
+    NEF_STATS_START(start);
+
+    while (s->row < height) {
+        unsigned want = NEF_STREAM_BAND_ROWS - s->band_row, got = 0;
+        uint16_t *out = s->band + s->band_row * width;
+
+        if (want > height - s->row) {
+            want = height - s->row;
+        }
+
+        if (s->npc != NULL) {
+            size_t used = 0;
+
+            ret = nef_npc_stream_rows(s->npc, s->win + pos, s->win_bytes - pos,
+                                      s->raw_left == 0, out, width, want, &got,
+                                      &used);
+            pos += used;
+        } else {
+            got = nef_stream_unpack_rows(s, s->win + pos, s->win_bytes - pos,
+                                         out, want);
+            pos += got * s->row_bytes;
+        }
+
+        s->row += got;
+        s->band_row += got;
+
+        if (ret != NEF_OK) {
+            break;
+        }
+
+        if (s->band_row == NEF_STREAM_BAND_ROWS || s->row == height) {
+            NEF_STATS_STOP(s->nef, NEF_STAGE_ENTROPY, start,
+                           s->band_row * width * sizeof(uint16_t));
+
+            if (s->cb.rows != NULL &&
+                (ret = s->cb.rows(s->cb.ctx, s->row - s->band_row,
+                                  s->band_row, s->band, width)) != NEF_OK)
+            {
+                break;
+            }
+
+            s->band_row = 0;
+            NEF_STATS_RESTART(start);
+        }
+
+        if (got == 0) {
+            if (s->raw_left == 0) {
+                NEF_ERROR("Raw image data ends at row %u of %u\n", s->row,
+                    height);
+                ret = NEF_RANGE_ERROR;
+            }
+            break;
+        }
+    }
+
+    memmove(s->win, s->win + pos, s->win_bytes - pos);
+    s->win_bytes -= pos;
+
+    if (ret == NEF_OK && s->row == height) {
+        s->state = NEF_STREAM_DONE;
+    }
+
+    return ret;
+}
+
+/* Set up decoding an uncompressed raw image, as the uncompressed reader
+ * does: samples are in a 16-bit container if there is room for one */
+static NEF_STATUS nef_stream_setup_unpacked(struct nef_stream *s)
+{
+    struct nef_stream_image *raw = s->raw;
+    size_t total = 0, samples = (size_t)raw->width * raw->height;
+    unsigned i;
+
+    if (raw->chans != 1) {
+        return NEF_RANGE_ERROR;
+    }
+
+    for (i = 0; i < raw->nr_strip_bytes; i++) {
+        total += raw->strip_bytes[i];
+    }
+
+    if (raw->bits == 16 || total >= samples * 2) {
+        s->packing = 16;
+    } else if ((raw->bits == 12 && raw->width % 2 == 0) ||
+               (raw->bits == 14 && raw->width % 4 == 0))
+    {
+        s->packing = raw->bits;
+    } else {
+        NEF_TRACE("Unsupported uncompressed sample depth: %u\n", raw->bits);
+        return NEF_RANGE_ERROR;
+    }
+
+    s->row_bytes = (size_t)raw->width * s->packing / 8;
+
+    /* Only take the rows of each strip, not any padding after them */
+    for (i = 0; i < raw->nr_strip_offs; i++) {
+        size_t rows = raw->height - (size_t)i * raw->rows_per_strip;
+
+        if (rows > raw->rows_per_strip) {
+            rows = raw->rows_per_strip;
+        }
+
+        if (raw->strip_bytes[i] < rows * s->row_bytes) {
+            NEF_TRACE("Strip %u is too short: %u bytes for %zu rows\n", i,
+                raw->strip_bytes[i], rows);
+            return NEF_RANGE_ERROR;
+        }
+
+        s->strip_len[i] = rows * s->row_bytes;
+    }
+
+    return NEF_OK;
+}
+
+/* The metadata is complete: find the raw image, set up its decoder, and
+ * start on whatever of its data is already here */
+static NEF_STATUS nef_stream_start_raw(struct nef_stream *s)
+{
+    struct nef_stream_image *raw = NULL;
+    size_t end = 0;
+    unsigned i;
+    NEF_STATUS ret;
+
+    if (!s->is_nikon) {
+        NEF_TRACE("Maker is not NIKON\n");
+        return NEF_NOT_NEF;
+    }
+
+    for (i = 0; i < s->nr_subs && raw == NULL; i++) {
+        struct nef_stream_image *img = &s->subs[i];
+
+        if (img->subfile_type == 0 && img->width > 0 && img->height > 0 &&
+            img->nr_strip_offs > 0 &&
+            img->nr_strip_offs == img->nr_strip_bytes)
+        {
+            raw = img;
+        }
+    }
+
+    if (raw == NULL) {
+        NEF_TRACE("No full-resolution image\n");
+        return NEF_NOT_NEF;
+    }
+
+    s->raw = raw;
+
+    if (raw->bits == 0) {
+        raw->bits = s->nef->params.bits_per_sample;
+    }
+
+    if (raw->chans == 0) {
+        raw->chans = 1;
+    }
+
+    if (raw->rows_per_strip == 0 || raw->rows_per_strip > raw->height) {
+        raw->rows_per_strip = raw->height;
+    }
+
+    if (!raw->has_cfa_pattern) {
+        memcpy(raw->cfa_pattern, s->nef->params.cfa_pattern, 4);
+    }
+
+    s->strip_len = (uint32_t *)nef_alloc(s->nef,
+                                         raw->nr_strip_offs * sizeof(uint32_t));
+    s->band = (uint16_t *)nef_alloc_raw(s->nef, sizeof(uint16_t) * raw->width *
+                                        NEF_STREAM_BAND_ROWS);
+    if (s->strip_len == NULL || s->band == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    memcpy(s->strip_len, raw->strip_bytes,
+           raw->nr_strip_offs * sizeof(uint32_t));
+
+    if (raw->compression == TIFF_COMPRESSION_NIKON) {
+        if (s->npc_table == NULL) {
+            NEF_TRACE("No NEF decode table\n");
+            return NEF_NOT_FOUND;
+        }
+
+        if ((ret = nef_npc_stream_new(s->nef, s->npc_table,
+                                      s->npc_table_bytes, raw->bits,
+                                      raw->width, raw->height, &s->npc))
+                != NEF_OK)
+        {
+            return ret;
+        }
+    } else if (raw->compression == TIFF_COMPRESSION_NONE) {
+        if ((ret = nef_stream_setup_unpacked(s)) != NEF_OK) {
+            return ret;
+        }
+    } else {
+        NEF_TRACE("Unsupported raw compression %u\n", raw->compression);
+        return NEF_RANGE_ERROR;
+    }
+
+    /* Strips are taken as they go by, so they must be in file order */
+    for (i = 0; i < raw->nr_strip_offs; i++) {
+        if (raw->strip_offs[i] < end) {
+            NEF_TRACE("Strip %u is out of order\n", i);
+            return NEF_RANGE_ERROR;
+        }
+
+        end = (size_t)raw->strip_offs[i] + s->strip_len[i];
+        s->raw_left += s->strip_len[i];
+    }
+
+    NEF_TRACE("Raw image: %u x %u, %u bits, compression %u, %u strips\n",
+        raw->width, raw->height, raw->bits, raw->compression,
+        raw->nr_strip_offs);
+
+    if (s->cb.image != NULL &&
+        (ret = s->cb.image(s->cb.ctx, raw->width, raw->height, raw->bits,
+                           raw->cfa_pattern)) != NEF_OK)
+    {
+        return ret;
+    }
+
+    s->state = NEF_STREAM_RAW;
+
+    /* Keep only the raw image data from what was held */
+    ret = nef_stream_take(s, 0, s->held, s->held_bytes);
+
+    nef_free(s->nef, s->held);
+    s->held = NULL;
+    s->held_bytes = s->held_cap = 0;
+
+    if (ret != NEF_OK) {
+        return ret;
+    }
+
+    return nef_stream_decode(s);
+}
+
+/* Parse whatever the held bytes allow */
+static NEF_STATUS nef_stream_parse(struct nef_stream *s)
+{
+    int progress = 1;
+    NEF_STATUS ret;
+
+    if (s->state == NEF_STREAM_HEADER) {
+        const uint8_t *h = s->held;
+
+        if (s->held_bytes < 8) {
+            return NEF_OK;
+        }
+
+        if (h[0] == 'M' && h[1] == 'M') {
+            s->big_endian = 1;
+        } else if (h[0] != 'I' || h[1] != 'I') {
+            return NEF_NOT_NEF;
+        }
+
+        if (nef_stream_get16(h + 2, s->big_endian) != 42) {
+            return NEF_NOT_NEF;
+        }
+
+        if ((ret = nef_stream_add_ifd(s, NEF_STREAM_IFD_ROOT, 0,
+                s->big_endian, 0, nef_stream_get32(h + 4, s->big_endian)))
+                != NEF_OK)
+        {
+            return ret;
+        }
+
+        s->state = NEF_STREAM_META;
+    }
+
+    while (progress && s->nr_needs > 0) {
+        size_t i = 0;
+
+        progress = 0;
+
+        while (i < s->nr_needs) {
+            struct nef_stream_need need = s->needs[i];
+
+            if (need.off + need.bytes > s->held_bytes) {
+                i++;
+                continue;
+            }
+
+            s->needs[i] = s->needs[--s->nr_needs];
+            progress = 1;
+
+            if (need.is_ifd) {
+                ret = nef_stream_parse_ifd(s, &need);
+            } else {
+                ret = nef_stream_tag(s, &need, need.tag, need.type, need.count,
+                                     s->held + need.off, need.off);
+            }
+
+            if (ret != NEF_OK) {
+                return ret;
+            }
+        }
+    }
+
+    if (s->nr_needs == 0) {
+        return nef_stream_start_raw(s);
+    }
+
+    if (s->held_bytes > NEF_STREAM_MAX_HELD) {
+        NEF_ERROR("Metadata is still incomplete after %zu bytes\n",
+            s->held_bytes);
+        return NEF_RANGE_ERROR;
+    }
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_stream_open(const struct nef_stream_callbacks *cb,
+                           const struct nef_allocator *alloc,
+                           nef_stream_t **stream)
+{
+    struct nef_stream *s = NULL;
+    nef_t *nef = NULL;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(cb);
+    NEF_CHECK_ARG(stream);
+
+    *stream = NULL;
+
+    nef_registry_seal();
+
+    if ((ret = nef_handle_alloc(0, alloc, &nef)) != NEF_OK) {
+        return ret;
+    }
+
+    if ((s = (struct nef_stream *)nef_alloc(nef, sizeof(*s))) == NULL) {
+        nef_handle_free(nef);
+        return NEF_NO_MEMORY;
+    }
+
+    nef_camera_get_params(NULL, &nef->params);
+
+    s->nef = nef;
+    s->cb = *cb;
+    s->state = NEF_STREAM_HEADER;
+
+    *stream = s;
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_stream_feed(nef_stream_t *stream, const void *bytes,
+                           size_t len)
+{
+    struct nef_stream *s = stream;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(stream);
+    NEF_CHECK_ARG(bytes != NULL || len == 0);
+
+    switch (s->state) {
+    case NEF_STREAM_FAILED:
+        return s->status;
+
+    case NEF_STREAM_DONE:
+        break;
+
+    case NEF_STREAM_RAW:
+        if ((ret = nef_stream_take(s, s->received, (const uint8_t *)bytes,
+                                   len)) == NEF_OK)
+        {
+            ret = nef_stream_decode(s);
+        }
+        break;
+
+    default:
+        if ((ret = nef_stream_reserve(s->nef, &s->held, &s->held_cap,
+                                      s->held_bytes + len)) != NEF_OK)
+        {
+            break;
+        }
+
+        memcpy(s->held + s->held_bytes, bytes, len);
+        s->held_bytes += len;
+
+        ret = nef_stream_parse(s);
+        break;
+    }
+
+    s->received += len;
+
+    if (ret != NEF_OK) {
+        s->state = NEF_STREAM_FAILED;
+        s->status = ret;
+    }
+
+    return ret;
+}
+
+NEF_STATUS nef_stream_finish(nef_stream_t *stream)
+{
+    NEF_CHECK_ARG(stream);
+
+    switch (stream->state) {
+    case NEF_STREAM_DONE:
+        return NEF_OK;
+    case NEF_STREAM_FAILED:
+        return stream->status;
+    default:
+        NEF_TRACE("Stream ended after %zu bytes, before the raw image did\n",
+            stream->received);
+        stream->state = NEF_STREAM_FAILED;
+        stream->status = NEF_RANGE_ERROR;
+        return NEF_RANGE_ERROR;
+    }
+}
+
+NEF_STATUS nef_stream_close(nef_stream_t *stream)
+{
+    nef_t *nef;
+    unsigned i;
+
+    NEF_CHECK_ARG(stream);
+
+    nef = stream->nef;
+
+    for (i = 0; i < stream->nr_subs; i++) {
+        if (stream->subs[i].strip_offs) nef_free(nef, stream->subs[i].strip_offs);
+        if (stream->subs[i].strip_bytes) nef_free(nef, stream->subs[i].strip_bytes);
+    }
+
+    nef_npc_stream_free(nef, stream->npc);
+
+    if (stream->held) nef_free(nef, stream->held);
+    if (stream->needs) nef_free(nef, stream->needs);
+    if (stream->npc_table) nef_free(nef, stream->npc_table);
+    if (stream->scratch) nef_free(nef, stream->scratch);
+    if (stream->strip_len) nef_free(nef, stream->strip_len);
+    if (stream->win) nef_free(nef, stream->win);
+    if (stream->band) nef_free(nef, stream->band);
+
+    nef_free(nef, stream);
+    nef_handle_free(nef);
+
+    return NEF_OK;
+}
@@ -0,0 +1,1065 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_synth.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Knots in the linearization curve of lossy images */
+#define NEF_SYNTH_CURVE_KNOTS   257
+
+/* Size of the NEF decode table; large enough to hold the split row */
+#define NEF_SYNTH_DECODE_SIZE   (NEF_NPC_SPLIT_OFF + 2)
+
+/* Size of the image settings block (MakerNote tag 151) */
+#define NEF_SYNTH_SETTINGS_SIZE 300
+
+/* Largest dimension of the RGB thumbnail in the root IFD */
+#define NEF_SYNTH_THUMB_MAX     160
+
+/* A growable output buffer */
+struct nef_synth_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+/* A TIFF directory entry to be written. data points at count values of
+ * the host type matching type: uint8_t, uint16_t or uint32_t, with
+ * RATIONALs as numerator/denominator pairs of uint32_t.
+ */
+struct nef_synth_entry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    const void *data;
+};
+
+#define NEF_SYNTH_ENTRY(t, ty, c, d) \
+    { .tag = (t), .type = (ty), .count = (c), .data = (d) }
+
+struct nef_synth_bits {
+    struct nef_synth_buf *buf;
+    uint64_t acc;
+    unsigned nr_bits;
+};
+
+void nef_synth_default_params(struct nef_synth_params *params)
+{
+    memset(params, 0, sizeof(*params));
+
+    params->width = 640;
+    params->height = 428;
+    params->bits = 12;
+    params->lossy = 0;
+    params->packing = NEF_SYNTH_PACK_NPC;
+    params->content = NEF_SYNTH_SCENE;
+    params->seed = 1;
+    params->model = "NIKON D300S";
+    params->serial = 4012345;
+    params->shutter_count = 12345;
+    params->cfa_pattern[0] = 0;
+    params->cfa_pattern[1] = 1;
+    params->cfa_pattern[2] = 1;
+    params->cfa_pattern[3] = 2;
+    params->wb[0] = 1.75f;
+    params->wb[1] = 1.25f;
+    params->orientation = 1;
+}
+
+static NEF_STATUS nef_synth_check_params(const struct nef_synth_params *params)
+{
+    NEF_CHECK_ARG(params);
+
+    if (params->width < 2 || params->height < 2 ||
+        (params->width & 1) || (params->height & 1))
+    {
+        NEF_TRACE("Image must be at least 2x2, with even dimensions\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    if (params->bits != 12 && params->bits != 14) {
+        NEF_TRACE("Unsupported sample depth: %u\n", params->bits);
+        return NEF_RANGE_ERROR;
+    }
+
+    if (params->content < NEF_SYNTH_SCENE || params->content > NEF_SYNTH_FLAT) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (params->packing < NEF_SYNTH_PACK_NPC ||
+        params->packing > NEF_SYNTH_PACK_BITS)
+    {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (params->orientation < 1 || params->orientation > 8) {
+        NEF_TRACE("Unknown orientation: %u\n", params->orientation);
+        return NEF_RANGE_ERROR;
+    }
+
+    if (params->lossy && params->packing != NEF_SYNTH_PACK_NPC) {
+        NEF_TRACE("Only NPC images can be lossy\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    /* Packed rows hold whole groups of samples, as cameras write them */
+    if (params->packing == NEF_SYNTH_PACK_BITS && params->bits == 14 &&
+        (params->width & 3))
+    {
+        NEF_TRACE("Packed 14-bit images must be a multiple of 4 wide\n");
+        return NEF_RANGE_ERROR;
+    }
+
+    return NEF_OK;
+}
+
+/*******************************************************************/
+/* Image content                                                   */
+/*******************************************************************/
+
+static inline uint32_t nef_synth_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+/* Render the linear samples of the raw image */
+static void nef_synth_render(const struct nef_synth_params *params,
+                             uint16_t *samples)
+{
+    unsigned row, col, max = (1u << params->bits) - 1;
+    uint32_t rng = params->seed ? params->seed : 1;
+
+    for (row = 0; row < params->height; row++) {
+        uint16_t *out = samples + (size_t)row * params->width;
+
+        for (col = 0; col < params->width; col++) {
+            unsigned colour = params->cfa_pattern[(row & 1) * 2 + (col & 1)];
+            int v;
+
+            switch (params->content) {
+            case NEF_SYNTH_GRADIENT:
+                v = (col * (max / 2)) / params->width +
+                    (row * (max / 2)) / params->height;
+                break;
+            case NEF_SYNTH_NOISE:
+                v = nef_synth_rand(&rng) & max;
+                break;
+            case NEF_SYNTH_FLAT:
+                v = (max / 4) * (colour + 1);
+                break;
+            default:
+                /* A gradient per colour, scaled like a daylight scene,
+                 * with some sensor noise on top */
+                v = ((col * (max / 2)) / params->width +
+                     (row * (max / 4)) / params->height) *
+                    (colour + 2) / 4 + max / 16;
+                v += (int)(nef_synth_rand(&rng) & 63) - 32;
+                break;
+            }
+
+            if (v < 0) v = 0;
+            if (v > (int)max) v = max;
+
+            out[col] = v;
+        }
+    }
+}
+
+/* Build the linearization curve of a lossy image, exactly as the decoder
+ * will expand it from the knots. Returns the knots and the expanded curve.
+ */
+static void nef_synth_lossy_curve(unsigned bits, uint16_t *knots,
+                                  uint16_t *curve)
+{
+    unsigned max = 1u << bits, step, i;
+    uint64_t top = max - 1, span = NEF_SYNTH_CURVE_KNOTS - 1;
+
+    step = max / (NEF_SYNTH_CURVE_KNOTS - 1);
+
+    /* Quadratic, so the shadows get the finest steps */
+    for (i = 0; i < NEF_SYNTH_CURVE_KNOTS; i++) {
+        knots[i] = (uint16_t)((i * i * top + span * span / 2) / (span * span));
+        curve[i * step] = knots[i];
+    }
+
+    for (i = 0; i < max; i++) {
+        unsigned frac = i % step;
+        curve[i] = (curve[i - frac] * (step - frac) +
+                    curve[i - frac + step] * frac) / step;
+    }
+}
+
+/* Map linear samples to curve indices, choosing the nearest curve entry */
+static NEF_STATUS nef_synth_quantize(unsigned bits, const uint16_t *curve,
+                                     uint16_t *samples, size_t count)
+{
+    unsigned max = 1u << bits, v, i = 0;
+    uint16_t *inv;
+    size_t n;
+
+    inv = (uint16_t *)malloc(max * sizeof(uint16_t));
+    if (inv == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    for (v = 0; v < max; v++) {
+        while (i + 1 < max &&
+               abs((int)curve[i + 1] - (int)v) <= abs((int)curve[i] - (int)v))
+        {
+            i++;
+        }
+        inv[v] = i;
+    }
+
+    for (n = 0; n < count; n++) {
+        samples[n] = inv[samples[n]];
+    }
+
+    free(inv);
+
+    return NEF_OK;
+}
+
+NEF_STATUS nef_synth_expected(const struct nef_synth_params *params,
+                              uint16_t *samples)
+{
+    uint16_t *knots = NULL, *curve = NULL;
+    size_t count, i;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(samples);
+
+    if ((ret = nef_synth_check_params(params)) != NEF_OK) {
+        return ret;
+    }
+
+    count = (size_t)params->width * params->height;
+
+    nef_synth_render(params, samples);
+
+    if (!params->lossy) {
+        return NEF_OK;
+    }
+
+    knots = (uint16_t *)malloc(NEF_SYNTH_CURVE_KNOTS * sizeof(uint16_t));
+    curve = (uint16_t *)malloc(NEF_NPC_CURVE_SIZE * sizeof(uint16_t));
+    if (knots == NULL || curve == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto done;
+    }
+
+    nef_synth_lossy_curve(params->bits, knots, curve);
+
+    if ((ret = nef_synth_quantize(params->bits, curve, samples, count))
+            != NEF_OK)
+    {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        samples[i] = curve[samples[i]];
+    }
+
+done:
+    free(knots);
+    free(curve);
+
+    return ret;
+}
+
+/*******************************************************************/
+/* Output buffer                                                   */
+/*******************************************************************/
+
+static NEF_STATUS nef_synth_reserve(struct nef_synth_buf *buf, size_t bytes)
+{
+    size_t cap = buf->cap ? buf->cap : 4096;
+    uint8_t *data;
+
+    if (buf->len + bytes <= buf->cap) {
+        return NEF_OK;
+    }
+
+    while (cap < buf->len + bytes) {
+        cap *= 2;
+    }
+
+    data = (uint8_t *)realloc(buf->data, cap);
+    if (data == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return NEF_OK;
+}
+
+/* Append bytes to the buffer, starting on an even offset as TIFF requires,
+ * and return the offset they were written at. data may be NULL to append
+ * zeroes.
+ */
+static NEF_STATUS nef_synth_append(struct nef_synth_buf *buf, const void *data,
+                                   size_t bytes, size_t *offset)
+{
+    NEF_STATUS ret;
+    size_t pad = buf->len & 1;
+
+    if ((ret = nef_synth_reserve(buf, bytes + pad)) != NEF_OK) {
+        return ret;
+    }
+
+    if (pad) {
+        buf->data[buf->len++] = 0;
+    }
+
+    if (offset) {
+        *offset = buf->len;
+    }
+
+    if (data) {
+        memcpy(buf->data + buf->len, data, bytes);
+    } else {
+        memset(buf->data + buf->len, 0, bytes);
+    }
+
+    buf->len += bytes;
+
+    return NEF_OK;
+}
+
+static inline NEF_STATUS nef_synth_append_byte(struct nef_synth_buf *buf,
+                                               uint8_t byte)
+{
+    NEF_STATUS ret;
+
+    if ((ret = nef_synth_reserve(buf, 1)) != NEF_OK) {
+        return ret;
+    }
+
+    buf->data[buf->len++] = byte;
+
+    return NEF_OK;
+}
+
+static void nef_synth_put16(uint8_t *p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void nef_synth_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Serialize count values of the given TIFF type, big-endian */
+static void nef_synth_put_values(uint8_t *p, int type, uint32_t count,
+                                 const void *data)
+{
+    uint32_t i;
+
+    switch (tiff_get_type_size(type)) {
+    case 2:
+        for (i = 0; i < count; i++) {
+            nef_synth_put16(p + i * 2, ((const uint16_t *)data)[i]);
+        }
+        break;
+    case 4:
+        for (i = 0; i < count; i++) {
+            nef_synth_put32(p + i * 4, ((const uint32_t *)data)[i]);
+        }
+        break;
+    case 8:
+        for (i = 0; i < count * 2; i++) {
+            nef_synth_put32(p + i * 4, ((const uint32_t *)data)[i]);
+        }
+        break;
+    default:
+        memcpy(p, data, count);
+        break;
+    }
+}
+
+/* Write an IFD, followed by the values that do not fit in its entries.
+ * Offsets written are relative to base. Entries must be sorted by tag.
+ */
+static NEF_STATUS nef_synth_write_ifd(struct nef_synth_buf *buf, size_t base,
+                                      const struct nef_synth_entry *entries,
+                                      unsigned nr_entries, size_t *ifd_off)
+{
+    size_t off, value_off;
+    unsigned i;
+    NEF_STATUS ret;
+
+    if ((ret = nef_synth_append(buf, NULL, 2 + nr_entries * 12 + 4, &off))
+            != NEF_OK)
+    {
+        return ret;
+    }
+
+    nef_synth_put16(buf->data + off, nr_entries);
+
+    for (i = 0; i < nr_entries; i++) {
+        const struct nef_synth_entry *e = &entries[i];
+        size_t bytes = tiff_get_type_size(e->type) * e->count;
+        uint8_t *ent;
+
+        if (bytes > 4) {
+            if ((ret = nef_synth_append(buf, NULL, bytes, &value_off))
+                    != NEF_OK)
+            {
+                return ret;
+            }
+            nef_synth_put_values(buf->data + value_off, e->type, e->count,
+                                 e->data);
+        }
+
+        /* The buffer may have moved */
+        ent = buf->data + off + 2 + i * 12;
+
+        nef_synth_put16(ent, e->tag);
+        nef_synth_put16(ent + 2, e->type);
+        nef_synth_put32(ent + 4, e->count);
+        nef_synth_put32(ent + 8, 0);
+
+        if (bytes > 4) {
+            nef_synth_put32(ent + 8, value_off - base);
+        } else {
+            nef_synth_put_values(ent + 8, e->type, e->count, e->data);
+        }
+    }
+
+    /* No next IFD */
+    nef_synth_put32(buf->data + off + 2 + nr_entries * 12, 0);
+
+    *ifd_off = off - base;
+
+    return NEF_OK;
+}
+
+/*******************************************************************/
+/* NPC encoder                                                     */
+/*******************************************************************/
+
+static NEF_STATUS nef_synth_put_bits(struct nef_synth_bits *bits,
+                                     uint32_t value, unsigned count)
+{
+    NEF_STATUS ret;
+
+    bits->acc = (bits->acc << count) | (value & ((1ull << count) - 1));
+    bits->nr_bits += count;
+
+    while (bits->nr_bits >= 8) {
+        uint8_t byte = bits->acc >> (bits->nr_bits - 8);
+
+        if ((ret = nef_synth_append_byte(bits->buf, byte)) != NEF_OK) {
+            return ret;
+        }
+
+        bits->nr_bits -= 8;
+    }
+
+    bits->acc &= (1ull << bits->nr_bits) - 1;
+
+    return NEF_OK;
+}
+
+/* Build the canonical code of each symbol in one of the NPC trees */
+static void nef_synth_huff_codes(const uint8_t *spec, uint16_t *codes,
+                                 uint8_t *lengths)
+{
+    unsigned len, i, code = 0, entry = 16;
+
+    memset(lengths, 0, 256);
+
+    for (len = 1; len <= 16; len++) {
+        for (i = 0; i < spec[len - 1]; i++) {
+            uint8_t sym = spec[entry++];
+
+            if (lengths[sym] == 0) {
+                codes[sym] = code;
+                lengths[sym] = len;
+            }
+            code++;
+        }
+        code <<= 1;
+    }
+}
+
+/* Encode samples (curve indices) as NPC, using the same predictors as the
+ * decoder. Every difference is coded exactly, so only the trees without
+ * dropped low-order bits are usable; the split row is never used.
+ */
+static NEF_STATUS nef_synth_npc_encode(const struct nef_synth_params *params,
+                                       const uint16_t *samples, int pred_init,
+                                       struct nef_synth_buf *out)
+{
+    struct nef_synth_bits bits = { .buf = out, .acc = 0, .nr_bits = 0 };
+    uint16_t codes[256];
+    uint8_t lengths[256];
+    int vpred[2][2], hpred[2];
+    unsigned row, col, tree;
+    NEF_STATUS ret;
+
+    tree = params->lossy ? NEF_NPC_TREE_12_LOSSY : NEF_NPC_TREE_12_LOSSLESS;
+    if (params->bits == 14) {
+        tree += NEF_NPC_TREE_14_OFF;
+    }
+
+    nef_synth_huff_codes(nef_npc_tree_spec(tree), codes, lengths);
+
+    vpred[0][0] = vpred[0][1] = vpred[1][0] = vpred[1][1] = pred_init;
+
+    for (row = 0; row < params->height; row++) {
+        const uint16_t *in = samples + (size_t)row * params->width;
+
+        for (col = 0; col < params->width; col++) {
+            int pred, diff, mag;
+            unsigned len = 0;
+
+            if (col < 2) {
+                pred = vpred[row & 1][col];
+                vpred[row & 1][col] = in[col];
+                hpred[col] = in[col];
+            } else {
+                pred = hpred[col & 1];
+                hpred[col & 1] = in[col];
+            }
+
+            diff = in[col] - pred;
+            mag = diff < 0 ? -diff : diff;
+
+            while (mag >> len) {
+                len++;
+            }
+
+            if (lengths[len] == 0) {
+                NEF_TRACE("No code for a %u-bit difference\n", len);
+                return NEF_RANGE_ERROR;
+            }
+
+            if ((ret = nef_synth_put_bits(&bits, codes[len], lengths[len]))
+                    != NEF_OK)
+            {
+                return ret;
+            }
+
+            if (len == 0) {
+                continue;
+            }
+
+            /* Negative differences are offset so their top bit is clear */
+            if (diff < 0) {
+                diff += (1 << len) - 1;
+            }
+
+            if ((ret = nef_synth_put_bits(&bits, diff, len)) != NEF_OK) {
+                return ret;
+            }
+        }
+    }
+
+    /* Flush, and pad so the decoder may read ahead */
+    if (bits.nr_bits > 0 &&
+        (ret = nef_synth_put_bits(&bits, 0, 8 - bits.nr_bits)) != NEF_OK)
+    {
+        return ret;
+    }
+
+    return nef_synth_put_bits(&bits, 0, 16);
+}
+
+/* Store samples uncompressed, big-endian like the rest of the file: one
+ * per 16-bit word, or packed most significant bit first.
+ */
+static NEF_STATUS nef_synth_unpacked_encode(const struct nef_synth_params *params,
+                                            const uint16_t *samples,
+                                            struct nef_synth_buf *out)
+{
+    struct nef_synth_bits bits = { .buf = out, .acc = 0, .nr_bits = 0 };
+    unsigned width = params->packing == NEF_SYNTH_PACK_16 ? 16 : params->bits;
+    size_t count = (size_t)params->width * params->height, i;
+    NEF_STATUS ret;
+
+    for (i = 0; i < count; i++) {
+        if ((ret = nef_synth_put_bits(&bits, samples[i], width)) != NEF_OK) {
+            return ret;
+        }
+    }
+
+    return NEF_OK;
+}
+
+/*******************************************************************/
+/* Container                                                       */
+/*******************************************************************/
+
+/* Render an RGB thumbnail by point-sampling the CFA quads */
+static void nef_synth_thumbnail(const struct nef_synth_params *params,
+                                const uint16_t *samples, unsigned tw,
+                                unsigned th, uint8_t *thumb)
+{
+    unsigned x, y, shift = params->bits - 8;
+
+    for (y = 0; y < th; y++) {
+        for (x = 0; x < tw; x++) {
+            unsigned row = (y * params->height / th) & ~1u;
+            unsigned col = (x * params->width / tw) & ~1u;
+            unsigned rgb[3] = { 0, 0, 0 }, n[3] = { 0, 0, 0 }, i;
+
+            for (i = 0; i < 4; i++) {
+                unsigned c = params->cfa_pattern[i];
+                rgb[c] += samples[(size_t)(row + (i >> 1)) * params->width +
+                                  col + (i & 1)];
+                n[c]++;
+            }
+
+            for (i = 0; i < 3; i++) {
+                thumb[(y * tw + x) * 3 + i] =
+                    n[i] ? (rgb[i] / n[i]) >> shift : 0;
+            }
+        }
+    }
+}
+
+/* Build the image settings block (MakerNote tag 151): a version, followed
+ * by a block obfuscated with the camera's serial and shutter count. The
+ * white balance levels are stored in it as 8.8 fixed point.
+ */
+static void nef_synth_image_settings(const struct nef_synth_params *params,
+                                     uint8_t *block)
+{
+    struct nef nef;
+    unsigned i;
+
+    memcpy(block, "0205", 4);
+
+    for (i = NEF_IMAGE_SETTINGS_0205_OFF; i < NEF_SYNTH_SETTINGS_SIZE; i++) {
+        block[i] = i;
+    }
+
+    nef_synth_put16(block + NEF_IMAGE_SETTINGS_OFF,
+                    (unsigned)(params->wb[0] * 256.0f + 0.5f));
+    nef_synth_put16(block + NEF_IMAGE_SETTINGS_OFF + 2,
+                    (unsigned)(params->wb[1] * 256.0f + 0.5f));
+
+    memset(&nef, 0, sizeof(nef));
+    nef_derive_obfuscation_params(params->serial, params->shutter_count,
+                                  &nef.key, &nef.iv);
+    nef_encrypt_buffer(&nef, block + NEF_IMAGE_SETTINGS_0205_OFF,
+                       NEF_SYNTH_SETTINGS_SIZE - NEF_IMAGE_SETTINGS_0205_OFF);
+}
+
+/* Build the NEF decode table (MakerNote tag 150) */
+static void nef_synth_decode_table(const struct nef_synth_params *params,
+                                   int pred_init, const uint16_t *knots,
+                                   uint8_t *table)
+{
+    unsigned i;
+
+    memset(table, 0, NEF_SYNTH_DECODE_SIZE);
+
+    if (params->lossy) {
+        table[0] = NEF_NPC_VER_LOSSY;
+        table[1] = NEF_NPC_VER_LOSSY_SUB;
+    } else {
+        table[0] = NEF_NPC_VER_LOSSLESS;
+        table[1] = 0x30;
+    }
+
+    for (i = 0; i < 4; i++) {
+        nef_synth_put16(table + 2 + i * 2, pred_init);
+    }
+
+    if (params->lossy) {
+        nef_synth_put16(table + 10, NEF_SYNTH_CURVE_KNOTS);
+        for (i = 0; i < NEF_SYNTH_CURVE_KNOTS; i++) {
+            nef_synth_put16(table + 12 + i * 2, knots[i]);
+        }
+    }
+
+    /* The split row stays 0: one tree for the whole image */
+}
+
+/* Build the Nikon MakerNote: a signature, then an embedded big-endian TIFF
+ * header that the MakerNote IFD offsets are relative to.
+ */
+static NEF_STATUS nef_synth_makernote(const struct nef_synth_params *params,
+                                      int pred_init, const uint16_t *knots,
+                                      struct nef_synth_buf *mn)
+{
+    static const uint8_t header[] = {
+        'N', 'i', 'k', 'o', 'n', 0, 0x02, 0x10, 0x00, 0x00,
+        'M', 'M', 0x00, 0x2a, 0x00, 0x00, 0x00, 0x08
+    };
+    uint8_t decode[NEF_SYNTH_DECODE_SIZE];
+    uint8_t settings[NEF_SYNTH_SETTINGS_SIZE];
+    uint32_t wb[8], shutter = params->shutter_count;
+    char serial[16];
+    size_t ifd_off;
+    NEF_STATUS ret;
+
+    struct nef_synth_entry entries[] = {
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_VERSION, TIFF_TYPE_UNDEFINED, 4,
+                        "0210"),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_WB_LEVELS, TIFF_TYPE_RATIONAL, 4, wb),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_SERIAL, TIFF_TYPE_ASCII, 0, serial),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_NEF_DECODE, TIFF_TYPE_UNDEFINED,
+                        sizeof(decode), decode),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_IMAGE_SETTINGS, TIFF_TYPE_UNDEFINED,
+                        sizeof(settings), settings),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKERNOTE_SHUTTER, TIFF_TYPE_LONG, 1, &shutter),
+    };
+
+    /* Red, blue, then two unit multipliers for green */
+    wb[0] = (uint32_t)(params->wb[0] * 1000.0f + 0.5f);
+    wb[1] = 1000;
+    wb[2] = (uint32_t)(params->wb[1] * 1000.0f + 0.5f);
+    wb[3] = 1000;
+    wb[4] = wb[5] = wb[6] = wb[7] = 1;
+
+    snprintf(serial, sizeof(serial), "%u", params->serial);
+    entries[2].count = strlen(serial) + 1;
+
+    nef_synth_decode_table(params, pred_init, knots, decode);
+    nef_synth_image_settings(params, settings);
+
+    if ((ret = nef_synth_append(mn, header, sizeof(header), NULL)) != NEF_OK) {
+        return ret;
+    }
+
+    return nef_synth_write_ifd(mn, NEF_MAKERNOTE_OFF - 8, entries,
+                               sizeof(entries) / sizeof(entries[0]), &ifd_off);
+}
+
+/* A placeholder JPEG stream for the preview SubIFD: just markers */
+static const uint8_t nef_synth_preview[] = {
+    0xff, 0xd8,
+    0xff, 0xfe, 0x00, 0x1a,
+    'l', 'i', 'b', 'n', 'e', 'f', 'k', 'o', ' ', 's', 'y', 'n',
+    't', 'h', 'e', 't', 'i', 'c', ' ', 'N', 'E', 'F',
+    0xff, 0xd9
+};
+
+#define NEF_SYNTH_NR(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Where the parts of the file were written */
+struct nef_synth_layout {
+    uint32_t raw_off;
+    uint32_t raw_bytes;
+    uint32_t thumb_off;
+    uint32_t thumb_width;
+    uint32_t thumb_height;
+    uint32_t preview_off;
+    uint32_t exif_ifd;
+    uint32_t subifds[2];
+};
+
+static NEF_STATUS nef_synth_exif_ifd(struct nef_synth_buf *file,
+                                     const struct nef_synth_buf *mn,
+                                     struct nef_synth_layout *layout)
+{
+    uint32_t exposure[2] = { 1, 250 }, fnumber[2] = { 56, 10 };
+    uint16_t iso = 200;
+    size_t off;
+    NEF_STATUS ret;
+
+    struct nef_synth_entry exif[] = {
+        NEF_SYNTH_ENTRY(TIFF_TAG_EXIF_EXPOSURETIME, TIFF_TYPE_RATIONAL, 1,
+                        exposure),
+        NEF_SYNTH_ENTRY(TIFF_TAG_EXIF_FNUMBER, TIFF_TYPE_RATIONAL, 1, fnumber),
+        NEF_SYNTH_ENTRY(TIFF_TAG_EXIF_ISO, TIFF_TYPE_SHORT, 1, &iso),
+        NEF_SYNTH_ENTRY(TIFF_TAG_EXIF_MAKERNOTE, TIFF_TYPE_UNDEFINED, mn->len,
+                        mn->data),
+    };
+
+    if ((ret = nef_synth_write_ifd(file, 0, exif, NEF_SYNTH_NR(exif), &off))
+            != NEF_OK)
+    {
+        return ret;
+    }
+
+    layout->exif_ifd = off;
+
+    return NEF_OK;
+}
+
+/* The SubIFDs: a JPEG preview, then the raw image */
+static NEF_STATUS nef_synth_subifds(const struct nef_synth_params *params,
+                                    struct nef_synth_buf *file,
+                                    struct nef_synth_layout *layout)
+{
+    uint32_t one = 1, zero = 0, width = params->width, height = params->height;
+    uint32_t pw = params->width / 2, ph = params->height / 2;
+    uint32_t preview_len = sizeof(nef_synth_preview);
+    uint16_t bps8[3] = { 8, 8, 8 }, three = 3, spp = 1, dim[2] = { 2, 2 };
+    uint16_t ojpeg = TIFF_COMPRESSION_OJPEG, ycbcr = TIFF_PHOTOMETRIC_YCBCR;
+    uint16_t cfa = TIFF_PHOTOMETRIC_CFA, bps = params->bits;
+    uint16_t compression = params->packing == NEF_SYNTH_PACK_NPC ?
+        TIFF_COMPRESSION_NIKON : TIFF_COMPRESSION_NONE;
+    size_t off;
+    NEF_STATUS ret;
+
+    struct nef_synth_entry preview[] = {
+        NEF_SYNTH_ENTRY(TIFF_TAG_NEWSUBFILETYPE, TIFF_TYPE_LONG, 1, &one),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGEWIDTH, TIFF_TYPE_LONG, 1, &pw),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGELENGTH, TIFF_TYPE_LONG, 1, &ph),
+        NEF_SYNTH_ENTRY(TIFF_TAG_BITSPERSAMPLE, TIFF_TYPE_SHORT, 3, bps8),
+        NEF_SYNTH_ENTRY(TIFF_TAG_COMPRESSION, TIFF_TYPE_SHORT, 1, &ojpeg),
+        NEF_SYNTH_ENTRY(TIFF_TAG_PHOTOMETRICINTERP, TIFF_TYPE_SHORT, 1, &ycbcr),
+        NEF_SYNTH_ENTRY(TIFF_TAG_SAMPLESPERPIXEL, TIFF_TYPE_SHORT, 1, &three),
+        NEF_SYNTH_ENTRY(TIFF_TAG_JPEGIFOFFSET, TIFF_TYPE_LONG, 1,
+                        &layout->preview_off),
+        NEF_SYNTH_ENTRY(TIFF_TAG_JPEGIFBYTECOUNT, TIFF_TYPE_LONG, 1,
+                        &preview_len),
+    };
+
+    struct nef_synth_entry raw[] = {
+        NEF_SYNTH_ENTRY(TIFF_TAG_NEWSUBFILETYPE, TIFF_TYPE_LONG, 1, &zero),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGEWIDTH, TIFF_TYPE_LONG, 1, &width),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGELENGTH, TIFF_TYPE_LONG, 1, &height),
+        NEF_SYNTH_ENTRY(TIFF_TAG_BITSPERSAMPLE, TIFF_TYPE_SHORT, 1, &bps),
+        NEF_SYNTH_ENTRY(TIFF_TAG_COMPRESSION, TIFF_TYPE_SHORT, 1,
+                        &compression),
+        NEF_SYNTH_ENTRY(TIFF_TAG_PHOTOMETRICINTERP, TIFF_TYPE_SHORT, 1, &cfa),
+        NEF_SYNTH_ENTRY(TIFF_TAG_STRIPOFFSETS, TIFF_TYPE_LONG, 1,
+                        &layout->raw_off),
+        NEF_SYNTH_ENTRY(TIFF_TAG_SAMPLESPERPIXEL, TIFF_TYPE_SHORT, 1, &spp),
+        NEF_SYNTH_ENTRY(TIFF_TAG_ROWSPERSTRIP, TIFF_TYPE_LONG, 1, &height),
+        NEF_SYNTH_ENTRY(TIFF_TAG_STRIPBYTECOUNTS, TIFF_TYPE_LONG, 1,
+                        &layout->raw_bytes),
+        NEF_SYNTH_ENTRY(TIFF_TAG_CFAREPEATPATTERNDIM, TIFF_TYPE_SHORT, 2, dim),
+        NEF_SYNTH_ENTRY(TIFF_TAG_CFAPATTERN, TIFF_TYPE_BYTE, 4,
+                        params->cfa_pattern),
+    };
+
+    if ((ret = nef_synth_write_ifd(file, 0, preview, NEF_SYNTH_NR(preview),
+                                   &off)) != NEF_OK)
+    {
+        return ret;
+    }
+    layout->subifds[0] = off;
+
+    if ((ret = nef_synth_write_ifd(file, 0, raw, NEF_SYNTH_NR(raw), &off))
+            != NEF_OK)
+    {
+        return ret;
+    }
+    layout->subifds[1] = off;
+
+    return NEF_OK;
+}
+
+/* The root IFD: an uncompressed RGB thumbnail, pointing at everything else */
+static NEF_STATUS nef_synth_root_ifd(const struct nef_synth_params *params,
+                                     struct nef_synth_buf *file,
+                                     struct nef_synth_layout *layout,
+                                     size_t *root_off)
+{
+    static const char make[] = "NIKON CORPORATION";
+    uint32_t one = 1;
+    uint32_t thumb_bytes = layout->thumb_width * layout->thumb_height * 3;
+    uint16_t bps8[3] = { 8, 8, 8 }, three = 3;
+    uint16_t none = TIFF_COMPRESSION_NONE, rgb = TIFF_PHOTOMETRIC_RGB;
+    uint16_t orientation = params->orientation;
+
+    struct nef_synth_entry root[] = {
+        NEF_SYNTH_ENTRY(TIFF_TAG_NEWSUBFILETYPE, TIFF_TYPE_LONG, 1, &one),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGEWIDTH, TIFF_TYPE_LONG, 1,
+                        &layout->thumb_width),
+        NEF_SYNTH_ENTRY(TIFF_TAG_IMAGELENGTH, TIFF_TYPE_LONG, 1,
+                        &layout->thumb_height),
+        NEF_SYNTH_ENTRY(TIFF_TAG_BITSPERSAMPLE, TIFF_TYPE_SHORT, 3, bps8),
+        NEF_SYNTH_ENTRY(TIFF_TAG_COMPRESSION, TIFF_TYPE_SHORT, 1, &none),
+        NEF_SYNTH_ENTRY(TIFF_TAG_PHOTOMETRICINTERP, TIFF_TYPE_SHORT, 1, &rgb),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MAKER, TIFF_TYPE_ASCII, sizeof(make), make),
+        NEF_SYNTH_ENTRY(TIFF_TAG_MODEL, TIFF_TYPE_ASCII,
+                        strlen(params->model) + 1, params->model),
+        NEF_SYNTH_ENTRY(TIFF_TAG_STRIPOFFSETS, TIFF_TYPE_LONG, 1,
+                        &layout->thumb_off),
+        NEF_SYNTH_ENTRY(TIFF_TAG_ORIENTATION, TIFF_TYPE_SHORT, 1, &orientation),
+        NEF_SYNTH_ENTRY(TIFF_TAG_SAMPLESPERPIXEL, TIFF_TYPE_SHORT, 1, &three),
+        NEF_SYNTH_ENTRY(TIFF_TAG_ROWSPERSTRIP, TIFF_TYPE_LONG, 1,
+                        &layout->thumb_height),
+        NEF_SYNTH_ENTRY(TIFF_TAG_STRIPBYTECOUNTS, TIFF_TYPE_LONG, 1,
+                        &thumb_bytes),
+        NEF_SYNTH_ENTRY(TIFF_TAG_SUBIFDS, TIFF_TYPE_LONG, 2, layout->subifds),
+        NEF_SYNTH_ENTRY(TIFF_TAG_EXIFIFD, TIFF_TYPE_LONG, 1, &layout->exif_ifd),
+    };
+
+    return nef_synth_write_ifd(file, 0, root, NEF_SYNTH_NR(root), root_off);
+}
+
+NEF_STATUS nef_synth_write_mem(const struct nef_synth_params *params,
+                               uint8_t **buf, size_t *bytes)
+{
+    static const uint8_t tiff_header[] = { 'M', 'M', 0x00, 0x2a, 0, 0, 0, 0 };
+    struct nef_synth_buf file = { NULL, 0, 0 }, mn = { NULL, 0, 0 };
+    struct nef_synth_buf raw = { NULL, 0, 0 };
+    struct nef_synth_layout layout;
+    uint16_t *samples = NULL, *knots = NULL, *curve = NULL;
+    uint8_t *thumb = NULL;
+    unsigned tw, th, pass;
+    size_t count, off;
+    int pred_init;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(buf);
+    NEF_CHECK_ARG(bytes);
+
+    if ((ret = nef_synth_check_params(params)) != NEF_OK) {
+        return ret;
+    }
+
+    *buf = NULL;
+    *bytes = 0;
+
+    count = (size_t)params->width * params->height;
+
+    if (params->width >= params->height) {
+        tw = params->width / 2 < NEF_SYNTH_THUMB_MAX ?
+            params->width / 2 : NEF_SYNTH_THUMB_MAX;
+        th = tw * params->height / params->width;
+    } else {
+        th = params->height / 2 < NEF_SYNTH_THUMB_MAX ?
+            params->height / 2 : NEF_SYNTH_THUMB_MAX;
+        tw = th * params->width / params->height;
+    }
+    if (tw == 0) tw = 1;
+    if (th == 0) th = 1;
+
+    samples = (uint16_t *)malloc(count * sizeof(uint16_t));
+    knots = (uint16_t *)malloc(NEF_SYNTH_CURVE_KNOTS * sizeof(uint16_t));
+    curve = (uint16_t *)malloc(NEF_NPC_CURVE_SIZE * sizeof(uint16_t));
+    thumb = (uint8_t *)malloc((size_t)tw * th * 3);
+    if (samples == NULL || knots == NULL || curve == NULL || thumb == NULL) {
+        ret = NEF_NO_MEMORY;
+        goto fail;
+    }
+
+    nef_synth_render(params, samples);
+    nef_synth_thumbnail(params, samples, tw, th, thumb);
+
+    /* Lossy images code indices into the curve rather than samples */
+    if (params->lossy) {
+        nef_synth_lossy_curve(params->bits, knots, curve);
+        if ((ret = nef_synth_quantize(params->bits, curve, samples, count))
+                != NEF_OK)
+        {
+            goto fail;
+        }
+    }
+
+    pred_init = 1 << (params->bits - 1);
+
+    if (params->packing == NEF_SYNTH_PACK_NPC) {
+        ret = nef_synth_npc_encode(params, samples, pred_init, &raw);
+    } else {
+        ret = nef_synth_unpacked_encode(params, samples, &raw);
+    }
+
+    if (ret != NEF_OK ||
+        (ret = nef_synth_makernote(params, pred_init, knots, &mn)) != NEF_OK)
+    {
+        goto fail;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    layout.raw_bytes = raw.len;
+    layout.thumb_width = tw;
+    layout.thumb_height = th;
+
+    /* The IFDs come first and the image data last, as cameras write them.
+     * The IFDs are the same size wherever the data goes, so they are
+     * written once to find where the data starts, then again pointing at
+     * it.
+     */
+    for (pass = 0; pass < 2; pass++) {
+        file.len = 0;
+
+        if ((ret = nef_synth_append(&file, tiff_header, sizeof(tiff_header),
+                                    NULL)) != NEF_OK ||
+            (ret = nef_synth_exif_ifd(&file, &mn, &layout)) != NEF_OK ||
+            (ret = nef_synth_subifds(params, &file, &layout)) != NEF_OK ||
+            (ret = nef_synth_root_ifd(params, &file, &layout, &off)) != NEF_OK)
+        {
+            goto fail;
+        }
+
+        layout.raw_off = (file.len + 1) & ~1ul;
+        layout.thumb_off = (layout.raw_off + raw.len + 1) & ~1ul;
+        layout.preview_off = (layout.thumb_off + (size_t)tw * th * 3 + 1) &
+            ~1ul;
+    }
+
+    nef_synth_put32(file.data + 4, off);
+
+    if ((ret = nef_synth_append(&file, raw.data, raw.len, NULL)) != NEF_OK ||
+        (ret = nef_synth_append(&file, thumb, (size_t)tw * th * 3, NULL))
+            != NEF_OK ||
+        (ret = nef_synth_append(&file, nef_synth_preview,
+                                sizeof(nef_synth_preview), NULL)) != NEF_OK)
+    {
+        goto fail;
+    }
+
+    *buf = file.data;
+    *bytes = file.len;
+    file.data = NULL;
+
+fail:
+    free(file.data);
+    free(raw.data);
+    free(mn.data);
+    free(samples);
+    free(knots);
+    free(curve);
+    free(thumb);
+
+    return ret;
+}
+
+NEF_STATUS nef_synth_write(const char *file,
+                           const struct nef_synth_params *params)
+{
+    uint8_t *buf = NULL;
+    size_t bytes = 0;
+    FILE *fp = NULL;
+    NEF_STATUS ret;
+
+    NEF_CHECK_ARG(file);
+
+    if ((ret = nef_synth_write_mem(params, &buf, &bytes)) != NEF_OK) {
+        return ret;
+    }
+
+    if ((fp = fopen(file, "wb")) == NULL) {
+        NEF_TRACE("Failed to create %s\n", file);
+        free(buf);
+        return NEF_NOT_FOUND;
+    }
+
+    if (fwrite(buf, bytes, 1, fp) != 1) {
+        ret = NEF_FAILURE;
+    }
+
+    if (fclose(fp) != 0) {
+        ret = NEF_FAILURE;
+    }
+
+    free(buf);
+
+    return ret;
+}
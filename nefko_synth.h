@@ -0,0 +1,56 @@
+#ifndef __INCLUDE_NEFKO_SYNTH_H__
+#define __INCLUDE_NEFKO_SYNTH_H__
+
+/* Generator for synthetic NEF files, for tests and benchmarks */
+
+#include <nefko.h>
+
+#include <stdint.h>
+
+/* Content of the synthetic raw image */
+#define NEF_SYNTH_SCENE     0x0 /* Smooth gradients with mild noise */
+#define NEF_SYNTH_GRADIENT  0x1 /* Noiseless diagonal gradient */
+#define NEF_SYNTH_NOISE     0x2 /* Uniform noise, the worst case for NPC */
+#define NEF_SYNTH_FLAT      0x3 /* A constant level per CFA colour */
+
+/* Storage of the synthetic raw image */
+#define NEF_SYNTH_PACK_NPC  0x0 /* NIKON Proprietary Compression */
+#define NEF_SYNTH_PACK_16   0x1 /* Uncompressed, one sample per 16-bit word */
+#define NEF_SYNTH_PACK_BITS 0x2 /* Uncompressed, packed at bits per sample */
+
+struct nef_synth_params {
+    unsigned width;             /* Raw image width, even */
+    unsigned height;            /* Raw image height, even */
+    unsigned bits;              /* Sample depth, 12 or 14 */
+    int lossy;                  /* Non-zero for lossy (curve-mapped) NPC */
+    int packing;                /* NEF_SYNTH_PACK_* */
+    int content;                /* NEF_SYNTH_* */
+    uint32_t seed;              /* Seed for the noise in the content */
+    const char *model;          /* Model string, e.g. "NIKON D300S" */
+    unsigned serial;            /* Camera serial number */
+    unsigned shutter_count;     /* Shutter count */
+    uint8_t cfa_pattern[4];     /* CFA colour per 2x2 position, 0 = R */
+    float wb[2];                /* Red and blue white balance multipliers */
+    unsigned orientation;       /* TIFF Orientation tag, 1 to 8 */
+};
+
+/* Fill in defaults: a 12-bit lossless 640x428 scene */
+void nef_synth_default_params(struct nef_synth_params *params);
+
+/* Generate a synthetic NEF in memory. The buffer is allocated with malloc
+ * and is the caller's to free.
+ */
+NEF_STATUS nef_synth_write_mem(const struct nef_synth_params *params,
+                               uint8_t **buf, size_t *bytes);
+
+/* Generate a synthetic NEF and write it to the given file */
+NEF_STATUS nef_synth_write(const char *file,
+                           const struct nef_synth_params *params);
+
+/* Get the samples a decoder should produce for the raw image of a file
+ * generated with params. samples must hold width * height samples.
+ */
+NEF_STATUS nef_synth_expected(const struct nef_synth_params *params,
+                              uint16_t *samples);
+
+#endif /* __INCLUDE_NEFKO_SYNTH_H__ */
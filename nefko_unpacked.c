@@ -0,0 +1,508 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Uncompressed raw images. Samples are either stored one per 16-bit word,
+ * or packed back to back at 12 or 14 bits, with no padding between rows.
+ * Either way they are in the byte order of the file: most significant
+ * byte (or bit) first in "MM" files, least significant first in "II"
+ * files.
+ *
+ * Nothing needs decoding, so rows can be read from anywhere in the image.
+ * In a mapped file, a 16-bit container in host byte order is handed to
+ * the sink straight from the map; anything else is swapped or unpacked a
+ * band at a time by the data-parallel kernels.
+ */
+
+/* Number of rows unpacked before they are handed to the row sink */
+#define NEF_UNPACKED_BAND_ROWS  16
+
+struct nef_unpacked {
+    /* Bits per sample in the data: 16 for a 16-bit container, otherwise
+     * 12 or 14 for packed samples */
+    unsigned packing;
+
+    /* Non-zero if the file is big-endian */
+    int big_endian;
+
+    /* Bytes from one row to the next */
+    size_t row_bytes;
+
+    /* The strips holding the image, each of rows_per_strip rows */
+    unsigned rows_per_strip;
+    unsigned nr_strips;
+    uint32_t *strip_offs;
+
+    /* All rows of the image, if they are contiguous in a mapped file */
+    const uint8_t *mapped;
+};
+
+static NEF_STATUS nef_unpacked_can_open(struct nef_image *image)
+{
+    NEF_CHECK_ARG(image);
+
+    if (image->compression != TIFF_COMPRESSION_NONE ||
+        image->photo_interp != TIFF_PHOTOMETRIC_CFA ||
+        image->chans != 1)
+    {
+        return NEF_FAILURE;
+    }
+
+    /* Packed rows must hold whole groups of samples (see the kernels) */
+    switch (image->bits_per_sample) {
+    case 12:
+        return image->width % 2 == 0 ? NEF_OK : NEF_FAILURE;
+    case 14:
+        return image->width % 4 == 0 ? NEF_OK : NEF_FAILURE;
+    case 16:
+        return NEF_OK;
+    default:
+        NEF_TRACE("Unsupported uncompressed sample depth: %u\n",
+            image->bits_per_sample);
+        return NEF_FAILURE;
+    }
+}
+
+/* Get whether the file is big-endian, from its TIFF header */
+static NEF_STATUS nef_unpacked_byte_order(nef_t *nef, int *big_endian)
+{
+    uint8_t order[2];
+    size_t count = 0;
+
+    if (nef->map != NULL) {
+        memcpy(order, nef->map, 2);
+    } else if (tiff_read(nef->tiff_fp, 0, 2, 1, order, &count) != TIFF_OK) {
+        return NEF_NOT_FOUND;
+    }
+
+    if (order[0] == 'M' && order[1] == 'M') {
+        *big_endian = 1;
+    } else if (order[0] == 'I' && order[1] == 'I') {
+        *big_endian = 0;
+    } else {
+        return NEF_NOT_NEF;
+    }
+
+    return NEF_OK;
+}
+
+static NEF_STATUS nef_unpacked_init_state(struct nef_image *image,
+                                          tiff_ifd_t *makernote)
+{
+    struct nef_unpacked *state = NULL;
+    nef_t *nef = NULL;
+    uint32_t *strip_bytes = NULL;
+    unsigned rows_per_strip = 0, i;
+    size_t total = 0, samples;
+    int type, nr_offs = 0, nr_bytes = 0;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(image);
+
+    nef = image->nef_file;
+
+    state = (struct nef_unpacked *)nef_alloc(nef, sizeof(*state));
+    if (state == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    if ((ret = nef_unpacked_byte_order(nef, &state->big_endian)) != NEF_OK) {
+        NEF_TRACE("Could not get the byte order of the file\n");
+        goto fail;
+    }
+
+    if (nef_get_tag_alloc(nef, image->ifd, TIFF_TAG_STRIPOFFSETS,
+                          (void **)&state->strip_offs, &type, &nr_offs)
+            != NEF_OK ||
+        type != TIFF_TYPE_LONG ||
+        nef_get_tag_alloc(nef, image->ifd, TIFF_TAG_STRIPBYTECOUNTS,
+                          (void **)&strip_bytes, &type, &nr_bytes)
+            != NEF_OK ||
+        type != TIFF_TYPE_LONG || nr_offs != nr_bytes || nr_offs == 0)
+    {
+        NEF_TRACE("Missing or inconsistent strip tags\n");
+        ret = NEF_NOT_FOUND;
+        goto fail;
+    }
+
+    if (nef_get_tag(nef, image, TIFF_TAG_ROWSPERSTRIP, &rows_per_strip)
+            != NEF_OK || rows_per_strip == 0 ||
+        rows_per_strip > image->height)
+    {
+        rows_per_strip = image->height;
+    }
+
+    state->nr_strips = nr_offs;
+    state->rows_per_strip = rows_per_strip;
+
+    for (i = 0; i < state->nr_strips; i++) {
+        total += strip_bytes[i];
+    }
+
+    /* Samples are in a 16-bit container if there is room for one */
+    samples = (size_t)image->width * image->height;
+
+    if (image->bits_per_sample == 16 || total >= samples * 2) {
+        state->packing = 16;
+    } else {
+        state->packing = image->bits_per_sample;
+    }
+
+    state->row_bytes = (size_t)image->width * state->packing / 8;
+
+    if ((size_t)state->nr_strips * rows_per_strip < image->height) {
+        NEF_TRACE("%u strips of %u rows cannot hold %u rows\n",
+            state->nr_strips, rows_per_strip, image->height);
+        ret = NEF_RANGE_ERROR;
+        goto fail;
+    }
+
+    for (i = 0; i < state->nr_strips; i++) {
+        unsigned rows = image->height - i * rows_per_strip;
+
+        if (rows > rows_per_strip) {
+            rows = rows_per_strip;
+        }
+
+        if (strip_bytes[i] < rows * state->row_bytes) {
+            NEF_TRACE("Strip %u is too short: %u bytes for %u rows\n", i,
+                strip_bytes[i], rows);
+            ret = NEF_RANGE_ERROR;
+            goto fail;
+        }
+    }
+
+    /* Rows can be taken straight from the map if they follow each other */
+    if (nef->map != NULL) {
+        int contiguous = 1;
+
+        for (i = 1; i < state->nr_strips && contiguous; i++) {
+            contiguous = state->strip_offs[i] == state->strip_offs[i - 1] +
+                rows_per_strip * state->row_bytes;
+        }
+
+        if (contiguous && state->strip_offs[0] +
+                state->row_bytes * image->height <= nef->map_bytes)
+        {
+            state->mapped = nef->map + state->strip_offs[0];
+        }
+    }
+
+    NEF_TRACE("Uncompressed image: %u-bit samples in %u-bit %s words, "
+        "%u strips%s\n", image->bits_per_sample, state->packing,
+        state->big_endian ? "big-endian" : "little-endian", state->nr_strips,
+        state->mapped ? ", mapped" : "");
+
+    nef_free(nef, strip_bytes);
+
+    image->reader_state = state;
+
+    return NEF_OK;
+
+fail:
+    if (strip_bytes) nef_free(nef, strip_bytes);
+    if (state->strip_offs) nef_free(nef, state->strip_offs);
+    nef_free(nef, state);
+
+    return ret;
+}
+
+/* Get nr_rows rows of raw data starting at row, from the map if it can,
+ * otherwise read into scratch (which holds NEF_UNPACKED_BAND_ROWS rows).
+ */
+static NEF_STATUS nef_unpacked_raw_rows(struct nef_image *image,
+                                        struct nef_unpacked *state,
+                                        unsigned row, unsigned nr_rows,
+                                        uint8_t *scratch, const uint8_t **raw)
+{
+    nef_t *nef = image->nef_file;
+    size_t done = 0;
+    NEF_STATS_START(start);
+
+    if (state->mapped != NULL) {
+        *raw = state->mapped + row * state->row_bytes;
+        return NEF_OK;
+    }
+
+    /* A band can straddle strips; read it a strip at a time */
+    while (nr_rows > 0) {
+        unsigned strip = row / state->rows_per_strip;
+        unsigned rows = state->rows_per_strip - row % state->rows_per_strip;
+        size_t count = 0;
+
+        if (rows > nr_rows) {
+            rows = nr_rows;
+        }
+
+        if (tiff_read(nef->tiff_fp, state->strip_offs[strip] +
+                      (row % state->rows_per_strip) * state->row_bytes,
+                      rows * state->row_bytes, 1, scratch + done,
+                      &count) != TIFF_OK)
+        {
+            NEF_ERROR("Failed to read rows %u to %u\n", row, row + rows - 1);
+            return NEF_RANGE_ERROR;
+        }
+
+        done += rows * state->row_bytes;
+        row += rows;
+        nr_rows -= rows;
+    }
+
+    NEF_STATS_STOP(nef, NEF_STAGE_IO, start, done);
+
+    *raw = scratch;
+
+    return NEF_OK;
+}
+
+/* Check if raw 16-bit rows can be used as they are */
+static int nef_unpacked_is_native(struct nef_unpacked *state,
+                                  const uint8_t *raw)
+{
+    return state->packing == 16 &&
+        state->big_endian == NEF_HOST_BIG_ENDIAN &&
+        ((uintptr_t)raw & 1) == 0;
+}
+
+/* Convert one row of raw data to width host-order samples */
+static void nef_unpacked_convert_row(struct nef_unpacked *state,
+                                     const uint8_t *raw, uint16_t *dest,
+                                     unsigned width)
+{
+    switch (state->packing) {
+    case 12:
+        nef_unpack_12(raw, dest, width, state->big_endian);
+        break;
+    case 14:
+        nef_unpack_14(raw, dest, width, state->big_endian);
+        break;
+    default:
+        if (state->big_endian == NEF_HOST_BIG_ENDIAN) {
+            memcpy(dest, raw, width * sizeof(uint16_t));
+        } else if (((uintptr_t)raw & 1) == 0) {
+            nef_swap_16((const uint16_t *)raw, dest, width);
+        } else {
+            unsigned x;
+
+            for (x = 0; x < width; x++) {
+                dest[x] = state->big_endian ?
+                    (raw[2 * x] << 8) | raw[2 * x + 1] :
+                    raw[2 * x] | (raw[2 * x + 1] << 8);
+            }
+        }
+        break;
+    }
+}
+
+static NEF_STATUS nef_unpacked_read_image_tile(struct nef_image *image,
+                                               unsigned x_off, unsigned y_off,
+                                               unsigned w, unsigned h,
+                                               void *buf)
+{
+    struct nef_unpacked *state = NULL;
+    nef_t *nef = NULL;
+    uint8_t *scratch = NULL;
+    uint16_t *line = NULL, *dst = (uint16_t *)buf;
+    const uint8_t *raw = NULL;
+    unsigned row, i, nr_rows;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(buf);
+    NEF_CHECK_ARG(image->reader_state);
+
+    state = (struct nef_unpacked *)image->reader_state;
+    nef = image->nef_file;
+
+    if (x_off + w > image->width || y_off + h > image->height) {
+        return NEF_RANGE_ERROR;
+    }
+
+    line = (uint16_t *)nef_alloc_raw(nef, image->width * sizeof(uint16_t));
+    if (line == NULL) {
+        return NEF_NO_MEMORY;
+    }
+
+    if (state->mapped == NULL) {
+        scratch = (uint8_t *)nef_alloc_raw(nef, state->row_bytes *
+                                           NEF_UNPACKED_BAND_ROWS);
+        if (scratch == NULL) {
+            ret = NEF_NO_MEMORY;
+            goto exit;
+        }
+    }
+
+    for (row = 0; row < h; row += nr_rows) {
+        nr_rows = h - row;
+        if (nr_rows > NEF_UNPACKED_BAND_ROWS) {
+            nr_rows = NEF_UNPACKED_BAND_ROWS;
+        }
+
+        if ((ret = nef_unpacked_raw_rows(image, state, y_off + row, nr_rows,
+                                         scratch, &raw)) != NEF_OK)
+        {
+            goto exit;
+        }
+
+        for (i = 0; i < nr_rows; i++) {
+            const uint8_t *src = raw + i * state->row_bytes;
+
+            if (nef_unpacked_is_native(state, src)) {
+                memcpy(dst, (const uint16_t *)src + x_off,
+                    w * sizeof(uint16_t));
+            } else {
+                nef_unpacked_convert_row(state, src, line, image->width);
+                memcpy(dst, line + x_off, w * sizeof(uint16_t));
+            }
+
+            dst += w;
+        }
+    }
+
+exit:
+    if (scratch) nef_free(nef, scratch);
+    nef_free(nef, line);
+
+    return ret;
+}
+
+static NEF_STATUS nef_unpacked_get_image_tile_size(struct nef_image *image,
+                                                   unsigned *w, unsigned *h)
+{
+    NEF_CHECK_ARG(image);
+
+    *w = image->width;
+    *h = NEF_UNPACKED_BAND_ROWS;
+
+    return NEF_OK;
+}
+
+/* Hand the image to the sink a band at a time, unpacking or swapping each
+ * band into the sink's own buffer where it offers one.
+ */
+static NEF_STATUS nef_unpacked_decode_rows(struct nef_image *image,
+                                           struct nef_row_sink *sink)
+{
+    struct nef_unpacked *state = NULL;
+    nef_t *nef = NULL;
+    uint8_t *scratch = NULL;
+    uint16_t *band = NULL, *dest = NULL;
+    const uint16_t *rows = NULL;
+    const uint8_t *raw = NULL;
+    unsigned row, i, nr_rows, stride;
+    NEF_STATUS ret = NEF_OK;
+
+    NEF_CHECK_ARG(image);
+    NEF_CHECK_ARG(sink);
+    NEF_CHECK_ARG(image->reader_state);
+
+    state = (struct nef_unpacked *)image->reader_state;
+    nef = image->nef_file;
+
+    if (state->mapped == NULL) {
+        scratch = (uint8_t *)nef_alloc_raw(nef, state->row_bytes *
+                                           NEF_UNPACKED_BAND_ROWS);
+        if (scratch == NULL) {
+            return NEF_NO_MEMORY;
+        }
+    }
+
+    for (row = 0; row < image->height; row += nr_rows) {
+        NEF_STATS_START(start);
+
+        nr_rows = image->height - row;
+        if (nr_rows > NEF_UNPACKED_BAND_ROWS) {
+            nr_rows = NEF_UNPACKED_BAND_ROWS;
+        }
+
+        if ((ret = nef_unpacked_raw_rows(image, state, row, nr_rows, scratch,
+                                         &raw)) != NEF_OK)
+        {
+            goto exit;
+        }
+
+        if (nef_unpacked_is_native(state, raw)) {
+            /* Zero copy: the rows are usable where they lie */
+            rows = (const uint16_t *)raw;
+            stride = image->width;
+        } else {
+            NEF_STATS_RESTART(start);
+
+            dest = NULL;
+            if (sink->get_rows != NULL) {
+                dest = sink->get_rows(sink, row, nr_rows, &stride);
+            }
+
+            if (dest == NULL) {
+                if (band == NULL) {
+                    band = (uint16_t *)nef_alloc_raw(nef, sizeof(uint16_t) *
+                        image->width * NEF_UNPACKED_BAND_ROWS);
+                    if (band == NULL) {
+                        ret = NEF_NO_MEMORY;
+                        goto exit;
+                    }
+                }
+
+                dest = band;
+                stride = image->width;
+            }
+
+            for (i = 0; i < nr_rows; i++) {
+                nef_unpacked_convert_row(state, raw + i * state->row_bytes,
+                                         dest + i * stride, image->width);
+            }
+
+            NEF_STATS_STOP(nef, NEF_STAGE_ENTROPY, start,
+                           nr_rows * image->width * sizeof(uint16_t));
+
+            rows = dest;
+        }
+
+        NEF_STATS_RESTART(start);
+
+        if ((ret = sink->put_rows(sink, row, nr_rows, rows, image->width,
+                                  stride)) != NEF_OK)
+        {
+            goto exit;
+        }
+
+        NEF_STATS_STOP(nef, NEF_STAGE_CONVERT, start,
+                       nr_rows * image->width * sizeof(uint16_t));
+    }
+
+exit:
+    if (band) nef_free(nef, band);
+    if (scratch) nef_free(nef, scratch);
+
+    return ret;
+}
+
+static NEF_STATUS nef_unpacked_clean_up(struct nef_image *image)
+{
+    struct nef_unpacked *state = NULL;
+
+    NEF_CHECK_ARG(image);
+
+    state = (struct nef_unpacked *)image->reader_state;
+
+    if (state != NULL) {
+        nef_free(image->nef_file, state->strip_offs);
+        nef_free(image->nef_file, state);
+    }
+
+    image->reader_state = NULL;
+
+    return NEF_OK;
+}
+
+struct nef_image_reader nef_unpacked = {
+    .format_name = "Uncompressed",
+    .can_open = nef_unpacked_can_open,
+    .init_state = nef_unpacked_init_state,
+    .read_image_tile = nef_unpacked_read_image_tile,
+    .image_tile_size = nef_unpacked_get_image_tile_size,
+    .decode_rows = nef_unpacked_decode_rows,
+    .clean_state = nef_unpacked_clean_up
+};
@@ -0,0 +1,517 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_synth.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Benchmarks for libnefko. The micro-benchmarks run on synthetic buffers;
+ * the file benchmarks run on the NEF files given on the command line, and
+ * on a synthetic NEF of the size given with -s.
+ * Results are written as JSON, one object per benchmark.
+ */
+
+#define BENCH_BUF_SIZE      (16 * 1024 * 1024)
+
+struct bench_result {
+    const char *name;
+    const char *variant;
+    unsigned long long ops;
+    double ns;
+    double bytes;
+    double samples;
+};
+
+static FILE *out = NULL;
+static int nr_results = 0;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_report(struct bench_result *res)
+{
+    double secs = res->ns / 1e9;
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"variant\": \"%s\", "
+        "\"ops\": %llu, \"ns_per_op\": %.2f, \"mb_per_s\": %.2f, "
+        "\"samples_per_s\": %.0f}",
+        nr_results++ ? ",\n" : "",
+        res->name, res->variant ? res->variant : "",
+        res->ops, res->ops ? res->ns / res->ops : 0.0,
+        secs > 0 ? res->bytes / secs / (1024.0 * 1024.0) : 0.0,
+        secs > 0 ? res->samples / secs : 0.0);
+
+    fprintf(stderr, "%-16s %-16s %12.2f ns/op %10.2f MB/s %14.0f samples/s\n",
+        res->name, res->variant ? res->variant : "",
+        res->ops ? res->ns / res->ops : 0.0,
+        secs > 0 ? res->bytes / secs / (1024.0 * 1024.0) : 0.0,
+        secs > 0 ? res->samples / secs : 0.0);
+}
+
+static uint8_t *bench_random_buffer(size_t bytes)
+{
+    uint8_t *buf = (uint8_t *)malloc(bytes);
+    uint32_t state = 0x2545f491;
+    size_t i;
+
+    if (buf == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < bytes; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        buf[i] = state;
+    }
+
+    return buf;
+}
+
+static void bench_decrypt(int iterations)
+{
+    struct bench_result res = { "decrypt", NULL, 0, 0, 0, 0 };
+    uint8_t *buf = bench_random_buffer(BENCH_BUF_SIZE);
+    nef_t nef;
+    double start;
+    int i;
+
+    memset(&nef, 0, sizeof(nef));
+    nef.key = 0x2f;
+    nef.iv = 0xa7;
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        nef_decrypt_buffer(&nef, buf, BENCH_BUF_SIZE);
+    }
+    res.ns = bench_now() - start;
+
+    res.ops = iterations;
+    res.bytes = (double)BENCH_BUF_SIZE * iterations;
+
+    bench_report(&res);
+
+    free(buf);
+}
+
+static void bench_bitread(int iterations)
+{
+    struct bench_result res = { "bitread", "12-bit", 0, 0, 0, 0 };
+    uint8_t *buf = bench_random_buffer(BENCH_BUF_SIZE);
+    unsigned count = (BENCH_BUF_SIZE - 1) * 8 / 12;
+    unsigned *fields = (unsigned *)malloc(count * sizeof(unsigned));
+    double start;
+    int i;
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        if (nef_npc_read_bits(buf, BENCH_BUF_SIZE, 12, fields, count)
+            != NEF_OK)
+        {
+            fprintf(stderr, "bit reading failed\n");
+            break;
+        }
+    }
+    res.ns = bench_now() - start;
+
+    res.ops = (unsigned long long)count * iterations;
+    res.bytes = (double)count * 12 / 8 * iterations;
+    res.samples = res.ops;
+
+    bench_report(&res);
+
+    free(fields);
+    free(buf);
+}
+
+static void bench_huff(int iterations)
+{
+    static const char *tree_names[] = {
+        "12-bit-lossy", "12-bit-split", "12-bit-lossless",
+        "14-bit-lossy", "14-bit-split", "14-bit-lossless"
+    };
+    uint8_t *buf = bench_random_buffer(BENCH_BUF_SIZE);
+    /* Symbols plus their differences never exceed 30 bits */
+    unsigned count = BENCH_BUF_SIZE * 8 / 30;
+    int *diffs = (int *)malloc(count * sizeof(int));
+    unsigned tree;
+
+    for (tree = 0; tree < 6; tree++) {
+        struct bench_result res = { "huff_decode", tree_names[tree],
+                                    0, 0, 0, 0 };
+        double start;
+        int i;
+
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            if (nef_npc_decode_diffs(NULL, tree, buf, BENCH_BUF_SIZE, diffs,
+                                     count) != NEF_OK)
+            {
+                fprintf(stderr, "Huffman decoding failed\n");
+                break;
+            }
+        }
+        res.ns = bench_now() - start;
+
+        res.ops = (unsigned long long)count * iterations;
+        res.samples = res.ops;
+
+        bench_report(&res);
+    }
+
+    free(diffs);
+    free(buf);
+}
+
+/* Find the full-resolution CFA image in an NEF */
+static nef_image_t *bench_find_raw(nef_t *nfp, int *width, int *height)
+{
+    nef_image_t *img = NULL;
+    int count = 0, i;
+
+    nef_image_get_count(nfp, &count);
+
+    for (i = 0; i < count; i++) {
+        int type, chans;
+
+        if (nef_image_get_handle(nfp, i, &img) != NEF_OK) {
+            continue;
+        }
+
+        nef_image_get_attribs(nfp, img, width, height, &chans, &type, NULL);
+
+        if (type == NEF_IMAGE_FULL && chans == 1) {
+            return img;
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_open(char **files, int nr_files, int iterations)
+{
+    struct bench_result res = { "open", NULL, 0, 0, 0, 0 };
+    double start;
+    int i, f;
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        for (f = 0; f < nr_files; f++) {
+            nef_t *nfp = NULL;
+
+            if (nef_open(files[f], &nfp) == NEF_OK) {
+                nef_close(nfp);
+                res.ops++;
+            }
+        }
+    }
+    res.ns = bench_now() - start;
+
+    bench_report(&res);
+}
+
+static void bench_tag_lookup(char **files, int nr_files, int iterations)
+{
+    struct bench_result res = { "tag_lookup", "shutter_count", 0, 0, 0, 0 };
+    int f, i;
+
+    for (f = 0; f < nr_files; f++) {
+        nef_t *nfp = NULL;
+        unsigned shutter;
+        double start;
+
+        if (nef_open(files[f], &nfp) != NEF_OK) {
+            continue;
+        }
+
+        start = bench_now();
+        for (i = 0; i < iterations * 1000; i++) {
+            shutter = 0;
+            if (nef_get_tag_low(nfp, nfp->makernote,
+                                TIFF_TAG_MAKERNOTE_SHUTTER, &shutter)
+                == NEF_OK)
+            {
+                res.ops++;
+            }
+        }
+        res.ns += bench_now() - start;
+
+        nef_close(nfp);
+    }
+
+    bench_report(&res);
+}
+
+static void bench_decode(char **files, int nr_files, int iterations)
+{
+    struct bench_result res = { "decode", "full-frame", 0, 0, 0, 0 };
+    int f, i;
+
+    for (f = 0; f < nr_files; f++) {
+        nef_t *nfp = NULL;
+        nef_image_t *img = NULL;
+        int width, height;
+        size_t size;
+        void *buf = NULL;
+        double start;
+
+        if (nef_open(files[f], &nfp) != NEF_OK) {
+            continue;
+        }
+
+        if ((img = bench_find_raw(nfp, &width, &height)) == NULL ||
+            nef_image_alloc_buffer(nfp, img, NEF_PIXEL_16, NEF_BUF_PREFAULT,
+                                   &buf, &size) != NEF_OK)
+        {
+            nef_close(nfp);
+            continue;
+        }
+
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            if (nef_image_get_raw(nfp, img, size, buf) == NEF_OK) {
+                res.ops++;
+                res.bytes += size;
+                res.samples += (double)width * height;
+            }
+        }
+        res.ns += bench_now() - start;
+
+        nef_image_free_buffer(buf);
+        nef_close(nfp);
+    }
+
+    bench_report(&res);
+}
+
+struct bench_worker {
+    char **files;
+    int nr_files;
+    int *next;
+    pthread_mutex_t *lock;
+    unsigned long long done;
+    double samples;
+};
+
+static void *bench_worker_main(void *arg)
+{
+    struct bench_worker *w = (struct bench_worker *)arg;
+
+    for (;;) {
+        nef_t *nfp = NULL;
+        nef_image_t *img = NULL;
+        int f, width, height;
+        size_t size;
+        void *buf = NULL;
+
+        pthread_mutex_lock(w->lock);
+        f = (*w->next)++;
+        pthread_mutex_unlock(w->lock);
+
+        if (f >= w->nr_files) {
+            break;
+        }
+
+        if (nef_open(w->files[f], &nfp) != NEF_OK) {
+            continue;
+        }
+
+        if ((img = bench_find_raw(nfp, &width, &height)) != NULL &&
+            nef_image_alloc_buffer(nfp, img, NEF_PIXEL_16, NEF_BUF_POOLED,
+                                   &buf, &size) == NEF_OK)
+        {
+            if (nef_image_get_raw(nfp, img, size, buf) == NEF_OK) {
+                w->done++;
+                w->samples += (double)width * height;
+            }
+            nef_image_free_buffer(buf);
+        }
+
+        nef_close(nfp);
+    }
+
+    return NULL;
+}
+
+static void bench_end_to_end(char **files, int nr_files, int max_threads)
+{
+    struct bench_worker workers[64];
+    pthread_t threads[64];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    int nthreads, i;
+
+    if (max_threads > 64) {
+        max_threads = 64;
+    }
+
+    for (nthreads = 1; nthreads <= max_threads; ) {
+        struct bench_result res = { "end_to_end", NULL, 0, 0, 0, 0 };
+        char variant[32];
+        int next = 0;
+        double start;
+
+        snprintf(variant, sizeof(variant), "%d-threads", nthreads);
+        res.variant = variant;
+
+        start = bench_now();
+        for (i = 0; i < nthreads; i++) {
+            workers[i].files = files;
+            workers[i].nr_files = nr_files;
+            workers[i].next = &next;
+            workers[i].lock = &lock;
+            workers[i].done = 0;
+            workers[i].samples = 0;
+            pthread_create(&threads[i], NULL, bench_worker_main, &workers[i]);
+        }
+
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            res.ops += workers[i].done;
+            res.samples += workers[i].samples;
+        }
+        res.ns = bench_now() - start;
+
+        bench_report(&res);
+
+        /* Powers of two, finishing with max_threads itself */
+        if (nthreads < max_threads && nthreads * 2 > max_threads) {
+            nthreads = max_threads;
+        } else {
+            nthreads *= 2;
+        }
+    }
+
+    nef_buffer_pool_drain();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o results.json] [-i iterations] "
+        "[-t max_threads] [-s WIDTHxHEIGHT] [file.nef ...]\n", name);
+    exit(-1);
+}
+
+/* Generate a synthetic 14-bit lossless NEF to benchmark on */
+static char *bench_synth_file(unsigned width, unsigned height)
+{
+    static char name[] = "/tmp/nefko_bench_XXXXXX";
+    struct nef_synth_params params;
+    int fd;
+
+    nef_synth_default_params(&params);
+    params.width = width;
+    params.height = height;
+    params.bits = 14;
+
+    if ((fd = mkstemp(name)) < 0) {
+        fprintf(stderr, "could not create a temporary file\n");
+        exit(-1);
+    }
+    close(fd);
+
+    if (nef_synth_write(name, &params) != NEF_OK) {
+        fprintf(stderr, "could not generate a %ux%u NEF\n", width, height);
+        unlink(name);
+        exit(-1);
+    }
+
+    return name;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 4, max_threads, opt, nr_files, i;
+    unsigned synth_width = 0, synth_height = 0;
+    const char *out_name = NULL;
+    char *synth_name = NULL;
+    char **files = NULL;
+
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "o:i:t:s:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%ux%u", &synth_width, &synth_height) != 2) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (iterations <= 0 || max_threads <= 0) {
+        usage(argv[0]);
+    }
+
+    out = stdout;
+    if (out_name != NULL && (out = fopen(out_name, "w")) == NULL) {
+        fprintf(stderr, "could not open '%s'\n", out_name);
+        exit(-1);
+    }
+
+    nr_files = argc - optind;
+    files = (char **)calloc(nr_files + 1, sizeof(char *));
+    if (files == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < nr_files; i++) {
+        files[i] = argv[optind + i];
+    }
+
+    if (synth_width != 0) {
+        synth_name = bench_synth_file(synth_width, synth_height);
+        files[nr_files++] = synth_name;
+    }
+
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"files\": %d,\n"
+        "  \"kernels\": \"%s\",\n  \"benchmarks\": [\n", iterations,
+        nr_files, nef_cpu_kernels());
+
+    bench_decrypt(iterations);
+    bench_bitread(iterations);
+    bench_huff(iterations);
+
+    if (nr_files > 0) {
+        bench_open(files, nr_files, iterations);
+        bench_tag_lookup(files, nr_files, iterations);
+        bench_decode(files, nr_files, iterations);
+        bench_end_to_end(files, nr_files, max_threads);
+    }
+
+    if (synth_name != NULL) {
+        unlink(synth_name);
+    }
+
+    free(files);
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
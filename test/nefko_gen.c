@@ -0,0 +1,84 @@
+#include <nefko.h>
+#include <nefko_synth.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Write a synthetic NEF file, for testing and benchmarking */
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-b 12|14] [-l] "
+        "[-p npc|16|packed] [-c scene|gradient|noise|flat] [-s seed] "
+        "[-m model] out.nef\n", name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *contents[] = { "scene", "gradient", "noise", "flat" };
+    static const char *packings[] = { "npc", "16", "packed" };
+    struct nef_synth_params params;
+    int opt, i;
+
+    nef_synth_default_params(&params);
+
+    while ((opt = getopt(argc, argv, "w:h:b:lp:c:s:m:")) != -1) {
+        switch (opt) {
+        case 'w':
+            params.width = atoi(optarg);
+            break;
+        case 'h':
+            params.height = atoi(optarg);
+            break;
+        case 'b':
+            params.bits = atoi(optarg);
+            break;
+        case 'l':
+            params.lossy = 1;
+            break;
+        case 'p':
+            params.packing = -1;
+            for (i = 0; i < 3; i++) {
+                if (!strcmp(optarg, packings[i])) {
+                    params.packing = i;
+                }
+            }
+            break;
+        case 'c':
+            params.content = -1;
+            for (i = 0; i < 4; i++) {
+                if (!strcmp(optarg, contents[i])) {
+                    params.content = i;
+                }
+            }
+            break;
+        case 's':
+            params.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            params.model = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+    }
+
+    if (nef_synth_write(argv[optind], &params) != NEF_OK) {
+        fprintf(stderr, "failed to write '%s'\n", argv[optind]);
+        return 1;
+    }
+
+    printf("Wrote %ux%u %u-bit %s NEF to '%s'\n", params.width,
+        params.height, params.bits,
+        params.packing != NEF_SYNTH_PACK_NPC ? "uncompressed" :
+        params.lossy ? "lossy" : "lossless", argv[optind]);
+
+    return 0;
+}
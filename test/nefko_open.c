@@ -3,6 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+static void log_stderr(void *ctx, int level, const char *func, int line,
+                       const char *msg)
+{
+    fprintf(stderr, "%s:%d - %s", func, line, msg);
+}
+
 int main(int argc, char *argv[])
 {
     nef_t *nfp = NULL;
@@ -14,6 +20,8 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    nef_set_log_callback(log_stderr, NULL, NEF_LOG_DEBUG);
+
     printf("Opening '%s'\n", argv[1]);
     nef_open(argv[1], &nfp);
 
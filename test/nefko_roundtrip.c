@@ -0,0 +1,1454 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+#include <nefko_synth.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+/* Round-trip check: generate synthetic NEFs, open and decode them with
+ * libnefko, and compare the result to what was encoded.
+ */
+
+struct roundtrip_case {
+    unsigned width;
+    unsigned height;
+    unsigned bits;
+    int lossy;
+    int content;
+    int packing;
+};
+
+static const struct roundtrip_case cases[] = {
+    { 640, 428, 12, 0, NEF_SYNTH_SCENE },
+    { 640, 428, 14, 0, NEF_SYNTH_SCENE },
+    { 640, 428, 12, 1, NEF_SYNTH_SCENE },
+    { 640, 428, 14, 1, NEF_SYNTH_SCENE },
+    { 256, 34, 12, 0, NEF_SYNTH_NOISE },
+    { 256, 34, 14, 0, NEF_SYNTH_NOISE },
+    { 256, 34, 14, 1, NEF_SYNTH_NOISE },
+    { 98, 66, 12, 0, NEF_SYNTH_GRADIENT },
+    { 98, 66, 14, 1, NEF_SYNTH_FLAT },
+    { 2, 2, 12, 0, NEF_SYNTH_SCENE },
+    { 640, 428, 12, 0, NEF_SYNTH_SCENE, NEF_SYNTH_PACK_BITS },
+    { 640, 428, 14, 0, NEF_SYNTH_SCENE, NEF_SYNTH_PACK_BITS },
+    { 256, 34, 14, 0, NEF_SYNTH_NOISE, NEF_SYNTH_PACK_16 },
+    { 98, 66, 12, 0, NEF_SYNTH_GRADIENT, NEF_SYNTH_PACK_16 },
+};
+
+static int roundtrip_find_raw(nef_t *nfp, nef_image_t **raw)
+{
+    nef_image_t *img = NULL;
+    int count, i, type;
+
+    if (nef_image_get_count(nfp, &count) != NEF_OK) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (nef_image_get_handle(nfp, i, &img) != NEF_OK ||
+            nef_image_get_attribs(nfp, img, NULL, NULL, NULL, &type, NULL)
+                != NEF_OK)
+        {
+            return -1;
+        }
+
+        if (type == NEF_IMAGE_FULL) {
+            *raw = img;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Write a synthetic NEF to a new temporary file, and put its name in name,
+ * which has room for ROUNDTRIP_NAME_MAX bytes. On failure, no file is left
+ * behind and name is empty.
+ */
+#define ROUNDTRIP_NAME_MAX  32
+
+static int roundtrip_make_file(const struct nef_synth_params *params,
+                               char *name)
+{
+    int fd;
+
+    snprintf(name, ROUNDTRIP_NAME_MAX, "/tmp/nefko_roundtrip_XXXXXX");
+
+    if ((fd = mkstemp(name)) < 0) {
+        name[0] = '\0';
+        return -1;
+    }
+    close(fd);
+
+    if (nef_synth_write(name, params) != NEF_OK) {
+        unlink(name);
+        name[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The white balance is stored twice: as MakerNote RATIONALs, and in 8.8
+ * fixed point in the obfuscated image settings block. The tags are all
+ * fetched in one batch.
+ */
+static int roundtrip_check_meta(nef_t *nfp, const struct nef_synth_params *params)
+{
+    static const int ids[] = {
+        TIFF_TAG_MODEL,
+        TIFF_TAG_EXIF_ISO,
+        NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_IMAGE_SETTINGS),
+        NEF_TAG_MAKERNOTE(0x7777),
+    };
+    struct nef_tag_result res[4];
+    uint64_t arena[128];
+    const uint8_t *settings = NULL;
+    char model[64];
+    float coeffs[3];
+    int count = 3;
+    unsigned red, blue, wb_off = nfp->params.settings_wb_off;
+
+    if (nef_meta_white_balance(nfp, &count, coeffs) != NEF_OK ||
+        fabsf(coeffs[0] - params->wb[0]) > 0.001f ||
+        fabsf(coeffs[2] - params->wb[1]) > 0.001f)
+    {
+        fprintf(stderr, "white balance mismatch\n");
+        return -1;
+    }
+
+    count = sizeof(model);
+
+    if (nef_meta_get_model(nfp, &count, model) != NEF_OK ||
+        strcmp(model, params->model))
+    {
+        fprintf(stderr, "model mismatch\n");
+        return -1;
+    }
+
+    if (nef_exif_get_tags(nfp, ids, 4, res, arena, sizeof(arena)) != NEF_OK ||
+        res[0].status != NEF_OK || strcmp(res[0].data, params->model) ||
+        res[1].status != NEF_OK || *(uint16_t *)res[1].data != 200 ||
+        res[2].status != NEF_OK || res[2].bytes < wb_off + 4 ||
+        res[3].status != NEF_NOT_FOUND)
+    {
+        fprintf(stderr, "batched tags missing\n");
+        return -1;
+    }
+
+    settings = (const uint8_t *)res[2].data;
+    red = (settings[wb_off] << 8) | settings[wb_off + 1];
+    blue = (settings[wb_off + 2] << 8) | settings[wb_off + 3];
+
+    if (red != (unsigned)(params->wb[0] * 256.0f + 0.5f) ||
+        blue != (unsigned)(params->wb[1] * 256.0f + 0.5f))
+    {
+        fprintf(stderr, "decrypted image settings mismatch (%04x, %04x)\n",
+            red, blue);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The preview must be found, whether the file is mapped or read */
+static int roundtrip_check_preview(const char *name, unsigned flags)
+{
+    nef_t *nfp = NULL;
+    nef_image_t *img = NULL;
+    const uint8_t *jpeg = NULL;
+    size_t bytes = 0;
+    int count, i, found = 0;
+
+    if (nef_open_ex(name, flags, NULL, &nfp) != NEF_OK) {
+        fprintf(stderr, "failed to open the image\n");
+        return -1;
+    }
+
+    nef_image_get_count(nfp, &count);
+
+    for (i = 0; i < count; i++) {
+        nef_image_get_handle(nfp, i, &img);
+
+        if (nef_image_get_preview(nfp, img, (const void **)&jpeg, &bytes)
+                == NEF_OK &&
+            bytes >= 4 && jpeg[0] == 0xff && jpeg[1] == 0xd8 &&
+            jpeg[bytes - 2] == 0xff && jpeg[bytes - 1] == 0xd9)
+        {
+            found++;
+        }
+    }
+
+    nef_close(nfp);
+
+    if (found != 1) {
+        fprintf(stderr, "expected one JPEG preview, found %d\n", found);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A sidecar of the raw image must map back to the same samples, whole and
+ * by tile, and carry the white balance.
+ */
+static int roundtrip_check_sidecar(nef_t *nfp, nef_image_t *raw,
+                                   const char *name, const uint16_t *expected,
+                                   size_t count)
+{
+    char sidecar[64], model[64];
+    nef_t *dfp = NULL;
+    nef_image_t *img = NULL;
+    uint16_t *samples = NULL;
+    float wb[2][3];
+    unsigned width, tile_w, tile_h, y, h;
+    int nr_wb = 3, ret = -1;
+
+    snprintf(sidecar, sizeof(sidecar), "%s.nefd", name);
+
+    if (nef_image_write_decoded(nfp, raw, sidecar, 6) != NEF_OK ||
+        nef_open_decoded(sidecar, &dfp) != NEF_OK)
+    {
+        fprintf(stderr, "failed to write or open the sidecar\n");
+        goto unlink;
+    }
+
+    samples = (uint16_t *)malloc(count * sizeof(uint16_t));
+
+    if (samples == NULL ||
+        nef_image_get_handle(dfp, 0, &img) != NEF_OK ||
+        nef_image_get_raw(dfp, img, count * sizeof(uint16_t), samples)
+            != NEF_OK ||
+        memcmp(samples, expected, count * sizeof(uint16_t)))
+    {
+        fprintf(stderr, "sidecar samples mismatch\n");
+        goto close;
+    }
+
+    /* Read it back again, a tile at a time */
+    memset(samples, 0, count * sizeof(uint16_t));
+
+    if (nef_image_get_tile_size(dfp, img, &tile_w, &tile_h) != NEF_OK) {
+        goto close;
+    }
+
+    width = tile_w;
+
+    for (y = 0; y < count / width; y += tile_h) {
+        h = count / width - y < tile_h ? count / width - y : tile_h;
+
+        if (nef_image_read_tile(dfp, img, 0, y, width, h,
+                                samples + y * width) != NEF_OK)
+        {
+            fprintf(stderr, "failed to read tile at row %u\n", y);
+            goto close;
+        }
+    }
+
+    if (memcmp(samples, expected, count * sizeof(uint16_t))) {
+        fprintf(stderr, "sidecar tiles mismatch\n");
+        goto close;
+    }
+
+    if (nef_meta_white_balance(nfp, &nr_wb, wb[0]) != NEF_OK ||
+        nef_meta_white_balance(dfp, &nr_wb, wb[1]) != NEF_OK ||
+        memcmp(wb[0], wb[1], sizeof(wb[0])))
+    {
+        fprintf(stderr, "sidecar white balance mismatch\n");
+        goto close;
+    }
+
+    nr_wb = sizeof(model);
+
+    if (nef_meta_get_model(dfp, &nr_wb, model) != NEF_OK ||
+        strcmp(model, "NIKON D300S"))
+    {
+        fprintf(stderr, "sidecar model mismatch\n");
+        goto close;
+    }
+
+    ret = 0;
+
+close:
+    free(samples);
+    if (dfp) nef_close(dfp);
+unlink:
+    unlink(sidecar);
+
+    return ret;
+}
+
+/* Uncompressed images must decode the same from a mapped file, and can be
+ * read from anywhere by tile, even once the decode has dropped the strips
+ * from the page cache.
+ */
+static int roundtrip_check_unpacked(const char *name, unsigned width,
+                                    const uint16_t *expected, size_t count)
+{
+    nef_t *nfp = NULL;
+    nef_image_t *raw = NULL;
+    struct nef_stats stats;
+    uint16_t *samples = NULL, tile[5 * 6];
+    char moved[64] = "";
+    FILE *out = NULL;
+    unsigned x, y;
+    int ret = -1;
+
+    if (nef_open_ex(name, NEF_OPEN_MMAP, NULL, &nfp) != NEF_OK ||
+        roundtrip_find_raw(nfp, &raw) != 0 ||
+        nef_set_io_hints(nfp, NEF_HINT_DEFAULT | NEF_HINT_DONTNEED) != NEF_OK)
+    {
+        fprintf(stderr, "failed to open the mapped image\n");
+        goto close;
+    }
+
+    samples = (uint16_t *)malloc(count * sizeof(uint16_t));
+
+    if (samples == NULL ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), samples)
+            != NEF_OK ||
+        memcmp(samples, expected, count * sizeof(uint16_t)))
+    {
+        fprintf(stderr, "mapped samples mismatch\n");
+        goto close;
+    }
+
+    /* Counters are all zero if they were compiled out */
+    if (nef_stats_get(nfp, &stats) != NEF_OK ||
+        (stats.stage[NEF_STAGE_OPEN].calls != 0 &&
+         stats.stage[NEF_STAGE_HINT].calls < 3))
+    {
+        fprintf(stderr, "no page cache hints were counted\n");
+        goto close;
+    }
+
+    /* Descriptors are only opened for hints that need one, which a mapped
+     * file never does */
+    if (nfp->fd >= 0) {
+        fprintf(stderr, "a mapped file opened a descriptor for hints\n");
+        goto close;
+    }
+
+    nef_close(nfp);
+    nfp = NULL;
+
+    if (nef_open(name, &nfp) != NEF_OK ||
+        roundtrip_find_raw(nfp, &raw) != 0 ||
+        nef_set_io_hints(nfp, NEF_HINT_SEQUENTIAL) != NEF_OK ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), samples)
+            != NEF_OK ||
+        nfp->fd >= 0 ||
+        nef_set_io_hints(nfp, NEF_HINT_WILLNEED) != NEF_OK ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), samples)
+            != NEF_OK ||
+        nfp->fd < 0)
+    {
+        fprintf(stderr, "hint descriptor not opened when it should be\n");
+        goto close;
+    }
+
+    nef_close(nfp);
+    nfp = NULL;
+
+    /* A path replaced after the open must not get the hints */
+    snprintf(moved, sizeof(moved), "%s.old", name);
+
+    if (nef_open(name, &nfp) != NEF_OK ||
+        roundtrip_find_raw(nfp, &raw) != 0 ||
+        rename(name, moved) != 0)
+    {
+        fprintf(stderr, "failed to move the image aside\n");
+        moved[0] = '\0';
+        goto close;
+    }
+
+    if ((out = fopen(name, "wb")) == NULL || fclose(out) != 0 ||
+        nef_set_io_hints(nfp, NEF_HINT_WILLNEED) != NEF_OK ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), samples)
+            != NEF_OK ||
+        memcmp(samples, expected, count * sizeof(uint16_t)) ||
+        nfp->fd >= 0)
+    {
+        fprintf(stderr, "hints went to a replaced file\n");
+        goto close;
+    }
+
+    if (count / width < 5 || width < 6) {
+        ret = 0;
+        goto close;
+    }
+
+    if (nef_image_read_tile(nfp, raw, width - 6, count / width - 5, 6, 5,
+                            tile) != NEF_OK)
+    {
+        fprintf(stderr, "failed to read a tile\n");
+        goto close;
+    }
+
+    for (y = 0; y < 5; y++) {
+        for (x = 0; x < 6; x++) {
+            size_t i = (count / width - 5 + y) * width + width - 6 + x;
+
+            if (tile[y * 6 + x] != expected[i]) {
+                fprintf(stderr, "tile mismatch at (%u, %u)\n", x, y);
+                goto close;
+            }
+        }
+    }
+
+    ret = 0;
+
+close:
+    free(samples);
+    if (nfp) nef_close(nfp);
+    if (moved[0] != '\0' && rename(moved, name) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* What a streamed decode saw */
+struct roundtrip_stream {
+    uint16_t *samples;
+    unsigned width;
+    unsigned height;
+    unsigned rows;
+    int saw_model;
+    int saw_decode_table;
+
+    /* Bytes fed so far, and when the first rows came out */
+    size_t fed;
+    size_t first_at;
+};
+
+static NEF_STATUS roundtrip_stream_tag(void *ctx, int tag_id, int type,
+                                       int count, const void *data)
+{
+    struct roundtrip_stream *rs = (struct roundtrip_stream *)ctx;
+
+    if (tag_id == TIFF_TAG_MODEL) {
+        rs->saw_model = !strncmp((const char *)data, "NIKON D300S", count);
+    } else if (tag_id == NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_NEF_DECODE)) {
+        rs->saw_decode_table = 1;
+    }
+
+    return NEF_OK;
+}
+
+static NEF_STATUS roundtrip_stream_image(void *ctx, unsigned width,
+                                         unsigned height, unsigned bits,
+                                         const unsigned char *cfa_pattern)
+{
+    struct roundtrip_stream *rs = (struct roundtrip_stream *)ctx;
+
+    if (width != rs->width || height != rs->height) {
+        return NEF_RANGE_ERROR;
+    }
+
+    return NEF_OK;
+}
+
+static NEF_STATUS roundtrip_stream_rows(void *ctx, unsigned row,
+                                        unsigned nr_rows,
+                                        const unsigned short *rows,
+                                        unsigned width)
+{
+    struct roundtrip_stream *rs = (struct roundtrip_stream *)ctx;
+
+    if (row != rs->rows || row + nr_rows > rs->height || (row & 1)) {
+        return NEF_RANGE_ERROR;
+    }
+
+    if (rs->rows == 0) {
+        rs->first_at = rs->fed;
+    }
+
+    memcpy(rs->samples + (size_t)row * width, rows,
+           (size_t)nr_rows * width * sizeof(uint16_t));
+    rs->rows += nr_rows;
+
+    return NEF_OK;
+}
+
+/* Feed the file to a stream in uneven pieces. The raw image must come out
+ * whole, and for anything taller than one band, start coming out before the
+ * last piece went in.
+ */
+static int roundtrip_check_stream(const struct nef_synth_params *params,
+                                  const uint16_t *expected, size_t count)
+{
+    static const size_t pieces[] = { 1, 13, 509, 4096 };
+    struct nef_stream_callbacks cb = {
+        .tag = roundtrip_stream_tag,
+        .image = roundtrip_stream_image,
+        .rows = roundtrip_stream_rows,
+    };
+    struct roundtrip_stream rs;
+    nef_stream_t *stream = NULL;
+    uint8_t *file = NULL;
+    size_t bytes = 0, i;
+    int ret = -1;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.width = params->width;
+    rs.height = params->height;
+    cb.ctx = &rs;
+
+    if ((rs.samples = (uint16_t *)malloc(count * sizeof(uint16_t))) == NULL ||
+        nef_synth_write_mem(params, &file, &bytes) != NEF_OK ||
+        nef_stream_open(&cb, NULL, &stream) != NEF_OK)
+    {
+        goto done;
+    }
+
+    for (i = 0; rs.fed < bytes; i++) {
+        size_t len = pieces[i % 4];
+
+        if (len > bytes - rs.fed) {
+            len = bytes - rs.fed;
+        }
+
+        rs.fed += len;
+
+        if (nef_stream_feed(stream, file + rs.fed - len, len) != NEF_OK) {
+            fprintf(stderr, "stream failed at byte %zu\n", rs.fed);
+            goto done;
+        }
+    }
+
+    if (nef_stream_finish(stream) != NEF_OK || !rs.saw_model ||
+        (params->packing == NEF_SYNTH_PACK_NPC && !rs.saw_decode_table) ||
+        rs.rows != rs.height || (rs.height > 16 && rs.first_at >= bytes))
+    {
+        fprintf(stderr, "stream: %u rows, model %d, decode table %d, first "
+            "rows at %zu of %zu bytes\n", rs.rows, rs.saw_model,
+            rs.saw_decode_table, rs.first_at, bytes);
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (rs.samples[i] != expected[i]) {
+            fprintf(stderr, "stream sample mismatch at (%zu, %zu)\n",
+                i % params->width, i / params->width);
+            goto done;
+        }
+    }
+
+    ret = 0;
+
+done:
+    if (stream) nef_stream_close(stream);
+    free(file);
+    free(rs.samples);
+
+    return ret;
+}
+
+/* Statistics gathered during a half-size decode must be those of the raw
+ * samples, and merge into a second copy of themselves.
+ */
+static int roundtrip_check_stats(nef_t *nfp, nef_image_t *raw, unsigned width,
+                                 unsigned bits, const uint16_t *expected,
+                                 size_t count)
+{
+    static unsigned hist[4 * 64], ref_hist[4 * 64], sum_hist[4 * 64];
+    struct nef_image_stats stats, ref, sum;
+    uint16_t *half = NULL;
+    size_t i;
+    unsigned c;
+    int ret = -1;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&ref, 0, sizeof(ref));
+    memset(ref_hist, 0, sizeof(ref_hist));
+    stats.bins = ref.bins = 64;
+    stats.clip = ref.clip = (1u << bits) - 64;
+    stats.hist = hist;
+
+    for (c = 0; c < 4; c++) {
+        ref.chan[c].min = ~0u;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned v = expected[i];
+        struct nef_channel_stats *ch;
+
+        c = ((i / width) & 1) * 2 + ((i % width) & 1);
+        ch = &ref.chan[c];
+        ch->count++;
+        ch->sum += v;
+        ch->clipped += v >= ref.clip;
+        ch->min = v < ch->min ? v : ch->min;
+        ch->max = v > ch->max ? v : ch->max;
+        ref_hist[c * 64 + (v >> (bits - 6))]++;
+    }
+
+    for (c = 0; c < 4; c++) {
+        if (ref.chan[c].count == 0) {
+            ref.chan[c].min = 0;
+        }
+    }
+
+    half = (uint16_t *)malloc(count * sizeof(uint16_t));
+
+    if (half == NULL ||
+        nef_image_set_stats(nfp, raw, &stats) != NEF_OK ||
+        nef_image_set_decode_mode(nfp, raw, NEF_DECODE_HALF_AVG) != NEF_OK ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), half) != NEF_OK)
+    {
+        fprintf(stderr, "failed to decode with statistics\n");
+        goto done;
+    }
+
+    if (memcmp(stats.chan, ref.chan, sizeof(ref.chan)) ||
+        memcmp(hist, ref_hist, sizeof(hist)))
+    {
+        fprintf(stderr, "statistics mismatch: mean %llu, %llu clipped, "
+            "expected %llu, %llu\n", stats.chan[0].sum / stats.chan[0].count,
+            stats.chan[0].clipped, ref.chan[0].sum / ref.chan[0].count,
+            ref.chan[0].clipped);
+        goto done;
+    }
+
+    sum = stats;
+    sum.hist = sum_hist;
+    memcpy(sum_hist, hist, sizeof(hist));
+
+    if (nef_image_stats_merge(&sum, &stats) != NEF_OK ||
+        sum.chan[3].count != 2 * ref.chan[3].count ||
+        sum.chan[3].min != ref.chan[3].min ||
+        sum_hist[64 * 3 + 63] != 2 * ref_hist[64 * 3 + 63])
+    {
+        fprintf(stderr, "merged statistics mismatch\n");
+        goto done;
+    }
+
+    /* Without a clip level, samples clip at the white level of the camera,
+     * a D300S, given at 14 bits */
+    stats.clip = 0;
+    ref.clip = 15520 >> (14 - bits);
+    ref.chan[0].clipped = 0;
+
+    for (i = 0; i < count; i++) {
+        ref.chan[0].clipped += ((i / width) & 1) == 0 && (i % width & 1) == 0 &&
+            expected[i] >= ref.clip;
+    }
+
+    if (nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), half) != NEF_OK ||
+        stats.chan[0].clipped != ref.chan[0].clipped)
+    {
+        fprintf(stderr, "clipped at the wrong white level\n");
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    nef_image_set_stats(nfp, raw, NULL);
+    nef_image_set_decode_mode(nfp, raw, NEF_DECODE_FULL);
+    free(half);
+
+    return ret;
+}
+
+/* The levels of a pyramid, put back together from its tiles */
+#define ROUNDTRIP_PYRAMID_LEVELS    16
+
+struct roundtrip_pyramid {
+    unsigned tile_size;
+    unsigned nr_levels;
+    unsigned width[ROUNDTRIP_PYRAMID_LEVELS];
+    unsigned height[ROUNDTRIP_PYRAMID_LEVELS];
+    uint16_t *expected[ROUNDTRIP_PYRAMID_LEVELS];
+    uint16_t *got[ROUNDTRIP_PYRAMID_LEVELS];
+};
+
+static NEF_STATUS roundtrip_pyramid_tile(void *ctx,
+                                         const struct nef_pyramid_tile *tile)
+{
+    struct roundtrip_pyramid *rp = (struct roundtrip_pyramid *)ctx;
+    unsigned l = tile->level, x0, y0, y;
+
+    x0 = tile->x * rp->tile_size;
+    y0 = tile->y * rp->tile_size;
+
+    if (l >= rp->nr_levels || tile->width > rp->tile_size ||
+        tile->height > rp->tile_size || x0 + tile->width > rp->width[l] ||
+        y0 + tile->height > rp->height[l])
+    {
+        return NEF_RANGE_ERROR;
+    }
+
+    for (y = 0; y < tile->height; y++) {
+        memcpy(rp->got[l] + ((size_t)(y0 + y) * rp->width[l] + x0) * 3,
+            tile->pixels + y * tile->stride,
+            tile->width * 3 * sizeof(uint16_t));
+    }
+
+    return NEF_OK;
+}
+
+/* Level 0 of a pyramid must be the half-size RGB decode, and each level
+ * after it that averaged down, with every pixel covered by a tile.
+ */
+static int roundtrip_check_pyramid(nef_t *nfp, nef_image_t *raw,
+                                   unsigned width, unsigned height)
+{
+    struct roundtrip_pyramid rp;
+    unsigned l, x, y;
+    int ret = -1;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.tile_size = 64;
+    rp.width[0] = width / 2;
+    rp.height[0] = height / 2;
+
+    for (l = 0; ; l++) {
+        size_t bytes = (size_t)rp.width[l] * rp.height[l] * 3 *
+            sizeof(uint16_t);
+
+        rp.nr_levels++;
+        rp.expected[l] = (uint16_t *)malloc(bytes);
+        rp.got[l] = (uint16_t *)malloc(bytes);
+
+        if (rp.expected[l] == NULL || rp.got[l] == NULL) {
+            goto done;
+        }
+
+        memset(rp.got[l], 0xff, bytes);
+
+        if ((rp.width[l] <= rp.tile_size && rp.height[l] <= rp.tile_size) ||
+            rp.width[l] < 2 || rp.height[l] < 2)
+        {
+            break;
+        }
+
+        rp.width[l + 1] = rp.width[l] / 2;
+        rp.height[l + 1] = rp.height[l] / 2;
+    }
+
+    if (nef_image_set_decode_mode(nfp, raw, NEF_DECODE_HALF_RGB) != NEF_OK ||
+        nef_image_get_raw(nfp, raw,
+            rp.width[0] * rp.height[0] * 3 * sizeof(uint16_t),
+            rp.expected[0]) != NEF_OK)
+    {
+        fprintf(stderr, "failed to decode at half size\n");
+        goto done;
+    }
+
+    for (l = 1; l < rp.nr_levels; l++) {
+        size_t stride = (size_t)rp.width[l - 1] * 3;
+
+        for (y = 0; y < rp.height[l]; y++) {
+            for (x = 0; x < rp.width[l] * 3; x++) {
+                const uint16_t *top = rp.expected[l - 1] + 2 * y * stride +
+                    (x / 3) * 6 + x % 3;
+
+                rp.expected[l][y * rp.width[l] * 3 + x] = (top[0] + top[3] +
+                    top[stride] + top[stride + 3] + 2) >> 2;
+            }
+        }
+    }
+
+    if (nef_image_set_decode_mode(nfp, raw, NEF_DECODE_FULL) != NEF_OK ||
+        nef_image_get_pyramid(nfp, raw, rp.tile_size, roundtrip_pyramid_tile,
+                              &rp) != NEF_OK)
+    {
+        fprintf(stderr, "failed to build the pyramid\n");
+        goto done;
+    }
+
+    for (l = 0; l < rp.nr_levels; l++) {
+        if (memcmp(rp.got[l], rp.expected[l],
+                   (size_t)rp.width[l] * rp.height[l] * 3 * sizeof(uint16_t)))
+        {
+            fprintf(stderr, "pyramid level %u mismatch\n", l);
+            goto done;
+        }
+    }
+
+    ret = 0;
+
+done:
+    nef_image_set_decode_mode(nfp, raw, NEF_DECODE_FULL);
+
+    for (l = 0; l < rp.nr_levels; l++) {
+        free(rp.expected[l]);
+        free(rp.got[l]);
+    }
+
+    return ret;
+}
+
+/* Where a stored pixel is displayed, for each TIFF orientation */
+static void roundtrip_orient(unsigned orientation, unsigned w, unsigned h,
+                             unsigned x, unsigned y, unsigned *dx, unsigned *dy)
+{
+    switch (orientation) {
+    case 2:
+        *dx = w - 1 - x;
+        *dy = y;
+        break;
+    case 3:
+        *dx = w - 1 - x;
+        *dy = h - 1 - y;
+        break;
+    case 4:
+        *dx = x;
+        *dy = h - 1 - y;
+        break;
+    case 5:
+        *dx = y;
+        *dy = x;
+        break;
+    case 6:
+        *dx = h - 1 - y;
+        *dy = x;
+        break;
+    case 7:
+        *dx = h - 1 - y;
+        *dy = w - 1 - x;
+        break;
+    case 8:
+        *dx = y;
+        *dy = w - 1 - x;
+        break;
+    default:
+        *dx = x;
+        *dy = y;
+        break;
+    }
+}
+
+/* Decode in each orientation, at full and half size, and check every
+ * sample lands where it is displayed, and that the CFA pattern follows.
+ */
+static int roundtrip_check_orientation(nef_t *nfp, nef_image_t *raw,
+                                       const struct nef_synth_params *params,
+                                       const uint16_t *expected, size_t count)
+{
+    unsigned w = params->width, h = params->height, hw = w / 2, hh = h / 2;
+    size_t half_count = (size_t)hw * hh * 3;
+    uint16_t *got = NULL, *half = NULL;
+    unsigned char pattern[4];
+    unsigned o, x, y, dx, dy, c;
+    int width, height, ret = -1;
+
+    got = (uint16_t *)malloc(count * sizeof(uint16_t));
+    half = (uint16_t *)malloc(2 * half_count * sizeof(uint16_t));
+    if (got == NULL || half == NULL) {
+        goto done;
+    }
+
+    if (nef_image_set_orientation(nfp, raw, NEF_ORIENT_AUTO) != NEF_OK ||
+        nef_image_get_attribs(nfp, raw, &width, &height, NULL, NULL, NULL)
+            != NEF_OK ||
+        (unsigned)width != (params->orientation >= 5 ? h : w))
+    {
+        fprintf(stderr, "orientation tag not picked up\n");
+        goto done;
+    }
+
+    if (nef_image_set_orientation(nfp, raw, NEF_ORIENT_STORED) != NEF_OK ||
+        nef_image_set_decode_mode(nfp, raw, NEF_DECODE_HALF_RGB) != NEF_OK ||
+        nef_image_get_raw(nfp, raw, half_count * sizeof(uint16_t), half)
+            != NEF_OK)
+    {
+        fprintf(stderr, "failed to decode at half size\n");
+        goto done;
+    }
+
+    for (o = 1; o <= 8; o++) {
+        unsigned dw = o >= 5 ? h : w;
+
+        if (nef_image_set_decode_mode(nfp, raw, NEF_DECODE_FULL) != NEF_OK ||
+            nef_image_set_orientation(nfp, raw, o) != NEF_OK ||
+            nef_image_get_attribs(nfp, raw, &width, &height, NULL, NULL, NULL)
+                != NEF_OK ||
+            (unsigned)width != dw || (unsigned)height != (o >= 5 ? w : h) ||
+            nef_image_get_cfa_pattern(nfp, raw, pattern) != NEF_OK ||
+            nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), got)
+                != NEF_OK)
+        {
+            fprintf(stderr, "failed to decode in orientation %u\n", o);
+            goto done;
+        }
+
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                roundtrip_orient(o, w, h, x, y, &dx, &dy);
+
+                if (got[dy * dw + dx] != expected[y * w + x]) {
+                    fprintf(stderr, "orientation %u: sample (%u, %u) "
+                        "mismatch\n", o, x, y);
+                    goto done;
+                }
+
+                if (dx < 2 && dy < 2 && pattern[dy * 2 + dx] !=
+                    params->cfa_pattern[(y & 1) * 2 + (x & 1)])
+                {
+                    fprintf(stderr, "orientation %u: wrong CFA pattern\n",
+                        o);
+                    goto done;
+                }
+            }
+        }
+
+        dw = o >= 5 ? hh : hw;
+
+        if (nef_image_set_decode_mode(nfp, raw, NEF_DECODE_HALF_RGB)
+                != NEF_OK ||
+            nef_image_get_raw(nfp, raw, half_count * sizeof(uint16_t),
+                              half + half_count) != NEF_OK)
+        {
+            fprintf(stderr, "failed to decode in orientation %u at half "
+                "size\n", o);
+            goto done;
+        }
+
+        for (y = 0; y < hh; y++) {
+            for (x = 0; x < hw; x++) {
+                roundtrip_orient(o, hw, hh, x, y, &dx, &dy);
+
+                for (c = 0; c < 3; c++) {
+                    if (half[half_count + (dy * dw + dx) * 3 + c] !=
+                        half[(y * hw + x) * 3 + c])
+                    {
+                        fprintf(stderr, "orientation %u: half size pixel "
+                            "(%u, %u) mismatch\n", o, x, y);
+                        goto done;
+                    }
+                }
+            }
+        }
+    }
+
+    ret = 0;
+
+done:
+    nef_image_set_orientation(nfp, raw, NEF_ORIENT_STORED);
+    nef_image_set_decode_mode(nfp, raw, NEF_DECODE_FULL);
+    free(got);
+    free(half);
+
+    return ret;
+}
+
+static int roundtrip_run(const struct roundtrip_case *tc)
+{
+    char name[ROUNDTRIP_NAME_MAX];
+    struct nef_synth_params params;
+    nef_t *nfp = NULL;
+    nef_image_t *raw = NULL;
+    uint16_t *expected = NULL, *decoded = NULL;
+    size_t count, i;
+    int width, height, ret = -1;
+
+    nef_synth_default_params(&params);
+    params.width = tc->width;
+    params.height = tc->height;
+    params.bits = tc->bits;
+    params.lossy = tc->lossy;
+    params.content = tc->content;
+    params.packing = tc->packing;
+    params.orientation = 6;
+
+    count = (size_t)tc->width * tc->height;
+    expected = (uint16_t *)malloc(count * sizeof(uint16_t));
+    decoded = (uint16_t *)malloc(count * sizeof(uint16_t));
+    if (expected == NULL || decoded == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+
+    if (roundtrip_make_file(&params, name) != 0) {
+        fprintf(stderr, "failed to generate the image\n");
+        goto done;
+    }
+
+    if (nef_synth_expected(&params, expected) != NEF_OK) {
+        fprintf(stderr, "failed to generate the image\n");
+        goto unlink;
+    }
+
+    if (nef_open(name, &nfp) != NEF_OK) {
+        fprintf(stderr, "failed to open the image\n");
+        goto unlink;
+    }
+
+    if (roundtrip_find_raw(nfp, &raw) != 0 ||
+        nef_image_get_attribs(nfp, raw, &width, &height, NULL, NULL, NULL)
+            != NEF_OK ||
+        width != (int)tc->width || height != (int)tc->height)
+    {
+        fprintf(stderr, "raw image missing or the wrong size\n");
+        goto close;
+    }
+
+    if (nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), decoded)
+            != NEF_OK)
+    {
+        fprintf(stderr, "failed to decode the raw image\n");
+        goto close;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (decoded[i] != expected[i]) {
+            fprintf(stderr, "sample mismatch at (%zu, %zu): got %u, "
+                "expected %u\n", i % tc->width, i / tc->width,
+                decoded[i], expected[i]);
+            goto close;
+        }
+    }
+
+    if (roundtrip_check_meta(nfp, &params) != 0 ||
+        roundtrip_check_preview(name, 0) != 0 ||
+        roundtrip_check_preview(name, NEF_OPEN_MMAP) != 0 ||
+        roundtrip_check_sidecar(nfp, raw, name, expected, count) != 0 ||
+        roundtrip_check_stats(nfp, raw, tc->width, tc->bits, expected,
+                              count) != 0 ||
+        roundtrip_check_pyramid(nfp, raw, tc->width, tc->height) != 0 ||
+        roundtrip_check_orientation(nfp, raw, &params, expected, count) != 0)
+    {
+        goto close;
+    }
+
+    if (tc->packing != NEF_SYNTH_PACK_NPC &&
+        roundtrip_check_unpacked(name, tc->width, expected, count) != 0)
+    {
+        goto close;
+    }
+
+    if (roundtrip_check_stream(&params, expected, count) != 0) {
+        goto close;
+    }
+
+    ret = 0;
+
+close:
+    nef_close(nfp);
+unlink:
+    unlink(name);
+done:
+    free(expected);
+    free(decoded);
+
+    return ret;
+}
+
+/* A second decode of the same frame, from another handle, must come from
+ * the decoded-frame cache and match the first.
+ */
+static int roundtrip_check_cache(void)
+{
+    char name[ROUNDTRIP_NAME_MAX];
+    struct nef_synth_params params;
+    struct nef_cache_stats stats;
+    uint16_t *frames[2] = { NULL, NULL };
+    size_t count;
+    int i, ret = -1;
+
+    nef_synth_default_params(&params);
+    count = (size_t)params.width * params.height;
+
+    if (roundtrip_make_file(&params, name) != 0) {
+        return -1;
+    }
+
+    nef_cache_set_budget(2 * count * sizeof(uint16_t));
+
+    for (i = 0; i < 2; i++) {
+        nef_t *nfp = NULL;
+        nef_image_t *raw = NULL;
+
+        frames[i] = (uint16_t *)malloc(count * sizeof(uint16_t));
+
+        if (frames[i] == NULL || nef_open(name, &nfp) != NEF_OK) {
+            goto done;
+        }
+
+        if (roundtrip_find_raw(nfp, &raw) != 0 ||
+            nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), frames[i])
+                != NEF_OK)
+        {
+            nef_close(nfp);
+            goto done;
+        }
+
+        nef_close(nfp);
+    }
+
+    if (nef_cache_get_stats(&stats) != NEF_OK || stats.hits != 1 ||
+        stats.misses != 1 ||
+        memcmp(frames[0], frames[1], count * sizeof(uint16_t)))
+    {
+        fprintf(stderr, "cache: %llu hits, %llu misses\n", stats.hits,
+            stats.misses);
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    nef_cache_set_budget(0);
+    free(frames[0]);
+    free(frames[1]);
+    unlink(name);
+
+    return ret;
+}
+
+/* Opening a batch must open every good file, and fail the bad ones alone */
+static int roundtrip_check_open_many(void)
+{
+    char names[3][ROUNDTRIP_NAME_MAX] = { "", "", "" };
+    const char *paths[4];
+    nef_t *handles[4];
+    NEF_STATUS statuses[4];
+    struct nef_synth_params params;
+    int i, ret = -1;
+
+    nef_synth_default_params(&params);
+    params.width = 64;
+    params.height = 32;
+
+    for (i = 0; i < 3; i++) {
+        if (roundtrip_make_file(&params, names[i]) != 0) {
+            goto unlink;
+        }
+
+        paths[i < 2 ? i : 3] = names[i];
+    }
+
+    paths[2] = "/tmp/nefko_roundtrip_missing";
+
+    if (nef_open_many(paths, 4, 0, handles, statuses, 2) == NEF_OK) {
+        fprintf(stderr, "batch open did not report the missing file\n");
+    } else if (statuses[0] != NEF_OK || statuses[1] != NEF_OK ||
+               statuses[2] == NEF_OK || statuses[3] != NEF_OK ||
+               handles[2] != NULL)
+    {
+        fprintf(stderr, "batch open statuses: %d %d %d %d\n", statuses[0],
+            statuses[1], statuses[2], statuses[3]);
+    } else {
+        ret = 0;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (handles[i]) nef_close(handles[i]);
+    }
+
+unlink:
+    for (i = 0; i < 3; i++) {
+        if (names[i][0] != '\0') unlink(names[i]);
+    }
+
+    return ret;
+}
+
+/* Fingerprint a file with one hash, opened with the given flags */
+static int roundtrip_fingerprint(const char *name, unsigned flags, int algo,
+                                 unsigned char *out)
+{
+    nef_t *nfp = NULL;
+    nef_image_t *raw = NULL;
+    int ret = -1;
+
+    if (nef_open_ex(name, flags, NULL, &nfp) != NEF_OK) {
+        return -1;
+    }
+
+    if (roundtrip_find_raw(nfp, &raw) == 0 &&
+        nef_image_fingerprint(nfp, raw, algo, out) == NEF_OK)
+    {
+        ret = 0;
+    }
+
+    nef_close(nfp);
+
+    return ret;
+}
+
+/* Fingerprints must not depend on how a file is read, or on metadata other
+ * than the camera identity fields, and the raw data must span several of
+ * the chunks hashed in parallel.
+ */
+static int roundtrip_check_fingerprint(void)
+{
+    char names[3][ROUNDTRIP_NAME_MAX] = { "", "", "" };
+    unsigned char fpr[4][NEF_FINGERPRINT_MAX];
+    struct nef_synth_params params;
+    int i, ret = -1;
+
+    nef_synth_default_params(&params);
+    params.width = 1600;
+    params.height = 1200;
+    params.content = NEF_SYNTH_NOISE;
+
+    for (i = 0; i < 3; i++) {
+        /* The same raw data with other white balance, then another shot */
+        if (i == 1) {
+            params.wb[0] *= 1.5f;
+        } else if (i == 2) {
+            params.shutter_count++;
+        }
+
+        if (roundtrip_make_file(&params, names[i]) != 0) {
+            goto unlink;
+        }
+    }
+
+    if (roundtrip_fingerprint(names[0], 0, NEF_HASH_XXH64, fpr[0]) != 0 ||
+        roundtrip_fingerprint(names[0], NEF_OPEN_MMAP, NEF_HASH_XXH64,
+                              fpr[1]) != 0 ||
+        roundtrip_fingerprint(names[0], NEF_OPEN_ARENA, NEF_HASH_XXH64,
+                              fpr[3]) != 0 ||
+        memcmp(fpr[0], fpr[3], 8) ||
+        roundtrip_fingerprint(names[1], 0, NEF_HASH_XXH64, fpr[2]) != 0 ||
+        roundtrip_fingerprint(names[2], 0, NEF_HASH_XXH64, fpr[3]) != 0)
+    {
+        fprintf(stderr, "failed to fingerprint\n");
+        goto unlink;
+    }
+
+    if (memcmp(fpr[0], fpr[1], 8) || memcmp(fpr[0], fpr[2], 8) ||
+        !memcmp(fpr[0], fpr[3], 8))
+    {
+        fprintf(stderr, "xxHash64 fingerprints do not match as they should\n");
+        goto unlink;
+    }
+
+    if (roundtrip_fingerprint(names[0], 0, NEF_HASH_SHA256, fpr[0]) != 0 ||
+        roundtrip_fingerprint(names[1], NEF_OPEN_MMAP, NEF_HASH_SHA256,
+                              fpr[1]) != 0 ||
+        memcmp(fpr[0], fpr[1], 32))
+    {
+        fprintf(stderr, "SHA-256 fingerprints do not match\n");
+        goto unlink;
+    }
+
+    ret = 0;
+
+unlink:
+    for (i = 0; i < 3; i++) {
+        if (names[i][0] != '\0') unlink(names[i]);
+    }
+
+    return ret;
+}
+
+/* Decode with a dark frame, flat field and defect map for the camera, and
+ * compare to the corrections applied here, one after the other.
+ */
+static int roundtrip_check_calibration(int packing)
+{
+    char dir[] = "/tmp/nefko_calib_XXXXXX", name[ROUNDTRIP_NAME_MAX] = "";
+    char cal[64] = "";
+    struct nef_synth_params params;
+    struct nef_calib_desc desc;
+    uint16_t *expected = NULL, *got = NULL, *dark = NULL, *flat = NULL;
+    uint8_t *defective = NULL;
+    uint32_t defects[8];
+    nef_t *nfp = NULL;
+    nef_image_t *raw = NULL;
+    unsigned w, h, i, nr_defects = 0;
+    size_t count;
+    int ret = -1;
+
+    nef_synth_default_params(&params);
+    params.width = w = 96;
+    params.height = h = 100;
+    params.content = NEF_SYNTH_NOISE;
+    params.packing = packing;
+    count = (size_t)w * h;
+
+    /* Defects at the corners, next to each other, and on band edges */
+    defects[nr_defects++] = 0;
+    defects[nr_defects++] = 2;
+    defects[nr_defects++] = 2 * w;
+    defects[nr_defects++] = 15 * w + 40;
+    defects[nr_defects++] = 16 * w + 41;
+    defects[nr_defects++] = 17 * w + 40;
+    defects[nr_defects++] = 50 * w + 50;
+    defects[nr_defects++] = count - 1;
+
+    expected = (uint16_t *)malloc(count * sizeof(uint16_t));
+    got = (uint16_t *)malloc(count * sizeof(uint16_t));
+    dark = (uint16_t *)malloc(count * sizeof(uint16_t));
+    flat = (uint16_t *)malloc(count * sizeof(uint16_t));
+    defective = (uint8_t *)calloc(count, 1);
+    if (expected == NULL || got == NULL || dark == NULL || flat == NULL ||
+        defective == NULL || mkdtemp(dir) == NULL)
+    {
+        goto done;
+    }
+
+    snprintf(cal, sizeof(cal), "%s/%u.nefcal", dir, params.serial);
+
+    if (roundtrip_make_file(&params, name) != 0 ||
+        nef_synth_expected(&params, expected) != NEF_OK ||
+        nef_open(name, &nfp) != NEF_OK ||
+        roundtrip_find_raw(nfp, &raw) != 0)
+    {
+        fprintf(stderr, "failed to generate the image\n");
+        goto rmdir;
+    }
+
+    if (nef_calib_set_dir(dir) != NEF_OK ||
+        nef_image_set_calibration(nfp, raw, 1) != NEF_NOT_FOUND)
+    {
+        fprintf(stderr, "found calibration that is not there\n");
+        goto rmdir;
+    }
+
+    for (i = 0; i < count; i++) {
+        dark[i] = (i * 7) % 61;
+        flat[i] = NEF_CALIB_FLAT_ONE - 300 + (i * 13) % 600;
+    }
+
+    desc.serial = params.serial;
+    desc.width = w;
+    desc.height = h;
+    desc.dark = dark;
+    desc.flat = flat;
+    desc.defects = defects;
+    desc.nr_defects = nr_defects;
+
+    if (nef_calib_write(cal, &desc) != NEF_OK ||
+        nef_image_set_calibration(nfp, raw, 1) != NEF_OK)
+    {
+        fprintf(stderr, "failed to set up calibration\n");
+        goto rmdir;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint32_t v = expected[i] > dark[i] ? expected[i] - dark[i] : 0;
+
+        v = (v * flat[i] + NEF_CALIB_FLAT_ONE / 2) >> NEF_CALIB_FLAT_SHIFT;
+        expected[i] = v > 65535 ? 65535 : v;
+    }
+
+    for (i = 0; i < nr_defects; i++) {
+        defective[defects[i]] = 1;
+    }
+
+    for (i = 0; i < nr_defects; i++) {
+        unsigned x = defects[i] % w, y = defects[i] / w, sum = 0, n = 0;
+        uint32_t d = defects[i];
+
+        if (x >= 2 && !defective[d - 2]) {
+            sum += expected[d - 2];
+            n++;
+        }
+
+        if (x + 2 < w && !defective[d + 2]) {
+            sum += expected[d + 2];
+            n++;
+        }
+
+        if (y >= 2 && !defective[d - 2 * w]) {
+            sum += expected[d - 2 * w];
+            n++;
+        }
+
+        if (y + 2 < h && !defective[d + 2 * w]) {
+            sum += expected[d + 2 * w];
+            n++;
+        }
+
+        if (n != 0) {
+            expected[d] = (sum + n / 2) / n;
+        }
+    }
+
+    /* Once flushed, calibration in use stays mapped until released */
+    if (nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), got) != NEF_OK ||
+        memcmp(got, expected, count * sizeof(uint16_t)) ||
+        nef_calib_flush() != NEF_OK ||
+        nef_image_get_raw(nfp, raw, count * sizeof(uint16_t), got) != NEF_OK ||
+        memcmp(got, expected, count * sizeof(uint16_t)))
+    {
+        for (i = 0; i < count && got[i] == expected[i]; i++);
+        fprintf(stderr, "calibrated sample mismatch at (%u, %u)\n", i % w,
+            i / w);
+        goto rmdir;
+    }
+
+    /* Sidecars carry no serial, so they are written calibrated */
+    if (roundtrip_check_sidecar(nfp, raw, name, expected, count) != 0) {
+        goto rmdir;
+    }
+
+    ret = 0;
+
+rmdir:
+    nef_close(nfp);
+    nef_calib_set_dir(NULL);
+    if (name[0] != '\0') unlink(name);
+    if (cal[0] != '\0') unlink(cal);
+    rmdir(dir);
+done:
+    free(expected);
+    free(got);
+    free(dark);
+    free(flat);
+    free(defective);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned i, failures = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const struct roundtrip_case *tc = &cases[i];
+        int ret = roundtrip_run(tc);
+
+        printf("%-4s %4ux%-4u %u-bit %-8s content %d\n",
+            ret ? "FAIL" : "ok", tc->width, tc->height, tc->bits,
+            tc->packing == NEF_SYNTH_PACK_BITS ? "packed" :
+            tc->packing == NEF_SYNTH_PACK_16 ? "16-bit" :
+            tc->lossy ? "lossy" : "lossless", tc->content);
+
+        if (ret) {
+            failures++;
+        }
+    }
+
+    if (roundtrip_check_cache() != 0) {
+        printf("FAIL decoded-frame cache\n");
+        failures++;
+    } else {
+        printf("ok   decoded-frame cache\n");
+    }
+
+    if (roundtrip_check_open_many() != 0) {
+        printf("FAIL batch open\n");
+        failures++;
+    } else {
+        printf("ok   batch open\n");
+    }
+
+    if (roundtrip_check_fingerprint() != 0) {
+        printf("FAIL fingerprint\n");
+        failures++;
+    } else {
+        printf("ok   fingerprint\n");
+    }
+
+    if (roundtrip_check_calibration(NEF_SYNTH_PACK_NPC) != 0 ||
+        roundtrip_check_calibration(NEF_SYNTH_PACK_16) != 0)
+    {
+        printf("FAIL calibration\n");
+        failures++;
+    } else {
+        printf("ok   calibration\n");
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,846 @@
+#include <nefko.h>
+#include <nefko_priv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Scan directory trees for NEFs and extract a table of metadata from
+ * them, one row per file, as CSV or as a binary columnar file. Doubles as
+ * an end-to-end throughput benchmark of opening files and fetching tags.
+ *
+ * Directories and files are shared out over a work-stealing pool: each
+ * worker pushes what it finds onto its own deque and works from its tail,
+ * and an idle worker steals from the head of another's deque, where the
+ * oldest (and usually largest) directories are.
+ *
+ * Columnar files hold, in host byte order:
+ *     "NEFC", version (u32), rows (u32), columns (u32)
+ *     for each column: type (u8), name length (u8), name
+ *     for each column, its values:
+ *         SCAN_U32: rows x u32 (0 if missing)
+ *         SCAN_F64: rows x f64 (NaN if missing)
+ *         SCAN_STR: (rows + 1) x u32 offsets into the bytes that follow
+ *                   (empty if missing), then the bytes
+ */
+
+#define SCAN_COLUMNAR_VERSION   1
+#define SCAN_MAX_THREADS        256
+#define SCAN_ARENA_SIZE         4096
+
+/* Column types */
+#define SCAN_U32                0
+#define SCAN_F64                1
+#define SCAN_STR                2
+
+/* Timed stages of the scan itself */
+#define SCAN_STAGE_WALK         0
+#define SCAN_STAGE_PROBE        1
+#define SCAN_STAGE_OPEN         2
+#define SCAN_STAGE_TAGS         3
+#define SCAN_STAGE_COUNT        4
+
+static const char *scan_stage_names[SCAN_STAGE_COUNT] = {
+    "walk", "probe", "open", "tags"
+};
+
+static const char *nef_stage_names[NEF_STAGE_COUNT] = {
+    "open", "ifd_parse", "tag_fetch", "io", "decrypt", "entropy", "convert",
+    "hint", "calib"
+};
+
+struct scan_value {
+    int valid;
+    uint32_t u32;
+    double f64;
+    char *str;
+};
+
+struct scan_row {
+    char *path;
+    struct scan_value values[];
+};
+
+struct scan_column {
+    const char *name;
+    int type;
+    int tag;                    /* Tag to fetch, or 0 */
+};
+
+/* The columns that can be selected, in output order */
+static const struct scan_column scan_columns[] = {
+    { "model", SCAN_STR, TIFF_TAG_MODEL },
+    { "serial", SCAN_STR, NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_SERIAL) },
+    { "shutter_count", SCAN_U32,
+      NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_SHUTTER) },
+    { "exposure", SCAN_F64, TIFF_TAG_EXIF_EXPOSURETIME },
+    { "fnumber", SCAN_F64, TIFF_TAG_EXIF_FNUMBER },
+    { "iso", SCAN_U32, TIFF_TAG_EXIF_ISO },
+    { "lens", SCAN_STR, NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_LENS) },
+    { "width", SCAN_U32, 0 },
+    { "height", SCAN_U32, 0 },
+};
+
+#define SCAN_NR_COLUMNS (sizeof(scan_columns) / sizeof(scan_columns[0]))
+
+/* Selected columns, as indices into scan_columns */
+static unsigned scan_selected[SCAN_NR_COLUMNS];
+static unsigned scan_nr_selected = 0;
+
+struct scan_deque {
+    pthread_mutex_t lock;
+    char **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct scan_worker {
+    struct scan_pool *pool;
+    unsigned id;
+    struct scan_deque deque;
+
+    struct scan_row **rows;
+    size_t nr_rows;
+    size_t cap_rows;
+
+    unsigned long long seen;
+    unsigned long long failed;
+    double ns[SCAN_STAGE_COUNT];
+};
+
+struct scan_pool {
+    struct scan_worker workers[SCAN_MAX_THREADS];
+    unsigned nr_workers;
+
+    /* Items pushed and not yet processed; the scan ends at zero */
+    size_t pending;
+};
+
+static double scan_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *scan_xalloc(size_t bytes)
+{
+    void *p = calloc(1, bytes);
+
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(-1);
+    }
+
+    return p;
+}
+
+/*******************************************************************/
+/* Work-stealing pool                                              */
+/*******************************************************************/
+
+static void scan_push(struct scan_worker *w, char *path)
+{
+    struct scan_deque *dq = &w->deque;
+
+    __atomic_fetch_add(&w->pool->pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->tail == dq->cap && dq->head > 0) {
+        /* Slide the live items down before growing */
+        memmove(dq->items, dq->items + dq->head,
+            (dq->tail - dq->head) * sizeof(char *));
+        dq->tail -= dq->head;
+        dq->head = 0;
+    }
+
+    if (dq->tail == dq->cap) {
+        dq->cap = dq->cap ? dq->cap * 2 : 64;
+        dq->items = (char **)realloc(dq->items, dq->cap * sizeof(char *));
+        if (dq->items == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(-1);
+        }
+    }
+
+    dq->items[dq->tail++] = path;
+
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Take the newest item of a worker's own deque */
+static char *scan_pop(struct scan_worker *w)
+{
+    struct scan_deque *dq = &w->deque;
+    char *path = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->items[--dq->tail];
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return path;
+}
+
+/* Take the oldest item of another worker's deque */
+static char *scan_steal(struct scan_worker *w)
+{
+    struct scan_pool *pool = w->pool;
+    unsigned i;
+
+    for (i = 1; i < pool->nr_workers; i++) {
+        struct scan_deque *dq =
+            &pool->workers[(w->id + i) % pool->nr_workers].deque;
+        char *path = NULL;
+
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail > dq->head) {
+            path = dq->items[dq->head++];
+        }
+        pthread_mutex_unlock(&dq->lock);
+
+        if (path != NULL) {
+            return path;
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************/
+/* Scanning                                                        */
+/*******************************************************************/
+
+static char *scan_join(const char *dir, const char *name)
+{
+    size_t len = strlen(dir), nlen = strlen(name);
+    char *path = (char *)scan_xalloc(len + nlen + 2);
+
+    memcpy(path, dir, len);
+    if (len == 0 || dir[len - 1] != '/') {
+        path[len++] = '/';
+    }
+    memcpy(path + len, name, nlen + 1);
+
+    return path;
+}
+
+static void scan_walk(struct scan_worker *w, const char *dir)
+{
+    struct dirent *ent;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL) {
+        fprintf(stderr, "could not open directory '%s'\n", dir);
+        return;
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+        unsigned char type = ent->d_type;
+        char *path;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        path = scan_join(dir, ent->d_name);
+
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            type = DT_UNKNOWN;
+            if (lstat(path, &st) == 0) {
+                if (S_ISDIR(st.st_mode)) type = DT_DIR;
+                else if (S_ISREG(st.st_mode)) type = DT_REG;
+            }
+        }
+
+        /* Symbolic links are not followed */
+        if (type == DT_DIR || type == DT_REG) {
+            scan_push(w, path);
+        } else {
+            free(path);
+        }
+    }
+
+    closedir(d);
+}
+
+/* Check the name and TIFF signature of a file before opening it */
+static int scan_probe(const char *path)
+{
+    static const uint8_t mm[4] = { 'M', 'M', 0, 42 };
+    static const uint8_t ii[4] = { 'I', 'I', 42, 0 };
+    size_t len = strlen(path);
+    uint8_t magic[4];
+    FILE *fp;
+    int ok;
+
+    if (len < 4 || strcasecmp(path + len - 4, ".nef")) {
+        return 0;
+    }
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        return 0;
+    }
+
+    ok = fread(magic, 4, 1, fp) == 1 &&
+        (!memcmp(magic, mm, 4) || !memcmp(magic, ii, 4));
+
+    fclose(fp);
+
+    return ok;
+}
+
+static double scan_rational(const struct nef_tag_result *res, int i)
+{
+    const uint32_t *r = (const uint32_t *)res->data;
+
+    return r[2 * i + 1] ? (double)r[2 * i] / r[2 * i + 1] : NAN;
+}
+
+/* Format the Lens tag (focal lengths and apertures) as "18-200mm f/3.5-5.6" */
+static char *scan_format_lens(const struct nef_tag_result *res)
+{
+    char buf[64];
+    double f0, f1, a0, a1;
+
+    if (res->type != TIFF_TYPE_RATIONAL || res->count < 4) {
+        return NULL;
+    }
+
+    f0 = scan_rational(res, 0);
+    f1 = scan_rational(res, 1);
+    a0 = scan_rational(res, 2);
+    a1 = scan_rational(res, 3);
+
+    if (f0 == f1) {
+        snprintf(buf, sizeof(buf), "%gmm f/%g", f0, a0);
+    } else {
+        snprintf(buf, sizeof(buf), "%g-%gmm f/%g-%g", f0, f1, a0, a1);
+    }
+
+    return strdup(buf);
+}
+
+static void scan_take_value(const struct scan_column *col,
+                            const struct nef_tag_result *res,
+                            struct scan_value *v)
+{
+    if (res->status != NEF_OK || res->count <= 0) {
+        return;
+    }
+
+    switch (col->type) {
+    case SCAN_STR:
+        if (col->tag == NEF_TAG_MAKERNOTE(TIFF_TAG_MAKERNOTE_LENS)) {
+            v->str = scan_format_lens(res);
+        } else if (res->type == TIFF_TYPE_ASCII) {
+            v->str = strndup((const char *)res->data, res->count);
+        }
+        break;
+    case SCAN_U32:
+        if (res->type == TIFF_TYPE_SHORT) {
+            v->u32 = *(const uint16_t *)res->data;
+        } else if (res->type == TIFF_TYPE_LONG) {
+            v->u32 = *(const uint32_t *)res->data;
+        } else {
+            return;
+        }
+        break;
+    case SCAN_F64:
+        if (res->type != TIFF_TYPE_RATIONAL) {
+            return;
+        }
+        v->f64 = scan_rational(res, 0);
+        break;
+    }
+
+    v->valid = col->type != SCAN_STR || v->str != NULL;
+}
+
+static void scan_raw_dims(nef_t *nfp, int *width, int *height)
+{
+    nef_image_t *img = NULL;
+    int count = 0, i, type, chans;
+
+    nef_image_get_count(nfp, &count);
+
+    for (i = 0; i < count; i++) {
+        if (nef_image_get_handle(nfp, i, &img) == NEF_OK &&
+            nef_image_get_attribs(nfp, img, width, height, &chans, &type,
+                                  NULL) == NEF_OK &&
+            type == NEF_IMAGE_FULL && chans == 1)
+        {
+            return;
+        }
+    }
+
+    *width = *height = -1;
+}
+
+static void scan_file(struct scan_worker *w, char *path)
+{
+    struct nef_tag_result res[SCAN_NR_COLUMNS];
+    uint64_t arena[SCAN_ARENA_SIZE / sizeof(uint64_t)];
+    int ids[SCAN_NR_COLUMNS], width = -1, height = -1;
+    struct scan_row *row;
+    nef_t *nfp = NULL;
+    unsigned i, nr_ids = 0;
+    double t0, t1;
+
+    t0 = scan_now();
+    if (!scan_probe(path)) {
+        w->ns[SCAN_STAGE_PROBE] += scan_now() - t0;
+        free(path);
+        return;
+    }
+
+    t1 = scan_now();
+    w->ns[SCAN_STAGE_PROBE] += t1 - t0;
+    w->seen++;
+
+    /* Only the IFDs and the MakerNote are read; no image data is touched */
+    if (nef_open(path, &nfp) != NEF_OK) {
+        w->ns[SCAN_STAGE_OPEN] += scan_now() - t1;
+        w->failed++;
+        free(path);
+        return;
+    }
+
+    t0 = scan_now();
+    w->ns[SCAN_STAGE_OPEN] += t0 - t1;
+
+    for (i = 0; i < scan_nr_selected; i++) {
+        if (scan_columns[scan_selected[i]].tag != 0) {
+            ids[nr_ids++] = scan_columns[scan_selected[i]].tag;
+        }
+    }
+
+    nef_exif_get_tags(nfp, ids, nr_ids, res, arena, sizeof(arena));
+    scan_raw_dims(nfp, &width, &height);
+
+    row = (struct scan_row *)scan_xalloc(sizeof(*row) +
+        scan_nr_selected * sizeof(struct scan_value));
+    row->path = path;
+
+    for (i = 0, nr_ids = 0; i < scan_nr_selected; i++) {
+        const struct scan_column *col = &scan_columns[scan_selected[i]];
+        struct scan_value *v = &row->values[i];
+
+        if (col->tag != 0) {
+            scan_take_value(col, &res[nr_ids++], v);
+        } else if (!strcmp(col->name, "width") && width >= 0) {
+            v->u32 = width;
+            v->valid = 1;
+        } else if (!strcmp(col->name, "height") && height >= 0) {
+            v->u32 = height;
+            v->valid = 1;
+        }
+    }
+
+    nef_close(nfp);
+
+    w->ns[SCAN_STAGE_TAGS] += scan_now() - t0;
+
+    if (w->nr_rows == w->cap_rows) {
+        w->cap_rows = w->cap_rows ? w->cap_rows * 2 : 256;
+        w->rows = (struct scan_row **)realloc(w->rows,
+            w->cap_rows * sizeof(struct scan_row *));
+        if (w->rows == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(-1);
+        }
+    }
+
+    w->rows[w->nr_rows++] = row;
+}
+
+static void *scan_worker_main(void *arg)
+{
+    struct scan_worker *w = (struct scan_worker *)arg;
+    struct stat st;
+
+    for (;;) {
+        char *path = scan_pop(w);
+        double start;
+
+        if (path == NULL && (path = scan_steal(w)) == NULL) {
+            if (__atomic_load_n(&w->pool->pending, __ATOMIC_ACQUIRE) == 0) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        start = scan_now();
+
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            scan_walk(w, path);
+            free(path);
+            w->ns[SCAN_STAGE_WALK] += scan_now() - start;
+        } else {
+            scan_file(w, path);
+        }
+
+        __atomic_fetch_sub(&w->pool->pending, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************/
+/* Output                                                          */
+/*******************************************************************/
+
+static int scan_row_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct scan_row * const *)a)->path,
+                  (*(struct scan_row * const *)b)->path);
+}
+
+static void scan_csv_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"') {
+            fputc('"', out);
+        }
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void scan_write_csv(FILE *out, struct scan_row **rows, size_t nr_rows)
+{
+    size_t r;
+    unsigned i;
+
+    fprintf(out, "path");
+    for (i = 0; i < scan_nr_selected; i++) {
+        fprintf(out, ",%s", scan_columns[scan_selected[i]].name);
+    }
+    fputc('\n', out);
+
+    for (r = 0; r < nr_rows; r++) {
+        scan_csv_string(out, rows[r]->path);
+
+        for (i = 0; i < scan_nr_selected; i++) {
+            const struct scan_value *v = &rows[r]->values[i];
+
+            fputc(',', out);
+
+            if (!v->valid) {
+                continue;
+            }
+
+            switch (scan_columns[scan_selected[i]].type) {
+            case SCAN_U32:
+                fprintf(out, "%u", v->u32);
+                break;
+            case SCAN_F64:
+                fprintf(out, "%.6g", v->f64);
+                break;
+            case SCAN_STR:
+                scan_csv_string(out, v->str);
+                break;
+            }
+        }
+        fputc('\n', out);
+    }
+}
+
+static void scan_write_u32(FILE *out, uint32_t v)
+{
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+/* Write a string column: offsets, then the bytes they index */
+static void scan_write_strings(FILE *out, struct scan_row **rows,
+                               size_t nr_rows, int col)
+{
+    uint32_t off = 0;
+    size_t r;
+
+    for (r = 0; r < nr_rows; r++) {
+        const char *s = col < 0 ? rows[r]->path :
+            rows[r]->values[col].valid ? rows[r]->values[col].str : "";
+
+        scan_write_u32(out, off);
+        off += strlen(s);
+    }
+    scan_write_u32(out, off);
+
+    for (r = 0; r < nr_rows; r++) {
+        const char *s = col < 0 ? rows[r]->path :
+            rows[r]->values[col].valid ? rows[r]->values[col].str : "";
+
+        fwrite(s, strlen(s), 1, out);
+    }
+}
+
+static void scan_write_columnar(FILE *out, struct scan_row **rows,
+                                size_t nr_rows)
+{
+    size_t r;
+    unsigned i;
+
+    fwrite("NEFC", 4, 1, out);
+    scan_write_u32(out, SCAN_COLUMNAR_VERSION);
+    scan_write_u32(out, nr_rows);
+    scan_write_u32(out, scan_nr_selected + 1);
+
+    fputc(SCAN_STR, out);
+    fputc(4, out);
+    fwrite("path", 4, 1, out);
+
+    for (i = 0; i < scan_nr_selected; i++) {
+        const struct scan_column *col = &scan_columns[scan_selected[i]];
+
+        fputc(col->type, out);
+        fputc(strlen(col->name), out);
+        fwrite(col->name, strlen(col->name), 1, out);
+    }
+
+    scan_write_strings(out, rows, nr_rows, -1);
+
+    for (i = 0; i < scan_nr_selected; i++) {
+        switch (scan_columns[scan_selected[i]].type) {
+        case SCAN_U32:
+            for (r = 0; r < nr_rows; r++) {
+                scan_write_u32(out, rows[r]->values[i].valid ?
+                    rows[r]->values[i].u32 : 0);
+            }
+            break;
+        case SCAN_F64:
+            for (r = 0; r < nr_rows; r++) {
+                double v = rows[r]->values[i].valid ?
+                    rows[r]->values[i].f64 : NAN;
+
+                fwrite(&v, sizeof(v), 1, out);
+            }
+            break;
+        case SCAN_STR:
+            scan_write_strings(out, rows, nr_rows, i);
+            break;
+        }
+    }
+}
+
+/*******************************************************************/
+/* Driver                                                          */
+/*******************************************************************/
+
+static void usage(const char *name)
+{
+    unsigned i;
+
+    fprintf(stderr, "usage: %s [-j threads] [-f csv|columnar] [-o out] "
+        "[-c column,...] dir|file ...\n", name);
+    fprintf(stderr, "columns:");
+    for (i = 0; i < SCAN_NR_COLUMNS; i++) {
+        fprintf(stderr, " %s", scan_columns[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+static int scan_select_columns(char *list)
+{
+    char *tok, *save = NULL;
+    unsigned i;
+
+    scan_nr_selected = 0;
+
+    for (tok = strtok_r(list, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        for (i = 0; i < SCAN_NR_COLUMNS; i++) {
+            if (!strcmp(tok, scan_columns[i].name)) {
+                break;
+            }
+        }
+
+        if (i == SCAN_NR_COLUMNS || scan_nr_selected == SCAN_NR_COLUMNS) {
+            fprintf(stderr, "unknown column '%s'\n", tok);
+            return -1;
+        }
+
+        scan_selected[scan_nr_selected++] = i;
+    }
+
+    return 0;
+}
+
+static void scan_report(struct scan_pool *pool, size_t nr_rows, double ns)
+{
+    unsigned long long seen = 0, failed = 0;
+    double stage_ns[SCAN_STAGE_COUNT] = { 0 };
+    struct nef_stats stats;
+    unsigned i, s;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        seen += pool->workers[i].seen;
+        failed += pool->workers[i].failed;
+        for (s = 0; s < SCAN_STAGE_COUNT; s++) {
+            stage_ns[s] += pool->workers[i].ns[s];
+        }
+    }
+
+    fprintf(stderr, "%llu NEFs, %zu opened, %llu failed in %.3f s "
+        "(%.0f files/s, %u threads)\n", seen, nr_rows, failed, ns / 1e9,
+        ns > 0 ? nr_rows / (ns / 1e9) : 0.0, pool->nr_workers);
+
+    fprintf(stderr, "scan stages (thread-seconds):\n");
+    for (s = 0; s < SCAN_STAGE_COUNT; s++) {
+        fprintf(stderr, "  %-10s %10.3f\n", scan_stage_names[s],
+            stage_ns[s] / 1e9);
+    }
+
+    if (nef_stats_get(NULL, &stats) == NEF_OK && stats.ticks_per_sec > 0) {
+        fprintf(stderr, "library stages (calls, thread-seconds, MB):\n");
+        for (s = 0; s < NEF_STAGE_COUNT; s++) {
+            if (stats.stage[s].calls == 0) {
+                continue;
+            }
+            fprintf(stderr, "  %-10s %10llu %10.3f %10.1f\n",
+                nef_stage_names[s], stats.stage[s].calls,
+                stats.stage[s].ticks / stats.ticks_per_sec,
+                stats.stage[s].bytes / (1024.0 * 1024.0));
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static struct scan_pool pool;
+    pthread_t threads[SCAN_MAX_THREADS];
+    struct scan_row **rows = NULL;
+    const char *out_name = NULL;
+    int nthreads, columnar = 0, opt, i;
+    size_t nr_rows = 0, r;
+    FILE *out = stdout;
+    double start;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (i = 0; i < (int)SCAN_NR_COLUMNS; i++) {
+        scan_selected[scan_nr_selected++] = i;
+    }
+
+    while ((opt = getopt(argc, argv, "j:f:o:c:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "columnar")) {
+                columnar = 1;
+            } else if (strcmp(optarg, "csv")) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'c':
+            if (scan_select_columns(optarg) != 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || nthreads <= 0) {
+        usage(argv[0]);
+    }
+
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+
+    if (out_name != NULL &&
+        (out = fopen(out_name, columnar ? "wb" : "w")) == NULL)
+    {
+        fprintf(stderr, "could not open '%s'\n", out_name);
+        exit(-1);
+    }
+
+    pool.nr_workers = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+    }
+
+    /* Seed the roots round-robin; stealing balances the rest */
+    for (i = optind; i < argc; i++) {
+        scan_push(&pool.workers[(i - optind) % nthreads], strdup(argv[i]));
+    }
+
+    start = scan_now();
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, scan_worker_main, &pool.workers[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        nr_rows += pool.workers[i].nr_rows;
+    }
+
+    start = scan_now() - start;
+
+    /* Gather the rows, in path order so output is reproducible */
+    rows = (struct scan_row **)scan_xalloc((nr_rows + 1) *
+                                           sizeof(struct scan_row *));
+    for (i = 0, r = 0; i < nthreads; i++) {
+        if (pool.workers[i].nr_rows > 0) {
+            memcpy(rows + r, pool.workers[i].rows,
+                pool.workers[i].nr_rows * sizeof(struct scan_row *));
+            r += pool.workers[i].nr_rows;
+        }
+        free(pool.workers[i].rows);
+        free(pool.workers[i].deque.items);
+    }
+
+    qsort(rows, nr_rows, sizeof(struct scan_row *), scan_row_cmp);
+
+    if (columnar) {
+        scan_write_columnar(out, rows, nr_rows);
+    } else {
+        scan_write_csv(out, rows, nr_rows);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    scan_report(&pool, nr_rows, start);
+
+    for (r = 0; r < nr_rows; r++) {
+        for (i = 0; i < (int)scan_nr_selected; i++) {
+            free(rows[r]->values[i].str);
+        }
+        free(rows[r]->path);
+        free(rows[r]);
+    }
+    free(rows);
+
+    return 0;
+}